@@ -0,0 +1,64 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+#include "lib/compiler.hpp"
+#include "lib/context.hpp"
+#include "lib/trap.hpp"
+
+using namespace wasmjit;
+
+using IntIntFn = int (*)(int);
+
+// a loop that does nothing but count its parameter down to zero,
+// so the fuel accounting is as large a share of the work as it gets
+static void compileCountdown(WasmCompiler &cc) {
+  std::vector<WasmValueType> params = {WasmValueType::I32};
+  cc.StartFunction(0, WasmValueType::I32, params);
+  cc.StartLoop(0, 0);
+  cc.LocalGet(0);
+  cc.I32Const(-1);
+  cc.Add();
+  cc.LocalSet(0);
+  cc.LocalGet(0);
+  cc.BrIf(0);
+  cc.EndBlock();
+  cc.LocalGet(0);
+  cc.EndFunction();
+  cc.finalize();
+}
+
+static double runMs(IntIntFn fn, i32 iterations) {
+  auto start = std::chrono::steady_clock::now();
+  callGuarded([&] { return fn(iterations); });
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main() {
+  constexpr i32 iterations = 200'000'000;
+  constexpr int repetitions = 5;
+
+  InstanceContext ctx;
+  WasmCompiler plain(1);
+  compileCountdown(plain);
+  WasmCompiler metered(1, {.fuelMetering = true});
+  metered.bindContext(&ctx);
+  compileCountdown(metered);
+
+  double best[2] = {1e300, 1e300};
+  for (int rep = 0; rep < repetitions; rep++) {
+    best[0] = std::min(best[0], runMs(plain.getEntry<IntIntFn>(0), iterations));
+    ctx.setFuel(std::numeric_limits<i64>::max());
+    best[1] =
+        std::min(best[1], runMs(metered.getEntry<IntIntFn>(0), iterations));
+  }
+
+  printf("countdown %d iterations, best of %d\n", iterations, repetitions);
+  printf("fuel off: %8.2f ms\n", best[0]);
+  printf("fuel on:  %8.2f ms (%+.1f%%)\n", best[1],
+         (best[1] / best[0] - 1.0) * 100.0);
+  return 0;
+}
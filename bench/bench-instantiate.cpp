@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "src/instance-pool.hpp"
+#include "src/runtime.hpp"
+#include "test/test-modules.hpp"
+
+using namespace wasmjit;
+
+// instantiations per second and thread, every instance makes one call so
+// its memory page gets dirtied and has to be dropped again
+template <class Instantiate>
+static double runRate(u32 numThreads, u32 perThread, Instantiate instantiate) {
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (u32 t = 0; t < numThreads; t++) {
+    threads.emplace_back([&] {
+      for (u32 i = 0; i < perThread; i++) {
+        instantiate();
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  return perThread / seconds;
+}
+
+// microseconds to reset `memory` after writing to the first `dirty` of its
+// pages, the committed size stays
+static double resetUs(LinearMemory &memory, u32 dirty) {
+  double best = 1e300;
+  for (int rep = 0; rep < 20; rep++) {
+    for (u32 page = 0; page < dirty; page++) {
+      memory.mem[u64{page} * LinearMemory::pageSize] = 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    memory.reset(memory.committedPages);
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(
+        best, std::chrono::duration<double, std::micro>(end - start).count());
+  }
+  return best;
+}
+
+int main() {
+  constexpr u32 perThread = 20'000;
+  constexpr int repetitions = 3;
+
+  auto module = std::make_shared<const Module>(std::span(kBumpModule));
+  u32 bump = module->findFunction("bump").value();
+  u32 maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  InstancePool pool({.slots = maxThreads});
+
+  printf("instantiate + call + teardown, per core, best of %d\n", repetitions);
+  printf("threads      fresh/s     pooled/s\n");
+  for (u32 numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+    double best[2] = {0, 0};
+    for (int rep = 0; rep < repetitions; rep++) {
+      best[0] = std::max(best[0], runRate(numThreads, perThread, [&] {
+                           Instance instance(module);
+                           instance.call<i32>(bump, 1);
+                         }));
+      best[1] = std::max(best[1], runRate(numThreads, perThread, [&] {
+                           auto instance = pool.instantiate(module);
+                           instance->call<i32>(bump, 1);
+                         }));
+    }
+    printf("%7u %12.0f %12.0f (%.1fx)\n", numThreads, best[0], best[1],
+           best[1] / best[0]);
+  }
+
+  // what a pooled slot pays on reuse depends on what was written, not on
+  // how much memory is committed
+  printf("\nreset of a slot's memory, best of 20\n");
+  printf("committed pages  written pages   reset us\n");
+  for (u32 pages : {16u, 256u, 4096u, 16384u}) {
+    LinearMemory memory;
+    memory.init(pages);
+    for (u32 dirty : {0u, 1u, pages / 16, pages}) {
+      printf("%15u %14u %10.1f\n", pages, dirty, resetUs(memory, dirty));
+    }
+  }
+  return 0;
+}
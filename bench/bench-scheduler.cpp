@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <span>
+#include <thread>
+
+#include "src/instance-pool.hpp"
+#include "src/runtime.hpp"
+#include "src/scheduler.hpp"
+#include "test/test-modules.hpp"
+
+using namespace wasmjit;
+
+// a synthetic request mix: connections arrive on the shared queue and each
+// one submits its requests to the deque of the worker it landed on. every
+// request is a fresh pooled instance and a call, one in 16 is 32 times as
+// expensive as the others, so the deques run out unevenly and idle workers
+// have to steal
+static constexpr u32 kConnections = 2'000;
+static constexpr u32 kRequestsPerConnection = 16;
+static constexpr i32 kSpin = 20'000;
+
+static SchedulerStats runWorkload(const std::shared_ptr<const Module> &module,
+                                  u32 spin, u32 workers) {
+  InstancePool pool({.slots = workers});
+  Scheduler scheduler({.workers = workers});
+  for (u32 c = 0; c < kConnections; c++) {
+    scheduler.submit([&, c] {
+      for (u32 r = 0; r < kRequestsPerConnection; r++) {
+        i32 iterations = (c + r) % 16 == 0 ? kSpin * 32 : kSpin;
+        scheduler.submit([&, iterations] {
+          auto instance = pool.instantiate(module);
+          instance->call<i32>(spin, iterations);
+        });
+      }
+    });
+  }
+  scheduler.wait();
+  return scheduler.stats();
+}
+
+int main() {
+  constexpr int repetitions = 3;
+
+  auto module = std::make_shared<const Module>(std::span(kSpinModule));
+  u32 spin = module->findFunction("spin").value();
+  u32 maxWorkers = std::max(1u, std::thread::hardware_concurrency());
+
+  printf("%u connections x %u requests, best of %d\n", kConnections,
+         kRequestsPerConnection, repetitions);
+  printf("workers      tasks/s  speedup  steals   mean/us    p50/us    "
+         "p99/us\n");
+  double baseline = 0;
+  for (u32 workers = 1; workers <= maxWorkers; workers *= 2) {
+    SchedulerStats best;
+    for (int rep = 0; rep < repetitions; rep++) {
+      auto stats = runWorkload(module, spin, workers);
+      if (stats.throughput > best.throughput) {
+        best = stats;
+      }
+    }
+    if (workers == 1) {
+      baseline = best.throughput;
+    }
+    auto us = [](std::chrono::nanoseconds ns) { return ns.count() / 1e3; };
+    printf("%7u %12.0f %7.2fx %7llu %9.1f %9.1f %9.1f\n", workers,
+           best.throughput, best.throughput / baseline,
+           static_cast<unsigned long long>(best.steals),
+           us(best.meanQueueLatency), us(best.p50QueueLatency),
+           us(best.p99QueueLatency));
+  }
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "lib/compiler.hpp"
+#include "lib/context.hpp"
+#include "lib/trap.hpp"
+
+using namespace wasmjit;
+
+using IntIntFn = int (*)(int);
+
+// doubly recursive fibonacci, almost nothing but calls, so the prologue
+// check is as large a share of the work as it gets
+static void compileFib(WasmCompiler &cc) {
+  std::vector<WasmValueType> params = {WasmValueType::I32};
+  std::vector<WasmValueType> locals = {WasmValueType::I32};
+  cc.StartFunction(0, WasmValueType::I32, params);
+  cc.AddLocals(locals);
+  cc.LocalGet(0);
+  cc.LocalSet(1);
+  cc.StartBlock(0, 0);
+  cc.LocalGet(0);
+  cc.I32Const(2);
+  cc.IntCompare(WasmOpcode::I32_LT_U);
+  cc.BrIf(0);
+  cc.LocalGet(0);
+  cc.I32Const(1);
+  cc.IntBinOp(WasmOpcode::I32_SUB);
+  cc.Call(u32{0}, WasmValueType::I32, params);
+  cc.LocalGet(0);
+  cc.I32Const(2);
+  cc.IntBinOp(WasmOpcode::I32_SUB);
+  cc.Call(u32{0}, WasmValueType::I32, params);
+  cc.IntBinOp(WasmOpcode::I32_ADD);
+  cc.LocalSet(1);
+  cc.EndBlock();
+  cc.LocalGet(1);
+  cc.EndFunction();
+  cc.finalize();
+}
+
+static double runMs(IntIntFn fn, i32 n) {
+  auto start = std::chrono::steady_clock::now();
+  callGuarded([&] { return fn(n); });
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main() {
+  constexpr i32 n = 30;
+  // 2 * fib(n + 1) - 1
+  constexpr double calls = 2.0 * 1346269 - 1;
+  constexpr int repetitions = 50;
+
+  InstanceContext ctx;
+  ctx.stackLimit = computeStackLimit();
+  WasmCompiler plain(1);
+  compileFib(plain);
+  WasmCompiler checked(1, {.stackChecks = true});
+  checked.bindContext(&ctx);
+  compileFib(checked);
+
+  // alternating, so both see the same state of the machine
+  double best[2] = {1e300, 1e300};
+  for (int rep = 0; rep < repetitions; rep++) {
+    best[0] = std::min(best[0], runMs(plain.getEntry<IntIntFn>(0), n));
+    best[1] = std::min(best[1], runMs(checked.getEntry<IntIntFn>(0), n));
+  }
+
+  printf("fib(%d), %.0f calls, best of %d\n", n, calls, repetitions);
+  printf("checks off: %8.2f ms %6.3f ns/call\n", best[0],
+         best[0] * 1e6 / calls);
+  printf("checks on:  %8.2f ms %6.3f ns/call (%+.3f ns/call, %+.1f%%)\n",
+         best[1], best[1] * 1e6 / calls, (best[1] - best[0]) * 1e6 / calls,
+         (best[1] / best[0] - 1.0) * 100.0);
+  return 0;
+}
@@ -0,0 +1,553 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <random>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lib/parser.hpp"
+#include "src/runtime.hpp"
+
+using namespace wasmjit;
+
+#ifndef WASMJIT_EXAMPLES_DIR
+#define WASMJIT_EXAMPLES_DIR "wasm_examples"
+#endif
+
+/*
+ * Parse, compile and execution throughput in one run, printed as JSON so
+ * two runs can be compared. Every input is either generated from a fixed
+ * seed or checked in under wasm_examples/, and every result is the best of
+ * a fixed number of repetitions after a warm up run.
+ *
+ *   bench-suite [--output file] [--baseline file] [--max-regression percent]
+ *               [--repetitions n] [--filter substring] [--examples dir]
+ */
+
+struct Options {
+  std::string output;
+  std::string baseline;
+  // exit with 1 if any benchmark got worse than this, in percent
+  double maxRegression = -1;
+  int repetitions = 5;
+  std::string filter;
+  std::string examplesDir = WASMJIT_EXAMPLES_DIR;
+};
+
+struct Result {
+  std::string name;
+  std::string unit;
+  double value;
+  bool higherIsBetter;
+};
+
+// the best of `repetitions` runs after a warm up run, in seconds
+template <class Fn> static double bestSeconds(int repetitions, Fn &&fn) {
+  fn();
+  double best = 1e300;
+  for (int rep = 0; rep < repetitions; rep++) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double>(end - start).count());
+  }
+  return best;
+}
+
+// keeps the compiler from dropping the work of a benchmark
+static volatile u64 sink;
+
+static void appendUleb(std::vector<u8> &out, u64 value) {
+  do {
+    u8 byte = value & 0x7f;
+    value >>= 7;
+    out.push_back(value != 0 ? byte | 0x80 : byte);
+  } while (value != 0);
+}
+
+static void appendSleb(std::vector<u8> &out, i64 value) {
+  while (true) {
+    u8 byte = value & 0x7f;
+    value >>= 7;
+    if ((value == 0 && (byte & 0x40) == 0) ||
+        (value == -1 && (byte & 0x40) != 0)) {
+      out.push_back(byte);
+      return;
+    }
+    out.push_back(byte | 0x80);
+  }
+}
+
+static void appendOp(std::vector<u8> &out, WasmOpcode op) {
+  out.push_back(static_cast<u8>(op));
+}
+
+// functions taking only i32 parameters and returning an i32, each with a
+// type of its own so the type section grows with them
+struct SyntheticModule {
+  struct Function {
+    u32 numParams = 1;
+    u32 numLocals = 0;
+    // the instructions, without the final end
+    std::vector<u8> code;
+    std::string exportName;
+  };
+
+  std::vector<Function> functions;
+
+  std::vector<u8> encode() const;
+};
+
+static void appendSection(std::vector<u8> &out, WasmSection id,
+                          const std::vector<u8> &content) {
+  out.push_back(static_cast<u8>(id));
+  appendUleb(out, content.size());
+  out.insert(out.end(), content.begin(), content.end());
+}
+
+std::vector<u8> SyntheticModule::encode() const {
+  constexpr u8 i32 = static_cast<u8>(WasmValueType::I32);
+  std::vector<u8> out = {0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00};
+  std::vector<u8> types, funcs, exports, code;
+  appendUleb(types, functions.size());
+  appendUleb(funcs, functions.size());
+  appendUleb(code, functions.size());
+  u32 numExports = 0;
+  for (u32 i = 0; i < functions.size(); i++) {
+    auto &function = functions[i];
+    types.push_back(0x60);
+    appendUleb(types, function.numParams);
+    types.insert(types.end(), function.numParams, i32);
+    types.push_back(1);
+    types.push_back(i32);
+    appendUleb(funcs, i);
+    if (!function.exportName.empty()) {
+      appendUleb(exports, function.exportName.size());
+      exports.insert(exports.end(), function.exportName.begin(),
+                     function.exportName.end());
+      exports.push_back(static_cast<u8>(ExportType::FUNCTION));
+      appendUleb(exports, i);
+      numExports++;
+    }
+    std::vector<u8> body;
+    if (function.numLocals > 0) {
+      body.push_back(1);
+      appendUleb(body, function.numLocals);
+      body.push_back(i32);
+    } else {
+      body.push_back(0);
+    }
+    body.insert(body.end(), function.code.begin(), function.code.end());
+    appendOp(body, WasmOpcode::END);
+    appendUleb(code, body.size());
+    code.insert(code.end(), body.begin(), body.end());
+  }
+  std::vector<u8> exportSection;
+  appendUleb(exportSection, numExports);
+  exportSection.insert(exportSection.end(), exports.begin(), exports.end());
+  appendSection(out, WasmSection::TYPE_SECTION, types);
+  appendSection(out, WasmSection::FUNCTION_SECTION, funcs);
+  appendSection(out, WasmSection::EXPORT_SECTION, exportSection);
+  appendSection(out, WasmSection::CODE_SECTION, code);
+  return out;
+}
+
+// mostly short values like most of the lebs in a module, with some of
+// every length
+template <class T> static std::vector<u8> encodeLebs(u32 count) {
+  std::mt19937_64 rng(42);
+  std::vector<u8> out;
+  for (u32 i = 0; i < count; i++) {
+    u32 bits = std::min<u32>(7 * (1 + rng() % 10), sizeof(T) * 8);
+    u64 value = rng() & (bits == 64 ? ~u64{0} : (u64{1} << bits) - 1);
+    if constexpr (std::is_signed_v<T>) {
+      // sign extended from its top bit, half of them negative
+      i64 shift = 64 - bits;
+      appendSleb(out, static_cast<i64>(value << shift) >> shift);
+    } else {
+      appendUleb(out, value);
+    }
+  }
+  return out;
+}
+
+template <class T> static void decodeLebs(std::span<const u8> data) {
+  BinaryReader reader(data.data(), data.size());
+  u64 sum = 0;
+  while (reader.hasMore()) {
+    sum += static_cast<u64>(reader.readIntLeb<T>());
+  }
+  sink = sum;
+}
+
+// a typical function of a large module: a handful of parameters and locals
+// and a few dozen instructions
+static SyntheticModule largeModule(u32 numFunctions) {
+  std::mt19937 rng(7);
+  SyntheticModule module;
+  for (u32 i = 0; i < numFunctions; i++) {
+    SyntheticModule::Function function;
+    function.numParams = 1 + rng() % 6;
+    function.numLocals = rng() % 8;
+    function.exportName = "function_" + std::to_string(i);
+    appendOp(function.code, WasmOpcode::LOCAL_GET);
+    appendUleb(function.code, 0);
+    for (u32 op = rng() % 32; op > 0; op--) {
+      appendOp(function.code, WasmOpcode::I32_CONST);
+      appendSleb(function.code, static_cast<i32>(rng()));
+      appendOp(function.code, WasmOpcode::I32_ADD);
+    }
+    module.functions.push_back(std::move(function));
+  }
+  return module;
+}
+
+// the function shapes that stress different parts of the compiler, every
+// function takes and returns an i32
+static SyntheticModule straightLine(u32 numFunctions) {
+  SyntheticModule module;
+  for (u32 i = 0; i < numFunctions; i++) {
+    SyntheticModule::Function function;
+    appendOp(function.code, WasmOpcode::LOCAL_GET);
+    appendUleb(function.code, 0);
+    for (u32 op = 0; op < 1000; op++) {
+      appendOp(function.code, WasmOpcode::I32_CONST);
+      appendSleb(function.code, static_cast<i32>(op * 2654435761u));
+      appendOp(function.code,
+               op % 2 == 0 ? WasmOpcode::I32_ADD : WasmOpcode::I32_XOR);
+    }
+    module.functions.push_back(std::move(function));
+  }
+  return module;
+}
+
+static SyntheticModule nestedBlocks(u32 numFunctions) {
+  constexpr u32 depth = 100;
+  SyntheticModule module;
+  for (u32 i = 0; i < numFunctions; i++) {
+    SyntheticModule::Function function;
+    for (u32 level = 0; level < depth; level++) {
+      appendOp(function.code, WasmOpcode::BLOCK);
+      function.code.push_back(static_cast<u8>(WasmValueType::NONE));
+      // leaves a varying number of blocks if the parameter is `level`
+      appendOp(function.code, WasmOpcode::LOCAL_GET);
+      appendUleb(function.code, 0);
+      appendOp(function.code, WasmOpcode::I32_CONST);
+      appendSleb(function.code, level);
+      appendOp(function.code, WasmOpcode::I32_EQ);
+      appendOp(function.code, WasmOpcode::BR_IF);
+      appendUleb(function.code, level % 8);
+    }
+    for (u32 level = 0; level < depth; level++) {
+      appendOp(function.code, WasmOpcode::END);
+    }
+    appendOp(function.code, WasmOpcode::LOCAL_GET);
+    appendUleb(function.code, 0);
+    module.functions.push_back(std::move(function));
+  }
+  return module;
+}
+
+static SyntheticModule manyLocals(u32 numFunctions) {
+  constexpr u32 numLocals = 500;
+  SyntheticModule module;
+  for (u32 i = 0; i < numFunctions; i++) {
+    SyntheticModule::Function function;
+    function.numLocals = numLocals;
+    // local[n] = local[n - 1] + local[n - 2], with the parameter as local 0
+    for (u32 local = 2; local <= numLocals; local++) {
+      appendOp(function.code, WasmOpcode::LOCAL_GET);
+      appendUleb(function.code, local - 1);
+      appendOp(function.code, WasmOpcode::LOCAL_GET);
+      appendUleb(function.code, local - 2);
+      appendOp(function.code, WasmOpcode::I32_ADD);
+      appendOp(function.code, WasmOpcode::LOCAL_SET);
+      appendUleb(function.code, local);
+    }
+    appendOp(function.code, WasmOpcode::LOCAL_GET);
+    appendUleb(function.code, numLocals);
+    module.functions.push_back(std::move(function));
+  }
+  return module;
+}
+
+static SyntheticModule callHeavy(u32 numFunctions) {
+  SyntheticModule module;
+  SyntheticModule::Function leaf;
+  appendOp(leaf.code, WasmOpcode::LOCAL_GET);
+  appendUleb(leaf.code, 0);
+  appendOp(leaf.code, WasmOpcode::I32_CONST);
+  appendSleb(leaf.code, 1);
+  appendOp(leaf.code, WasmOpcode::I32_ADD);
+  module.functions.push_back(std::move(leaf));
+  for (u32 i = 1; i < numFunctions; i++) {
+    SyntheticModule::Function function;
+    appendOp(function.code, WasmOpcode::LOCAL_GET);
+    appendUleb(function.code, 0);
+    for (u32 call = 0; call < 200; call++) {
+      appendOp(function.code, WasmOpcode::CALL);
+      appendUleb(function.code, call % i);
+    }
+    module.functions.push_back(std::move(function));
+  }
+  return module;
+}
+
+// a kernel from wasm_examples/: `setup` runs once, `run` is timed
+struct Kernel {
+  const char *name;
+  const char *file;
+  const char *setup;
+  i32 setupArg;
+  const char *run;
+  i32 runArg;
+  // what run returns, checked on every call
+  u32 expected;
+  // per timed sample
+  u32 calls;
+};
+
+static const Kernel kKernels[] = {
+    {"fib", "fib.wasm", nullptr, 0, "fib", 27, 196418, 4},
+    {"sieve", "sieve.wasm", nullptr, 0, "sieve", 65536, 6542, 32},
+    {"crc32", "crc32.wasm", "fill", 65536, "crc32", 65536, 0x12e573a3, 8},
+    {"matmul", "matmul.wasm", "init", 64, "matmul", 64, 89456640, 16},
+};
+
+class Suite {
+public:
+  explicit Suite(const Options &options) : options(options) {}
+
+  void run() {
+    runLeb128();
+    runParse();
+    runCompile();
+    runKernels();
+  }
+  const std::vector<Result> &results() const { return all; }
+
+private:
+  bool selected(const std::string &name) const {
+    return name.find(options.filter) != std::string::npos;
+  }
+  void add(std::string name, std::string unit, double value,
+           bool higherIsBetter) {
+    fprintf(stderr, "%-28s %12.2f %s\n", name.c_str(), value, unit.c_str());
+    all.push_back({std::move(name), std::move(unit), value, higherIsBetter});
+  }
+  static double megabytesPerSecond(std::size_t bytes, double seconds) {
+    return bytes / seconds / 1e6;
+  }
+
+  template <class T> void runLeb128(const char *name) {
+    if (!selected(name)) {
+      return;
+    }
+    auto data = encodeLebs<T>(4'000'000);
+    double seconds =
+        bestSeconds(options.repetitions, [&] { decodeLebs<T>(data); });
+    add(name, "MB/s", megabytesPerSecond(data.size(), seconds), true);
+  }
+  void runLeb128() {
+    runLeb128<u32>("leb128/u32");
+    runLeb128<i64>("leb128/i64");
+  }
+
+  void runParse() {
+    if (!selected("parse/sections")) {
+      return;
+    }
+    auto binary = largeModule(50'000).encode();
+    double seconds = bestSeconds(options.repetitions, [&] {
+      WasmModule wasm;
+      wasm.parseSections(binary);
+      sink = wasm.functionSection.functions.size();
+    });
+    add("parse/sections", "MB/s", megabytesPerSecond(binary.size(), seconds),
+        true);
+  }
+
+  void runCompile(const char *name, const SyntheticModule &module) {
+    if (!selected(name)) {
+      return;
+    }
+    auto binary = module.encode();
+    std::span<const u8> span(binary);
+    double seconds =
+        bestSeconds(options.repetitions, [&] { Module compiled(span); });
+    add(name, "MB/s", megabytesPerSecond(binary.size(), seconds), true);
+  }
+  void runCompile() {
+    runCompile("compile/straight-line", straightLine(64));
+    runCompile("compile/nested-blocks", nestedBlocks(64));
+    runCompile("compile/many-locals", manyLocals(64));
+    runCompile("compile/call-heavy", callHeavy(64));
+  }
+
+  void runKernel(const Kernel &kernel) {
+    std::string name = std::string("exec/") + kernel.name;
+    if (!selected(name)) {
+      return;
+    }
+    auto module = std::make_shared<const Module>(options.examplesDir + "/" +
+                                                 kernel.file);
+    Instance instance(module);
+    if (kernel.setup != nullptr) {
+      instance.typedFunc<i32(i32)>(kernel.setup)(kernel.setupArg);
+    }
+    auto fn = instance.typedFunc<i32(i32)>(kernel.run);
+    double seconds = bestSeconds(options.repetitions, [&] {
+      for (u32 i = 0; i < kernel.calls; i++) {
+        u32 result = fn(kernel.runArg);
+        if (result != kernel.expected) {
+          throw std::runtime_error(name + " returned " +
+                                   std::to_string(result) + " instead of " +
+                                   std::to_string(kernel.expected));
+        }
+      }
+    });
+    add(name, "us", seconds / kernel.calls * 1e6, false);
+  }
+  void runKernels() {
+    for (auto &kernel : kKernels) {
+      runKernel(kernel);
+    }
+  }
+
+  const Options &options;
+  std::vector<Result> all;
+};
+
+// reads back what writeJson writes, a benchmark per line
+static std::map<std::string, double> readBaseline(const std::string &path) {
+  std::ifstream file(path);
+  if (!file) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+  std::map<std::string, double> values;
+  std::string line;
+  while (std::getline(file, line)) {
+    auto name = line.find("\"name\": \"");
+    auto value = line.find("\"value\": ");
+    if (name == std::string::npos || value == std::string::npos) {
+      continue;
+    }
+    name += std::strlen("\"name\": \"");
+    auto nameEnd = line.find('"', name);
+    values[line.substr(name, nameEnd - name)] =
+        std::stod(line.substr(value + std::strlen("\"value\": ")));
+  }
+  return values;
+}
+
+// how much better than the baseline, in percent
+static double improvement(const Result &result, double baseline) {
+  double change = (result.value - baseline) / baseline * 100;
+  return result.higherIsBetter ? change : -change;
+}
+
+static std::string toJson(const Options &options,
+                          const std::vector<Result> &results,
+                          const std::map<std::string, double> &baseline) {
+  std::ostringstream out;
+  char number[64];
+  out << "{\n  \"repetitions\": " << options.repetitions
+      << ",\n  \"benchmarks\": [\n";
+  for (std::size_t i = 0; i < results.size(); i++) {
+    auto &result = results[i];
+    std::snprintf(number, sizeof(number), "%.3f", result.value);
+    out << "    {\"name\": \"" << result.name << "\", \"unit\": \""
+        << result.unit << "\", \"value\": " << number
+        << ", \"higherIsBetter\": "
+        << (result.higherIsBetter ? "true" : "false");
+    auto it = baseline.find(result.name);
+    if (it != baseline.end() && it->second > 0) {
+      std::snprintf(number, sizeof(number), "%.3f, \"improvement\": %.2f",
+                    it->second, improvement(result, it->second));
+      out << ", \"baseline\": " << number;
+    }
+    out << (i + 1 < results.size() ? "},\n" : "}\n");
+  }
+  out << "  ]\n}\n";
+  return out.str();
+}
+
+static Options parseOptions(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (i + 1 >= argc) {
+      throw std::runtime_error("Missing value of " + std::string(arg));
+    }
+    const char *value = argv[++i];
+    if (arg == "--output") {
+      options.output = value;
+    } else if (arg == "--baseline") {
+      options.baseline = value;
+    } else if (arg == "--max-regression") {
+      options.maxRegression = std::stod(value);
+    } else if (arg == "--repetitions") {
+      options.repetitions = std::max(1, std::stoi(value));
+    } else if (arg == "--filter") {
+      options.filter = value;
+    } else if (arg == "--examples") {
+      options.examplesDir = value;
+    } else {
+      throw std::runtime_error("Unknown option " + std::string(arg));
+    }
+  }
+  return options;
+}
+
+int main(int argc, char **argv) {
+  try {
+    Options options = parseOptions(argc, argv);
+    std::map<std::string, double> baseline;
+    if (!options.baseline.empty()) {
+      baseline = readBaseline(options.baseline);
+    }
+
+    Suite suite(options);
+    suite.run();
+
+    std::string json = toJson(options, suite.results(), baseline);
+    if (options.output.empty()) {
+      fputs(json.c_str(), stdout);
+    } else {
+      std::ofstream file(options.output);
+      if (!(file << json)) {
+        throw std::runtime_error("Failed to write " + options.output);
+      }
+    }
+
+    int regressions = 0;
+    for (auto &result : suite.results()) {
+      auto it = baseline.find(result.name);
+      if (it == baseline.end() || it->second <= 0) {
+        continue;
+      }
+      double change = improvement(result, it->second);
+      fprintf(stderr, "%-28s %+8.2f%% vs baseline\n", result.name.c_str(),
+              change);
+      if (options.maxRegression >= 0 && -change > options.maxRegression) {
+        regressions++;
+      }
+    }
+    if (regressions > 0) {
+      fprintf(stderr, "%d benchmarks regressed by more than %.1f%%\n",
+              regressions, options.maxRegression);
+      return 1;
+    }
+  } catch (const std::exception &e) {
+    fprintf(stderr, "bench-suite: %s\n", e.what());
+    return 2;
+  }
+  return 0;
+}
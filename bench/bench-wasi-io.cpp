@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <unistd.h>
+
+#include "lib/host-functions.hpp"
+#include "lib/io-uring.hpp"
+#include "lib/wasi.h"
+#include "src/runtime.hpp"
+
+using namespace wasmjit;
+
+// (module
+//   (type $io (func (param i32 i32 i32 i64 i32) (result i32)))
+//   (import "wasi_snapshot_preview1" "fd_pwrite" (func (type $io)))
+//   (import "wasi_snapshot_preview1" "fd_pread" (func (type $io)))
+//   (memory 1)
+//   (func (export "pwrite") ... forwards its parameters to fd_pwrite)
+//   (func (export "pread") ... forwards its parameters to fd_pread))
+static const u8 kIoModule[] = {
+    0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+    // type section
+    0x01, 0x0a, 0x01, 0x60, 0x05, 0x7f, 0x7f, 0x7f, 0x7e, 0x7f, 0x01, 0x7f,
+    // import section
+    0x02, 0x46, 0x02,
+    0x16, 'w', 'a', 's', 'i', '_', 's', 'n', 'a', 'p', 's', 'h', 'o', 't', '_',
+    'p', 'r', 'e', 'v', 'i', 'e', 'w', '1',
+    0x09, 'f', 'd', '_', 'p', 'w', 'r', 'i', 't', 'e', 0x00, 0x00,
+    0x16, 'w', 'a', 's', 'i', '_', 's', 'n', 'a', 'p', 's', 'h', 'o', 't', '_',
+    'p', 'r', 'e', 'v', 'i', 'e', 'w', '1',
+    0x08, 'f', 'd', '_', 'p', 'r', 'e', 'a', 'd', 0x00, 0x00,
+    // function section
+    0x03, 0x03, 0x02, 0x00, 0x00,
+    // memory section
+    0x05, 0x03, 0x01, 0x00, 0x01,
+    // export section
+    0x07, 0x12, 0x02, 0x06, 'p', 'w', 'r', 'i', 't', 'e', 0x00, 0x02,
+    0x05, 'p', 'r', 'e', 'a', 'd', 0x00, 0x03,
+    // code section
+    0x0a, 0x1f, 0x02,
+    0x0e, 0x00, 0x20, 0x00, 0x20, 0x01, 0x20, 0x02, 0x20, 0x03, 0x20, 0x04,
+    0x10, 0x00, 0x0b,
+    0x0e, 0x00, 0x20, 0x00, 0x20, 0x01, 0x20, 0x02, 0x20, 0x03, 0x20, 0x04,
+    0x10, 0x01, 0x0b};
+
+static constexpr u32 kChunk = 4096;
+static constexpr u32 kChunks = 16 * 1024;
+
+using IoFn = TypedFunc<i32(i32, i32, i32, i64, i32)>;
+
+// ms for writing (or reading) kChunks chunks through the guest
+static double runMs(IoFn &fn, u32 guestFd) {
+  auto start = std::chrono::steady_clock::now();
+  for (u32 i = 0; i < kChunks; i++) {
+    // iovec at 0 pointing at the buffer at 64, result at 16
+    if (fn(guestFd, 0, 1, i64{i} * kChunk, 16) != 0) {
+      fprintf(stderr, "wasi call failed\n");
+      exit(1);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main() {
+  constexpr int repetitions = 3;
+  auto module = std::make_shared<const Module>(std::span(kIoModule));
+  auto path = std::filesystem::temp_directory_path() / "wasmjit-bench-io";
+  int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+
+  bool haveUring = IoUring::supported();
+  printf("%u x %u byte pwrite/pread of a local file, best of %d\n", kChunks,
+         kChunk, repetitions);
+  for (auto backend : {preview1::IoBackend::SYNC, preview1::IoBackend::URING}) {
+    bool uring = backend == preview1::IoBackend::URING;
+    if (uring && !haveUring) {
+      printf("io_uring: not available\n");
+      continue;
+    }
+    preview1::WasiContext wasi;
+    wasi.setIoBackend(backend);
+    u32 guestFd = wasi.insert({fd, false, {}});
+    Instance instance(module);
+    instance.setWasi(wasi);
+    MemoryView memory(instance.ctx().memoryBase, instance.ctx().memorySize);
+    memory.store<u32>(0, 64);
+    memory.store<u32>(4, kChunk);
+    std::fill_n(memory.data() + 64, kChunk, 'x');
+    auto pwrite = instance.typedFunc<i32(i32, i32, i32, i64, i32)>("pwrite");
+    auto pread = instance.typedFunc<i32(i32, i32, i32, i64, i32)>("pread");
+
+    double best[2] = {1e300, 1e300};
+    for (int rep = 0; rep < repetitions; rep++) {
+      best[0] = std::min(best[0], runMs(pwrite, guestFd));
+      best[1] = std::min(best[1], runMs(pread, guestFd));
+    }
+    double mb = double(kChunks) * kChunk / (1024 * 1024);
+    printf("%-8s write: %8.2f ms (%7.0f MiB/s)  read: %8.2f ms (%7.0f MiB/s)\n",
+           uring ? "io_uring" : "sync", best[0], mb / best[0] * 1000, best[1],
+           mb / best[1] * 1000);
+  }
+  close(fd);
+  std::filesystem::remove(path);
+  return 0;
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <cinttypes>
+#include <cstddef>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <new>
@@ -9,6 +10,9 @@
 template <uint32_t blockSize>
 struct MemoryBlock {
     MemoryBlock* next;
+    // of the whole mapping, header included
+    std::size_t mappedSize;
+    // larger than blockSize for the allocations that don't fit a block
     uint8_t mem[blockSize];
 };
 
@@ -28,15 +32,24 @@ public:
         MemoryBlock<blockSize>* block = head;
         while (block != nullptr) {
             MemoryBlock<blockSize>* next = block->next;
-            munmap(block, blockSize);
+            munmap(block, block->mappedSize);
             block = next;
         }
     }
 
     void* allocate(uint32_t size) {
-        assert(size <= blockSize && "Requested size is larger than block size");
+        if (size > blockSize) {
+            // gets a block of its own, the current one stays in use
+            MemoryBlock<blockSize>* newBlock = getNewBlock(size);
+            if (newBlock == nullptr) {
+                return nullptr;
+            }
+            newBlock->next = head;
+            head = newBlock;
+            return newBlock->mem;
+        }
         if (curAddr == nullptr || curAddr + size > curEnd) {
-            MemoryBlock<blockSize>* newBlock = getNewBlock();
+            MemoryBlock<blockSize>* newBlock = getNewBlock(blockSize);
             if (newBlock == nullptr) {
                 return nullptr;
             }
@@ -50,12 +63,15 @@ public:
         return result;
     }
 
-    MemoryBlock<blockSize>* getNewBlock() {
-        void* mem = mmap(nullptr, blockSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    MemoryBlock<blockSize>* getNewBlock(std::size_t capacity) {
+        std::size_t mappedSize = offsetof(MemoryBlock<blockSize>, mem) + capacity;
+        void* mem = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
         if (mem == MAP_FAILED) {
             return nullptr;
         }
-        return static_cast<MemoryBlock<blockSize>*>(mem);
+        auto* block = static_cast<MemoryBlock<blockSize>*>(mem);
+        block->mappedSize = mappedSize;
+        return block;
     }
 
     template<class T, class... Args>
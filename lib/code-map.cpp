@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "code-map.hpp"
+
+namespace wasmjit {
+
+static std::atomic<const CodeMap *> codeMapSlots[kMaxCodeMaps];
+// CodeMapRefs that may have loaded the slot's map
+static std::atomic<u32> codeMapReaders[kMaxCodeMaps];
+static std::atomic<u32> usedCodeMapSlots = 0;
+
+std::string JitSymbols::functionName(u32 index) const {
+  if (index < functionNames.size() && !functionNames[index].empty()) {
+    return functionNames[index];
+  }
+  return "wasm-function[" + std::to_string(index) + "]";
+}
+
+CodeMap::CodeMap(uintptr_t base, std::size_t size,
+                 std::vector<FunctionRange> _functions,
+                 std::vector<SourceSite> _sites,
+                 std::vector<LineEntry> _lines, JitSymbols symbols)
+    : base(base), size(size), functions(std::move(_functions)),
+      sites(std::move(_sites)), lines(std::move(_lines)),
+      names(std::move(symbols)) {
+  std::sort(functions.begin(), functions.end(),
+            [](auto &a, auto &b) { return a.begin < b.begin; });
+  std::stable_sort(sites.begin(), sites.end(), [](auto &a, auto &b) {
+    return a.nativeOffset < b.nativeOffset;
+  });
+  std::stable_sort(lines.begin(), lines.end(), [](auto &a, auto &b) {
+    return a.nativeOffset < b.nativeOffset;
+  });
+}
+
+const FunctionRange *CodeMap::findFunction(uintptr_t pc) const {
+  if (!contains(pc)) {
+    return nullptr;
+  }
+  u32 offset = pc - base;
+  auto it = std::upper_bound(
+      functions.begin(), functions.end(), offset,
+      [](u32 offset, const FunctionRange &range) { return offset < range.begin; });
+  if (it == functions.begin()) {
+    return nullptr;
+  }
+  --it;
+  return offset < it->end ? &*it : nullptr;
+}
+
+std::optional<WasmFrame> CodeMap::lookup(uintptr_t pc) const {
+  auto *function = findFunction(pc);
+  if (function == nullptr) {
+    return std::nullopt;
+  }
+  u32 offset = pc - base;
+  WasmFrame frame{function->funcIndex, 0};
+  auto it = std::upper_bound(
+      sites.begin(), sites.end(), offset,
+      [](u32 offset, const SourceSite &site) { return offset < site.nativeOffset; });
+  if (it != sites.begin()) {
+    --it;
+    if (it->nativeOffset >= function->begin) {
+      frame.wasmOffset = it->wasmOffset;
+    }
+  }
+  return frame;
+}
+
+const SourceSite *CodeMap::findTrapSite(uintptr_t pc) const {
+  if (!contains(pc)) {
+    return nullptr;
+  }
+  u32 offset = pc - base;
+  auto it = std::upper_bound(
+      sites.begin(), sites.end(), offset,
+      [](u32 offset, const SourceSite &site) { return offset < site.nativeOffset; });
+  // trap sites don't overlap and contain no calls, so only the closest one
+  // before pc can contain it
+  while (it != sites.begin()) {
+    --it;
+    if (it->isTrap) {
+      return offset < it->nativeEnd ? &*it : nullptr;
+    }
+  }
+  return nullptr;
+}
+
+void registerCodeMap(const CodeMap *map) {
+  for (u32 i = 0; i < kMaxCodeMaps; i++) {
+    const CodeMap *expected = nullptr;
+    if (codeMapSlots[i].compare_exchange_strong(expected, map)) {
+      u32 used = usedCodeMapSlots.load(std::memory_order_relaxed);
+      while (used <= i && !usedCodeMapSlots.compare_exchange_weak(
+                              used, i + 1, std::memory_order_release)) {
+      }
+      return;
+    }
+  }
+  throw std::runtime_error("Too many code maps registered");
+}
+
+void unregisterCodeMap(const CodeMap *map) {
+  u32 used = usedCodeMapSlots.load(std::memory_order_acquire);
+  for (u32 i = 0; i < used; i++) {
+    auto &slot = codeMapSlots[i];
+    const CodeMap *expected = map;
+    if (slot.compare_exchange_strong(expected, nullptr,
+                                     std::memory_order_seq_cst)) {
+      // a reader either counted itself before the slot was cleared and is
+      // waited for here, or it loads the cleared slot
+      while (codeMapReaders[i].load(std::memory_order_seq_cst) != 0) {
+        std::this_thread::yield();
+      }
+      return;
+    }
+  }
+}
+
+CodeMapRef::CodeMapRef(uintptr_t pc) {
+  u32 used = usedCodeMapSlots.load(std::memory_order_acquire);
+  for (u32 i = 0; i < used; i++) {
+    codeMapReaders[i].fetch_add(1, std::memory_order_seq_cst);
+    auto *found = codeMapSlots[i].load(std::memory_order_seq_cst);
+    if (found != nullptr && found->contains(pc)) {
+      map = found;
+      slot = i;
+      return;
+    }
+    codeMapReaders[i].fetch_sub(1, std::memory_order_release);
+  }
+}
+
+CodeMapRef::~CodeMapRef() {
+  if (map != nullptr) {
+    codeMapReaders[slot].fetch_sub(1, std::memory_order_release);
+  }
+}
+
+} // namespace wasmjit
@@ -0,0 +1,116 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "lib/trap.hpp"
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+// native code of a single function, offsets are relative to CodeMap::base
+struct FunctionRange {
+  u32 begin;
+  u32 end;
+  u32 funcIndex;
+};
+
+// a native instruction the compiler knows the wasm offset of, either a
+// call (for backtraces) or an instruction that is expected to fault
+struct SourceSite {
+  u32 nativeOffset;
+  // for trap sites the end of the faulting instruction. the register
+  // allocator may put moves in front of it, so it can start anywhere in
+  // [nativeOffset, nativeEnd). nativeOffset for calls
+  u32 nativeEnd;
+  u32 wasmOffset;
+  bool isTrap;
+  TrapCode code;
+};
+
+// native offset of the first instruction of a wasm instruction, recorded
+// with CompilerOptions::lineTable
+struct LineEntry {
+  u32 nativeOffset;
+  u32 wasmOffset;
+};
+
+// names of the functions of one compilation
+struct JitSymbols {
+  // the module file (or the module name), the file name of the line info
+  std::string sourceName;
+  // by function index, empty for functions without a name
+  std::vector<std::string> functionNames;
+
+  // the name or wasm-function[index]
+  std::string functionName(u32 index) const;
+};
+
+/*
+ * Maps the native code of one finalized compilation back to wasm function
+ * indices and bytecode offsets. It is consulted from signal handlers, so it
+ * is immutable once it was registered.
+ */
+class CodeMap : NonCopyable {
+public:
+  CodeMap(uintptr_t base, std::size_t size, std::vector<FunctionRange> functions,
+          std::vector<SourceSite> sites, std::vector<LineEntry> lines = {},
+          JitSymbols symbols = {});
+
+  bool contains(uintptr_t pc) const { return pc >= base && pc < base + size; }
+  const FunctionRange *findFunction(uintptr_t pc) const;
+  // the function and the offset of the closest site at or before pc
+  std::optional<WasmFrame> lookup(uintptr_t pc) const;
+  // the trap site whose range contains pc
+  const SourceSite *findTrapSite(uintptr_t pc) const;
+
+  uintptr_t codeBase() const { return base; }
+  std::size_t codeSize() const { return size; }
+  const std::vector<FunctionRange> &functionRanges() const { return functions; }
+  const std::vector<SourceSite> &sourceSites() const { return sites; }
+  const std::vector<LineEntry> &lineTable() const { return lines; }
+  const JitSymbols &symbols() const { return names; }
+
+private:
+  uintptr_t base;
+  std::size_t size;
+  // both sorted by their native offset
+  std::vector<FunctionRange> functions;
+  std::vector<SourceSite> sites;
+  std::vector<LineEntry> lines;
+  JitSymbols names;
+};
+
+static constexpr u32 kMaxCodeMaps = 4096;
+
+// the registry is a fixed array of slots so it can be searched lock free
+// from signal handlers, a search only covers the slots that were ever used.
+// unregistering waits until no CodeMapRef holds the map any more, after
+// that it can be freed
+void registerCodeMap(const CodeMap *map);
+void unregisterCodeMap(const CodeMap *map);
+
+/*
+ * The registered code map that contains pc, if any, kept registered for as
+ * long as the ref lives. Signal handlers may look at a map while another
+ * thread destroys its compiler, this is what keeps them from reading freed
+ * memory. Async-signal-safe. A handler that leaves with siglongjmp has to
+ * drop its refs first.
+ */
+class CodeMapRef : NonCopyable {
+public:
+  explicit CodeMapRef(uintptr_t pc);
+  ~CodeMapRef();
+
+  explicit operator bool() const { return map != nullptr; }
+  const CodeMap *get() const { return map; }
+  const CodeMap *operator->() const { return map; }
+
+private:
+  const CodeMap *map = nullptr;
+  u32 slot = 0;
+};
+
+} // namespace wasmjit
@@ -0,0 +1,91 @@
+#include <cstdio>
+
+#include "compile-stats.hpp"
+
+namespace wasmjit {
+
+double CompileStats::throughput() const {
+  if (totalTime.count() == 0) {
+    return 0;
+  }
+  return static_cast<double>(wasmBytes) * 1e3 / totalTime.count();
+}
+
+static void appendString(std::string &out, const std::string &str) {
+  out += '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escape[8];
+      std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+      out += escape;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+static void appendField(std::string &out, const char *name, u64 value) {
+  out += '"';
+  out += name;
+  out += "\":";
+  out += std::to_string(value);
+}
+
+static void appendField(std::string &out, const char *name,
+                        std::chrono::nanoseconds value) {
+  appendField(out, name, static_cast<u64>(value.count()));
+}
+
+std::string CompileStats::toJson() const {
+  std::string out = "{\"source\":";
+  appendString(out, sourceName);
+  out += ',';
+  appendField(out, "wasmBytes", wasmBytes);
+  out += ',';
+  appendField(out, "codeSectionBytes", codeSectionBytes);
+  out += ',';
+  appendField(out, "nativeBytes", nativeBytes);
+  out += ',';
+  appendField(out, "virtRegs", virtRegs);
+  out += ',';
+  appendField(out, "spillBytes", spillBytes);
+  out += ',';
+  appendField(out, "parseNs", parseTime);
+  out += ',';
+  appendField(out, "translateNs", translateTime);
+  out += ',';
+  appendField(out, "finalizeNs", finalizeTime);
+  out += ',';
+  appendField(out, "linkNs", linkTime);
+  out += ',';
+  appendField(out, "totalNs", totalTime);
+  char throughputField[64];
+  std::snprintf(throughputField, sizeof(throughputField),
+                ",\"throughputMBps\":%.3f", throughput());
+  out += throughputField;
+  out += ",\"functions\":[";
+  for (std::size_t i = 0; i < functions.size(); i++) {
+    auto &function = functions[i];
+    out += i == 0 ? "{" : ",{";
+    appendField(out, "index", function.funcIndex);
+    out += ',';
+    appendField(out, "wasmBytes", function.wasmBytes);
+    out += ',';
+    appendField(out, "nativeBytes", function.nativeBytes);
+    out += ',';
+    appendField(out, "virtRegs", function.virtRegs);
+    out += ',';
+    appendField(out, "spillBytes", function.spillBytes);
+    out += ',';
+    appendField(out, "translateNs", function.translateTime);
+    out += '}';
+  }
+  out += "]}";
+  return out;
+}
+
+} // namespace wasmjit
@@ -0,0 +1,50 @@
+#pragma once
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+struct FunctionCompileStats {
+  u32 funcIndex = 0;
+  // of the body in the code section, locals included
+  u32 wasmBytes = 0;
+  u32 nativeBytes = 0;
+  u32 virtRegs = 0;
+  // stack the register allocator reserved for spilled virtual registers
+  u32 spillBytes = 0;
+  // decoding the body and building the compiler's IR for it
+  std::chrono::nanoseconds translateTime{0};
+};
+
+/*
+ * Where the time of loading a module went and what came out of it. The
+ * phases follow each other: parsing the sections, translating the function
+ * bodies one by one, finalizing the IR of the whole module (register
+ * allocation and emission) and linking the code into executable memory.
+ */
+struct CompileStats {
+  std::string sourceName;
+  // the whole module and its code section
+  u64 wasmBytes = 0;
+  u64 codeSectionBytes = 0;
+  u64 nativeBytes = 0;
+  u64 virtRegs = 0;
+  u64 spillBytes = 0;
+  std::chrono::nanoseconds parseTime{0};
+  std::chrono::nanoseconds translateTime{0};
+  std::chrono::nanoseconds finalizeTime{0};
+  std::chrono::nanoseconds linkTime{0};
+  std::chrono::nanoseconds totalTime{0};
+  // of the functions defined in the module, in compilation order
+  std::vector<FunctionCompileStats> functions;
+
+  // wasm bytes per second of totalTime, in MB/s
+  double throughput() const;
+  // a single JSON object, the times in nanoseconds
+  std::string toJson() const;
+};
+
+} // namespace wasmjit
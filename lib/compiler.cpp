@@ -1,11 +1,17 @@
 #include <array>
+#include <bit>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <limits>
 #include <span>
+#include <string_view>
 #include <unordered_set>
+#include <variant>
 
 #include "asmjit/x86/x86operand.h"
 #include "compiler.hpp"
+#include "div-magic.hpp"
 #include "lib/tz-utils.hpp"
 #include "parser.hpp"
 
@@ -48,7 +54,7 @@ void OperandStack::deduplicate(x86::Compiler &cc) {
   deduped.reserve(stack.size());
   for (auto reg : stack) {
     if (seen.find(reg.id()) == seen.end()) {
-      std::cout << reg.id() << std::endl;
+      TRACE_VERBOSE("compiler", "deduplicate keeps {}", reg.id());
       deduped.push_back(reg);
       seen.insert(reg.id());
     } else {
@@ -65,17 +71,20 @@ void OperandStack::transferFrom(x86::Compiler &cc, OperandStack &other, u64 coun
   assert(other.size() >= count);
   auto transferred = stack.size() - frozenIdx;
   auto newSize =  frozenIdx + std::max(count, transferred);
+  // the transferred values are the topmost ones of the other stack
+  auto srcBase = other.size() - count;
 
   stack.resize(newSize);
   u32 i = frozenIdx;
   u32 mergeCount = std::min(count, transferred);
   for (; i < frozenIdx + mergeCount; i++) {
-    if (stack[i] != other.stack[i]) {
-      cc.mov(stack[i], other.stack[i]);
+    auto src = other.stack[srcBase + i - frozenIdx];
+    if (stack[i] != src) {
+      cc.mov(stack[i], src);
     }
   }
-  for (; i < newSize; i++) {
-    stack[i] = other.stack[i];
+  for (; i < frozenIdx + count; i++) {
+    stack[i] = other.stack[srcBase + i - frozenIdx];
   }
 }
 
@@ -116,7 +125,7 @@ BlockState &BlockManager::getRelative(i32 depth) {
 }
 
 BlockState &BlockManager::getByDepth(i32 depth) {
-  assert(depth >= 0 && depth < blocks.size());
+  assert(depth >= 0 && static_cast<std::size_t>(depth) < blocks.size());
   return blocks[depth];
 }
 
@@ -140,15 +149,299 @@ void BlockManager::clear() {
 }
 
 
-WasmCompiler::WasmCompiler(u32 funcCount) {
-  std::stringstream temp;
-  dbg.swap(temp);
+WasmCompiler::WasmCompiler(u32 funcCount, CompilerOptions options)
+    : options(options),
+      features(options.targetFeatures.value_or(HostFeatureProfile::detect())) {
+  requireHostSupport(features);
+  if (options.jitDump || options.gdbJit) {
+    this->options.lineTable = true;
+  }
+  if (options.cycleCounters) {
+    this->options.callCounters = true;
+  }
   code.init(runtime.environment(), runtime.cpuFeatures());
-  code.setLogger(&logger);
+  // formatting every instruction is a good part of the compile time
+  if (traceEnabled(TraceLevel::VERBOSE)) {
+    code.setLogger(&logger);
+  }
   code.attach(&cc);
   fnLabels.reserve(funcCount);
+  fnEndLabels.reserve(funcCount);
   for (u32 i = 0; i < funcCount; i++) {
     fnLabels.push_back(cc.newLabel());
+    fnEndLabels.push_back(cc.newLabel());
+  }
+}
+
+WasmCompiler::~WasmCompiler() {
+  gdbRegistration.reset();
+  if (map) {
+    unregisterCodeMap(map.get());
+  }
+}
+
+void WasmCompiler::bindContext(InstanceContext *ctx) { context = ctx; }
+
+void WasmCompiler::setSourceOffset(u32 offset) {
+  sourceOffset = offset;
+  if (options.lineTable) {
+    Label label = cc.newLabel();
+    cc.bind(label);
+    lines.push_back({label, offset});
+  }
+}
+
+void WasmCompiler::setSymbols(JitSymbols symbols) {
+  this->symbols = std::move(symbols);
+}
+
+/*
+ * binds a label in front of the next instruction, after finalize its offset
+ * becomes the native pc of the site in the code map. the register allocator
+ * may still insert moves between the label and the instruction, so a trap
+ * site is closed with endTrapSite() right after the faulting instruction and
+ * covers everything in between
+ */
+void WasmCompiler::markSite(bool isTrap, TrapCode code) {
+  Label label = cc.newLabel();
+  cc.bind(label);
+  sites.push_back({label, sourceOffset, isTrap, code, Label()});
+}
+
+void WasmCompiler::endTrapSite() {
+  assert(!sites.empty() && sites.back().isTrap);
+  sites.back().end = cc.newLabel();
+  cc.bind(sites.back().end);
+}
+
+void WasmCompiler::buildCodeMap() {
+  std::vector<FunctionRange> ranges;
+  for (u32 i = 0; i < fnLabels.size(); i++) {
+    if (code.isLabelBound(fnLabels[i]) && code.isLabelBound(fnEndLabels[i])) {
+      ranges.push_back({static_cast<u32>(code.labelOffsetFromBase(fnLabels[i])),
+                        static_cast<u32>(code.labelOffsetFromBase(fnEndLabels[i])),
+                        i});
+    }
+  }
+  std::vector<SourceSite> sourceSites;
+  sourceSites.reserve(sites.size());
+  for (auto &site : sites) {
+    auto begin = static_cast<u32>(code.labelOffsetFromBase(site.label));
+    auto end = site.end.isValid()
+                   ? static_cast<u32>(code.labelOffsetFromBase(site.end))
+                   : begin;
+    sourceSites.push_back(
+        {begin, end, site.wasmOffset, site.isTrap, site.code});
+  }
+  std::vector<LineEntry> lineTable;
+  lineTable.reserve(lines.size());
+  for (auto &line : lines) {
+    lineTable.push_back(
+        {static_cast<u32>(code.labelOffsetFromBase(line.label)),
+         line.wasmOffset});
+  }
+  map = std::make_unique<CodeMap>(reinterpret_cast<uintptr_t>(entry),
+                                  code.codeSize(), std::move(ranges),
+                                  std::move(sourceSites), std::move(lineTable),
+                                  std::move(symbols));
+  registerCodeMap(map.get());
+}
+
+// the frames and label offsets are only final once the code was emitted
+void WasmCompiler::collectCodeStats() {
+  stats.nativeBytes = code.codeSize();
+  stats.spillBytes = 0;
+  for (std::size_t i = 0; i < stats.functions.size(); i++) {
+    auto &function = stats.functions[i];
+    function.nativeBytes = static_cast<u32>(
+        code.labelOffsetFromBase(fnEndLabels[function.funcIndex]) -
+        code.labelOffsetFromBase(fnLabels[function.funcIndex]));
+    function.spillBytes = funcNodes[i]->frame().localStackSize();
+    stats.spillBytes += function.spillBytes;
+  }
+}
+
+x86::Gp WasmCompiler::contextReg() {
+  if (options.contextArgument) {
+    return fnState.contextArg;
+  }
+  if (context == nullptr) {
+    throw std::runtime_error("No instance context bound to the compiler");
+  }
+  auto reg = cc.newIntPtr();
+  cc.mov(reg, imm(reinterpret_cast<uintptr_t>(context)));
+  return reg;
+}
+
+Label WasmCompiler::trapStub(TrapCode code) {
+  for (auto &stub : fnState.trapStubs) {
+    if (stub.code == code) {
+      return stub.label;
+    }
+  }
+  fnState.trapStubs.push_back({cc.newLabel(), code});
+  return fnState.trapStubs.back().label;
+}
+
+/*
+ * whether a check is needed is only known once the whole body was seen,
+ * so the check is inserted after the fact at the start of the function
+ */
+void WasmCompiler::emitStackCheck() {
+  if (!options.stackChecks || !fnState.hasCalls) {
+    return;
+  }
+  BaseNode *prev = cc.setCursor(fnState.entryCursor);
+  auto ctx = contextReg();
+  cc.cmp(x86::rsp, x86::ptr(ctx, offsetof(InstanceContext, stackLimit)));
+  cc.jb(trapStub(TrapCode::STACK_OVERFLOW));
+  cc.setCursor(prev);
+}
+
+void WasmCompiler::emitEpochCheck() {
+  if (!options.epochInterruption) {
+    return;
+  }
+  auto epoch = cc.newUInt64();
+  cc.mov(epoch, imm(reinterpret_cast<uintptr_t>(&globalEpoch)));
+  cc.mov(epoch, x86::qword_ptr(epoch));
+  auto ctx = contextReg();
+  cc.cmp(epoch, x86::qword_ptr(ctx, offsetof(InstanceContext, epochDeadline)));
+  EpochStub stub{cc.newLabel(), cc.newLabel()};
+  cc.jae(stub.label);
+  cc.bind(stub.resume);
+  fnState.epochStubs.push_back(stub);
+}
+
+static i32 counterOffset(u32 funcIndex, std::size_t field) {
+  return static_cast<i32>(funcIndex * sizeof(FunctionCounters) + field);
+}
+
+void WasmCompiler::emitFunctionEntryCounters() {
+  if (!options.callCounters) {
+    return;
+  }
+  auto ctx = contextReg();
+  auto counters = cc.newIntPtr();
+  cc.mov(counters,
+         x86::qword_ptr(ctx, offsetof(InstanceContext, functionCounters)));
+  cc.add(x86::qword_ptr(counters, counterOffset(fnState.index,
+                                                offsetof(FunctionCounters,
+                                                         calls))),
+         1);
+  if (!options.cycleCounters) {
+    return;
+  }
+  // the callees of this call report their cycles into calleeCycles, the
+  // caller's sum is restored (plus this call) at the exit
+  fnState.callerCycles = cc.newUInt64();
+  cc.mov(fnState.callerCycles,
+         x86::qword_ptr(ctx, offsetof(InstanceContext, calleeCycles)));
+  cc.mov(x86::qword_ptr(ctx, offsetof(InstanceContext, calleeCycles)), 0);
+  fnState.entryTsc = emitReadTsc();
+}
+
+void WasmCompiler::emitFunctionExitCounters() {
+  if (!options.callCounters) {
+    return;
+  }
+  auto ctx = contextReg();
+  auto counters = cc.newIntPtr();
+  cc.mov(counters,
+         x86::qword_ptr(ctx, offsetof(InstanceContext, functionCounters)));
+  cc.add(x86::qword_ptr(counters, counterOffset(fnState.index,
+                                                offsetof(FunctionCounters,
+                                                         returns))),
+         1);
+  if (!options.cycleCounters) {
+    return;
+  }
+  auto cycles = emitReadTsc();
+  cc.sub(cycles, fnState.entryTsc);
+  cc.add(x86::qword_ptr(counters,
+                        counterOffset(fnState.index,
+                                      offsetof(FunctionCounters,
+                                               inclusiveCycles))),
+         cycles);
+  auto exclusive = cc.newUInt64();
+  cc.mov(exclusive, cycles);
+  cc.sub(exclusive,
+         x86::qword_ptr(ctx, offsetof(InstanceContext, calleeCycles)));
+  cc.add(x86::qword_ptr(counters,
+                        counterOffset(fnState.index,
+                                      offsetof(FunctionCounters,
+                                               exclusiveCycles))),
+         exclusive);
+  cc.add(cycles, fnState.callerCycles);
+  cc.mov(x86::qword_ptr(ctx, offsetof(InstanceContext, calleeCycles)), cycles);
+}
+
+x86::Gp WasmCompiler::emitReadTsc() {
+  auto low = cc.newUInt64();
+  auto high = cc.newUInt64();
+  cc.rdtsc(high, low);
+  cc.shl(high, 32);
+  cc.or_(low, high);
+  return low;
+}
+
+void WasmCompiler::countInstr() { fnState.fuelCost++; }
+
+void WasmCompiler::beginFuelBlock() {
+  fnState.fuelBlockStart = cc.cursor();
+  fnState.fuelCost = 0;
+}
+
+/*
+ * the cost of a basic block is only known at its end, so the charge is
+ * inserted after the fact at the node the block started at
+ */
+void WasmCompiler::endFuelBlock() {
+  if (!options.fuelMetering || fnState.fuelCost == 0) {
+    return;
+  }
+  BaseNode *prev = cc.setCursor(fnState.fuelBlockStart);
+  auto ctx = contextReg();
+  cc.sub(x86::qword_ptr(ctx, offsetof(InstanceContext, fuel)),
+         fnState.fuelCost);
+  cc.js(trapStub(TrapCode::OUT_OF_FUEL));
+  // nothing was emitted since the block started, keep appending after the
+  // charge instead of in front of it
+  if (prev != fnState.fuelBlockStart) {
+    cc.setCursor(prev);
+  }
+  fnState.fuelCost = 0;
+}
+
+// the stubs live behind the epilogue so they stay out of the hot path
+void WasmCompiler::emitTrapStubs() {
+  for (auto &stub : fnState.epochStubs) {
+    cc.bind(stub.label);
+    FuncSignature sig;
+    sig.setRet(TypeId::kVoid);
+    sig.addArg(TypeId::kUIntPtr);
+    InvokeNode *invokeNode;
+    Error err = cc.invoke(
+        &invokeNode, imm(reinterpret_cast<uintptr_t>(&handleEpochDeadline)),
+        sig);
+    if (err) {
+      throw std::runtime_error("Failed to generate invoke node");
+    }
+    invokeNode->setArg(0, contextReg());
+    cc.jmp(stub.resume);
+  }
+  for (auto &stub : fnState.trapStubs) {
+    cc.bind(stub.label);
+    FuncSignature sig;
+    sig.setRet(TypeId::kVoid);
+    sig.addArg(TypeId::kUInt32);
+    InvokeNode *invokeNode;
+    Error err = cc.invoke(&invokeNode,
+                          imm(reinterpret_cast<uintptr_t>(&raiseTrap)), sig);
+    if (err) {
+      throw std::runtime_error("Failed to generate invoke node");
+    }
+    invokeNode->setArg(0, imm(static_cast<u32>(stub.code)));
   }
 }
 
@@ -170,7 +463,18 @@ x86::Gp WasmCompiler::createReg(WasmValueType type) {
 
 void WasmCompiler::StartFunction(u32 index, WasmValueType retType,
                                  std::span<WasmValueType> params) {
-  LOG_DEBUG_CC("StartFunction Index: {}, retType: {}, params: {}", index, toString(retType), params.size());
+  TRACE_VERBOSE("compiler", "StartFunction Index: {}, retType: {}, params: {}", index, toString(retType), params.size());
+  if ((options.stackChecks || options.epochInterruption ||
+       options.fuelMetering || options.callCounters) &&
+      context == nullptr && !options.contextArgument) {
+    throw std::runtime_error("Stack, epoch and fuel checks and counters "
+                             "require an instance context");
+  }
+  fnState = FunctionState{};
+  fnState.index = index;
+  fnState.startTime = std::chrono::steady_clock::now();
+  fnState.startVirtRegs = cc.virtRegs().size();
+  constRegs.clear();
   // this is for return
   {
     returnType = retType;
@@ -189,21 +493,37 @@ void WasmCompiler::StartFunction(u32 index, WasmValueType retType,
   block.label = cc.newLabel();
   FuncSignature sig;
   sig.setRet(WasmTtoJitT(retType));
+  u32 argBase = options.contextArgument ? 1 : 0;
+  if (options.contextArgument) {
+    sig.addArg(TypeId::kUIntPtr);
+  }
   for (auto param : params) {
     sig.addArg(WasmTtoJitT(param));
   }
   cc.bind(fnLabels[index]);
   auto funcNode = cc.addFunc(sig);
   funcNode->frame().setPreservedFP();
+  fnState.node = funcNode;
+  if (options.contextArgument) {
+    fnState.contextArg = cc.newIntPtr();
+    funcNode->setArg(0, fnState.contextArg);
+  }
   block.locals.reserve(params.size());
   for (u32 i = 0; i < params.size(); i++) {
     block.locals.push_back(createReg(params[i]));
-    funcNode->setArg(i, block.locals.back());
+    funcNode->setArg(argBase + i, block.locals.back());
   }
+  fnState.entryCursor = cc.cursor();
+  emitFunctionEntryCounters();
+  emitEpochCheck();
+  beginFuelBlock();
 }
 
 void WasmCompiler::Return() {
-  LOG_DEBUG_CC("Return, type: {}", toString(returnType));
+  TRACE_VERBOSE("compiler", "Return, type: {}", toString(returnType));
+  countInstr();
+  endFuelBlock();
+  emitFunctionExitCounters();
   if (returnType != WasmValueType::NONE) {
     auto& block = blockMngr.getActive();
     auto reg = block.stack.pop();
@@ -211,13 +531,14 @@ void WasmCompiler::Return() {
   } else {
     cc.ret();
   }
-
+  beginFuelBlock();
 }
 
 void WasmCompiler::EndFunction() {
-  LOG_DEBUG_CC("EndFunction, nest: {}", blockMngr.size());
+  TRACE_VERBOSE("compiler", "EndFunction, nest: {}", blockMngr.size());
   EndBlock();
   assert(blockMngr.size() == 1 && "BlockManager not empty at end of function");
+  emitFunctionExitCounters();
   if (returnType != WasmValueType::NONE) {
     auto& block = blockMngr.getActive();
     auto reg = block.stack.pop();
@@ -225,39 +546,127 @@ void WasmCompiler::EndFunction() {
   } else {
     cc.ret();
   }
+  emitStackCheck();
+  emitTrapStubs();
   cc.endFunc();
+  cc.bind(fnEndLabels[fnState.index]);
   blockMngr.clear();
+
+  FunctionCompileStats function;
+  function.funcIndex = fnState.index;
+  function.virtRegs = cc.virtRegs().size() - fnState.startVirtRegs;
+  function.translateTime = std::chrono::steady_clock::now() - fnState.startTime;
+  stats.translateTime += function.translateTime;
+  stats.virtRegs += function.virtRegs;
+  stats.functions.push_back(function);
+  funcNodes.push_back(fnState.node);
 }
 
 
 
 void WasmCompiler::AddLocals(std::span<WasmValueType> localTypes) {
-  LOG_DEBUG("AddLocals: {}", localTypes.size());
+  TRACE_VERBOSE("compiler", "AddLocals: {}", localTypes.size());
   auto &locals = blockMngr.getActive().locals;
   for (auto type : localTypes) {
     locals.push_back(createReg(type));
   }
 }
 
+static u64 constBits(const value_t &value) {
+  return std::visit(
+      [](auto v) -> u64 {
+        using T = decltype(v);
+        if constexpr (std::is_same_v<T, f32>) {
+          return std::bit_cast<u32>(v);
+        } else if constexpr (std::is_same_v<T, f64>) {
+          return std::bit_cast<u64>(v);
+        } else if constexpr (std::is_same_v<T, i32>) {
+          return static_cast<u32>(v);
+        } else {
+          return static_cast<u64>(v);
+        }
+      },
+      value);
+}
+
 void WasmCompiler::AddGlobals(std::span<WasmGlobal> _globals,
-                              std::span<value_t> values) {
-  LOG_DEBUG_CC("AddGlobals: {}", _globals.size());
+                              std::span<WasmConstExpr> initExprs) {
+  TRACE_VERBOSE("compiler", "AddGlobals: {}", _globals.size());
   for (u32 i = 0; i < _globals.size(); i++) {
     auto &global = _globals[i];
-    auto &value = values[i];
+    auto &init = initExprs[i];
+    GlobalSlot slot{global.type, global.isMutable, false, 0, 0};
+    if (init.isInitByGlobal) {
+      u32 source = std::get<u32>(init.value);
+      if (source >= globals.size() || !globals[source].isConstant) {
+        throw std::runtime_error(
+            "Globals can only be initialized from constant globals");
+      }
+      slot.bits = globals[source].bits;
+    } else {
+      slot.bits = constBits(init.value);
+    }
     if (!global.isMutable) {
-      globals.push_back(cc.newInt32Const(globalPool, std::get<i32>(value)));
+      slot.isConstant = true;
     } else {
-      globals.push_back(cc.newInt32Const(globalPool, std::get<i32>(value)));
+      slot.offset = globalAreaBytes;
+      globalAreaBytes += sizeof(u64);
     }
+    globals.push_back(slot);
+  }
+}
 
+void WasmCompiler::initGlobalArea(u8 *area) const {
+  for (auto &global : globals) {
+    if (!global.isConstant) {
+      std::memcpy(area + global.offset, &global.bits, sizeof(u64));
+    }
   }
+}
+
+std::size_t WasmCompiler::functionCounterCount() const {
+  return options.callCounters ? fnLabels.size() : 0;
+}
+
+std::optional<u64> WasmCompiler::constantGlobal(u32 index) const {
+  if (index >= globals.size() || !globals[index].isConstant) {
+    return std::nullopt;
+  }
+  return globals[index].bits;
+}
+
+/*
+ * neither the global area nor the linear memory move while the code runs,
+ * so their address is loaded once in front of the function body on the
+ * first access instead of at every access
+ */
+x86::Gp WasmCompiler::loadAtEntry(x86::Gp &cached, u32 contextOffset) {
+  if (cached.isValid()) {
+    return cached;
+  }
+  BaseNode *prev = cc.setCursor(fnState.entryCursor);
+  cached = cc.newIntPtr();
+  auto ctx = contextReg();
+  cc.mov(cached, x86::ptr(ctx, contextOffset));
+  // nothing was emitted since the entry yet, keep appending after the load
+  if (prev != fnState.entryCursor) {
+    cc.setCursor(prev);
+  }
+  return cached;
+}
 
+x86::Gp WasmCompiler::globalsReg() {
+  return loadAtEntry(fnState.globalsBase, offsetof(InstanceContext, globals));
 }
 
+x86::Gp WasmCompiler::memoryReg() {
+  return loadAtEntry(fnState.memoryBase,
+                     offsetof(InstanceContext, memoryBase));
+}
 
 void WasmCompiler::StartBlock(u32 in, u32 out) {
-  LOG_DEBUG_CC("StartBlock: in: {}, out: {}", in, out);
+  TRACE_VERBOSE("compiler", "StartBlock: in: {}, out: {}", in, out);
+  countInstr();
   blockMngr.pushBlock();
   auto &block = blockMngr.getActive();
   auto &parent = blockMngr.getParent();
@@ -266,17 +675,34 @@ void WasmCompiler::StartBlock(u32 in, u32 out) {
   block.outArity = out;
   block.stack.initFrom(parent.stack, in);
   parent.stack.freeze();
-  parent.stack.push(cc.newInt32());
+  for (u32 i = 0; i < out; i++) {
+    parent.stack.push(cc.newInt32());
+  }
+}
+
+void WasmCompiler::StartLoop(u32 in, u32 out) {
+  TRACE_VERBOSE("compiler", "StartLoop: in: {}, out: {}", in, out);
+  StartBlock(in, out);
+  auto &block = blockMngr.getActive();
+  block.isLoop = true;
+  endFuelBlock();
+  cc.bind(block.label);
+  beginFuelBlock();
 }
 
 void WasmCompiler::EndBlock() {
-  LOG_DEBUG_CC("EndBlock", 0);
+  TRACE_VERBOSE("compiler", "EndBlock");
+  countInstr();
   BlockState &block = blockMngr.getActive();
   assert(blockMngr.size() >= 1 && "EndBlock called on empty block stack");
   BlockState &parent = blockMngr.getParent();
   parent.stack.transferFrom(cc, block.stack, block.outArity);
   parent.stack.unfreeze();
-  cc.bind(block.label);
+  endFuelBlock();
+  if (!block.isLoop) {
+    cc.bind(block.label);
+  }
+  beginFuelBlock();
   blockMngr.popBlock();
 }
 
@@ -289,10 +715,12 @@ void WasmCompiler::EndBlock() {
  * has to be transferred to the block at depth + 1
  */
 void WasmCompiler::BrIf(i32 depth) {
-  LOG_DEBUG_CC("BrIf: {}", depth);
+  TRACE_VERBOSE("compiler", "BrIf: {}", depth);
+  countInstr();
   Label noBreak = cc.newLabel();
   auto& currentBlock = blockMngr.getActive();
   auto reg = currentBlock.stack.pop();
+  endFuelBlock();
   cc.test(reg, reg);
 
   cc.jz(noBreak);
@@ -300,34 +728,68 @@ void WasmCompiler::BrIf(i32 depth) {
 
  // currentBlock.stack.deduplicate(cc);
   auto& targetBlock = blockMngr.getRelative(depth);
-  auto& transferBlock = blockMngr.getRelative(depth + 1);
   assert(targetBlock.label.isValid() && "Invalid target block label");
-  transferBlock.stack.transferFrom(cc, currentBlock.stack, currentBlock.outArity);
+  if (targetBlock.isLoop) {
+    // back-edge, loops only take block params which are not supported yet
+    emitEpochCheck();
+  } else {
+    auto& transferBlock = blockMngr.getRelative(depth + 1);
+    transferBlock.stack.transferFrom(cc, currentBlock.stack, currentBlock.outArity);
+  }
   cc.jmp(targetBlock.label);
   cc.bind(noBreak);
+  beginFuelBlock();
+}
+
+void WasmCompiler::Unreachable() {
+  TRACE_VERBOSE("compiler", "Unreachable");
+  countInstr();
+  endFuelBlock();
+  markSite(true, TrapCode::UNREACHABLE);
+  cc.ud2();
+  endTrapSite();
+  beginFuelBlock();
 }
 
-void WasmCompiler::BrIfnz(i32 depth) {
+void WasmCompiler::BrIfnz(i32) {
 
   assert (false && "Not implemented");
 
 }
 
 void WasmCompiler::Br(i32 depth) {
-  LOG_DEBUG_CC("Br: {}", depth);
+  TRACE_VERBOSE("compiler", "Br: {}", depth);
+  countInstr();
   BlockState &block = blockMngr.getRelative(depth - 1);
+  endFuelBlock();
+  if (block.isLoop) {
+    emitEpochCheck();
+  }
   cc.jmp(block.label);
+  beginFuelBlock();
 }
 
 void WasmCompiler::I32Const(i32 value) {
-  LOG_DEBUG_CC("I32Const: {}", value);
+  TRACE_VERBOSE("compiler", "I32Const: {}", value);
+  countInstr();
   auto& block = blockMngr.getActive();
   auto reg = createReg(WasmValueType::I32);
   cc.mov(reg, value);
+  constRegs[reg.id()] = value;
+  block.stack.push(reg);
+}
+
+void WasmCompiler::I64Const(i64 value) {
+  TRACE_VERBOSE("compiler", "I64Const: {}", value);
+  countInstr();
+  auto& block = blockMngr.getActive();
+  auto reg = createReg(WasmValueType::I64);
+  cc.mov(reg, value);
+  constRegs[reg.id()] = value;
   block.stack.push(reg);
 }
 
-void WasmCompiler::_I32Add(x86::Gp dst, x86::Gp lhs, x86::Gp rhs) {
+void WasmCompiler::_IntAdd(x86::Gp dst, x86::Gp lhs, x86::Gp rhs) {
   if (dst != lhs) {
     cc.lea(dst, x86::ptr(lhs, rhs, 0, 0));
   } else {
@@ -335,81 +797,844 @@ void WasmCompiler::_I32Add(x86::Gp dst, x86::Gp lhs, x86::Gp rhs) {
   }
 }
 
-void WasmCompiler::Add() {
-  LOG_DEBUG_CC("Add", 0);
+void WasmCompiler::Add() { IntBinOp(WasmOpcode::I32_ADD); }
+
+void WasmCompiler::Gts() { IntCompare(WasmOpcode::I32_GT_S); }
+
+void WasmCompiler::Eq() { IntCompare(WasmOpcode::I32_EQ); }
+
+static bool inOpcodeRange(WasmOpcode op, WasmOpcode first, WasmOpcode last) {
+  return op >= first && op <= last;
+}
+
+// the type the operands of an integer instruction have
+static WasmValueType intOperandType(WasmOpcode op) {
+  if (inOpcodeRange(op, WasmOpcode::I64_EQZ, WasmOpcode::I64_GE_U) ||
+      inOpcodeRange(op, WasmOpcode::I64_CLZ, WasmOpcode::I64_ROTR) ||
+      op == WasmOpcode::I32_WRAP_I64 ||
+      inOpcodeRange(op, WasmOpcode::I64_EXTEND_8S, WasmOpcode::I64_EXTEND_32S)) {
+    return WasmValueType::I64;
+  }
+  return WasmValueType::I32;
+}
+
+void WasmCompiler::IntBinOp(WasmOpcode op) {
+  TRACE_VERBOSE("compiler", "IntBinOp: {}", static_cast<u32>(op));
+  countInstr();
   auto& block = blockMngr.getActive();
-  x86::Gp dst = createReg(WasmValueType::I32);
+  auto type = intOperandType(op);
   x86::Gp rhs = block.stack.pop();
   x86::Gp lhs = block.stack.pop();
-  _I32Add(dst, lhs, rhs);
+  x86::Gp dst;
+  switch (op) {
+  case WasmOpcode::I32_ADD:
+  case WasmOpcode::I64_ADD:
+    dst = createReg(type);
+    _IntAdd(dst, lhs, rhs);
+    break;
+  case WasmOpcode::I32_SUB:
+  case WasmOpcode::I64_SUB:
+    dst = createReg(type);
+    cc.mov(dst, lhs);
+    cc.sub(dst, rhs);
+    break;
+  case WasmOpcode::I32_MUL:
+  case WasmOpcode::I64_MUL:
+    dst = createReg(type);
+    cc.mov(dst, lhs);
+    cc.imul(dst, rhs);
+    break;
+  case WasmOpcode::I32_AND:
+  case WasmOpcode::I64_AND:
+    dst = createReg(type);
+    cc.mov(dst, lhs);
+    cc.and_(dst, rhs);
+    break;
+  case WasmOpcode::I32_OR:
+  case WasmOpcode::I64_OR:
+    dst = createReg(type);
+    cc.mov(dst, lhs);
+    cc.or_(dst, rhs);
+    break;
+  case WasmOpcode::I32_XOR:
+  case WasmOpcode::I64_XOR:
+    dst = createReg(type);
+    cc.mov(dst, lhs);
+    cc.xor_(dst, rhs);
+    break;
+  case WasmOpcode::I32_SHL:
+  case WasmOpcode::I32_SHR_S:
+  case WasmOpcode::I32_SHR_U:
+  case WasmOpcode::I32_ROTL:
+  case WasmOpcode::I32_ROTR:
+  case WasmOpcode::I64_SHL:
+  case WasmOpcode::I64_SHR_S:
+  case WasmOpcode::I64_SHR_U:
+  case WasmOpcode::I64_ROTL:
+  case WasmOpcode::I64_ROTR:
+    dst = emitShift(op, type, lhs, rhs);
+    break;
+  case WasmOpcode::I32_DIV_S:
+  case WasmOpcode::I32_DIV_U:
+  case WasmOpcode::I32_REM_S:
+  case WasmOpcode::I32_REM_U:
+  case WasmOpcode::I64_DIV_S:
+  case WasmOpcode::I64_DIV_U:
+  case WasmOpcode::I64_REM_S:
+  case WasmOpcode::I64_REM_U:
+    dst = emitDivRem(op, type, lhs, rhs);
+    break;
+  default:
+    throw std::runtime_error("Invalid integer binary opcode");
+  }
+  block.stack.push(dst);
+}
+
+/*
+ * x86 masks shift counts to the operand width exactly like wasm does. with
+ * BMI2 the count can live in any register and the source isn't clobbered,
+ * otherwise it has to go through cl
+ */
+x86::Gp WasmCompiler::emitShift(WasmOpcode op, WasmValueType type,
+                                x86::Gp lhs, x86::Gp rhs) {
+  u32 bits = type == WasmValueType::I64 ? 64 : 32;
+  bool isRotl = op == WasmOpcode::I32_ROTL || op == WasmOpcode::I64_ROTL;
+  bool isRotr = op == WasmOpcode::I32_ROTR || op == WasmOpcode::I64_ROTR;
+  auto dst = createReg(type);
+
+  if (auto it = constRegs.find(rhs.id()); it != constRegs.end()) {
+    u32 count = static_cast<u32>(it->second) & (bits - 1);
+    if ((isRotl || isRotr) && features.has(HostFeatureProfile::BMI2)) {
+      cc.rorx(dst, lhs, isRotr ? count : (bits - count) & (bits - 1));
+      return dst;
+    }
+    cc.mov(dst, lhs);
+    switch (op) {
+    case WasmOpcode::I32_SHL:
+    case WasmOpcode::I64_SHL:
+      cc.shl(dst, count);
+      break;
+    case WasmOpcode::I32_SHR_S:
+    case WasmOpcode::I64_SHR_S:
+      cc.sar(dst, count);
+      break;
+    case WasmOpcode::I32_SHR_U:
+    case WasmOpcode::I64_SHR_U:
+      cc.shr(dst, count);
+      break;
+    case WasmOpcode::I32_ROTL:
+    case WasmOpcode::I64_ROTL:
+      cc.rol(dst, count);
+      break;
+    default:
+      cc.ror(dst, count);
+      break;
+    }
+    return dst;
+  }
+
+  // there is no variable count form of rorx
+  if (!isRotl && !isRotr && features.has(HostFeatureProfile::BMI2)) {
+    switch (op) {
+    case WasmOpcode::I32_SHL:
+    case WasmOpcode::I64_SHL:
+      cc.shlx(dst, lhs, rhs);
+      break;
+    case WasmOpcode::I32_SHR_S:
+    case WasmOpcode::I64_SHR_S:
+      cc.sarx(dst, lhs, rhs);
+      break;
+    default:
+      cc.shrx(dst, lhs, rhs);
+      break;
+    }
+    return dst;
+  }
+
+  cc.mov(dst, lhs);
+  switch (op) {
+  case WasmOpcode::I32_SHL:
+  case WasmOpcode::I64_SHL:
+    cc.shl(dst, rhs.r8());
+    break;
+  case WasmOpcode::I32_SHR_S:
+  case WasmOpcode::I64_SHR_S:
+    cc.sar(dst, rhs.r8());
+    break;
+  case WasmOpcode::I32_SHR_U:
+  case WasmOpcode::I64_SHR_U:
+    cc.shr(dst, rhs.r8());
+    break;
+  case WasmOpcode::I32_ROTL:
+  case WasmOpcode::I64_ROTL:
+    cc.rol(dst, rhs.r8());
+    break;
+  default:
+    cc.ror(dst, rhs.r8());
+    break;
+  }
+  return dst;
+}
+
+static bool isSignedDivRem(WasmOpcode op) {
+  return op == WasmOpcode::I32_DIV_S || op == WasmOpcode::I32_REM_S ||
+         op == WasmOpcode::I64_DIV_S || op == WasmOpcode::I64_REM_S;
+}
+
+static bool isRemainder(WasmOpcode op) {
+  return op == WasmOpcode::I32_REM_S || op == WasmOpcode::I32_REM_U ||
+         op == WasmOpcode::I64_REM_S || op == WasmOpcode::I64_REM_U;
+}
+
+/*
+ * a zero divisor is not checked for inline, the div faults with #DE and the
+ * signal handler finds the trap site. the one other input idiv faults on is
+ * INT_MIN / -1, so a divisor of -1 takes a separate path that negates
+ * instead: div_s traps on the overflow, rem_s is always 0
+ */
+x86::Gp WasmCompiler::emitDivRem(WasmOpcode op, WasmValueType type,
+                                 x86::Gp lhs, x86::Gp rhs) {
+  if (auto it = constRegs.find(rhs.id()); it != constRegs.end()) {
+    x86::Gp result;
+    if (emitDivRemByConst(op, type, lhs, it->second, result)) {
+      return result;
+    }
+  }
+  bool isRem = isRemainder(op);
+  auto lo = createReg(type);
+  auto hi = createReg(type);
+  if (isSignedDivRem(op)) {
+    Label divide = cc.newLabel();
+    Label done = cc.newLabel();
+    cc.cmp(rhs, -1);
+    cc.jne(divide);
+    if (isRem) {
+      cc.xor_(hi, hi);
+    } else {
+      cc.mov(lo, lhs);
+      cc.neg(lo);
+      cc.jo(trapStub(TrapCode::INTEGER_OVERFLOW));
+    }
+    cc.jmp(done);
+    cc.bind(divide);
+    cc.mov(lo, lhs);
+    if (type == WasmValueType::I64) {
+      cc.cqo(hi, lo);
+    } else {
+      cc.cdq(hi, lo);
+    }
+    markSite(true, TrapCode::INTEGER_DIVIDE_BY_ZERO);
+    cc.idiv(hi, lo, rhs);
+    endTrapSite();
+    cc.bind(done);
+  } else {
+    cc.xor_(hi, hi);
+    cc.mov(lo, lhs);
+    markSite(true, TrapCode::INTEGER_DIVIDE_BY_ZERO);
+    cc.div(hi, lo, rhs);
+    endTrapSite();
+  }
+  return isRem ? hi : lo;
+}
+
+/*
+ * division by a constant never traps (a zero divisor is left to the generic
+ * path) and turns into shifts for powers of two and a multiply-high
+ * otherwise, see div-magic.hpp. returns false if there is nothing to gain
+ */
+bool WasmCompiler::emitDivRemByConst(WasmOpcode op, WasmValueType type,
+                                     x86::Gp lhs, i64 divisor,
+                                     x86::Gp &result) {
+  bool is64 = type == WasmValueType::I64;
+  u32 bits = is64 ? 64 : 32;
+  bool isRem = isRemainder(op);
+  if (divisor == 0) {
+    return false;
+  }
+
+  if (!isSignedDivRem(op)) {
+    u64 d = is64 ? static_cast<u64>(divisor)
+                 : static_cast<u64>(static_cast<u32>(divisor));
+    if (std::has_single_bit(d)) {
+      result = createReg(type);
+      cc.mov(result, lhs);
+      if (isRem) {
+        if (d - 1 <= static_cast<u64>(std::numeric_limits<i32>::max())) {
+          cc.and_(result, static_cast<i32>(d - 1));
+        } else {
+          auto mask = createReg(type);
+          cc.mov(mask, d - 1);
+          cc.and_(result, mask);
+        }
+      } else if (d != 1) {
+        cc.shr(result, std::countr_zero(d));
+      }
+      return true;
+    }
+    auto quotient = emitUnsignedDivByConst(type, lhs, d);
+    result = isRem ? emitRemFromQuotient(type, lhs, quotient, divisor)
+                   : quotient;
+    return true;
+  }
+
+  i64 d = is64 ? divisor : static_cast<i64>(static_cast<i32>(divisor));
+  if (d == 1 || (d == -1 && isRem)) {
+    result = createReg(type);
+    if (isRem) {
+      cc.xor_(result, result);
+    } else {
+      cc.mov(result, lhs);
+    }
+    return true;
+  }
+  if (d == -1) {
+    // needs the overflow check of the generic path
+    return false;
+  }
+  u64 absD = d < 0 ? u64{0} - static_cast<u64>(d) : static_cast<u64>(d);
+  if (!is64) {
+    absD = static_cast<u32>(absD);
+  }
+  if (std::has_single_bit(absD)) {
+    // bias negative dividends by |d| - 1 so the shift rounds towards zero
+    u32 k = std::countr_zero(absD);
+    auto quotient = createReg(type);
+    cc.mov(quotient, lhs);
+    cc.sar(quotient, bits - 1);
+    cc.shr(quotient, bits - k);
+    cc.add(quotient, lhs);
+    cc.sar(quotient, k);
+    if (isRem) {
+      result = createReg(type);
+      cc.shl(quotient, k);
+      cc.mov(result, lhs);
+      cc.sub(result, quotient);
+    } else {
+      if (d < 0) {
+        cc.neg(quotient);
+      }
+      result = quotient;
+    }
+    return true;
+  }
+  auto quotient = emitSignedDivByConst(type, lhs, d);
+  result = isRem ? emitRemFromQuotient(type, lhs, quotient, d) : quotient;
+  return true;
+}
+
+x86::Gp WasmCompiler::emitUnsignedDivByConst(WasmValueType type, x86::Gp lhs,
+                                             u64 divisor) {
+  auto quotient = createReg(type);
+  if (type == WasmValueType::I32) {
+    // a 33 bit magic number fits a 64 bit multiply, no need for mul's rdx:rax
+    auto magic = computeUnsignedMagic<u32>(static_cast<u32>(divisor));
+    auto n = cc.newUInt64();
+    auto t = cc.newUInt64();
+    cc.mov(n.r32(), lhs);
+    cc.mov(t, magic.multiplier);
+    cc.imul(t, n);
+    if (magic.add) {
+      cc.shr(t, 32);
+      cc.sub(n, t);
+      cc.shr(n, 1);
+      cc.add(n, t);
+      cc.shr(n, magic.shift);
+      cc.mov(quotient, n.r32());
+    } else {
+      cc.shr(t, 32 + magic.shift);
+      cc.mov(quotient, t.r32());
+    }
+    return quotient;
+  }
+  auto magic = computeUnsignedMagic<u64>(divisor);
+  auto lo = cc.newUInt64();
+  auto hi = cc.newUInt64();
+  cc.mov(lo, magic.multiplier);
+  cc.mul(hi, lo, lhs);
+  if (magic.add) {
+    cc.mov(quotient, lhs);
+    cc.sub(quotient, hi);
+    cc.shr(quotient, 1);
+    cc.add(quotient, hi);
+  } else {
+    cc.mov(quotient, hi);
+  }
+  if (magic.shift != 0) {
+    cc.shr(quotient, magic.shift);
+  }
+  return quotient;
+}
+
+x86::Gp WasmCompiler::emitSignedDivByConst(WasmValueType type, x86::Gp lhs,
+                                           i64 divisor) {
+  x86::Gp q;
+  x86::Gp n;
+  DivMagic magic;
+  if (type == WasmValueType::I32) {
+    magic = computeSignedMagic<i32>(static_cast<i32>(divisor));
+    n = cc.newInt64();
+    q = cc.newInt64();
+    cc.movsxd(n, lhs);
+    cc.mov(q, static_cast<i64>(magic.multiplier));
+    cc.imul(q, n);
+    cc.sar(q, 32);
+  } else {
+    magic = computeSignedMagic<i64>(divisor);
+    n = lhs;
+    q = cc.newInt64();
+    auto lo = cc.newInt64();
+    cc.mov(lo, static_cast<i64>(magic.multiplier));
+    cc.imul(q, lo, lhs);
+  }
+  if (magic.add) {
+    if (divisor > 0) {
+      cc.add(q, n);
+    } else {
+      cc.sub(q, n);
+    }
+  }
+  if (magic.shift != 0) {
+    cc.sar(q, magic.shift);
+  }
+  // round towards zero by adding one to negative quotients
+  auto sign = cc.newInt64();
+  cc.mov(sign, q);
+  cc.shr(sign, 63);
+  cc.add(q, sign);
+  if (type == WasmValueType::I64) {
+    return q;
+  }
+  auto quotient = createReg(type);
+  cc.mov(quotient, q.r32());
+  return quotient;
+}
+
+// n - (n / d) * d, wrapping in the width of the type
+x86::Gp WasmCompiler::emitRemFromQuotient(WasmValueType type, x86::Gp lhs,
+                                          x86::Gp quotient, i64 divisor) {
+  auto product = createReg(type);
+  if (type == WasmValueType::I32) {
+    cc.imul(product, quotient, static_cast<i32>(divisor));
+  } else if (divisor >= std::numeric_limits<i32>::min() &&
+             divisor <= std::numeric_limits<i32>::max()) {
+    cc.imul(product, quotient, divisor);
+  } else {
+    cc.mov(product, divisor);
+    cc.imul(product, quotient);
+  }
+  auto result = createReg(type);
+  cc.mov(result, lhs);
+  cc.sub(result, product);
+  return result;
+}
+
+x86::Gp WasmCompiler::emitBitCount(WasmOpcode op, WasmValueType type,
+                                   x86::Gp src) {
+  u32 bits = type == WasmValueType::I64 ? 64 : 32;
+  auto dst = createReg(type);
+  switch (op) {
+  case WasmOpcode::I32_CLZ:
+  case WasmOpcode::I64_CLZ:
+    if (features.has(HostFeatureProfile::LZCNT)) {
+      cc.lzcnt(dst, src);
+    } else {
+      // bsr yields the index of the highest set bit and leaves dst undefined
+      // for 0, 2 * bits - 1 makes the final xor come out as bits for that
+      auto zeroResult = createReg(type);
+      cc.mov(zeroResult, 2 * bits - 1);
+      cc.bsr(dst, src);
+      cc.cmovz(dst, zeroResult);
+      cc.xor_(dst, bits - 1);
+    }
+    break;
+  case WasmOpcode::I32_CTZ:
+  case WasmOpcode::I64_CTZ:
+    if (features.has(HostFeatureProfile::BMI1)) {
+      cc.tzcnt(dst, src);
+    } else {
+      auto zeroResult = createReg(type);
+      cc.mov(zeroResult, bits);
+      cc.bsf(dst, src);
+      cc.cmovz(dst, zeroResult);
+    }
+    break;
+  default:
+    if (features.has(HostFeatureProfile::POPCNT)) {
+      cc.popcnt(dst, src);
+    } else {
+      emitPopcntFallback(type, dst, src);
+    }
+    break;
+  }
+  return dst;
+}
+
+// the classic SWAR bit count, Hacker's Delight 5-2
+void WasmCompiler::emitPopcntFallback(WasmValueType type, x86::Gp dst,
+                                      x86::Gp src) {
+  bool is64 = type == WasmValueType::I64;
+  u64 ones = is64 ? ~u64{0} : u64{0xffffffff};
+  auto tmp = createReg(type);
+  auto mask = createReg(type);
+  cc.mov(dst, src);
+  cc.mov(tmp, src);
+  cc.shr(tmp, 1);
+  cc.mov(mask, 0x5555555555555555 & ones);
+  cc.and_(tmp, mask);
+  cc.sub(dst, tmp);
+  cc.mov(tmp, dst);
+  cc.shr(tmp, 2);
+  cc.mov(mask, 0x3333333333333333 & ones);
+  cc.and_(tmp, mask);
+  cc.and_(dst, mask);
+  cc.add(dst, tmp);
+  cc.mov(tmp, dst);
+  cc.shr(tmp, 4);
+  cc.add(dst, tmp);
+  cc.mov(mask, 0x0f0f0f0f0f0f0f0f & ones);
+  cc.and_(dst, mask);
+  // sums up the per byte counts in the top byte
+  cc.mov(mask, 0x0101010101010101 & ones);
+  cc.imul(dst, mask);
+  cc.shr(dst, is64 ? 56 : 24);
+}
+
+void WasmCompiler::IntCompare(WasmOpcode op) {
+  TRACE_VERBOSE("compiler", "IntCompare: {}", static_cast<u32>(op));
+  countInstr();
+  auto& block = blockMngr.getActive();
+  x86::Gp rhs = block.stack.pop();
+  x86::Gp lhs = block.stack.pop();
+  cc.cmp(lhs, rhs);
+  auto flag = cc.newUInt8();
+  switch (op) {
+  case WasmOpcode::I32_EQ:
+  case WasmOpcode::I64_EQ:
+    cc.sete(flag);
+    break;
+  case WasmOpcode::I32_NE:
+  case WasmOpcode::I64_NE:
+    cc.setne(flag);
+    break;
+  case WasmOpcode::I32_LT_S:
+  case WasmOpcode::I64_LT_S:
+    cc.setl(flag);
+    break;
+  case WasmOpcode::I32_LT_U:
+  case WasmOpcode::I64_LT_U:
+    cc.setb(flag);
+    break;
+  case WasmOpcode::I32_GT_S:
+  case WasmOpcode::I64_GT_S:
+    cc.setg(flag);
+    break;
+  case WasmOpcode::I32_GT_U:
+  case WasmOpcode::I64_GT_U:
+    cc.seta(flag);
+    break;
+  case WasmOpcode::I32_LE_S:
+  case WasmOpcode::I64_LE_S:
+    cc.setle(flag);
+    break;
+  case WasmOpcode::I32_LE_U:
+  case WasmOpcode::I64_LE_U:
+    cc.setbe(flag);
+    break;
+  case WasmOpcode::I32_GE_S:
+  case WasmOpcode::I64_GE_S:
+    cc.setge(flag);
+    break;
+  case WasmOpcode::I32_GE_U:
+  case WasmOpcode::I64_GE_U:
+    cc.setae(flag);
+    break;
+  default:
+    throw std::runtime_error("Invalid integer compare opcode");
+  }
+  x86::Gp dst = createReg(WasmValueType::I32);
+  cc.movzx(dst, flag);
+  block.stack.push(dst);
+}
+
+void WasmCompiler::IntUnOp(WasmOpcode op) {
+  TRACE_VERBOSE("compiler", "IntUnOp: {}", static_cast<u32>(op));
+  countInstr();
+  auto& block = blockMngr.getActive();
+  x86::Gp src = block.stack.pop();
+  x86::Gp dst;
+  switch (op) {
+  case WasmOpcode::I32_EQZ:
+  case WasmOpcode::I64_EQZ: {
+    auto flag = cc.newUInt8();
+    cc.test(src, src);
+    cc.sete(flag);
+    dst = createReg(WasmValueType::I32);
+    cc.movzx(dst, flag);
+    break;
+  }
+  case WasmOpcode::I32_CLZ:
+  case WasmOpcode::I32_CTZ:
+  case WasmOpcode::I32_POPCNT:
+  case WasmOpcode::I64_CLZ:
+  case WasmOpcode::I64_CTZ:
+  case WasmOpcode::I64_POPCNT:
+    dst = emitBitCount(op, intOperandType(op), src);
+    break;
+  case WasmOpcode::I32_WRAP_I64:
+    dst = createReg(WasmValueType::I32);
+    cc.mov(dst, src.r32());
+    break;
+  case WasmOpcode::I64_EXTEND_I32_S:
+    dst = createReg(WasmValueType::I64);
+    cc.movsxd(dst, src);
+    break;
+  case WasmOpcode::I64_EXTEND_I32_U:
+    // writing the low half clears the upper one
+    dst = createReg(WasmValueType::I64);
+    cc.mov(dst.r32(), src);
+    break;
+  case WasmOpcode::I32_EXTEND_8S:
+  case WasmOpcode::I64_EXTEND_8S:
+    dst = createReg(intOperandType(op));
+    cc.movsx(dst, src.r8());
+    break;
+  case WasmOpcode::I32_EXTEND_16S:
+  case WasmOpcode::I64_EXTEND_16S:
+    dst = createReg(intOperandType(op));
+    cc.movsx(dst, src.r16());
+    break;
+  case WasmOpcode::I64_EXTEND_32S:
+    dst = createReg(WasmValueType::I64);
+    cc.movsxd(dst, src.r32());
+    break;
+  default:
+    throw std::runtime_error("Invalid integer unary opcode");
+  }
   block.stack.push(dst);
 }
 
 void WasmCompiler::I32Load(i64 base) {
-  LOG_DEBUG_CC("I32Load: {}", base);
+  TRACE_VERBOSE("compiler", "I32Load: {}", base);
+  countInstr();
   auto& block = blockMngr.getActive();
   auto result = createReg(WasmValueType::I32);
   auto offset = block.stack.pop();
   auto baseReg = createReg(WasmValueType::I64);
   cc.mov(baseReg, base);
+  markSite(true, TrapCode::MEMORY_OUT_OF_BOUNDS);
   cc.mov(result, x86::ptr_32(baseReg, offset));
+  endTrapSite();
   block.stack.push(result);
 }
 
 void WasmCompiler::I32Store(i64 base) {
-  LOG_DEBUG_CC("I32Store: {}", base);
+  TRACE_VERBOSE("compiler", "I32Store: {}", base);
+  countInstr();
   auto& block = blockMngr.getActive();
   auto value = block.stack.pop();
   auto offset = block.stack.pop();
   auto baseReg = createReg(WasmValueType::I64);
   cc.mov(baseReg, base);
+  markSite(true, TrapCode::MEMORY_OUT_OF_BOUNDS);
   cc.mov(x86::ptr_32(baseReg, offset), value);
+  endTrapSite();
+}
+
+/*
+ * an i32 address plus a u32 offset stays within the reservation of the
+ * linear memory, everything past the committed pages faults
+ */
+x86::Mem WasmCompiler::linearMemoryOperand(x86::Gp addr, u32 offset,
+                                           u32 size) {
+  auto index = cc.newUInt64();
+  cc.mov(index.r32(), addr.r32());
+  if (offset > static_cast<u32>(std::numeric_limits<i32>::max())) {
+    auto wideOffset = cc.newUInt64();
+    cc.mov(wideOffset, u64{offset});
+    cc.add(index, wideOffset);
+    offset = 0;
+  }
+  return x86::ptr(memoryReg(), index, 0, static_cast<i32>(offset), size);
+}
+
+void WasmCompiler::Load(WasmOpcode op, u32 offset) {
+  TRACE_VERBOSE("compiler", "Load: {}, offset: {}", static_cast<u32>(op), offset);
+  countInstr();
+  auto& block = blockMngr.getActive();
+  auto addr = block.stack.pop();
+  bool is64 = inOpcodeRange(op, WasmOpcode::I64_LOAD_8S,
+                            WasmOpcode::I64_LOAD_32U) ||
+              op == WasmOpcode::I64_LOAD;
+  auto dst = createReg(is64 ? WasmValueType::I64 : WasmValueType::I32);
+  u32 size;
+  switch (op) {
+  case WasmOpcode::I32_LOAD_8S:
+  case WasmOpcode::I32_LOAD_8U:
+  case WasmOpcode::I64_LOAD_8S:
+  case WasmOpcode::I64_LOAD_8U:
+    size = 1;
+    break;
+  case WasmOpcode::I32_LOAD_16S:
+  case WasmOpcode::I32_LOAD_16U:
+  case WasmOpcode::I64_LOAD_16S:
+  case WasmOpcode::I64_LOAD_16U:
+    size = 2;
+    break;
+  case WasmOpcode::I32_LOAD:
+  case WasmOpcode::I64_LOAD_32S:
+  case WasmOpcode::I64_LOAD_32U:
+    size = 4;
+    break;
+  case WasmOpcode::I64_LOAD:
+    size = 8;
+    break;
+  default:
+    throw std::runtime_error("Invalid load opcode");
+  }
+  auto mem = linearMemoryOperand(addr, offset, size);
+  markSite(true, TrapCode::MEMORY_OUT_OF_BOUNDS);
+  switch (op) {
+  case WasmOpcode::I32_LOAD_8S:
+  case WasmOpcode::I32_LOAD_16S:
+  case WasmOpcode::I64_LOAD_8S:
+  case WasmOpcode::I64_LOAD_16S:
+    cc.movsx(dst, mem);
+    break;
+  case WasmOpcode::I32_LOAD_8U:
+  case WasmOpcode::I32_LOAD_16U:
+  case WasmOpcode::I64_LOAD_8U:
+  case WasmOpcode::I64_LOAD_16U:
+    cc.movzx(dst, mem);
+    break;
+  case WasmOpcode::I64_LOAD_32S:
+    cc.movsxd(dst, mem);
+    break;
+  case WasmOpcode::I64_LOAD_32U:
+    cc.mov(dst.r32(), mem);
+    break;
+  default:
+    cc.mov(dst, mem);
+    break;
+  }
+  endTrapSite();
+  block.stack.push(dst);
+}
+
+void WasmCompiler::Store(WasmOpcode op, u32 offset) {
+  TRACE_VERBOSE("compiler", "Store: {}, offset: {}", static_cast<u32>(op), offset);
+  countInstr();
+  auto& block = blockMngr.getActive();
+  auto value = block.stack.pop();
+  auto addr = block.stack.pop();
+  x86::Gp src;
+  switch (op) {
+  case WasmOpcode::I32_STORE_8:
+  case WasmOpcode::I64_STORE_8:
+    src = value.r8();
+    break;
+  case WasmOpcode::I32_STORE_16:
+  case WasmOpcode::I64_STORE_16:
+    src = value.r16();
+    break;
+  case WasmOpcode::I32_STORE:
+  case WasmOpcode::I64_STORE_32:
+    src = value.r32();
+    break;
+  case WasmOpcode::I64_STORE:
+    src = value;
+    break;
+  default:
+    throw std::runtime_error("Invalid store opcode");
+  }
+  auto mem = linearMemoryOperand(addr, offset, src.size());
+  markSite(true, TrapCode::MEMORY_OUT_OF_BOUNDS);
+  cc.mov(mem, src);
+  endTrapSite();
 }
 
 void WasmCompiler::LocalGet(u32 index) {
-  LOG_DEBUG_CC("LocalGet: {}", index);
+  TRACE_VERBOSE("compiler", "LocalGet: {}", index);
+  countInstr();
   auto &block = blockMngr.getActive();
   block.stack.push(block.locals[index]);
 }
 void WasmCompiler::GlobalGet(u32 index) {
-  LOG_DEBUG_CC("GlobalGet: {}", index);
+  TRACE_VERBOSE("compiler", "GlobalGet: {}", index);
+  countInstr();
   auto &block = blockMngr.getActive();
-  auto reg = createReg(WasmValueType::I32);
-  cc.mov(reg, globals[index]);
+  auto &global = globals[index];
+  auto reg = createReg(global.type);
+  if (global.isConstant) {
+    if (reg.isGpd()) {
+      cc.mov(reg, static_cast<u32>(global.bits));
+    } else {
+      cc.mov(reg, global.bits);
+    }
+    if (global.type == WasmValueType::I32) {
+      constRegs[reg.id()] = static_cast<i32>(global.bits);
+    } else if (global.type == WasmValueType::I64) {
+      constRegs[reg.id()] = static_cast<i64>(global.bits);
+    }
+  } else {
+    cc.mov(reg, x86::ptr(globalsReg(), global.offset));
+  }
   block.stack.push(reg);
 }
 
-void WasmCompiler::LocalSet(u32 index) {
-  LOG_DEBUG_CC("LocalSet: {}", index);
+void WasmCompiler::GlobalSet(u32 index) {
+  TRACE_VERBOSE("compiler", "GlobalSet: {}", index);
+  auto &global = globals[index];
+  if (!global.isMutable) {
+    throw std::runtime_error("global.set on an immutable global");
+  }
+  countInstr();
   auto &block = blockMngr.getActive();
   auto reg = block.stack.pop();
-  cc.mov(block.locals[index], reg);
+  cc.mov(x86::ptr(globalsReg(), global.offset), reg);
 }
 
-void WasmCompiler::Gts() {
-  LOG_DEBUG_CC("Gts", 0);
-  auto& block = blockMngr.getActive();
-  x86::Gp rhs = block.stack.pop();
-  x86::Gp lhs = block.stack.pop();
-  cc.cmp(lhs, rhs);
-  x86::Gp dst = cc.newInt32();
-  cc.setg(x86::cl);
-  cc.movzx(dst, x86::cl);
-  block.stack.push(dst);
+void WasmCompiler::LocalSet(u32 index) {
+  TRACE_VERBOSE("compiler", "LocalSet: {}", index);
+  countInstr();
+  auto &block = blockMngr.getActive();
+  auto reg = block.stack.pop();
+  cc.mov(block.locals[index], reg);
 }
 
 void WasmCompiler::finalize() {
-  LOG_DEBUG_CC("finalize", 0);
+  TRACE_VERBOSE("compiler", "finalize");
+  auto start = std::chrono::steady_clock::now();
   cc.finalize();
+  auto finalized = std::chrono::steady_clock::now();
   Error err = runtime.add(&entry, &code);
   if (err) {
     printf("Error: %s\n", DebugUtils::errorAsString(err));
+    return;
+  }
+  stats.finalizeTime = finalized - start;
+  stats.linkTime = std::chrono::steady_clock::now() - finalized;
+  buildCodeMap();
+  collectCodeStats();
+  if (options.perfMap) {
+    writePerfMap(*map, map->symbols());
+  }
+  if (options.jitDump) {
+    writeJitDump(*map, map->symbols());
+  }
+  if (options.gdbJit) {
+    gdbRegistration =
+        std::make_unique<GdbJitRegistration>(*map, map->symbols());
   }
 }
 
-void WasmCompiler::dumpAsm() { std::cout << logger.data() << std::endl; }
-void WasmCompiler::dumpTrace() {
-  std::cout << dbg.str() << std::endl;
+void WasmCompiler::dumpAsm() {
+  // a trace per line, a whole function wouldn't fit into one message
+  std::string_view text(logger.data(), logger.dataSize());
+  while (!text.empty()) {
+    auto end = std::min(text.find('\n'), text.size());
+    TRACE_VERBOSE("compiler", "{}", text.substr(0, end));
+    text.remove_prefix(std::min(end + 1, text.size()));
+  }
 }
 
 } // namespace wasmjit
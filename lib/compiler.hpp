@@ -4,10 +4,23 @@
 #include "asmjit/core/constpool.h"
 #include "asmjit/x86/x86opcode_p.h"
 #include "asmjit/x86/x86operand.h"
+#include "lib/code-map.hpp"
+#include "lib/compile-stats.hpp"
+#include "lib/context.hpp"
+#include "lib/epoch.hpp"
+#include "lib/gdb-jit.hpp"
+#include "lib/host-features.hpp"
+#include "lib/jit-profiling.hpp"
+#include "lib/trace.hpp"
+#include "lib/trap.hpp"
 #include "lib/tz-utils.hpp"
 #include "parser.hpp"
+#include <chrono>
+#include <memory>
+#include <optional>
 #include <span>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 
 using namespace asmjit;
@@ -15,10 +28,6 @@ using namespace asmjit;
 namespace wasmjit {
 
 
-#define LOG_DEBUG_CC(fmt, ...)                                                    \
-  dbg << "CC ->"; \
-  dbg << std::format(fmt, __VA_ARGS__) << std::endl
-
 class OperandStack {
 public:
   OperandStack();
@@ -47,6 +56,8 @@ struct BlockState {
   OperandStack stack;
   std::vector<x86::Gp> locals;
   u32 outArity;
+  // loops are entered at their label, so branches to them go backwards
+  bool isLoop = false;
 };
 
 class BlockManager {
@@ -69,29 +80,90 @@ private:
   std::vector<BlockState> blocks;
 };
 
+struct CompilerOptions {
+  // compare rsp against InstanceContext::stackLimit in the prologue of every
+  // function that makes calls, leaf functions can't recurse and skip it
+  bool stackChecks = false;
+  // compare globalEpoch against InstanceContext::epochDeadline at function
+  // entries and loop back-edges
+  bool epochInterruption = false;
+  // charge every basic block its number of wasm instructions against
+  // InstanceContext::fuel with a single subtraction at the start of the block
+  bool fuelMetering = false;
+  // cpu extensions the generated code may use, defaults to everything the
+  // host supports. must be a subset of what the host supports
+  std::optional<HostFeatureProfile> targetFeatures = std::nullopt;
+  // pass the InstanceContext as a hidden first argument to every function
+  // (host functions included) instead of embedding the address of a bound
+  // context, the code then only depends on the module and can be shared by
+  // any number of instances
+  bool contextArgument = false;
+  // record the native offset of every wasm instruction in the code map. it
+  // binds a label in front of each one, which splits the register allocator's
+  // blocks, so this is meant for profiling builds
+  bool lineTable = false;
+  // announce every function to perf once it is in executable memory, see
+  // writePerfMap() and writeJitDump() (the latter implies lineTable)
+  bool perfMap = false;
+  bool jitDump = false;
+  // register the code with gdb through __jit_debug_register_code, with
+  // symbols and a DWARF line table (implies lineTable)
+  bool gdbJit = false;
+  // count the calls and returns of every function in
+  // InstanceContext::functionCounters. without it nothing is emitted
+  bool callCounters = false;
+  // also add the rdtsc cycles every call took to the counters of the
+  // function (implies callCounters)
+  bool cycleCounters = false;
+};
+
 class WasmCompiler {
 public:
-  WasmCompiler(u32 funcCount);
+  WasmCompiler(u32 funcCount, CompilerOptions options = {});
+  ~WasmCompiler();
+
+  // the context whose address is embedded into the generated code, not
+  // needed with CompilerOptions::contextArgument
+  void bindContext(InstanceContext *ctx);
+  // offset into the module of the instruction that is compiled next,
+  // ends up in the code map for trap sites and backtraces
+  void setSourceOffset(u32 offset);
+  // function names for perf, gdb and the Sampler, has to be called before
+  // finalize()
+  void setSymbols(JitSymbols symbols);
 
   void StartFunction(u32 index, WasmValueType retType,
                      std::span<WasmValueType> params);
   void EndFunction();
   void AddLocals(std::span<WasmValueType> types);
-  void AddGlobals(std::span<WasmGlobal> globals, std::span<value_t> values);
+  // immutable globals with a constant initializer are folded into the code,
+  // all others live in the instance's global area
+  void AddGlobals(std::span<WasmGlobal> globals,
+                  std::span<WasmConstExpr> initExprs);
   void EndBlock();
   void Return();
 
   void LocalGet(u32 index);
   void GlobalGet(u32 index);
+  void GlobalSet(u32 index);
   void LocalSet(u32 index);
   void I32Const(i32 value);
+  void I64Const(i64 value);
   template<class T>
   void Call(T target, WasmValueType retType, std::span<WasmValueType> params);
 
   void StartBlock(u32 in, u32 out);
+  void StartLoop(u32 in, u32 out);
 
+  // access to a fixed address, used before there was an instance context
   void I32Load(i64 addr);
   void I32Store(i64 addr);
+  // integer loads/stores of the linear memory of the instance,
+  // InstanceContext::memoryBase + the zero extended address + offset
+  void Load(WasmOpcode op, u32 offset);
+  void Store(WasmOpcode op, u32 offset);
+
+  void Unreachable();
 
   void BrIf(i32 depth);
   void BrIfnz(i32 depth);
@@ -101,22 +173,141 @@ public:
   void Gts();
   void Eq();
 
+  // i32/i64 arithmetic, bitwise ops and shifts, the width follows the opcode
+  void IntBinOp(WasmOpcode op);
+  // i32/i64 comparisons, the result is always an i32
+  void IntCompare(WasmOpcode op);
+  // eqz, clz/ctz/popcnt and the conversions between the integer types
+  void IntUnOp(WasmOpcode op);
+
   void finalize();
-  template <typename T> T getEntry(u32 fnIdx);
+  template <typename T> T getEntry(u32 fnIdx) const;
+  const CodeMap *codeMap() const { return map.get(); }
+  // size of the GlobalArea the compiled code expects in the context and the
+  // initial values for it
+  std::size_t globalAreaSize() const { return globalAreaBytes; }
+  void initGlobalArea(u8 *area) const;
+  // of the array of FunctionCounters the compiled code expects in the
+  // context, 0 without CompilerOptions::callCounters
+  std::size_t functionCounterCount() const;
+  // bit pattern of an immutable global, for constant expressions that read it
+  std::optional<u64> constantGlobal(u32 index) const;
+  // the translation of every function, finalize() and the link, the module
+  // level fields are up to the caller
+  const CompileStats &compileStats() const { return stats; }
+  CompileStats &compileStats() { return stats; }
+  // has to be checked with requireHostSupport() before code compiled by
+  // this compiler is run anywhere else
+  const HostFeatureProfile &targetFeatures() const { return features; }
+  // the generated assembly, only recorded while verbose tracing is enabled
+  // when the compiler is created
   void dumpAsm();
-  void dumpTrace();
 
 private:
-
-  void _I32Add(x86::Gp dst, x86::Gp lhs, x86::Gp rhs);
+  struct TrapStub {
+    Label label;
+    TrapCode code;
+  };
+
+  // out of line call that returns to where the check was made
+  struct EpochStub {
+    Label label;
+    Label resume;
+  };
+
+  struct PendingSite {
+    Label label;
+    u32 wasmOffset;
+    bool isTrap;
+    TrapCode code;
+    // bound right after the faulting instruction by endTrapSite()
+    Label end;
+  };
+
+  struct PendingLine {
+    Label label;
+    u32 wasmOffset;
+  };
+
+  struct GlobalSlot {
+    WasmValueType type;
+    bool isMutable;
+    bool isConstant;
+    // the constant or the initial value, floats as their bit pattern
+    u64 bits;
+    // into the global area, unused for constants
+    u32 offset;
+  };
+
+  // per function bookkeeping, reset by StartFunction
+  struct FunctionState {
+    u32 index = 0;
+    BaseNode *entryCursor = nullptr;
+    // the hidden context argument
+    x86::Gp contextArg;
+    // InstanceContext::globals and memoryBase, loaded once at the entry by
+    // the first access
+    x86::Gp globalsBase;
+    x86::Gp memoryBase;
+    bool hasCalls = false;
+    std::vector<TrapStub> trapStubs;
+    std::vector<EpochStub> epochStubs;
+    // node after which the fuel charge of the current basic block goes
+    BaseNode *fuelBlockStart = nullptr;
+    u32 fuelCost = 0;
+    // with cycle counters, the tsc at the entry and the
+    // InstanceContext::calleeCycles of the caller
+    x86::Gp entryTsc;
+    x86::Gp callerCycles;
+    FuncNode *node = nullptr;
+    std::chrono::steady_clock::time_point startTime;
+    u32 startVirtRegs = 0;
+  };
+
+  void _IntAdd(x86::Gp dst, x86::Gp lhs, x86::Gp rhs);
+  x86::Gp emitDivRem(WasmOpcode op, WasmValueType type, x86::Gp lhs,
+                     x86::Gp rhs);
+  bool emitDivRemByConst(WasmOpcode op, WasmValueType type, x86::Gp lhs,
+                         i64 divisor, x86::Gp &result);
+  x86::Gp emitUnsignedDivByConst(WasmValueType type, x86::Gp lhs, u64 divisor);
+  x86::Gp emitSignedDivByConst(WasmValueType type, x86::Gp lhs, i64 divisor);
+  x86::Gp emitRemFromQuotient(WasmValueType type, x86::Gp lhs, x86::Gp quotient,
+                              i64 divisor);
+  x86::Gp emitShift(WasmOpcode op, WasmValueType type, x86::Gp lhs,
+                    x86::Gp rhs);
+  x86::Gp emitBitCount(WasmOpcode op, WasmValueType type, x86::Gp src);
+  void emitPopcntFallback(WasmValueType type, x86::Gp dst, x86::Gp src);
   x86::Gp createReg(WasmValueType type);
+  x86::Gp contextReg();
+  x86::Gp globalsReg();
+  x86::Gp memoryReg();
+  x86::Gp loadAtEntry(x86::Gp &cached, u32 contextOffset);
+  x86::Mem linearMemoryOperand(x86::Gp addr, u32 offset, u32 size);
+  Label trapStub(TrapCode code);
+  void emitStackCheck();
+  void emitEpochCheck();
+  void emitFunctionEntryCounters();
+  void emitFunctionExitCounters();
+  // rdtsc into a single register
+  x86::Gp emitReadTsc();
+  void countInstr();
+  void beginFuelBlock();
+  void endFuelBlock();
+  void emitTrapStubs();
+  void markSite(bool isTrap, TrapCode code = TrapCode::UNREACHABLE);
+  void endTrapSite();
+  void buildCodeMap();
+  void collectCodeStats();
   WasmValueType returnType;
 
+  CompilerOptions options;
+  HostFeatureProfile features;
+  InstanceContext *context = nullptr;
+  FunctionState fnState;
 
-  std::vector<x86::Mem> globals;
 
-  ConstPoolScope globalPool;
-  std::stringstream dbg;
+  std::vector<GlobalSlot> globals;
+  u32 globalAreaBytes = 0;
 
   JitRuntime runtime;
   CodeHolder code;
@@ -124,13 +315,31 @@ private:
   StringLogger logger;
   u8 *entry;
 
+  // registers produced by a constant, keyed by their virtual register id,
+  // lets divisions by a constant be strength reduced
+  std::unordered_map<u32, i64> constRegs;
+
   std::vector<Label> fnLabels;
+  std::vector<Label> fnEndLabels;
   BlockManager blockMngr;
 
+  u32 sourceOffset = 0;
+  std::vector<PendingSite> sites;
+  std::vector<PendingLine> lines;
+  std::unique_ptr<CodeMap> map;
+  // moved into the code map by finalize()
+  JitSymbols symbols;
+  CompileStats stats;
+  // parallel to stats.functions, the frames tell the spill area after
+  // register allocation
+  std::vector<FuncNode *> funcNodes;
+  // unregistered before the code map and the code go away
+  std::unique_ptr<GdbJitRegistration> gdbRegistration;
+
 };
 
 
-template <class T> T WasmCompiler::getEntry(u32 fnIdx) {
+template <class T> T WasmCompiler::getEntry(u32 fnIdx) const {
   assert(fnLabels[fnIdx].isValid());
   auto offset = code.labelOffsetFromBase(fnLabels[fnIdx]);
   return reinterpret_cast<T>(entry + offset);
@@ -156,13 +365,22 @@ static TypeId WasmTtoJitT(WasmValueType type) {
 template<class T>
 void WasmCompiler::Call(T target, WasmValueType retType,
                         std::span<WasmValueType> params) {
-  LOG_DEBUG_CC("Call target: {}, retType: {}, parms: {}", target, toString(retType), params.size());
+  TRACE_VERBOSE("compiler", "Call target: {}, retType: {}, parms: {}", target,
+                toString(retType), params.size());
   // TODO: maybe cache the sig if its already generated
   FuncSignature calleeSig;
   calleeSig.setRet(WasmTtoJitT(retType));
+  // host functions get it too, through a HostTrampoline
+  bool passContext = options.contextArgument;
+  if (passContext) {
+    calleeSig.addArg(TypeId::kUIntPtr);
+  }
   for (auto param : params) {
     calleeSig.addArg(WasmTtoJitT(param));
   }
+  countInstr();
+  fnState.hasCalls = true;
+  markSite(false);
   InvokeNode *invokeNode;
   if constexpr (std::is_same_v<u32, T>) {
     Error err = cc.invoke(&invokeNode, fnLabels[target], calleeSig);
@@ -178,8 +396,13 @@ void WasmCompiler::Call(T target, WasmValueType retType,
   }
 
   auto& block = blockMngr.getActive();
-  for (u32 i = 0; i < params.size(); i++) {
-    invokeNode->setArg(i, block.stack.pop());
+  u32 argBase = passContext ? 1 : 0;
+  if (passContext) {
+    invokeNode->setArg(0, contextReg());
+  }
+  // the last parameter is on top of the stack
+  for (u32 i = params.size(); i-- > 0;) {
+    invokeNode->setArg(argBase + i, block.stack.pop());
   }
 
   if (retType == WasmValueType::NONE) {
@@ -0,0 +1,103 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+
+#include "lib/epoch.hpp"
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+struct InstanceContext;
+namespace preview1 {
+class WasiContext;
+}
+
+// called once the epoch deadline has passed, returns the number of epoch
+// ticks to extend the deadline by or 0 to trap with INTERRUPTED
+using EpochDeadlineCallback = u64 (*)(InstanceContext &ctx);
+
+// per function counters of code compiled with CompilerOptions::callCounters
+struct FunctionCounters {
+  u64 calls;
+  // calls that returned, a trap unwinds without counting them
+  u64 returns;
+  // rdtsc cycles with CompilerOptions::cycleCounters, including and
+  // excluding the time spent in callees. the frames of a recursion all count
+  // the recursive calls as inclusive cycles
+  u64 inclusiveCycles;
+  u64 exclusiveCycles;
+};
+
+// State of a single instance that compiled code reaches through the context
+// pointer. Field offsets are baked into the generated code (via offsetof), so
+// this has to stay a standard layout struct.
+struct InstanceContext {
+  // compiled code traps with STACK_OVERFLOW once rsp drops below this value,
+  // the embedder sets it for the thread that enters the instance
+  uintptr_t stackLimit = 0;
+
+  // compiled code traps (or calls the callback) once globalEpoch reaches it
+  u64 epochDeadline = std::numeric_limits<u64>::max();
+  EpochDeadlineCallback epochDeadlineCallback = nullptr;
+
+  // fuel left for code compiled with fuel metering, every basic block
+  // subtracts its instruction count up front and traps once this goes negative
+  i64 fuel = 0;
+
+  // storage of the globals that aren't folded into the code, see GlobalArea
+  u8 *globals = nullptr;
+
+  // start of the linear memory, wasm addresses are offsets from here
+  u8 *memoryBase = nullptr;
+  // accessible bytes from memoryBase, compiled code relies on the guard
+  // region instead, this is for the host
+  u64 memorySize = 0;
+
+  // what wasi calls of the instance operate on, the process wide default
+  // (stdio only) if not set
+  preview1::WasiContext *wasi = nullptr;
+
+  // indexed by function index, see WasmCompiler::functionCounterCount()
+  FunctionCounters *functionCounters = nullptr;
+  // cycles spent in the callees of the innermost function compiled with
+  // cycle counters so far
+  u64 calleeCycles = 0;
+
+  void setEpochDeadline(u64 ticks) { epochDeadline = currentEpoch() + ticks; }
+  void setFuel(u64 amount) { fuel = static_cast<i64>(amount); }
+  void addFuel(u64 amount) { fuel += static_cast<i64>(amount); }
+  u64 remainingFuel() const { return fuel < 0 ? 0 : static_cast<u64>(fuel); }
+};
+
+static constexpr std::size_t kCacheLineSize = 64;
+
+// backing store of InstanceContext::globals, every global gets an 8 byte slot
+// and the area starts on a cache line of its own
+class GlobalArea : NonCopyable {
+public:
+  explicit GlobalArea(std::size_t size)
+      : size((std::max<std::size_t>(size, 1) + kCacheLineSize - 1) &
+             ~(kCacheLineSize - 1)) {
+    mem = static_cast<u8 *>(std::aligned_alloc(kCacheLineSize, this->size));
+    if (mem == nullptr) {
+      throw std::bad_alloc();
+    }
+    std::memset(mem, 0, this->size);
+  }
+
+  ~GlobalArea() { std::free(mem); }
+
+  u8 *data() const { return mem; }
+  std::size_t capacity() const { return size; }
+
+private:
+  std::size_t size;
+  u8 *mem;
+};
+
+} // namespace wasmjit
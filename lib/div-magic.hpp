@@ -0,0 +1,86 @@
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+/*
+ * Multiply-high constants for dividing by an invariant integer, following
+ * Granlund/Montgomery and Hacker's Delight (10-1, 10-10). The quotient is
+ *
+ *   unsigned: q = mulhi(n, multiplier)
+ *             add ? (((n - q) >> 1) + q) >> shift : q >> shift
+ *   signed:   q = mulhs(n, multiplier), add ? q += (d > 0 ? n : -n)
+ *             q >>= shift (arithmetic), q += q < 0
+ *
+ * Powers of two are not covered, they are plain shifts.
+ */
+struct DivMagic {
+  u64 multiplier;
+  u32 shift;
+  bool add;
+};
+
+template <class T> using WideOf =
+    std::conditional_t<sizeof(T) == 4, u64, unsigned __int128>;
+
+// d must not be zero or a power of two
+template <class T> DivMagic computeUnsignedMagic(T d) {
+  static_assert(std::is_unsigned_v<T>);
+  using Wide = WideOf<T>;
+  constexpr u32 bits = sizeof(T) * 8;
+  u32 log2d = bits - 1 - std::countl_zero(d);
+  Wide numerator = Wide{1} << (bits + log2d);
+  T proposed = static_cast<T>(numerator / d);
+  T rem = static_cast<T>(numerator - Wide{proposed} * d);
+  DivMagic magic{0, log2d, false};
+  if (d - rem < (T{1} << log2d)) {
+    magic.add = false;
+  } else {
+    proposed += proposed;
+    T twiceRem = rem + rem;
+    if (twiceRem >= d || twiceRem < rem) {
+      proposed += 1;
+    }
+    magic.add = true;
+  }
+  magic.multiplier = static_cast<T>(proposed + 1);
+  return magic;
+}
+
+// |d| must not be zero, one or a power of two
+template <class T> DivMagic computeSignedMagic(T d) {
+  static_assert(std::is_signed_v<T>);
+  using U = std::make_unsigned_t<T>;
+  using Wide = WideOf<U>;
+  constexpr u32 bits = sizeof(T) * 8;
+  U absD = d < 0 ? U(0) - static_cast<U>(d) : static_cast<U>(d);
+  u32 log2d = bits - 1 - std::countl_zero(absD);
+  Wide numerator = Wide{1} << (bits - 1 + log2d);
+  U proposed = static_cast<U>(numerator / absD);
+  U rem = static_cast<U>(numerator - Wide{proposed} * absD);
+  DivMagic magic{0, 0, false};
+  if (absD - rem < (U{1} << log2d)) {
+    magic.shift = log2d - 1;
+  } else {
+    proposed += proposed;
+    U twiceRem = rem + rem;
+    if (twiceRem >= absD || twiceRem < rem) {
+      proposed += 1;
+    }
+    magic.shift = log2d;
+    magic.add = true;
+  }
+  proposed += 1;
+  T signedMagic = static_cast<T>(proposed);
+  if (d < 0) {
+    signedMagic = static_cast<T>(U(0) - proposed);
+  }
+  magic.multiplier = static_cast<u64>(static_cast<i64>(signedMagic));
+  return magic;
+}
+
+} // namespace wasmjit
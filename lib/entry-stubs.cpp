@@ -0,0 +1,187 @@
+#include <cstddef>
+#include <stdexcept>
+
+#include "compiler.hpp"
+#include "entry-stubs.hpp"
+
+namespace wasmjit {
+
+EntryStubs::EntryStubs() = default;
+EntryStubs::~EntryStubs() = default;
+
+std::string EntryStubs::key(const FunctionPrototype &prototype) {
+  std::string result(1, static_cast<char>(prototype.returnType));
+  for (auto param : prototype.paramTypes) {
+    result += static_cast<char>(param);
+  }
+  return result;
+}
+
+EntryStub EntryStubs::get(const FunctionPrototype &prototype) {
+  auto signature = key(prototype);
+  auto it = stubs.find(signature);
+  if (it != stubs.end()) {
+    return it->second;
+  }
+  auto stub = build(prototype);
+  stubs.emplace(std::move(signature), stub);
+  return stub;
+}
+
+BatchStub EntryStubs::getBatch(const FunctionPrototype &prototype) {
+  auto signature = key(prototype);
+  auto it = batchStubs.find(signature);
+  if (it != batchStubs.end()) {
+    return it->second;
+  }
+  auto stub = buildBatch(prototype);
+  batchStubs.emplace(std::move(signature), stub);
+  return stub;
+}
+
+// the same signature the compiler gives wasm functions
+static FuncSignature calleeSignature(const FunctionPrototype &prototype) {
+  FuncSignature sig;
+  sig.setRet(WasmTtoJitT(prototype.returnType));
+  sig.addArg(TypeId::kUIntPtr);
+  for (auto param : prototype.paramTypes) {
+    sig.addArg(WasmTtoJitT(param));
+  }
+  return sig;
+}
+
+EntryStub EntryStubs::build(const FunctionPrototype &prototype) {
+  CodeHolder code;
+  code.init(runtime.environment(), runtime.cpuFeatures());
+  x86::Compiler cc(&code);
+
+  FuncSignature stubSig;
+  stubSig.setRet(TypeId::kUInt64);
+  stubSig.addArg(TypeId::kUIntPtr);
+  stubSig.addArg(TypeId::kUIntPtr);
+  stubSig.addArg(TypeId::kUIntPtr);
+  auto *funcNode = cc.addFunc(stubSig);
+  auto ctx = cc.newUIntPtr();
+  auto args = cc.newUIntPtr();
+  auto target = cc.newUIntPtr();
+  funcNode->setArg(0, ctx);
+  funcNode->setArg(1, args);
+  funcNode->setArg(2, target);
+
+  InvokeNode *invokeNode;
+  if (cc.invoke(&invokeNode, target, calleeSignature(prototype))) {
+    throw std::runtime_error("Failed to generate invoke node");
+  }
+  invokeNode->setArg(0, ctx);
+  for (u32 i = 0; i < prototype.paramTypes.size(); i++) {
+    u32 disp = i * sizeof(Val) + offsetof(Val, bits);
+    bool is64 = WasmTtoJitT(prototype.paramTypes[i]) == TypeId::kInt64;
+    auto arg = is64 ? cc.newInt64() : cc.newInt32();
+    cc.mov(arg, x86::ptr(args, disp, is64 ? 8 : 4));
+    invokeNode->setArg(i + 1, arg);
+  }
+
+  auto result = cc.newUInt64();
+  switch (WasmTtoJitT(prototype.returnType)) {
+  case TypeId::kVoid:
+    cc.xor_(result.r32(), result.r32());
+    break;
+  case TypeId::kInt32: {
+    auto ret = cc.newInt32();
+    invokeNode->setRet(0, ret);
+    // writing the low half zero extends
+    cc.mov(result.r32(), ret);
+    break;
+  }
+  default:
+    invokeNode->setRet(0, result);
+    break;
+  }
+  cc.ret(result);
+  cc.endFunc();
+  cc.finalize();
+
+  EntryStub stub;
+  if (runtime.add(&stub, &code)) {
+    throw std::runtime_error("Failed to add entry stub");
+  }
+  return stub;
+}
+
+BatchStub EntryStubs::buildBatch(const FunctionPrototype &prototype) {
+  CodeHolder code;
+  code.init(runtime.environment(), runtime.cpuFeatures());
+  x86::Compiler cc(&code);
+
+  FuncSignature stubSig;
+  stubSig.setRet(TypeId::kVoid);
+  for (u32 i = 0; i < 5; i++) {
+    stubSig.addArg(TypeId::kUIntPtr);
+  }
+  auto *funcNode = cc.addFunc(stubSig);
+  auto ctx = cc.newUIntPtr();
+  auto args = cc.newUIntPtr();
+  auto results = cc.newUIntPtr();
+  auto count = cc.newUInt64();
+  auto target = cc.newUIntPtr();
+  funcNode->setArg(0, ctx);
+  funcNode->setArg(1, args);
+  funcNode->setArg(2, results);
+  funcNode->setArg(3, count);
+  funcNode->setArg(4, target);
+
+  Label loop = cc.newLabel();
+  Label done = cc.newLabel();
+  cc.test(count, count);
+  cc.jz(done);
+  cc.bind(loop);
+  InvokeNode *invokeNode;
+  if (cc.invoke(&invokeNode, target, calleeSignature(prototype))) {
+    throw std::runtime_error("Failed to generate invoke node");
+  }
+  invokeNode->setArg(0, ctx);
+  u32 numParams = prototype.paramTypes.size();
+  for (u32 i = 0; i < numParams; i++) {
+    bool is64 = WasmTtoJitT(prototype.paramTypes[i]) == TypeId::kInt64;
+    auto arg = is64 ? cc.newInt64() : cc.newInt32();
+    cc.mov(arg, x86::ptr(args, i * sizeof(u64), is64 ? 8 : 4));
+    invokeNode->setArg(i + 1, arg);
+  }
+  switch (WasmTtoJitT(prototype.returnType)) {
+  case TypeId::kVoid:
+    break;
+  case TypeId::kInt32: {
+    auto ret = cc.newInt32();
+    invokeNode->setRet(0, ret);
+    auto wide = cc.newUInt64();
+    cc.mov(wide.r32(), ret);
+    cc.mov(x86::qword_ptr(results), wide);
+    cc.add(results, sizeof(u64));
+    break;
+  }
+  default: {
+    auto ret = cc.newInt64();
+    invokeNode->setRet(0, ret);
+    cc.mov(x86::qword_ptr(results), ret);
+    cc.add(results, sizeof(u64));
+    break;
+  }
+  }
+  if (numParams > 0) {
+    cc.add(args, numParams * sizeof(u64));
+  }
+  cc.dec(count);
+  cc.jnz(loop);
+  cc.bind(done);
+  cc.ret();
+  cc.endFunc();
+  cc.finalize();
+
+  BatchStub stub;
+  if (runtime.add(&stub, &code)) {
+    throw std::runtime_error("Failed to add batch stub");
+  }
+  return stub;
+}
+
+} // namespace wasmjit
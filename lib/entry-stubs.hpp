@@ -0,0 +1,69 @@
+#pragma once
+#include <span>
+#include <string>
+#include <unordered_map>
+
+#include "asmjit/asmjit.h"
+#include "lib/context.hpp"
+#include "lib/parser.hpp"
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+// a wasm value of any type, for embedders that don't know the signature of
+// what they call at compile time
+struct Val {
+  WasmValueType type;
+  // i32 zero extended, floats as their bit pattern
+  u64 bits;
+
+  static Val fromI32(i32 value) {
+    return {WasmValueType::I32, static_cast<u32>(value)};
+  }
+  static Val fromI64(i64 value) {
+    return {WasmValueType::I64, static_cast<u64>(value)};
+  }
+  i32 asI32() const { return static_cast<i32>(bits); }
+  i64 asI64() const { return static_cast<i64>(bits); }
+
+  bool operator==(const Val &) const = default;
+};
+
+// calls the compiled function at target with its wasm arguments taken from
+// the Vals in args, the result comes back in the same form as Val::bits
+using EntryStub = u64 (*)(InstanceContext *ctx, const Val *args,
+                          uintptr_t target);
+
+// calls the compiled function at target `count` times, the i-th call takes
+// its arguments from args[i * numParams...] (i32 in the low half) and writes
+// its result, if any, to results[i]
+using BatchStub = void (*)(InstanceContext *ctx, const u64 *args,
+                           u64 *results, u64 count, uintptr_t target);
+
+/*
+ * Entry stubs for calls through Vals, one per function signature. A stub
+ * loads the arguments straight out of the Val array into the registers the
+ * callee expects, so a dynamic call costs no more than a few loads on top of
+ * a direct one. Batch stubs call the same function in a loop, so that the
+ * cost of entering wasm is paid once for all calls.
+ */
+class EntryStubs : NonCopyable {
+public:
+  EntryStubs();
+  ~EntryStubs();
+
+  // generated on the first request for a signature, not thread safe
+  EntryStub get(const FunctionPrototype &prototype);
+  BatchStub getBatch(const FunctionPrototype &prototype);
+
+private:
+  static std::string key(const FunctionPrototype &prototype);
+  EntryStub build(const FunctionPrototype &prototype);
+  BatchStub buildBatch(const FunctionPrototype &prototype);
+
+  asmjit::JitRuntime runtime;
+  std::unordered_map<std::string, EntryStub> stubs;
+  std::unordered_map<std::string, BatchStub> batchStubs;
+};
+
+} // namespace wasmjit
@@ -0,0 +1,18 @@
+#include "epoch.hpp"
+#include "context.hpp"
+#include "trap.hpp"
+
+namespace wasmjit {
+
+void handleEpochDeadline(InstanceContext *ctx) {
+  if (ctx->epochDeadlineCallback != nullptr) {
+    u64 ticks = ctx->epochDeadlineCallback(*ctx);
+    if (ticks != 0) {
+      ctx->setEpochDeadline(ticks);
+      return;
+    }
+  }
+  raiseTrap(static_cast<u32>(TrapCode::INTERRUPTED));
+}
+
+} // namespace wasmjit
@@ -0,0 +1,26 @@
+#pragma once
+#include <atomic>
+
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+struct InstanceContext;
+
+// process wide epoch, the embedder bumps it (typically from a timer thread)
+// and compiled code compares it against InstanceContext::epochDeadline
+inline std::atomic<u64> globalEpoch{0};
+
+inline u64 currentEpoch() {
+  return globalEpoch.load(std::memory_order_relaxed);
+}
+
+inline void incrementEpoch() {
+  globalEpoch.fetch_add(1, std::memory_order_relaxed);
+}
+
+// slow path of the epoch check, either extends the deadline through the
+// context's callback and returns or traps with INTERRUPTED
+void handleEpochDeadline(InstanceContext *ctx);
+
+} // namespace wasmjit
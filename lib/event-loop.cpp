@@ -0,0 +1,108 @@
+#include <cassert>
+#include <stdexcept>
+#include <utility>
+
+#include "event-loop.hpp"
+
+namespace wasmjit {
+
+static thread_local EventLoop *currentLoop = nullptr;
+
+EventLoop::EventLoop() = default;
+
+EventLoop::~EventLoop() { assert(currentLoop != this); }
+
+EventLoop *EventLoop::current() { return currentLoop; }
+
+void EventLoop::spawn(std::function<void()> body, std::size_t stackSize) {
+  fibers.push_back(std::make_unique<Fiber>(std::move(body), stackSize));
+  ready.push_back(fibers.back().get());
+}
+
+void EventLoop::run() {
+  EventLoop *outer = std::exchange(currentLoop, this);
+  AsyncIo *outerIo = AsyncIo::exchangeCurrent(this);
+  while (liveFibers() > 0) {
+    if (ready.empty()) {
+      if (inFlight == 0) {
+        currentLoop = outer;
+        AsyncIo::exchangeCurrent(outerIo);
+        throw std::runtime_error("Every fiber is parked without io pending");
+      }
+      completeIo();
+      continue;
+    }
+    Fiber *fiber = ready.front();
+    ready.pop_front();
+    try {
+      fiber->resume();
+    } catch (...) {
+      if (!firstError) {
+        firstError = std::current_exception();
+      }
+    }
+    if (fiber->finished()) {
+      finished++;
+    }
+  }
+  currentLoop = outer;
+  AsyncIo::exchangeCurrent(outerIo);
+  fibers.clear();
+  finished = 0;
+  if (firstError) {
+    std::rethrow_exception(std::exchange(firstError, nullptr));
+  }
+}
+
+void EventLoop::park() {
+  assert(currentLoop == this && Fiber::current() != nullptr);
+  Fiber::suspend();
+}
+
+void EventLoop::wake(Fiber *fiber) { ready.push_back(fiber); }
+
+std::optional<i32> EventLoop::awaitIo(u8 opcode, int fd, const void *addr,
+                                      u32 len, u64 offset) {
+  if (ring == nullptr) {
+    if (ringUnavailable) {
+      return std::nullopt;
+    }
+    ring = IoUring::tryCreate();
+    if (ring == nullptr) {
+      ringUnavailable = true;
+      return std::nullopt;
+    }
+  }
+  IoWait wait{Fiber::current()};
+  while (!ring->prepare(opcode, fd, addr, len, offset,
+                        reinterpret_cast<u64>(&wait))) {
+    if (i32 submitted = ring->submit(); submitted < 0) {
+      ring->failUnsubmitted(submitted, [&](u64 userData, i32 result) {
+        complete(userData, result);
+      });
+      return submitted;
+    }
+  }
+  inFlight++;
+  park();
+  return wait.result;
+}
+
+void EventLoop::completeIo() {
+  auto completeOne = [&](u64 userData, i32 result) {
+    complete(userData, result);
+  };
+  if (i32 submitted = ring->submit(1); submitted < 0) {
+    ring->failUnsubmitted(submitted, completeOne);
+  }
+  ring->reap(completeOne);
+}
+
+void EventLoop::complete(u64 userData, i32 result) {
+  auto *wait = reinterpret_cast<IoWait *>(userData);
+  wait->result = result;
+  inFlight--;
+  wake(wait->fiber);
+}
+
+} // namespace wasmjit
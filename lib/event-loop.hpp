@@ -0,0 +1,64 @@
+#pragma once
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "lib/fiber.hpp"
+#include "lib/io-uring.hpp"
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+/*
+ * Runs fibers on the calling thread until all of them finished. A fiber
+ * that waits for something parks itself and the loop runs the next ready
+ * one, io requests of all parked fibers go to the kernel together whenever
+ * nothing is ready anymore.
+ */
+class EventLoop : public AsyncIo, NonCopyable, NonMoveable {
+public:
+  EventLoop();
+  ~EventLoop();
+
+  // the loop running on this thread, null outside of run()
+  static EventLoop *current();
+
+  void spawn(std::function<void()> body,
+             std::size_t stackSize = Fiber::kDefaultStackSize);
+  // runs until every fiber finished, rethrows the first exception a fiber
+  // finished with once all of them are done
+  void run();
+
+  // on a fiber of this loop: suspends it until wake() is called for it
+  void park();
+  // makes a parked fiber ready again, has to be called on the loop's thread
+  void wake(Fiber *fiber);
+  // on a fiber of this loop, see AsyncIo
+  std::optional<i32> awaitIo(u8 opcode, int fd, const void *addr, u32 len,
+                             u64 offset) override;
+
+  std::size_t liveFibers() const { return fibers.size() - finished; }
+
+private:
+  struct IoWait {
+    Fiber *fiber;
+    i32 result = 0;
+  };
+
+  void completeIo();
+  void complete(u64 userData, i32 result);
+
+  std::vector<std::unique_ptr<Fiber>> fibers;
+  std::size_t finished = 0;
+  std::deque<Fiber *> ready;
+  std::unique_ptr<IoUring> ring;
+  // creating the ring failed once, it isn't tried again
+  bool ringUnavailable = false;
+  u32 inFlight = 0;
+  std::exception_ptr firstError;
+};
+
+} // namespace wasmjit
@@ -0,0 +1,214 @@
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+#include "fiber.hpp"
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+namespace wasmjit {
+
+// saves the callee saved registers, mxcsr and the x87 control word of the
+// caller on its stack, stores its rsp to *save and continues on `to`, which
+// has to be a stack that was switched away from the same way (or prepared
+// like one by the Fiber constructor)
+extern "C" void wasmjitSwitchStack(void **save, void *to);
+// first frame on a fresh fiber stack, calls r13(r12)
+extern "C" void wasmjitFiberStart();
+
+asm(R"(
+  .text
+  .globl wasmjitSwitchStack
+  .type wasmjitSwitchStack, @function
+wasmjitSwitchStack:
+  pushq %rbp
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  pushq %r14
+  pushq %r15
+  subq $8, %rsp
+  stmxcsr (%rsp)
+  fnstcw 4(%rsp)
+  movq %rsp, (%rdi)
+  movq %rsi, %rsp
+  ldmxcsr (%rsp)
+  fldcw 4(%rsp)
+  addq $8, %rsp
+  popq %r15
+  popq %r14
+  popq %r13
+  popq %r12
+  popq %rbx
+  popq %rbp
+  ret
+  .size wasmjitSwitchStack, .-wasmjitSwitchStack
+
+  .globl wasmjitFiberStart
+  .type wasmjitFiberStart, @function
+wasmjitFiberStart:
+  movq %r12, %rdi
+  callq *%r13
+  ud2
+  .size wasmjitFiberStart, .-wasmjitFiberStart
+)");
+
+static thread_local Fiber *currentFiber = nullptr;
+
+static std::size_t hostPageSize() {
+  static const std::size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+#if defined(__SANITIZE_ADDRESS__)
+static void startSwitch(void **fakeStack, const void *bottom,
+                        std::size_t size) {
+  __sanitizer_start_switch_fiber(fakeStack, bottom, size);
+}
+static void finishSwitch(void *fakeStack, const void **bottom,
+                         std::size_t *size) {
+  __sanitizer_finish_switch_fiber(fakeStack, bottom, size);
+}
+// frames of a fiber that never returned stay poisoned, the next mapping at
+// the same address would inherit that
+static void unpoisonStack(void *stack, std::size_t size) {
+  __asan_unpoison_memory_region(stack, size);
+}
+#else
+static void startSwitch(void **, const void *, std::size_t) {}
+static void finishSwitch(void *, const void **, std::size_t *) {}
+static void unpoisonStack(void *, std::size_t) {}
+#endif
+
+Fiber::Fiber(std::function<void()> body, std::size_t stackSize)
+    : body(std::move(body)) {
+  std::size_t page = hostPageSize();
+  stackSize = (stackSize + page - 1) & ~(page - 1);
+  if (stackSize <= 2 * kStackHeadroom) {
+    throw std::runtime_error("Fiber stack is smaller than the headroom");
+  }
+  mappingSize = stackSize + page;
+  void *result = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                      -1, 0);
+  if (result == MAP_FAILED) {
+    throw std::runtime_error("Failed to allocate fiber stack");
+  }
+  mapping = static_cast<u8 *>(result);
+  // an overflow of the native stack faults here instead of running into
+  // whatever is mapped below
+  if (mprotect(mapping, page, PROT_NONE) != 0) {
+    munmap(mapping, mappingSize);
+    throw std::runtime_error("Failed to protect fiber stack");
+  }
+  prepareStack();
+}
+
+void Fiber::reset(std::function<void()> body) {
+  if (!done) {
+    throw std::runtime_error("Fiber is still running");
+  }
+  this->body = std::move(body);
+  done = false;
+  unpoisonStack(mapping + hostPageSize(), mappingSize - hostPageSize());
+  prepareStack();
+}
+
+void Fiber::prepareStack() {
+  // the frame wasmjitSwitchStack pops when the fiber is resumed the first
+  // time: mxcsr and control word defaults, r15..r12, rbx, rbp and the return
+  // address into wasmjitFiberStart, which calls with an aligned stack
+  auto *top = reinterpret_cast<uintptr_t *>(mapping + mappingSize - 16);
+  auto *frame = top - 8;
+  u32 fpControl[2] = {0x1f80, 0x037f};
+  std::memcpy(&frame[0], fpControl, sizeof(fpControl));
+  frame[1] = 0; // r15
+  frame[2] = 0; // r14
+  frame[3] = reinterpret_cast<uintptr_t>(&Fiber::main); // r13
+  frame[4] = reinterpret_cast<uintptr_t>(this); // r12
+  frame[5] = 0; // rbx
+  frame[6] = 0; // rbp, ends frame pointer walks
+  frame[7] = reinterpret_cast<uintptr_t>(&wasmjitFiberStart);
+  sp = frame;
+}
+
+Fiber::~Fiber() {
+  assert(currentFiber != this);
+  unpoisonStack(mapping + hostPageSize(), mappingSize - hostPageSize());
+  munmap(mapping, mappingSize);
+}
+
+void Fiber::resume() {
+  if (done) {
+    throw std::runtime_error("Fiber already finished");
+  }
+  assert(resumer == nullptr && currentFiber != this);
+  // the fiber may be in the middle of wasm that was entered on another
+  // thread, a fault has to find a signal stack on this one too
+  prepareThreadForTraps();
+  resumer = currentFiber;
+  currentFiber = this;
+  TrapActivation *outer = exchangeActivations(activation);
+  std::size_t page = hostPageSize();
+  void *resumerFakeStack = nullptr;
+  startSwitch(&resumerFakeStack, mapping + page, mappingSize - page);
+  wasmjitSwitchStack(&resumerSp, sp);
+  finishSwitch(resumerFakeStack, nullptr, nullptr);
+  activation = exchangeActivations(outer);
+  currentFiber = resumer;
+  resumer = nullptr;
+  if (done && error) {
+    std::rethrow_exception(std::exchange(error, nullptr));
+  }
+}
+
+void Fiber::switchOut() {
+  startSwitch(done ? nullptr : &fakeStack, resumerStack, resumerStackSize);
+  wasmjitSwitchStack(&sp, resumerSp);
+  // resumed, maybe from another stack than last time
+  finishSwitch(fakeStack, &resumerStack, &resumerStackSize);
+}
+
+void Fiber::suspend() {
+  Fiber *self = currentFiber;
+  if (self == nullptr) {
+    throw std::runtime_error("Not running on a fiber");
+  }
+  self->switchOut();
+}
+
+Fiber *Fiber::current() { return currentFiber; }
+
+uintptr_t Fiber::stackLimit() const {
+  return reinterpret_cast<uintptr_t>(mapping) + hostPageSize() +
+         kStackHeadroom;
+}
+
+void Fiber::main(Fiber *self) {
+  finishSwitch(nullptr, &self->resumerStack, &self->resumerStackSize);
+  try {
+    self->body();
+  } catch (...) {
+    self->error = std::current_exception();
+  }
+  self->body = nullptr;
+  self->done = true;
+  self->switchOut();
+  // a finished fiber is never resumed
+  std::abort();
+}
+
+uintptr_t currentStackLimit() {
+  if (Fiber *fiber = Fiber::current()) {
+    return fiber->stackLimit();
+  }
+  return threadStackLimit();
+}
+
+} // namespace wasmjit
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <exception>
+#include <functional>
+
+#include "lib/trap.hpp"
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+/*
+ * A stackful coroutine on an mmap'd stack with a guard page below it. Code
+ * running on a fiber (wasm included) can suspend() at any depth, typically
+ * from within a host function, and continues right there once somebody
+ * resumes the fiber again, possibly on another thread.
+ *
+ * The trap handler state is per fiber, so a trap always unwinds to the
+ * callGuarded() on the fiber that trapped.
+ */
+class Fiber : NonCopyable, NonMoveable {
+public:
+  static constexpr std::size_t kDefaultStackSize = 1024 * 1024;
+
+  explicit Fiber(std::function<void()> body,
+                 std::size_t stackSize = kDefaultStackSize);
+  // the stack of a fiber that hasn't finished is dropped without unwinding
+  ~Fiber();
+
+  // starts over with another body on the stack of a finished fiber, saves
+  // the mmap of a fresh one
+  void reset(std::function<void()> body);
+
+  // runs the fiber until it suspends or finishes, rethrows what the body
+  // threw once it finished with an exception
+  void resume();
+  // on a fiber: switches back to where it was resumed from
+  static void suspend();
+  // the fiber running on this thread, null on a thread's own stack
+  static Fiber *current();
+
+  bool finished() const { return done; }
+  // lowest address code on this fiber may push to, minus headroom
+  uintptr_t stackLimit() const;
+
+private:
+  [[noreturn]] static void main(Fiber *self);
+  void prepareStack();
+  void switchOut();
+
+  std::function<void()> body;
+  u8 *mapping;
+  std::size_t mappingSize;
+  void *sp = nullptr;
+  void *resumerSp = nullptr;
+  Fiber *resumer = nullptr;
+  TrapActivation *activation = nullptr;
+  std::exception_ptr error;
+  bool done = false;
+  // bounds of the stack the fiber was resumed from, asan needs to know
+  // about every stack switch
+  const void *resumerStack = nullptr;
+  std::size_t resumerStackSize = 0;
+  void *fakeStack = nullptr;
+};
+
+// stack limit for code running on the calling thread right now, either on a
+// fiber or on the thread's own stack
+uintptr_t currentStackLimit();
+
+} // namespace wasmjit
@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <cstring>
+#include <elf.h>
+#include <mutex>
+#include <string>
+
+#include "gdb-jit.hpp"
+
+extern "C" {
+// gdb puts a breakpoint here and reads the descriptor whenever it is hit.
+// weak, so another jit in the process that defines them as well (like llvm's)
+// links and both register through the same descriptor
+__attribute__((weak, noinline, used)) void __jit_debug_register_code() {
+  asm volatile("" ::: "memory");
+}
+
+__attribute__((weak)) jit_descriptor __jit_debug_descriptor = {1, 0, nullptr,
+                                                               nullptr};
+}
+
+namespace wasmjit {
+
+enum JitAction : u32 { JIT_NOACTION = 0, JIT_REGISTER_FN, JIT_UNREGISTER_FN };
+
+static std::mutex registrationMutex;
+
+namespace {
+
+class ByteWriter {
+public:
+  template <class T> void put(T value) {
+    auto *bytes = reinterpret_cast<const u8 *>(&value);
+    data.insert(data.end(), bytes, bytes + sizeof(T));
+  }
+  void putUleb(u64 value) {
+    do {
+      u8 byte = value & 0x7f;
+      value >>= 7;
+      data.push_back(value != 0 ? byte | 0x80 : byte);
+    } while (value != 0);
+  }
+  void putSleb(i64 value) {
+    while (true) {
+      u8 byte = value & 0x7f;
+      value >>= 7;
+      bool done = (value == 0 && !(byte & 0x40)) ||
+                  (value == -1 && (byte & 0x40));
+      data.push_back(done ? byte : byte | 0x80);
+      if (done) {
+        return;
+      }
+    }
+  }
+  void putString(std::string_view str) {
+    data.insert(data.end(), str.begin(), str.end());
+    data.push_back(0);
+  }
+  template <class T> void patch(std::size_t offset, T value) {
+    std::memcpy(data.data() + offset, &value, sizeof(T));
+  }
+  std::size_t size() const { return data.size(); }
+
+  std::vector<u8> data;
+};
+
+} // namespace
+
+// DWARF 4 constants, only what the image uses
+static constexpr u8 DW_TAG_compile_unit = 0x11;
+static constexpr u8 DW_TAG_subprogram = 0x2e;
+static constexpr u8 DW_AT_name = 0x03;
+static constexpr u8 DW_AT_stmt_list = 0x10;
+static constexpr u8 DW_AT_low_pc = 0x11;
+static constexpr u8 DW_AT_high_pc = 0x12;
+static constexpr u8 DW_AT_producer = 0x25;
+static constexpr u8 DW_FORM_addr = 0x01;
+static constexpr u8 DW_FORM_data8 = 0x07;
+static constexpr u8 DW_FORM_string = 0x08;
+static constexpr u8 DW_FORM_sec_offset = 0x17;
+static constexpr u8 DW_LNS_copy = 0x01;
+static constexpr u8 DW_LNS_advance_pc = 0x02;
+static constexpr u8 DW_LNS_advance_line = 0x03;
+static constexpr u8 DW_LNE_end_sequence = 0x01;
+static constexpr u8 DW_LNE_set_address = 0x02;
+
+static std::vector<u8> debugAbbrev() {
+  ByteWriter w;
+  w.putUleb(1);
+  w.putUleb(DW_TAG_compile_unit);
+  w.put<u8>(1); // has children
+  for (auto [attribute, form] :
+       {std::pair{DW_AT_producer, DW_FORM_string},
+        std::pair{DW_AT_name, DW_FORM_string},
+        std::pair{DW_AT_stmt_list, DW_FORM_sec_offset},
+        std::pair{DW_AT_low_pc, DW_FORM_addr},
+        std::pair{DW_AT_high_pc, DW_FORM_data8}}) {
+    w.putUleb(attribute);
+    w.putUleb(form);
+  }
+  w.put<u16>(0);
+  w.putUleb(2);
+  w.putUleb(DW_TAG_subprogram);
+  w.put<u8>(0);
+  for (auto [attribute, form] : {std::pair{DW_AT_name, DW_FORM_string},
+                                 std::pair{DW_AT_low_pc, DW_FORM_addr},
+                                 std::pair{DW_AT_high_pc, DW_FORM_data8}}) {
+    w.putUleb(attribute);
+    w.putUleb(form);
+  }
+  w.put<u16>(0);
+  w.putUleb(0);
+  return std::move(w.data);
+}
+
+static std::vector<u8> debugInfo(const CodeMap &map,
+                                 const JitSymbols &symbols) {
+  ByteWriter w;
+  w.put<u32>(0); // unit length
+  w.put<u16>(4);
+  w.put<u32>(0); // abbrev offset
+  w.put<u8>(8);
+  w.putUleb(1);
+  w.putString("wasmjit");
+  w.putString(symbols.sourceName);
+  w.put<u32>(0);
+  w.put<u64>(map.codeBase());
+  w.put<u64>(map.codeSize());
+  for (auto &range : map.functionRanges()) {
+    w.putUleb(2);
+    w.putString(symbols.functionName(range.funcIndex));
+    w.put<u64>(map.codeBase() + range.begin);
+    w.put<u64>(range.end - range.begin);
+  }
+  w.putUleb(0);
+  w.patch<u32>(0, w.size() - sizeof(u32));
+  return std::move(w.data);
+}
+
+// one sequence per function, the wasm offsets are the line numbers
+static std::vector<u8> debugLine(const CodeMap &map,
+                                 const JitSymbols &symbols) {
+  constexpr u8 kOpcodeBase = 13;
+  constexpr u8 kStandardOpcodeLengths[kOpcodeBase - 1] = {0, 1, 1, 1, 1, 0,
+                                                          0, 0, 1, 0, 0, 1};
+  ByteWriter w;
+  w.put<u32>(0); // unit length
+  w.put<u16>(4);
+  std::size_t headerLengthAt = w.size();
+  w.put<u32>(0);
+  w.put<u8>(1); // minimum instruction length
+  w.put<u8>(1); // maximum operations per instruction
+  w.put<u8>(1); // default is_stmt
+  w.put<i8>(-5); // line base
+  w.put<u8>(14); // line range
+  w.put<u8>(kOpcodeBase);
+  for (u8 length : kStandardOpcodeLengths) {
+    w.put<u8>(length);
+  }
+  w.put<u8>(0); // no include directories
+  w.putString(symbols.sourceName);
+  w.putUleb(0); // directory
+  w.putUleb(0); // modification time
+  w.putUleb(0); // length
+  w.put<u8>(0);
+  w.patch<u32>(headerLengthAt, w.size() - headerLengthAt - sizeof(u32));
+
+  auto &lines = map.lineTable();
+  for (auto &range : map.functionRanges()) {
+    auto it = std::lower_bound(lines.begin(), lines.end(), range.begin,
+                               [](const LineEntry &line, u32 offset) {
+                                 return line.nativeOffset < offset;
+                               });
+    if (it == lines.end() || it->nativeOffset >= range.end) {
+      continue;
+    }
+    w.put<u8>(0);
+    w.putUleb(9);
+    w.put<u8>(DW_LNE_set_address);
+    w.put<u64>(map.codeBase() + it->nativeOffset);
+    u32 address = it->nativeOffset;
+    i64 line = 1;
+    for (; it != lines.end() && it->nativeOffset < range.end; ++it) {
+      if (it->nativeOffset != address) {
+        w.put<u8>(DW_LNS_advance_pc);
+        w.putUleb(it->nativeOffset - address);
+        address = it->nativeOffset;
+      }
+      w.put<u8>(DW_LNS_advance_line);
+      w.putSleb(i64{it->wasmOffset} - line);
+      line = it->wasmOffset;
+      w.put<u8>(DW_LNS_copy);
+    }
+    w.put<u8>(DW_LNS_advance_pc);
+    w.putUleb(range.end - address);
+    w.put<u8>(0);
+    w.putUleb(1);
+    w.put<u8>(DW_LNE_end_sequence);
+  }
+  w.patch<u32>(0, w.size() - sizeof(u32));
+  return std::move(w.data);
+}
+
+std::vector<u8> buildDebugImage(const CodeMap &map,
+                                const JitSymbols &symbols) {
+  enum Section : u16 {
+    NONE,
+    TEXT,
+    SYMTAB,
+    STRTAB,
+    SHSTRTAB,
+    DEBUG_ABBREV,
+    DEBUG_INFO,
+    DEBUG_LINE,
+    COUNT
+  };
+  const char *names[COUNT] = {"",          ".text",         ".symtab",
+                              ".strtab",   ".shstrtab",     ".debug_abbrev",
+                              ".debug_info", ".debug_line"};
+
+  ByteWriter shstrtab;
+  u32 nameOffsets[COUNT];
+  for (u32 i = 0; i < COUNT; i++) {
+    nameOffsets[i] = shstrtab.size();
+    shstrtab.putString(names[i]);
+  }
+
+  // symbols are relative to .text, whose address is the one of the code
+  ByteWriter strtab;
+  strtab.put<u8>(0);
+  ByteWriter symtab;
+  symtab.put(Elf64_Sym{});
+  for (auto &range : map.functionRanges()) {
+    Elf64_Sym sym = {};
+    sym.st_name = strtab.size();
+    strtab.putString(symbols.functionName(range.funcIndex));
+    sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+    sym.st_shndx = TEXT;
+    sym.st_value = range.begin;
+    sym.st_size = range.end - range.begin;
+    symtab.put(sym);
+  }
+
+  std::vector<u8> contents[COUNT] = {
+      {}, {}, std::move(symtab.data), std::move(strtab.data),
+      std::move(shstrtab.data), debugAbbrev(), debugInfo(map, symbols),
+      debugLine(map, symbols)};
+
+  ByteWriter image;
+  image.put(Elf64_Ehdr{});
+  Elf64_Shdr headers[COUNT] = {};
+  for (u32 i = SYMTAB; i < COUNT; i++) {
+    while (image.size() % 8 != 0) {
+      image.put<u8>(0);
+    }
+    headers[i].sh_name = nameOffsets[i];
+    headers[i].sh_type = SHT_PROGBITS;
+    headers[i].sh_offset = image.size();
+    headers[i].sh_size = contents[i].size();
+    headers[i].sh_addralign = 1;
+    image.data.insert(image.data.end(), contents[i].begin(),
+                      contents[i].end());
+  }
+  headers[TEXT].sh_name = nameOffsets[TEXT];
+  headers[TEXT].sh_type = SHT_NOBITS;
+  headers[TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  headers[TEXT].sh_addr = map.codeBase();
+  headers[TEXT].sh_size = map.codeSize();
+  headers[TEXT].sh_addralign = 16;
+  headers[SYMTAB].sh_type = SHT_SYMTAB;
+  headers[SYMTAB].sh_link = STRTAB;
+  headers[SYMTAB].sh_info = 1; // first global symbol
+  headers[SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+  headers[SYMTAB].sh_addralign = 8;
+  headers[STRTAB].sh_type = SHT_STRTAB;
+  headers[SHSTRTAB].sh_type = SHT_STRTAB;
+
+  while (image.size() % 8 != 0) {
+    image.put<u8>(0);
+  }
+  std::size_t headersAt = image.size();
+  for (auto &header : headers) {
+    image.put(header);
+  }
+
+  Elf64_Ehdr ehdr = {};
+  std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+  ehdr.e_type = ET_REL;
+  ehdr.e_machine = EM_X86_64;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_shoff = headersAt;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = COUNT;
+  ehdr.e_shstrndx = SHSTRTAB;
+  image.patch(0, ehdr);
+  return std::move(image.data);
+}
+
+GdbJitRegistration::GdbJitRegistration(const CodeMap &map,
+                                       const JitSymbols &symbols)
+    : image(buildDebugImage(map, symbols)) {
+  entry.symfile_addr = reinterpret_cast<const char *>(image.data());
+  entry.symfile_size = image.size();
+  std::lock_guard lock(registrationMutex);
+  entry.next_entry = __jit_debug_descriptor.first_entry;
+  if (entry.next_entry != nullptr) {
+    entry.next_entry->prev_entry = &entry;
+  }
+  __jit_debug_descriptor.first_entry = &entry;
+  __jit_debug_descriptor.relevant_entry = &entry;
+  __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+  __jit_debug_register_code();
+}
+
+GdbJitRegistration::~GdbJitRegistration() {
+  std::lock_guard lock(registrationMutex);
+  if (entry.prev_entry != nullptr) {
+    entry.prev_entry->next_entry = entry.next_entry;
+  } else {
+    __jit_debug_descriptor.first_entry = entry.next_entry;
+  }
+  if (entry.next_entry != nullptr) {
+    entry.next_entry->prev_entry = entry.prev_entry;
+  }
+  __jit_debug_descriptor.relevant_entry = &entry;
+  __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+  __jit_debug_register_code();
+}
+
+} // namespace wasmjit
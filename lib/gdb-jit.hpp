@@ -0,0 +1,48 @@
+#pragma once
+#include <vector>
+
+#include "lib/code-map.hpp"
+#include "lib/jit-profiling.hpp"
+#include "lib/tz-utils.hpp"
+
+// the interface gdb (and lldb) look for in the process, see "JIT Compilation
+// Interface" in the gdb manual. the names and the layout are fixed
+extern "C" {
+struct jit_code_entry {
+  jit_code_entry *next_entry;
+  jit_code_entry *prev_entry;
+  const char *symfile_addr;
+  uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+  uint32_t version;
+  uint32_t action_flag;
+  jit_code_entry *relevant_entry;
+  jit_code_entry *first_entry;
+};
+
+extern jit_descriptor __jit_debug_descriptor;
+void __jit_debug_register_code();
+}
+
+namespace wasmjit {
+
+// an ELF object describing one compilation: a .text section at the address
+// of the code, a symbol per function and DWARF with a compile unit, a
+// subprogram per function and a line table with the wasm offsets as lines
+std::vector<u8> buildDebugImage(const CodeMap &map, const JitSymbols &symbols);
+
+// announces the debug image of a compilation to an attached (or later
+// attaching) debugger for as long as it lives
+class GdbJitRegistration : NonCopyable, NonMoveable {
+public:
+  GdbJitRegistration(const CodeMap &map, const JitSymbols &symbols);
+  ~GdbJitRegistration();
+
+private:
+  std::vector<u8> image;
+  jit_code_entry entry = {};
+};
+
+} // namespace wasmjit
@@ -0,0 +1,65 @@
+#include <stdexcept>
+#include <utility>
+
+#include "asmjit/core/cpuinfo.h"
+#include "host-features.hpp"
+
+using namespace std::literals;
+
+namespace wasmjit {
+
+static constexpr std::pair<HostFeatureProfile::Feature, const char *>
+    kFeatureNames[] = {
+        {HostFeatureProfile::LZCNT, "lzcnt"},
+        {HostFeatureProfile::BMI1, "bmi1"},
+        {HostFeatureProfile::BMI2, "bmi2"},
+        {HostFeatureProfile::POPCNT, "popcnt"},
+};
+
+HostFeatureProfile HostFeatureProfile::detect() {
+  static const HostFeatureProfile host = [] {
+    auto &x86 = asmjit::CpuInfo::host().features().x86();
+    HostFeatureProfile profile;
+    if (x86.hasLZCNT()) {
+      profile.features |= LZCNT;
+    }
+    if (x86.hasBMI()) {
+      profile.features |= BMI1;
+    }
+    if (x86.hasBMI2()) {
+      profile.features |= BMI2;
+    }
+    if (x86.hasPOPCNT()) {
+      profile.features |= POPCNT;
+    }
+    return profile;
+  }();
+  return host;
+}
+
+std::string HostFeatureProfile::toString() const {
+  std::string result;
+  u32 known = 0;
+  for (auto [feature, name] : kFeatureNames) {
+    known |= feature;
+    if (has(feature)) {
+      result += result.empty() ? name : ","s + name;
+    }
+  }
+  // profiles written by a newer version of the compiler
+  if ((features & ~known) != 0) {
+    result += result.empty() ? "unknown" : ",unknown";
+  }
+  return result.empty() ? "baseline" : result;
+}
+
+void requireHostSupport(const HostFeatureProfile &required) {
+  auto host = HostFeatureProfile::detect();
+  if (!host.supports(required)) {
+    HostFeatureProfile missing{required.features & ~host.features};
+    throw std::runtime_error("Code requires cpu features the host lacks: " +
+                             missing.toString());
+  }
+}
+
+} // namespace wasmjit
@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+/*
+ * The optional x86 extensions the compiler makes use of. Code compiled for a
+ * profile only runs on hosts that support every feature in it, so a profile
+ * is recorded with anything that outlives the process it was compiled in and
+ * checked again before that code is used.
+ */
+struct HostFeatureProfile {
+  enum Feature : u32 {
+    LZCNT = 1 << 0,
+    // tzcnt, andn, ...
+    BMI1 = 1 << 1,
+    // shlx/sarx/shrx, rorx, ...
+    BMI2 = 1 << 2,
+    POPCNT = 1 << 3,
+  };
+
+  u32 features = 0;
+
+  // what the current cpu supports
+  static HostFeatureProfile detect();
+  // only what every x86-64 cpu supports
+  static HostFeatureProfile baseline() { return {}; }
+
+  bool has(Feature feature) const { return (features & feature) != 0; }
+  bool supports(const HostFeatureProfile &required) const {
+    return (required.features & ~features) == 0;
+  }
+  bool operator==(const HostFeatureProfile &) const = default;
+
+  // comma separated feature names, "baseline" if there are none
+  std::string toString() const;
+};
+
+// throws if code compiled for `required` can't run on this host
+void requireHostSupport(const HostFeatureProfile &required);
+
+} // namespace wasmjit
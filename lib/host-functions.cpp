@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "host-functions.hpp"
+
+namespace wasmjit {
+
+bool HostFunction::matches(const FunctionPrototype &prototype) const {
+  return returnType == prototype.returnType &&
+         std::equal(paramTypes.begin(), paramTypes.end(),
+                    prototype.paramTypes.begin(), prototype.paramTypes.end());
+}
+
+std::string HostFunction::signature() const {
+  std::string result = "(";
+  for (std::size_t i = 0; i < paramTypes.size(); i++) {
+    result += i == 0 ? "" : " ";
+    result += toString(paramTypes[i]);
+  }
+  result += ") -> ";
+  result += toString(returnType);
+  return result;
+}
+
+std::string HostFunctions::key(std::string_view module,
+                               std::string_view name) {
+  std::string result(module);
+  result += '.';
+  result += name;
+  return result;
+}
+
+void HostFunctions::add(std::string_view module, std::string_view name,
+                        HostFunction function) {
+  functions.insert_or_assign(key(module, name), std::move(function));
+}
+
+const HostFunction *HostFunctions::find(std::string_view module,
+                                        std::string_view name) const {
+  auto it = functions.find(key(module, name));
+  return it == functions.end() ? nullptr : &it->second;
+}
+
+uintptr_t HostFunctions::resolve(std::string_view module,
+                                 std::string_view name,
+                                 const FunctionPrototype &prototype) const {
+  auto *function = find(module, name);
+  if (function == nullptr) {
+    throw std::runtime_error("Unresolved import: " + key(module, name));
+  }
+  if (!function->matches(prototype)) {
+    HostFunction expected{0, prototype.returnType,
+                          {prototype.paramTypes.begin(),
+                           prototype.paramTypes.end()}};
+    throw std::runtime_error("Import " + key(module, name) + " has type " +
+                             expected.signature() +
+                             " but the host function has type " +
+                             function->signature());
+  }
+  return function->address;
+}
+
+} // namespace wasmjit
@@ -0,0 +1,165 @@
+#pragma once
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "lib/context.hpp"
+#include "lib/parser.hpp"
+#include "lib/trap.hpp"
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+// thrown by host code to trap the wasm code that called it. the host
+// trampoline catches it once the host frames are unwound and only then
+// raises the trap, which skips the remaining (jit) frames with a siglongjmp
+struct HostTrap {
+  TrapCode code;
+};
+
+// bounds checked access to the linear memory of the calling instance, out
+// of bounds accesses trap with MEMORY_OUT_OF_BOUNDS like they would in wasm.
+// the trap is a HostTrap exception, so destructors of the host function run.
+// host functions must let it pass through
+class MemoryView {
+public:
+  MemoryView(u8 *base, u64 size) : base(base), length(size) {}
+
+  bool contains(u32 addr, u64 count) const {
+    return u64{addr} + count <= length;
+  }
+
+  std::span<u8> bytes(u32 addr, u32 count) const {
+    if (!contains(addr, count)) {
+      throw HostTrap{TrapCode::MEMORY_OUT_OF_BOUNDS};
+    }
+    return {base + addr, count};
+  }
+
+  template <class T> T load(u32 addr) const {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T value;
+    std::memcpy(&value, bytes(addr, sizeof(T)).data(), sizeof(T));
+    return value;
+  }
+
+  template <class T> void store(u32 addr, T value) const {
+    static_assert(std::is_trivially_copyable_v<T>);
+    std::memcpy(bytes(addr, sizeof(T)).data(), &value, sizeof(T));
+  }
+
+  u8 *data() const { return base; }
+  u64 size() const { return length; }
+
+private:
+  u8 *base;
+  u64 length;
+};
+
+// what a host function gets to see of the instance that called it
+class Caller {
+public:
+  explicit Caller(InstanceContext &ctx) : ctx(ctx) {}
+
+  InstanceContext &context() const { return ctx; }
+  MemoryView memory() const { return {ctx.memoryBase, ctx.memorySize}; }
+
+private:
+  InstanceContext &ctx;
+};
+
+template <class T> constexpr WasmValueType hostValueType() {
+  // floats are still passed in general purpose registers by the compiler
+  static_assert(std::is_integral_v<T> && !std::is_same_v<T, bool> &&
+                    (sizeof(T) == 4 || sizeof(T) == 8),
+                "host functions take and return i32/u32/i64/u64");
+  return sizeof(T) == 4 ? WasmValueType::I32 : WasmValueType::I64;
+}
+
+template <class Ret> constexpr WasmValueType hostReturnType() {
+  if constexpr (std::is_void_v<Ret>) {
+    return WasmValueType::NONE;
+  } else {
+    return hostValueType<Ret>();
+  }
+}
+
+// the native entry compiled code calls, the context comes in front of the
+// wasm parameters. Fn is a template argument so it is called (and usually
+// inlined) directly, the whole host call is one direct call without boxing.
+// no exception may leave it, there is no unwind info for the jit frames:
+// a HostTrap raises its trap, anything else traps with HOST_ERROR
+template <auto Fn> struct HostTrampoline;
+
+template <class Ret, class... Args, Ret (*Fn)(Caller &, Args...)>
+struct HostTrampoline<Fn> {
+  static Ret call(InstanceContext *ctx, Args... args) {
+    TrapCode code;
+    try {
+      Caller caller(*ctx);
+      return Fn(caller, args...);
+    } catch (const HostTrap &trap) {
+      code = trap.code;
+    } catch (...) {
+      code = TrapCode::HOST_ERROR;
+    }
+    raiseTrap(static_cast<u32>(code));
+  }
+};
+
+struct HostFunction {
+  uintptr_t address;
+  WasmValueType returnType;
+  std::vector<WasmValueType> paramTypes;
+
+  // a native entry that takes the context first, with its wasm signature
+  template <class Ret, class... Args>
+  static HostFunction forEntry(Ret (*entry)(InstanceContext *, Args...)) {
+    return {reinterpret_cast<uintptr_t>(entry), hostReturnType<Ret>(),
+            {hostValueType<Args>()...}};
+  }
+  // only the wasm signature of the entry type Fn, to check a function
+  // against with matches(). the address stays 0
+  template <class Fn> static HostFunction signatureOf() {
+    return forEntry(static_cast<Fn>(nullptr));
+  }
+
+  bool matches(const FunctionPrototype &prototype) const;
+  std::string signature() const;
+};
+
+/*
+ * Host functions that imports are resolved against, by module and field
+ * name. A function is registered with its C++ type, the wasm signature is
+ * derived from it and checked against the import when a module is linked:
+ *
+ *   i32 add(Caller &caller, i32 lhs, i32 rhs);
+ *   functions.define<&add>("env", "add");
+ */
+class HostFunctions {
+public:
+  template <auto Fn>
+  HostFunctions &define(std::string_view module, std::string_view name) {
+    add(module, name, HostFunction::forEntry(&HostTrampoline<Fn>::call));
+    return *this;
+  }
+
+  const HostFunction *find(std::string_view module,
+                           std::string_view name) const;
+  // throws if there is no function with that name or its type doesn't match
+  uintptr_t resolve(std::string_view module, std::string_view name,
+                    const FunctionPrototype &prototype) const;
+
+private:
+  void add(std::string_view module, std::string_view name,
+           HostFunction function);
+  static std::string key(std::string_view module, std::string_view name);
+
+  std::unordered_map<std::string, HostFunction> functions;
+};
+
+} // namespace wasmjit
@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+
+#include "io-uring.hpp"
+
+namespace wasmjit {
+
+static int ioUringSetup(u32 entries, io_uring_params *params) {
+  return syscall(SYS_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int fd, u32 toSubmit, u32 minComplete, u32 flags) {
+  return syscall(SYS_io_uring_enter, fd, toSubmit, minComplete, flags,
+                 nullptr, 0);
+}
+
+IoUring::IoUring(u32 entries) {
+  if (!setup(entries)) {
+    throw std::runtime_error("Failed to set up io_uring");
+  }
+}
+
+std::unique_ptr<IoUring> IoUring::tryCreate(u32 entries) {
+  std::unique_ptr<IoUring> ring(new IoUring(NotSetUp{}));
+  if (!ring->setup(entries)) {
+    return nullptr;
+  }
+  return ring;
+}
+
+bool IoUring::setup(u32 entries) {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  int fd = ioUringSetup(entries, &params);
+  if (fd < 0) {
+    return false;
+  }
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(u32);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMmap) {
+    sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+  }
+  void *sq = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  void *cq = sq;
+  if (!singleMmap) {
+    cq = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      munmap(sq, sqRingSize);
+      close(fd);
+      return false;
+    }
+  }
+  sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqesMem = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqesMem == MAP_FAILED) {
+    if (cq != sq) {
+      munmap(cq, cqRingSize);
+    }
+    munmap(sq, sqRingSize);
+    close(fd);
+    return false;
+  }
+  ringFd = fd;
+  sqRing = sq;
+  cqRing = cq;
+  sqes = static_cast<io_uring_sqe *>(sqesMem);
+
+  auto *sqBytes = static_cast<u8 *>(sqRing);
+  sqHead = reinterpret_cast<u32 *>(sqBytes + params.sq_off.head);
+  sqTail = reinterpret_cast<u32 *>(sqBytes + params.sq_off.tail);
+  sqMask = reinterpret_cast<u32 *>(sqBytes + params.sq_off.ring_mask);
+  sqArray = reinterpret_cast<u32 *>(sqBytes + params.sq_off.array);
+  auto *cqBytes = static_cast<u8 *>(cqRing);
+  cqHead = reinterpret_cast<u32 *>(cqBytes + params.cq_off.head);
+  cqTail = reinterpret_cast<u32 *>(cqBytes + params.cq_off.tail);
+  cqMask = reinterpret_cast<u32 *>(cqBytes + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe *>(cqBytes + params.cq_off.cqes);
+  return true;
+}
+
+IoUring::~IoUring() {
+  if (ringFd < 0) {
+    return;
+  }
+  munmap(sqes, sqesSize);
+  if (cqRing != sqRing) {
+    munmap(cqRing, cqRingSize);
+  }
+  munmap(sqRing, sqRingSize);
+  close(ringFd);
+}
+
+bool IoUring::supported() {
+  static const bool available = [] {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = ioUringSetup(1, &params);
+    if (fd < 0) {
+      return false;
+    }
+    close(fd);
+    return true;
+  }();
+  return available;
+}
+
+IoUring *IoUring::forThread() {
+  // a failure is remembered, the plain syscalls are used from then on
+  thread_local std::unique_ptr<IoUring> ring;
+  thread_local bool created = false;
+  if (!created) {
+    ring = tryCreate();
+    created = true;
+  }
+  return ring.get();
+}
+
+bool IoUring::prepare(u8 opcode, int fd, const void *addr, u32 len,
+                      u64 offset, u64 userData) {
+  u32 tail = *sqTail;
+  u32 head = std::atomic_ref(*sqHead).load(std::memory_order_acquire);
+  if (tail - head > *sqMask) {
+    return false;
+  }
+  u32 index = tail & *sqMask;
+  auto &sqe = sqes[index];
+  std::memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = opcode;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<u64>(addr);
+  sqe.len = len;
+  sqe.off = offset;
+  sqe.user_data = userData;
+  sqArray[index] = index;
+  std::atomic_ref(*sqTail).store(tail + 1, std::memory_order_release);
+  toSubmit++;
+  return true;
+}
+
+i32 IoUring::waitForCompletions(u32 minComplete) {
+  while (ioUringEnter(ringFd, 0, minComplete, IORING_ENTER_GETEVENTS) < 0) {
+    if (errno != EINTR) {
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+i32 IoUring::submit(u32 minComplete) {
+  u32 flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (true) {
+    int submitted = ioUringEnter(ringFd, toSubmit, minComplete, flags);
+    if (submitted >= 0) {
+      toSubmit -= submitted;
+      return submitted;
+    }
+    if (errno != EINTR) {
+      return -errno;
+    }
+  }
+}
+
+static thread_local AsyncIo *currentAsyncIo = nullptr;
+
+AsyncIo *AsyncIo::current() { return currentAsyncIo; }
+
+AsyncIo *AsyncIo::exchangeCurrent(AsyncIo *io) {
+  return std::exchange(currentAsyncIo, io);
+}
+
+} // namespace wasmjit
@@ -0,0 +1,141 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <linux/io_uring.h>
+
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+/*
+ * A minimal io_uring on top of the raw syscalls: requests are prepared into
+ * the submission queue, handed to the kernel in one io_uring_enter() and
+ * their results come back tagged with the userData they were prepared with.
+ * A ring belongs to a single thread. Only the constructor throws, rings are
+ * used from host functions where an exception would have to cross jit
+ * frames.
+ */
+class IoUring : NonCopyable {
+public:
+  explicit IoUring(u32 entries = 256);
+  ~IoUring();
+
+  // null instead of throwing if the ring can't be set up
+  static std::unique_ptr<IoUring> tryCreate(u32 entries = 256);
+  // whether the kernel (and seccomp policy) allows io_uring at all
+  static bool supported();
+  // the ring of the calling thread, created on first use, null if it can't
+  // be created
+  static IoUring *forThread();
+
+  // false if the submission queue is full, submit() first then
+  bool prepare(u8 opcode, int fd, const void *addr, u32 len, u64 offset,
+               u64 userData);
+  // hands everything prepared to the kernel and waits until at least
+  // minComplete requests have completed, returns the number submitted or
+  // -errno. after a failure the prepared requests are still queued, see
+  // failUnsubmitted()
+  i32 submit(u32 minComplete = 0);
+  // only waits for minComplete completions and submits nothing, so a thread
+  // that reaps can wait while other threads prepare and submit (under a
+  // lock of their own). 0 or -errno
+  i32 waitForCompletions(u32 minComplete);
+  // completes every prepared request the kernel hasn't seen yet with
+  // fn(userData, error) and takes it out of the queue again
+  template <class Fn> void failUnsubmitted(i32 error, Fn &&fn) {
+    u32 tail = *sqTail;
+    u32 first = tail - toSubmit;
+    for (u32 i = first; i != tail; i++) {
+      fn(sqes[sqArray[i & *sqMask]].user_data, error);
+    }
+    // the kernel only reads the tail in io_uring_enter, so it can go back
+    std::atomic_ref(*sqTail).store(first, std::memory_order_release);
+    toSubmit = 0;
+  }
+  // calls fn(userData, result) for every completion that is available
+  template <class Fn> u32 reap(Fn &&fn) {
+    u32 head = *cqHead;
+    u32 count = 0;
+    while (head != std::atomic_ref(*cqTail).load(std::memory_order_acquire)) {
+      auto &cqe = cqes[head & *cqMask];
+      fn(cqe.user_data, cqe.res);
+      head++;
+      count++;
+    }
+    std::atomic_ref(*cqHead).store(head, std::memory_order_release);
+    return count;
+  }
+  // result of the request with userData (-errno on failure), submits and
+  // waits as needed, completions of other requests are passed to `other`
+  template <class Fn> i32 wait(u64 userData, Fn &&other) {
+    std::optional<i32> result;
+    auto complete = [&](u64 data, i32 res) {
+      if (data == userData) {
+        result = res;
+      } else {
+        other(data, res);
+      }
+    };
+    while (true) {
+      reap(complete);
+      if (result.has_value()) {
+        return *result;
+      }
+      i32 submitted = submit(1);
+      if (submitted < 0) {
+        failUnsubmitted(submitted, complete);
+        return result.value_or(submitted);
+      }
+    }
+  }
+
+private:
+  struct NotSetUp {};
+  explicit IoUring(NotSetUp) {}
+  // false if any step failed, whatever was set up is released again then
+  bool setup(u32 entries);
+
+  int ringFd = -1;
+  void *sqRing = nullptr;
+  void *cqRing = nullptr;
+  std::size_t sqRingSize = 0;
+  std::size_t cqRingSize = 0;
+  io_uring_sqe *sqes = nullptr;
+  std::size_t sqesSize = 0;
+
+  u32 *sqHead;
+  u32 *sqTail;
+  u32 *sqMask;
+  u32 *sqArray;
+  u32 *cqHead;
+  u32 *cqTail;
+  u32 *cqMask;
+  io_uring_cqe *cqes;
+  // prepared but not yet submitted
+  u32 toSubmit = 0;
+};
+
+/*
+ * Whatever runs the fiber on the calling thread and can park it until an
+ * io_uring request completed, so that a host function doing io doesn't
+ * block the thread: the EventLoop, or the Scheduler on its workers.
+ */
+class AsyncIo {
+public:
+  // the one running the current fiber of this thread, if any
+  static AsyncIo *current();
+  // for the runners, around resuming one of their fibers
+  static AsyncIo *exchangeCurrent(AsyncIo *io);
+
+  // on a fiber: prepares a request and parks the fiber until it completed,
+  // returns its result (-errno on failure). empty if there is no io_uring
+  // to be had, the caller has to do the io itself then
+  virtual std::optional<i32> awaitIo(u8 opcode, int fd, const void *addr,
+                                     u32 len, u64 offset) = 0;
+
+protected:
+  ~AsyncIo() = default;
+};
+
+} // namespace wasmjit
@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <elf.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "jit-profiling.hpp"
+
+namespace wasmjit {
+
+static std::mutex profilingMutex;
+
+void writePerfMap(const CodeMap &map, const JitSymbols &symbols) {
+  std::lock_guard lock(profilingMutex);
+  static FILE *file = [] {
+    std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    FILE *file = std::fopen(path.c_str(), "a");
+    if (file == nullptr) {
+      throw std::runtime_error("Failed to open " + path);
+    }
+    return file;
+  }();
+  for (auto &range : map.functionRanges()) {
+    std::fprintf(file, "%lx %x %s\n",
+                 static_cast<unsigned long>(map.codeBase() + range.begin),
+                 range.end - range.begin,
+                 symbols.functionName(range.funcIndex).c_str());
+  }
+  std::fflush(file);
+}
+
+// see tools/perf/Documentation/jitdump-specification.txt in the kernel tree
+static constexpr u32 kJitDumpMagic = 0x4a695444;
+static constexpr u32 kJitDumpVersion = 1;
+static constexpr u32 kJitCodeLoad = 0;
+static constexpr u32 kJitCodeDebugInfo = 2;
+
+// has to be the clock perf records with, -k mono
+static u64 timestamp() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return u64(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+// a record under construction, the fields are written back to back
+class RecordBuffer {
+public:
+  template <class T> void put(T value) {
+    auto *bytes = reinterpret_cast<const u8 *>(&value);
+    data.insert(data.end(), bytes, bytes + sizeof(T));
+  }
+  void putString(const std::string &str) {
+    data.insert(data.end(), str.begin(), str.end());
+    data.push_back(0);
+  }
+  void putBytes(const void *bytes, std::size_t size) {
+    auto *begin = static_cast<const u8 *>(bytes);
+    data.insert(data.end(), begin, begin + size);
+  }
+  // id, total size and timestamp
+  void begin(u32 id) {
+    data.clear();
+    put(id);
+    put(u32{0});
+    put(timestamp());
+  }
+  void end() {
+    u32 size = data.size();
+    std::memcpy(data.data() + sizeof(u32), &size, sizeof(size));
+  }
+
+  std::vector<u8> data;
+};
+
+class JitDumpFile {
+public:
+  JitDumpFile() {
+    std::string path = "/tmp/jit-" + std::to_string(getpid()) + ".dump";
+    fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open " + path);
+    }
+    // perf finds the dump through the executable mmap of it in the
+    // recorded mmap events
+    marker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+                  MAP_PRIVATE, fd, 0);
+    if (marker == MAP_FAILED) {
+      throw std::runtime_error("Failed to map " + path);
+    }
+    RecordBuffer header;
+    header.put(kJitDumpMagic);
+    header.put(kJitDumpVersion);
+    header.put(u32{40});
+    header.put(u32{EM_X86_64});
+    header.put(u32{0});
+    header.put(static_cast<u32>(getpid()));
+    header.put(timestamp());
+    header.put(u64{0});
+    write(header);
+  }
+
+  void write(const RecordBuffer &record) {
+    std::size_t done = 0;
+    while (done < record.data.size()) {
+      ssize_t n = ::write(fd, record.data.data() + done,
+                          record.data.size() - done);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Failed to write the jitdump");
+      }
+      done += n;
+    }
+  }
+
+  u64 nextCodeIndex() { return codeIndex++; }
+
+private:
+  int fd;
+  void *marker;
+  u64 codeIndex = 0;
+};
+
+void writeJitDump(const CodeMap &map, const JitSymbols &symbols) {
+  std::lock_guard lock(profilingMutex);
+  static JitDumpFile file;
+  auto &lines = map.lineTable();
+  auto pid = static_cast<u32>(getpid());
+  auto tid = static_cast<u32>(syscall(SYS_gettid));
+  RecordBuffer record;
+  for (auto &range : map.functionRanges()) {
+    u64 address = map.codeBase() + range.begin;
+    auto first = std::lower_bound(
+        lines.begin(), lines.end(), range.begin,
+        [](const LineEntry &line, u32 offset) {
+          return line.nativeOffset < offset;
+        });
+    auto last = first;
+    while (last != lines.end() && last->nativeOffset < range.end) {
+      ++last;
+    }
+    // the line info has to come before the code it describes
+    if (first != last) {
+      record.begin(kJitCodeDebugInfo);
+      record.put(address);
+      record.put(static_cast<u64>(last - first));
+      for (auto it = first; it != last; ++it) {
+        record.put(u64{map.codeBase() + it->nativeOffset});
+        record.put(it->wasmOffset);
+        record.put(u32{0});
+        record.putString(symbols.sourceName);
+      }
+      record.end();
+      file.write(record);
+    }
+    record.begin(kJitCodeLoad);
+    record.put(pid);
+    record.put(tid);
+    record.put(address);
+    record.put(address);
+    record.put(u64{range.end - range.begin});
+    record.put(file.nextCodeIndex());
+    record.putString(symbols.functionName(range.funcIndex));
+    record.putBytes(reinterpret_cast<const void *>(address),
+                    range.end - range.begin);
+    record.end();
+    file.write(record);
+  }
+}
+
+} // namespace wasmjit
@@ -0,0 +1,16 @@
+#pragma once
+#include "lib/code-map.hpp"
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+// appends a "start size name" line per function to /tmp/perf-<pid>.map,
+// perf report resolves samples in anonymous executable memory through it
+void writePerfMap(const CodeMap &map, const JitSymbols &symbols);
+// appends every function with its code bytes and, if the code map has a
+// line table, the wasm offsets as line numbers to /tmp/jit-<pid>.dump.
+// `perf record -k mono` followed by `perf inject --jit` turns them into
+// proper symbols with annotated source lines
+void writeJitDump(const CodeMap &map, const JitSymbols &symbols);
+
+} // namespace wasmjit
@@ -1,15 +1,16 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <format>
 #include <limits>
 #include <span>
+#include <string>
 #include <string_view>
-#include <iostream>
 #include <variant>
+#include "trace.hpp"
 #include "tz-utils.hpp"
 #include "wasm-types.hpp"
 #include "parser.hpp"
-#include "wasi.h"
 using namespace std::literals;
 
 
@@ -91,6 +92,8 @@ std::string_view toString(WasmSection section) {
     return "CODE_SECTION";
   case WasmSection::DATA_SECTION:
     return "DATA_SECTION";
+  case WasmSection::DATA_COUNT_SECTION:
+    return "DATA_COUNT_SECTION";
   case WasmSection::SIZE:
     assert(false && "Invalid section");
     break;
@@ -184,7 +187,7 @@ void FunctionSection::parseSection(ArenaAllocator &alloc, BinaryReader &reader,
   auto count = reader.readIntLeb<u32>();
 
 
-  LOG_DEBUG("Function count: {}", count);
+  TRACE_DEBUG("parser", "Function count: {}", count);
   functions = alloc.constructSpan<u32>(count + numImportedFns);
   importedFnPtrs = alloc.constructSpan<uintptr_t>(numImportedFns);
   importSection->resolveImportedFuncs(*this);
@@ -211,6 +214,58 @@ void ExportSection::parseSection(ArenaAllocator &alloc, BinaryReader &reader) {
   }
 }
 
+static std::string_view copyName(ArenaAllocator &alloc, std::string_view name) {
+  auto strMem = alloc.constructSpan<u8>(name.size());
+  std::copy(name.begin(), name.end(), strMem.begin());
+  return std::string_view(reinterpret_cast<const char *>(strMem.data()),
+                          strMem.size());
+}
+
+void NameSection::parseSection(ArenaAllocator &alloc, BinaryReader &reader) {
+  constexpr u8 kModuleNames = 0;
+  constexpr u8 kFunctionNames = 1;
+  try {
+    while (reader.hasMore()) {
+      auto id = reader.read<u8>();
+      auto size = reader.readIntLeb<u32>();
+      auto content = reader.readChunk(size);
+      BinaryReader subsection(content.data(), content.size());
+      if (id == kModuleNames) {
+        moduleName = copyName(alloc, subsection.readStr());
+      } else if (id == kFunctionNames) {
+        auto count = subsection.readIntLeb<u32>();
+        if (count > content.size()) {
+          throw std::runtime_error("Invalid function name count");
+        }
+        auto names = alloc.constructSpan<WasmFunctionName>(count);
+        for (auto &entry : names) {
+          entry.index = subsection.readIntLeb<u32>();
+          entry.name = copyName(alloc, subsection.readStr());
+        }
+        std::stable_sort(names.begin(), names.end(), [](auto &a, auto &b) {
+          return a.index < b.index;
+        });
+        functionNames = names;
+      }
+    }
+  } catch (std::runtime_error &) {
+    moduleName = {};
+    functionNames = {};
+  }
+}
+
+std::optional<std::string_view> NameSection::functionName(u32 index) const {
+  auto it = std::lower_bound(
+      functionNames.begin(), functionNames.end(), index,
+      [](const WasmFunctionName &entry, u32 index) {
+        return entry.index < index;
+      });
+  if (it == functionNames.end() || it->index != index) {
+    return std::nullopt;
+  }
+  return it->name;
+}
+
 void ImportedName::parse(ArenaAllocator &alloc, BinaryReader &reader) {
   auto name1 = reader.readStr();
   auto name2 = reader.readStr();
@@ -275,10 +330,9 @@ void ImportSection::parseSection(ArenaAllocator &alloc, BinaryReader &reader) {
 void ImportSection::resolveImportedFuncs(FunctionSection &functionSection) {
   for (u32 i = 0; i < numImportedFuncs; i++) {
     auto fnIdx = std::get<u32>(imports[importedFunctions[i]]);
-    assert(importedNames[importedFunctions[i]].l1Name == "wasi_snapshot_preview1");
-
+    // the addresses are filled in when the module is linked against the
+    // host functions
     functionSection.functions[i] = fnIdx;
-    functionSection.importedFnPtrs[0] =  preview1::linkTable[importedNames[importedFunctions[i]].l2Name];
   }
 }
 
@@ -358,12 +412,53 @@ void GlobalSection::parseSection(ArenaAllocator& alloc, BinaryReader &reader) {
   }
 }
 
+void WasmDataSegment::parse(BinaryReader &reader) {
+  auto kind = reader.readIntLeb<u32>();
+  switch (kind) {
+  case 0:
+    isPassive = false;
+    offset.parse(reader);
+    break;
+  case 1:
+    isPassive = true;
+    break;
+  case 2: {
+    auto memoryIndex = reader.readIntLeb<u32>();
+    WASM_VALIDATE(memoryIndex == 0, "Only one memory is supported");
+    isPassive = false;
+    offset.parse(reader);
+    break;
+  }
+  default:
+    WASM_VALIDATE(false, "Invalid data segment kind");
+  }
+  WASM_VALIDATE(isPassive || offset.isInitByGlobal ||
+                    std::holds_alternative<i32>(offset.value),
+                "Data segment offset has to be an i32");
+  auto size = reader.readIntLeb<u32>();
+  bytes = reader.readChunk(size);
+}
+
+void DataSection::parseSection(ArenaAllocator &alloc, BinaryReader &reader) {
+  auto count = reader.readIntLeb<u32>();
+  WASM_VALIDATE(!dataCount.has_value() || *dataCount == count,
+                "Data count doesn't match the data section");
+  segments = alloc.constructSpan<WasmDataSegment>(count);
+  for (u32 i = 0; i < count; i++) {
+    segments[i].parse(reader);
+  }
+}
+
+// the dumps go to the trace sink a line at a time, the caller checks that
+// debug traces are enabled
 void FunctionPrototype::dump() const {
-  std::cout << "FunctionPrototype: (";
+  std::string params;
   for (auto type : paramTypes) {
-    std::cout << toString(type) << " ";
+    params += toString(type);
+    params += " ";
   }
-  std::cout << ") -> " << toString(returnType) << std::endl;
+  TRACE_DEBUG("parser", "FunctionPrototype: ({}) -> {}", params,
+              toString(returnType));
 }
 
 void TypeSection::dump() const {
@@ -374,13 +469,13 @@ void TypeSection::dump() const {
 
 void FunctionSection::dump() const {
   for (auto index : functions) {
-    std::cout << "Function index: " << std::to_string(index) << std::endl;
+    TRACE_DEBUG("parser", "Function index: {}", index);
   }
 }
 
 void ExportEntity::dump() const {
-  std::cout << "ExportEntity: " << name << " -> " << toString(type) << " "
-            << std::to_string(entityIndex) << std::endl;
+  TRACE_DEBUG("parser", "ExportEntity: {} -> {} {}", name, toString(type),
+              entityIndex);
 }
 
 void ExportSection::dump() const {
@@ -390,16 +485,17 @@ void ExportSection::dump() const {
 }
 
 void ImportedName::dump() const {
-  std::cout << "ImportedName: " << l1Name << " " << l2Name << std::endl;
+  TRACE_DEBUG("parser", "ImportedName: {} {}", l1Name, l2Name);
 }
 
 void ImportSection::dump() const {
-  std::cout << "ImportSection: " << std::endl;
-  std::cout << "Num imported functions: " << numImportedFuncs << std::endl;
-  std::cout << "Num imported Globals: " << numImportedGlobals << std::endl;
+  TRACE_DEBUG("parser", "ImportSection:");
+  TRACE_DEBUG("parser", "Num imported functions: {}", numImportedFuncs);
+  TRACE_DEBUG("parser", "Num imported Globals: {}", numImportedGlobals);
   for (u32 i = 0; i < importedFunctions.size(); i++) {
     importedNames[importedFunctions[i]].dump();
-    std::cout << "Fn idx: " << std::get<u32>(imports[importedFunctions[i]]) << std::endl;
+    TRACE_DEBUG("parser", "Fn idx: {}",
+                std::get<u32>(imports[importedFunctions[i]]));
   }
   for (u32 i = 0; i < importedGlobals.size(); i++) {
     importedNames[importedGlobals[i]].dump();
@@ -407,12 +503,12 @@ void ImportSection::dump() const {
   }
 
   if (importedTableLimit.has_value()) {
-    std::cout << "Imported table limit: ";
+    TRACE_DEBUG("parser", "Imported table limit:");
     importedNames[importedTableLimit.value().second].dump();
     importedTableLimit.value().first.dump();
   }
   if (importedMemoryLimit.has_value()) {
-    std::cout << "Imported memory limit: ";
+    TRACE_DEBUG("parser", "Imported memory limit:");
     importedNames[importedMemoryLimit.value().second].dump();
     importedMemoryLimit.value().first.dump();
   }
@@ -420,49 +516,68 @@ void ImportSection::dump() const {
 
 void WasmLimit::dump() const {
   if (maxSize == std::numeric_limits<u32>::max())
-    std::cout << "WasmLimit: " << minSize << " " << "inf" << std::endl;
+    TRACE_DEBUG("parser", "WasmLimit: {} inf", minSize);
   else
-    std::cout << "WasmLimit: " << minSize << " " << maxSize << std::endl;
+    TRACE_DEBUG("parser", "WasmLimit: {} {}", minSize, maxSize);
 }
 
 void TableSection::dump() const {
   if (limit.has_value()) {
-    std::cout << "TableSection: ";
+    TRACE_DEBUG("parser", "TableSection:");
     limit.value().dump();
   } else {
-    std::cout << "TableSection: empty" << std::endl;
+    TRACE_DEBUG("parser", "TableSection: empty");
   }
 }
 
 void MemorySection::dump() const {
   if (limit.has_value()) {
-    std::cout << "MemorySection: ";
+    TRACE_DEBUG("parser", "MemorySection:");
     limit.value().dump();
   } else {
-    std::cout << "MemorySection: empty" << std::endl;
+    TRACE_DEBUG("parser", "MemorySection: empty");
   }
 }
 
 void WasmConstExpr::dump() const {
   if (isInitByGlobal) {
-    std::cout << std::format("WasmConstExpr: globalIdx {}\n", std::get<u32>(value));
+    TRACE_DEBUG("parser", "WasmConstExpr: globalIdx {}", std::get<u32>(value));
   } else {
-    std::visit([](auto &&arg) { std::cout << std::format("WasmConstExpr: value: {}\n", arg); }, value);
+    std::visit(
+        [](auto &&arg) {
+          TRACE_DEBUG("parser", "WasmConstExpr: value: {}", arg);
+        },
+        value);
   }
 }
 
 void WasmGlobal::dump() const {
-  std::cout << "WasmGlobal: " << toString(type) << " " << isMutable << std::endl;
+  TRACE_DEBUG("parser", "WasmGlobal: {} {}", toString(type), isMutable);
 }
 
 void GlobalSection::dump() const {
-  std::cout << "GlobalSection: " << std::endl;
+  TRACE_DEBUG("parser", "GlobalSection:");
   for (u32 i = 0; i < globals.size(); i++) {
     globals[i].dump();
     initExprs[i].dump();
   }
 }
 
+void WasmDataSegment::dump() const {
+  TRACE_DEBUG("parser", "WasmDataSegment: {} {} bytes",
+              isPassive ? "passive" : "active", bytes.size());
+  if (!isPassive) {
+    offset.dump();
+  }
+}
+
+void DataSection::dump() const {
+  TRACE_DEBUG("parser", "DataSection:");
+  for (auto &segment : segments) {
+    segment.dump();
+  }
+}
+
 FunctionPrototype &WasmModule::getPrototype(u32 index) const {
   u32 typeIdx = functionSection.functions[index];
   return typeSection.types[typeIdx];
@@ -484,36 +599,29 @@ void WasmModule::parseSections(std::span<const u8> wasmFile) {
     //               "Custom sections are not supported");
     auto sectionSize = reader.readIntLeb<u32>();
 
-    LOG_DEBUG("Section: {} size: {}", toString(static_cast<WasmSection>(sectionId)), sectionSize);
+    TRACE_DEBUG("parser", "Section: {} size: {}", toString(static_cast<WasmSection>(sectionId)), sectionSize);
 
     switch (static_cast<WasmSection>(sectionId)) {
     case WasmSection::TYPE_SECTION:
       typeSection.parseSection(allocator, reader);
-      typeSection.dump();
       break;
     case WasmSection::IMPORT_SECTION:
       importSection.parseSection(allocator, reader);
-      importSection.dump();
       break;
     case WasmSection::FUNCTION_SECTION:
       functionSection.parseSection(allocator, reader, &importSection);
-      functionSection.dump();
       break;
     case WasmSection::TABLE_SECTION:
       tableSection.parseSection(reader);
-      tableSection.dump();
       break;
     case WasmSection::MEMORY_SECTION:
       memorySection.parseSection(reader);
-      memorySection.dump();
       break;
     case WasmSection::GLOBAL_SECTION:
       globalSection.parseSection(allocator, reader);
-      globalSection.dump();
       break;
     case WasmSection::EXPORT_SECTION:
       exportSection.parseSection(allocator, reader);
-      exportSection.dump();
       break;
     case WasmSection::START_SECTION:
       break;
@@ -523,10 +631,19 @@ void WasmModule::parseSections(std::span<const u8> wasmFile) {
       codeSection.code = reader.readChunk(sectionSize);
       break;
     case WasmSection::DATA_SECTION:
+      dataSection.parseSection(allocator, reader);
+      break;
+    case WasmSection::DATA_COUNT_SECTION:
+      dataSection.dataCount = reader.readIntLeb<u32>();
       break;
-    case WasmSection::CUSTOM_SECTION:
-      reader.advance(sectionSize);
+    case WasmSection::CUSTOM_SECTION: {
+      auto content = reader.readChunk(sectionSize);
+      BinaryReader custom(content.data(), content.size());
+      if (custom.readStr() == "name") {
+        nameSection.parseSection(allocator, custom);
+      }
       break;
+    }
     default:
       throw std::runtime_error("Invalid section id");
     }
@@ -541,6 +658,7 @@ void WasmModule::dump() const {
   tableSection.dump();
   memorySection.dump();
   globalSection.dump();
+  dataSection.dump();
 }
 
 } // namespace wasmjit
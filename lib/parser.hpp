@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <optional>
 #include <string_view>
+#include <variant>
 
 #include "ArenaAllocator.hpp"
 #include "lib/wasm-types.hpp"
@@ -27,6 +28,7 @@ public:
   void advance(std::size_t count);
 
   [[nodiscard]] bool hasMore() const;
+  std::size_t position() const { return pos; }
   std::span<const u8> readChunk(std::size_t count);
 
 private:
@@ -85,7 +87,8 @@ enum class WasmSection {
   ELEMENT_SECTION = 9,
   CODE_SECTION = 10,
   DATA_SECTION = 11,
-  SIZE = 12
+  DATA_COUNT_SECTION = 12,
+  SIZE = 13
 };
 
 std::string_view toString(WasmSection section);
@@ -172,8 +175,9 @@ public:
 
   void dump() const;
 
-  u32 numImportedFuncs;
-  u32 numImportedGlobals;
+  // stay 0 for modules without an import section
+  u32 numImportedFuncs = 0;
+  u32 numImportedGlobals = 0;
   std::span<import_t> imports;
   std::span<ImportedName> importedNames;
   // indices into the imports/names
@@ -189,7 +193,7 @@ struct FunctionSection : NonCopyable, NonMoveable {
   void parseSection(ArenaAllocator &alloc, BinaryReader &reader, ImportSection* importSection);
   void dump() const;
 
-  u32 numImportedFns;
+  u32 numImportedFns = 0;
   std::span<uintptr_t> importedFnPtrs;
   std::span<u32> functions;
 };
@@ -247,6 +251,41 @@ struct GlobalSection : NonMoveable, NonCopyable {
   std::span<WasmConstExpr> initExprs;
 };
 
+struct WasmDataSegment {
+  void parse(BinaryReader &reader);
+  void dump() const;
+
+  // passive segments are only copied by memory.init
+  bool isPassive;
+  // where active segments go in memory 0
+  WasmConstExpr offset;
+  // points into the module binary, nothing is copied while parsing
+  std::span<const u8> bytes;
+};
+
+struct DataSection : NonMoveable, NonCopyable {
+  void parseSection(ArenaAllocator &alloc, BinaryReader &reader);
+  void dump() const;
+
+  std::span<WasmDataSegment> segments;
+  std::optional<u32> dataCount;
+};
+
+struct WasmFunctionName {
+  u32 index;
+  std::string_view name;
+};
+
+// the module and function names of the custom "name" section, a malformed
+// section is ignored as the spec asks for
+struct NameSection : NonMoveable, NonCopyable {
+  void parseSection(ArenaAllocator &alloc, BinaryReader &reader);
+  std::optional<std::string_view> functionName(u32 index) const;
+
+  std::string_view moduleName;
+  // sorted by function index
+  std::span<WasmFunctionName> functionNames;
+};
 
 class CodeSection : NonMoveable, NonCopyable {
 public:
@@ -269,6 +308,8 @@ struct WasmModule : NonCopyable, NonMoveable {
   MemorySection memorySection;
   GlobalSection globalSection;
   CodeSection codeSection;
+  DataSection dataSection;
+  NameSection nameSection;
 };
 
 } // namespace wasmjit
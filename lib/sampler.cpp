@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <sys/time.h>
+#include <thread>
+#include <ucontext.h>
+
+#include "code-map.hpp"
+#include "sampler.hpp"
+#include "trap.hpp"
+
+namespace wasmjit {
+
+static constexpr u32 kMaxSampleFrames = 64;
+
+static std::atomic<Sampler *> activeSampler = nullptr;
+// handlers that may still look at the active sampler
+static std::atomic<u32> runningHandlers = 0;
+
+static void setTimer(u32 frequency) {
+  itimerval timer = {};
+  if (frequency > 0) {
+    timer.it_interval.tv_usec = std::max<u32>(1'000'000 / frequency, 1);
+    timer.it_value = timer.it_interval;
+  }
+  if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+    throw std::runtime_error("Failed to set the profiling timer");
+  }
+}
+
+Sampler::Sampler(SamplerConfig config)
+    : config(config), buffer(new uintptr_t[config.bufferSize]) {}
+
+Sampler::~Sampler() { stop(); }
+
+void Sampler::start() {
+  if (running) {
+    return;
+  }
+  // stays installed, a SIGPROF that is still pending when the sampler stops
+  // must not hit the default action, which terminates the process
+  static std::once_flag handlerInstalled;
+  std::call_once(handlerInstalled, [] {
+    struct sigaction action = {};
+    action.sa_sigaction = handleSignal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0) {
+      throw std::runtime_error("Failed to install the SIGPROF handler");
+    }
+  });
+  Sampler *expected = nullptr;
+  if (!activeSampler.compare_exchange_strong(expected, this)) {
+    throw std::runtime_error("Another sampler is already running");
+  }
+  running = true;
+  setTimer(config.frequency);
+}
+
+void Sampler::stop() {
+  if (!running) {
+    return;
+  }
+  setTimer(0);
+  activeSampler.store(nullptr, std::memory_order_seq_cst);
+  while (runningHandlers.load(std::memory_order_seq_cst) != 0) {
+    std::this_thread::yield();
+  }
+  running = false;
+}
+
+void Sampler::clear() {
+  if (running) {
+    throw std::runtime_error("Can't clear a running sampler");
+  }
+  used = 0;
+  samples = 0;
+  hostSamples = 0;
+  dropped = 0;
+}
+
+void Sampler::handleSignal(int, siginfo_t *, void *context) {
+  int savedErrno = errno;
+  runningHandlers.fetch_add(1, std::memory_order_seq_cst);
+  if (auto *sampler = activeSampler.load(std::memory_order_seq_cst)) {
+    auto *uc = static_cast<ucontext_t *>(context);
+    sampler->record(static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RIP]),
+                    static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RBP]),
+                    static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RSP]));
+  }
+  runningHandlers.fetch_sub(1, std::memory_order_release);
+  errno = savedErrno;
+}
+
+void Sampler::record(uintptr_t pc, uintptr_t fp, uintptr_t sp) {
+  uintptr_t pcs[kMaxSampleFrames];
+  u32 depth = walkWasmStack(pc, fp, sp, pcs);
+  if (depth == 0) {
+    hostSamples.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  std::size_t at = used.load(std::memory_order_relaxed);
+  do {
+    if (at + depth + 1 > config.bufferSize) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  } while (!used.compare_exchange_weak(at, at + depth + 1,
+                                       std::memory_order_relaxed));
+  buffer[at] = depth;
+  std::copy(pcs, pcs + depth, &buffer[at + 1]);
+  samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+static std::string frameName(uintptr_t pc) {
+  CodeMapRef map(pc);
+  const FunctionRange *function = map ? map->findFunction(pc) : nullptr;
+  if (function == nullptr) {
+    return "[unknown]";
+  }
+  auto &symbols = map->symbols();
+  return symbols.sourceName + "`" + symbols.functionName(function->funcIndex);
+}
+
+std::string Sampler::folded() const {
+  if (running) {
+    throw std::runtime_error("Can't resolve the samples of a running sampler");
+  }
+  std::map<uintptr_t, std::string> names;
+  std::map<std::string, u64> stacks;
+  std::size_t end = used.load();
+  for (std::size_t at = 0; at < end; at += buffer[at] + 1) {
+    std::string stack;
+    for (std::size_t i = buffer[at]; i > 0; i--) {
+      uintptr_t pc = buffer[at + i];
+      auto it = names.find(pc);
+      if (it == names.end()) {
+        it = names.emplace(pc, frameName(pc)).first;
+      }
+      if (!stack.empty()) {
+        stack += ';';
+      }
+      stack += it->second;
+    }
+    stacks[stack]++;
+  }
+  std::string result;
+  for (auto &[stack, count] : stacks) {
+    result += stack + " " + std::to_string(count) + "\n";
+  }
+  return result;
+}
+
+void Sampler::writeFolded(const std::string &path) const {
+  std::ofstream file(path);
+  if (!file) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+  file << folded();
+}
+
+SamplerStats Sampler::stats() const {
+  return {samples.load(), hostSamples.load(), dropped.load()};
+}
+
+} // namespace wasmjit
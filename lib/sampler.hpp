@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <csignal>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+struct SamplerConfig {
+  // samples per second of cpu time the process consumes, on all threads
+  // together
+  u32 frequency = 99;
+  // of words in the sample buffer, a sample takes one per frame plus one,
+  // samples that don't fit anymore are dropped
+  std::size_t bufferSize = 1 << 20;
+};
+
+struct SamplerStats {
+  // that interrupted wasm code and went into the buffer
+  u64 samples;
+  // that interrupted anything else, host functions included
+  u64 hostSamples;
+  // that didn't fit into the buffer
+  u64 dropped;
+};
+
+/*
+ * Samples the wasm call stacks of all threads on SIGPROF. The handler walks
+ * the frame pointer chain of the interrupted jit code (see walkWasmStack)
+ * and appends the raw pcs to a preallocated buffer, resolving them to
+ * functions is left to folded(), so a sample costs a few dozen loads and
+ * no locks.
+ *
+ * SIGPROF is process wide, only one sampler can run at a time. The modules
+ * whose code was sampled have to be alive when the profile is resolved,
+ * samples in code that is gone are reported as [unknown].
+ */
+class Sampler : NonCopyable, NonMoveable {
+public:
+  explicit Sampler(SamplerConfig config = {});
+  ~Sampler();
+
+  void start();
+  // no handler touches the buffer anymore once this returns
+  void stop();
+  // drops the samples taken so far, only while stopped
+  void clear();
+
+  // the samples aggregated into the folded stack format flamegraph.pl and
+  // speedscope read: a line per distinct stack with its frames outermost
+  // first, separated by ';', and the sample count, e.g.
+  // "main.wasm`run;main.wasm`fib 42". only while stopped
+  std::string folded() const;
+  void writeFolded(const std::string &path) const;
+  SamplerStats stats() const;
+
+private:
+  static void handleSignal(int sig, siginfo_t *info, void *context);
+  void record(uintptr_t pc, uintptr_t fp, uintptr_t sp);
+
+  SamplerConfig config;
+  std::unique_ptr<uintptr_t[]> buffer;
+  // each sample is its depth followed by its pcs, innermost first
+  std::atomic<std::size_t> used = 0;
+  std::atomic<u64> samples = 0;
+  std::atomic<u64> hostSamples = 0;
+  std::atomic<u64> dropped = 0;
+  bool running = false;
+};
+
+} // namespace wasmjit
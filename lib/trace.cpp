@@ -0,0 +1,128 @@
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#include "trace.hpp"
+
+namespace wasmjit {
+
+std::string_view toString(TraceLevel level) {
+  switch (level) {
+  case TraceLevel::NONE:
+    return "none";
+  case TraceLevel::INFO:
+    return "info";
+  case TraceLevel::DEBUG:
+    return "debug";
+  case TraceLevel::VERBOSE:
+    return "verbose";
+  }
+  return "unknown";
+}
+
+std::optional<TraceLevel> parseTraceLevel(std::string_view name) {
+  for (auto level : {TraceLevel::NONE, TraceLevel::INFO, TraceLevel::DEBUG,
+                     TraceLevel::VERBOSE}) {
+    if (toString(level) == name) {
+      return level;
+    }
+  }
+  return std::nullopt;
+}
+
+static u64 steadyNanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void StderrTraceSink::write(TraceLevel level, const char *category,
+                            std::string_view message) {
+  // a single write keeps the lines of concurrent writers apart
+  char line[kMaxTraceMessage + 64];
+  int prefix = std::snprintf(line, sizeof(line), "[%.*s] %s: ",
+                             static_cast<int>(toString(level).size()),
+                             toString(level).data(), category);
+  std::size_t size = std::min<std::size_t>(prefix, sizeof(line) - 1);
+  std::size_t length = std::min(message.size(), sizeof(line) - 1 - size);
+  std::memcpy(line + size, message.data(), length);
+  size += length;
+  line[size++] = '\n';
+  ::write(STDERR_FILENO, line, size);
+}
+
+TraceRing::TraceRing(std::size_t capacity)
+    : mask(std::bit_ceil(std::max<std::size_t>(capacity, 1)) - 1),
+      records(new Record[mask + 1]) {}
+
+void TraceRing::write(TraceLevel level, const char *category,
+                      std::string_view message) {
+  u64 ticket = nextTicket.fetch_add(1, std::memory_order_relaxed);
+  auto &record = records[ticket & mask];
+  u64 sequence = record.sequence.load(std::memory_order_relaxed);
+  // a writer that is a whole ring ahead (or behind) still owns the slot
+  if ((sequence & 1) != 0 ||
+      !record.sequence.compare_exchange_strong(sequence, 2 * ticket + 1,
+                                               std::memory_order_acquire)) {
+    droppedRecords.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  // readers that see any of the contents below also see the odd sequence
+  std::atomic_thread_fence(std::memory_order_release);
+  std::size_t size = std::min(message.size(), kMaxMessageSize);
+  record.header.store(static_cast<u64>(level) | size << 8,
+                      std::memory_order_relaxed);
+  record.timestampNs.store(steadyNanoseconds(), std::memory_order_relaxed);
+  record.category.store(category, std::memory_order_relaxed);
+  for (std::size_t i = 0; i * sizeof(u64) < size; i++) {
+    u64 word = 0;
+    std::memcpy(&word, message.data() + i * sizeof(u64),
+                std::min(sizeof(u64), size - i * sizeof(u64)));
+    record.message[i].store(word, std::memory_order_relaxed);
+  }
+  record.sequence.store(2 * ticket + 2, std::memory_order_release);
+}
+
+std::vector<TraceRecord> TraceRing::snapshot() const {
+  std::vector<TraceRecord> result;
+  u64 end = nextTicket.load(std::memory_order_acquire);
+  u64 begin = end > mask + 1 ? end - (mask + 1) : 0;
+  for (u64 ticket = begin; ticket < end; ticket++) {
+    auto &record = records[ticket & mask];
+    if (record.sequence.load(std::memory_order_acquire) != 2 * ticket + 2) {
+      continue;
+    }
+    u64 header = record.header.load(std::memory_order_relaxed);
+    TraceRecord copy{static_cast<TraceLevel>(header & 0xff),
+                     record.category.load(std::memory_order_relaxed),
+                     record.timestampNs.load(std::memory_order_relaxed),
+                     std::string(header >> 8, '\0')};
+    for (std::size_t i = 0; i * sizeof(u64) < copy.message.size(); i++) {
+      u64 word = record.message[i].load(std::memory_order_relaxed);
+      std::size_t offset = i * sizeof(u64);
+      std::memcpy(copy.message.data() + offset, &word,
+                  std::min(sizeof(u64), copy.message.size() - offset));
+    }
+    // the writer of a later ticket may have started in the meantime
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (record.sequence.load(std::memory_order_relaxed) != 2 * ticket + 2) {
+      continue;
+    }
+    result.push_back(std::move(copy));
+  }
+  return result;
+}
+
+static StderrTraceSink stderrSink;
+static std::atomic<TraceSink *> activeSink = &stderrSink;
+
+void setTraceSink(TraceSink *sink) {
+  activeSink.store(sink != nullptr ? sink : &stderrSink,
+                   std::memory_order_release);
+}
+
+TraceSink &traceSink() { return *activeSink.load(std::memory_order_acquire); }
+
+} // namespace wasmjit
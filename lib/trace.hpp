@@ -0,0 +1,172 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <format>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lib/tz-utils.hpp"
+
+// the most detailed level traces are compiled in for, everything above it
+// compiles to nothing: 0 none, 1 info, 2 debug, 3 verbose
+#ifndef WASMJIT_TRACE_LEVEL
+#define WASMJIT_TRACE_LEVEL 0
+#endif
+
+namespace wasmjit {
+
+enum class TraceLevel : u8 {
+  NONE = 0,
+  // once per module
+  INFO = 1,
+  // once per section or function
+  DEBUG = 2,
+  // once per instruction
+  VERBOSE = 3,
+};
+
+std::string_view toString(TraceLevel level);
+// "none", "info", "debug" or "verbose"
+std::optional<TraceLevel> parseTraceLevel(std::string_view name);
+
+inline std::atomic<TraceLevel> runtimeTraceLevel{TraceLevel::NONE};
+
+inline void setTraceLevel(TraceLevel level) {
+  runtimeTraceLevel.store(level, std::memory_order_relaxed);
+}
+
+// false at compile time for the levels that aren't compiled in, so whatever
+// is guarded by it goes away as well
+inline bool traceEnabled(TraceLevel level) {
+  return static_cast<int>(level) <= WASMJIT_TRACE_LEVEL &&
+         level <= runtimeTraceLevel.load(std::memory_order_relaxed);
+}
+
+// receives the formatted traces, write() is called concurrently from any
+// thread. categories are string literals
+class TraceSink {
+public:
+  virtual ~TraceSink() = default;
+  virtual void write(TraceLevel level, const char *category,
+                     std::string_view message) = 0;
+};
+
+// a line per trace on stderr, the default sink
+class StderrTraceSink : public TraceSink {
+public:
+  void write(TraceLevel level, const char *category,
+             std::string_view message) override;
+};
+
+struct TraceRecord {
+  TraceLevel level;
+  const char *category;
+  // steady clock
+  u64 timestampNs;
+  std::string message;
+};
+
+/*
+ * Keeps the latest traces in a fixed ring of fixed size records. Writers
+ * claim a record with a single fetch_add and publish it through a sequence
+ * number, they never block and never allocate. A record whose slot is still
+ * being written by a writer that wrapped around is dropped.
+ */
+class TraceRing : public TraceSink, NonCopyable, NonMoveable {
+public:
+  // longer messages are truncated
+  static constexpr std::size_t kMessageWords = 28;
+  static constexpr std::size_t kMaxMessageSize = kMessageWords * sizeof(u64);
+
+  // rounded up to a power of two
+  explicit TraceRing(std::size_t capacity = 4096);
+
+  void write(TraceLevel level, const char *category,
+             std::string_view message) override;
+  // the records still in the ring, oldest first. records that are
+  // overwritten while this copies them are left out
+  std::vector<TraceRecord> snapshot() const;
+  u64 dropped() const { return droppedRecords.load(); }
+
+private:
+  struct Record {
+    // 2 * ticket + 1 while it is written, 2 * ticket + 2 once it is complete
+    std::atomic<u64> sequence{0};
+    // level and message size
+    std::atomic<u64> header{0};
+    std::atomic<u64> timestampNs{0};
+    std::atomic<const char *> category{nullptr};
+    std::atomic<u64> message[kMessageWords];
+  };
+
+  std::size_t mask;
+  std::unique_ptr<Record[]> records;
+  std::atomic<u64> nextTicket = 0;
+  std::atomic<u64> droppedRecords = 0;
+};
+
+// null goes back to the stderr sink. the sink has to outlive its use, only
+// swap it while nothing traces
+void setTraceSink(TraceSink *sink);
+TraceSink &traceSink();
+
+static constexpr std::size_t kMaxTraceMessage = 256;
+
+// formats into a buffer on the stack and hands it to the sink, the
+// TRACE_* macros check traceEnabled() first
+template <class... Args>
+void trace(TraceLevel level, const char *category,
+           std::format_string<Args...> fmt, Args &&...args) {
+  char message[kMaxTraceMessage];
+  auto result = std::format_to_n(message, sizeof(message), fmt,
+                                 std::forward<Args>(args)...);
+  auto size = std::min<std::size_t>(result.size, sizeof(message));
+  traceSink().write(level, category, std::string_view(message, size));
+}
+
+} // namespace wasmjit
+
+// the arguments are only evaluated if the level is compiled in and enabled
+// at runtime
+#define WASMJIT_TRACE(level, category, ...)                                    \
+  do {                                                                         \
+    if (::wasmjit::traceEnabled(level)) {                                      \
+      ::wasmjit::trace(level, category, __VA_ARGS__);                          \
+    }                                                                          \
+  } while (0)
+
+// the levels that aren't compiled in still type check their arguments, so
+// builds at every level see the same uses of the traced variables
+#define WASMJIT_TRACE_DISABLED(level, category, ...)                           \
+  do {                                                                         \
+    if constexpr (false) {                                                     \
+      ::wasmjit::trace(level, category, __VA_ARGS__);                          \
+    }                                                                          \
+  } while (0)
+
+#if WASMJIT_TRACE_LEVEL >= 1
+#define TRACE_INFO(category, ...)                                              \
+  WASMJIT_TRACE(::wasmjit::TraceLevel::INFO, category, __VA_ARGS__)
+#else
+#define TRACE_INFO(category, ...)                                              \
+  WASMJIT_TRACE_DISABLED(::wasmjit::TraceLevel::INFO, category, __VA_ARGS__)
+#endif
+
+#if WASMJIT_TRACE_LEVEL >= 2
+#define TRACE_DEBUG(category, ...)                                             \
+  WASMJIT_TRACE(::wasmjit::TraceLevel::DEBUG, category, __VA_ARGS__)
+#else
+#define TRACE_DEBUG(category, ...)                                             \
+  WASMJIT_TRACE_DISABLED(::wasmjit::TraceLevel::DEBUG, category, __VA_ARGS__)
+#endif
+
+#if WASMJIT_TRACE_LEVEL >= 3
+#define TRACE_VERBOSE(category, ...)                                           \
+  WASMJIT_TRACE(::wasmjit::TraceLevel::VERBOSE, category, __VA_ARGS__)
+#else
+#define TRACE_VERBOSE(category, ...)                                           \
+  WASMJIT_TRACE_DISABLED(::wasmjit::TraceLevel::VERBOSE, category, __VA_ARGS__)
+#endif
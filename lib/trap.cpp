@@ -0,0 +1,263 @@
+#include <cassert>
+#include <csignal>
+#include <cstdlib>
+#include <mutex>
+#include <optional>
+#include <pthread.h>
+#include <string>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include "code-map.hpp"
+#include "trap.hpp"
+
+using namespace std::literals;
+
+namespace wasmjit {
+
+static thread_local TrapActivation *activeTrapActivation = nullptr;
+
+static constexpr int kTrapSignals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE};
+static struct sigaction previousHandlers[std::size(kTrapSignals)];
+
+// faults closer than this to rsp are treated as a native stack overflow
+static constexpr uintptr_t kStackFaultWindow = 64 * 1024;
+static constexpr std::size_t kAltStackSize = 64 * 1024;
+
+std::string_view toString(TrapCode code) {
+  switch (code) {
+  case TrapCode::STACK_OVERFLOW:
+    return "stack overflow";
+  case TrapCode::INTERRUPTED:
+    return "interrupted";
+  case TrapCode::OUT_OF_FUEL:
+    return "out of fuel";
+  case TrapCode::UNREACHABLE:
+    return "unreachable";
+  case TrapCode::MEMORY_OUT_OF_BOUNDS:
+    return "out of bounds memory access";
+  case TrapCode::INTEGER_OVERFLOW:
+    return "integer overflow";
+  case TrapCode::INTEGER_DIVIDE_BY_ZERO:
+    return "integer divide by zero";
+  case TrapCode::HOST_ERROR:
+    return "host function failed";
+  }
+  assert(false);
+  return ""sv;
+}
+
+WasmTrap::WasmTrap(TrapCode code, std::span<const WasmFrame> frames)
+    : std::runtime_error("wasm trap: " + std::string(toString(code))),
+      trapCode(code), frames(frames.begin(), frames.end()) {}
+
+/*
+ * walks the frame pointer chain, every jit function preserves rbp so this
+ * works until the first frame that belongs to the embedder again. a frame
+ * pointer has to lie between sp and the innermost activation, which sits in
+ * the frame of callGuarded() above all jit frames, so the walk never reads
+ * outside the live part of the stack even if pc is in a prologue or an
+ * epilogue where rbp still belongs to the caller
+ */
+u32 walkWasmStack(uintptr_t pc, uintptr_t fp, uintptr_t sp,
+                  std::span<uintptr_t> pcs) {
+  auto top = reinterpret_cast<uintptr_t>(activeTrapActivation);
+  u32 depth = 0;
+  while (depth < pcs.size() && CodeMapRef(pc)) {
+    pcs[depth++] = pc;
+    if (fp < sp || fp + 2 * sizeof(uintptr_t) > top || (fp & 7) != 0) {
+      break;
+    }
+    auto *slots = reinterpret_cast<const uintptr_t *>(fp);
+    // step back into the call instruction so it maps to the call site
+    pc = slots[1] - 1;
+    sp = fp + 2 * sizeof(uintptr_t);
+    fp = slots[0];
+  }
+  return depth;
+}
+
+static void captureBacktrace(TrapActivation &activation, uintptr_t pc,
+                             uintptr_t fp, uintptr_t sp) {
+  uintptr_t pcs[kMaxTrapFrames];
+  u32 depth = walkWasmStack(pc, fp, sp, pcs);
+  activation.numFrames = 0;
+  for (u32 i = 0; i < depth; i++) {
+    CodeMapRef map(pcs[i]);
+    auto frame = map ? map->lookup(pcs[i]) : std::nullopt;
+    if (!frame.has_value()) {
+      break;
+    }
+    activation.frames[activation.numFrames++] = frame.value();
+  }
+}
+
+static struct sigaction &previousHandler(int sig) {
+  for (u32 i = 0; i < std::size(kTrapSignals); i++) {
+    if (kTrapSignals[i] == sig) {
+      return previousHandlers[i];
+    }
+  }
+  std::abort();
+}
+
+static void forwardSignal(int sig, siginfo_t *info, void *context) {
+  struct sigaction &prev = previousHandler(sig);
+  if (prev.sa_flags & SA_SIGINFO) {
+    prev.sa_sigaction(sig, info, context);
+  } else if (prev.sa_handler == SIG_DFL || prev.sa_handler == SIG_IGN) {
+    // returning re-executes the faulting instruction under the old action
+    sigaction(sig, &prev, nullptr);
+  } else {
+    prev.sa_handler(sig);
+  }
+}
+
+static TrapCode classifyFault(int sig, siginfo_t *info, uintptr_t sp) {
+  switch (sig) {
+  case SIGILL:
+    return TrapCode::UNREACHABLE;
+  case SIGFPE:
+    return TrapCode::INTEGER_DIVIDE_BY_ZERO;
+  default: {
+    auto addr = reinterpret_cast<uintptr_t>(info->si_addr);
+    if (addr + kStackFaultWindow >= sp && addr < sp + kStackFaultWindow) {
+      return TrapCode::STACK_OVERFLOW;
+    }
+    return TrapCode::MEMORY_OUT_OF_BOUNDS;
+  }
+  }
+}
+
+static void trapSignalHandler(int sig, siginfo_t *info, void *context) {
+  auto *uc = static_cast<ucontext_t *>(context);
+  auto pc = static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RIP]);
+  TrapActivation *activation = activeTrapActivation;
+  std::optional<TrapCode> siteCode;
+  {
+    // the ref has to be gone before the siglongjmp below skips its destructor
+    CodeMapRef map(pc);
+    if (activation == nullptr || !map) {
+      forwardSignal(sig, info, context);
+      return;
+    }
+    if (auto *site = map->findTrapSite(pc)) {
+      siteCode = site->code;
+    }
+  }
+
+  TrapCode code;
+  if (siteCode.has_value()) {
+    code = siteCode.value();
+  } else {
+    code = classifyFault(
+        sig, info, static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RSP]));
+  }
+  captureBacktrace(*activation, pc,
+                   static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RBP]),
+                   static_cast<uintptr_t>(uc->uc_mcontext.gregs[REG_RSP]));
+  activation->code = code;
+  // the handlers are installed with SA_NODEFER so there is no signal mask
+  // that would have to be restored here
+  siglongjmp(activation->jmpBuf, 1);
+}
+
+static void installTrapHandlers() {
+  struct sigaction action = {};
+  action.sa_sigaction = trapSignalHandler;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  for (u32 i = 0; i < std::size(kTrapSignals); i++) {
+    if (sigaction(kTrapSignals[i], &action, &previousHandlers[i]) != 0) {
+      throw std::runtime_error("Failed to install trap handler");
+    }
+  }
+}
+
+// stack overflows fault on the guard page, the handler needs a stack of its own
+struct AltSignalStack {
+  AltSignalStack() {
+    mem = mmap(nullptr, kAltStackSize, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+      throw std::runtime_error("Failed to allocate signal stack");
+    }
+    stack_t ss = {};
+    ss.ss_sp = mem;
+    ss.ss_size = kAltStackSize;
+    if (sigaltstack(&ss, &prev) != 0) {
+      throw std::runtime_error("Failed to install signal stack");
+    }
+  }
+
+  ~AltSignalStack() {
+    sigaltstack(&prev, nullptr);
+    munmap(mem, kAltStackSize);
+  }
+
+  void *mem;
+  stack_t prev;
+};
+
+void prepareThreadForTraps() {
+  static std::once_flag handlersInstalled;
+  std::call_once(handlersInstalled, installTrapHandlers);
+  static thread_local AltSignalStack altStack;
+}
+
+void enterActivation(TrapActivation &activation) {
+  prepareThreadForTraps();
+  activation.numFrames = 0;
+  activation.prev = activeTrapActivation;
+  activeTrapActivation = &activation;
+}
+
+void leaveActivation(TrapActivation &activation) {
+  assert(activeTrapActivation == &activation);
+  activeTrapActivation = activation.prev;
+}
+
+TrapActivation *exchangeActivations(TrapActivation *activations) {
+  TrapActivation *previous = activeTrapActivation;
+  activeTrapActivation = activations;
+  return previous;
+}
+
+void raiseTrap(u32 code) {
+  TrapActivation *activation = activeTrapActivation;
+  if (activation == nullptr) {
+    // no embedder frame to return to, so there is nothing sane left to do
+    std::abort();
+  }
+  // the caller is the trap stub inside the jit function, its rbp was saved
+  // by our own prologue
+  auto pc = reinterpret_cast<uintptr_t>(__builtin_return_address(0)) - 1;
+  auto *frame = static_cast<uintptr_t *>(__builtin_frame_address(0));
+  captureBacktrace(*activation, pc, frame[0],
+                   reinterpret_cast<uintptr_t>(frame));
+  activation->code = static_cast<TrapCode>(code);
+  siglongjmp(activation->jmpBuf, 1);
+}
+
+uintptr_t computeStackLimit(std::size_t headroom) {
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+    throw std::runtime_error("Failed to query thread stack");
+  }
+  void *stackAddr;
+  std::size_t stackSize;
+  pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+  pthread_attr_destroy(&attr);
+  if (headroom >= stackSize) {
+    throw std::runtime_error("Stack headroom exceeds the thread stack");
+  }
+  return reinterpret_cast<uintptr_t>(stackAddr) + headroom;
+}
+
+uintptr_t threadStackLimit() {
+  // pthread_getattr_np parses /proc/self/maps for the main thread
+  static thread_local uintptr_t limit = computeStackLimit();
+  return limit;
+}
+
+} // namespace wasmjit
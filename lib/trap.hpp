@@ -0,0 +1,114 @@
+#pragma once
+#include <csetjmp>
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+enum class TrapCode : u32 {
+  STACK_OVERFLOW = 0,
+  INTERRUPTED = 1,
+  OUT_OF_FUEL = 2,
+  UNREACHABLE = 3,
+  MEMORY_OUT_OF_BOUNDS = 4,
+  INTEGER_OVERFLOW = 5,
+  INTEGER_DIVIDE_BY_ZERO = 6,
+  // a host function called from wasm threw something other than a HostTrap
+  HOST_ERROR = 7,
+};
+
+std::string_view toString(TrapCode code);
+
+// a frame of the wasm call stack at the time of a trap, innermost first
+struct WasmFrame {
+  u32 funcIndex;
+  // offset of the instruction into the module file
+  u32 wasmOffset;
+};
+
+class WasmTrap : public std::runtime_error {
+public:
+  explicit WasmTrap(TrapCode code, std::span<const WasmFrame> frames = {});
+
+  TrapCode code() const { return trapCode; }
+  const std::vector<WasmFrame> &backtrace() const { return frames; }
+
+private:
+  TrapCode trapCode;
+  std::vector<WasmFrame> frames;
+};
+
+static constexpr u32 kMaxTrapFrames = 64;
+
+/*
+ * A trap unwinds straight back to the innermost callGuarded() on the current
+ * thread with a siglongjmp, jit code has no unwind info so there is nothing
+ * else in between that could clean up. Traps either come from the cold stubs
+ * the compiler emits (raiseTrap) or from a fault inside jit code (ud2, a
+ * faulting div or a load/store into the guard region of a linear memory)
+ * that the signal handlers turn into a trap.
+ */
+struct TrapActivation {
+  sigjmp_buf jmpBuf;
+  TrapActivation *prev;
+  TrapCode code;
+  u32 numFrames;
+  WasmFrame frames[kMaxTrapFrames];
+};
+
+// installs the signal handlers (once per process) and the alternate signal
+// stack (once per thread) that faults in jit code are handled on
+void prepareThreadForTraps();
+// also prepares the thread
+void enterActivation(TrapActivation &activation);
+void leaveActivation(TrapActivation &activation);
+// replaces the chain of activations of the calling thread and returns the
+// old one, a fiber takes its activations along when it is switched out
+TrapActivation *exchangeActivations(TrapActivation *activations);
+
+// collects the pcs of the wasm frames of the calling thread, innermost
+// first, starting at pc with the frame pointer fp and the stack pointer sp
+// of the innermost frame. the pcs of the outer frames point into their call
+// instructions. async signal safe, it is meant to be called from a signal
+// handler that interrupted jit code on the same thread
+u32 walkWasmStack(uintptr_t pc, uintptr_t fp, uintptr_t sp,
+                  std::span<uintptr_t> pcs);
+
+// entry point of the cold trap stubs emitted by the compiler, host
+// trampolines raise the traps of their host functions through it as well
+[[noreturn]] void raiseTrap(u32 code);
+
+// headroom that is left below the stack limit so the trap path itself
+// (and the host functions called from wasm) still have stack to run on
+static constexpr std::size_t kStackHeadroom = 128 * 1024;
+
+// lowest address compiled code may push to on the calling thread
+uintptr_t computeStackLimit(std::size_t headroom = kStackHeadroom);
+// computeStackLimit() with the default headroom, cached per thread
+uintptr_t threadStackLimit();
+
+template <class Fn> auto callGuarded(Fn &&fn) -> decltype(fn()) {
+  TrapActivation activation;
+  enterActivation(activation);
+  if (sigsetjmp(activation.jmpBuf, 0) != 0) {
+    leaveActivation(activation);
+    throw WasmTrap(activation.code,
+                   std::span(activation.frames, activation.numFrames));
+  }
+  if constexpr (std::is_void_v<decltype(fn())>) {
+    fn();
+    leaveActivation(activation);
+  } else {
+    auto result = fn();
+    leaveActivation(activation);
+    return result;
+  }
+}
+
+} // namespace wasmjit
@@ -21,9 +21,6 @@ using i64 = int64_t;
 using f32 = float;
 using f64 = double;
 
-#define LOG_DEBUG(fmt, ...)                                                    \
-  std::cout << std::format(fmt, __VA_ARGS__) << std::endl
-
 class NonCopyable {
 public:
   NonCopyable() = default;
@@ -89,19 +86,14 @@ public:
     close(fd);
   }
 
-  void dump() const {
-    for (std::size_t i = 0; i < length; i++) {
-      printf("%02x ", data()[i]);
-    }
-    printf("\n");
-  }
-
   const uint8_t *data() const { return static_cast<const uint8_t *>(addr); }
 
   std::size_t size() const { return length; }
 
   std::span<const u8> asSpan() const { return {data(), length}; }
 
+  int descriptor() const { return fd; }
+
 private:
   int fd;
   void *addr;
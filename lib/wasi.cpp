@@ -0,0 +1,585 @@
+#include <cerrno>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <optional>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdexcept>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fiber.hpp"
+#include "io-uring.hpp"
+#include "wasi.h"
+
+namespace wasmjit {
+namespace preview1 {
+
+Errno fromHostErrno(int error) {
+  switch (error) {
+  case E2BIG:
+    return Errno::TOOBIG;
+  case EACCES:
+    return Errno::ACCES;
+  case EAGAIN:
+    return Errno::AGAIN;
+  case EBADF:
+    return Errno::BADF;
+  case EEXIST:
+    return Errno::EXIST;
+  case EFAULT:
+    return Errno::FAULT;
+  case EFBIG:
+    return Errno::FBIG;
+  case EINTR:
+    return Errno::INTR;
+  case EINVAL:
+    return Errno::INVAL;
+  case EISDIR:
+    return Errno::ISDIR;
+  case ELOOP:
+    return Errno::LOOP;
+  case EMFILE:
+    return Errno::MFILE;
+  case ENAMETOOLONG:
+    return Errno::NAMETOOLONG;
+  case ENOENT:
+    return Errno::NOENT;
+  case ENOMEM:
+    return Errno::NOMEM;
+  case ENOSPC:
+    return Errno::NOSPC;
+  case ENOSYS:
+    return Errno::NOSYS;
+  case ENOTDIR:
+    return Errno::NOTDIR;
+  case ENOTEMPTY:
+    return Errno::NOTEMPTY;
+  case EOPNOTSUPP:
+    return Errno::NOTSUP;
+  case EPERM:
+    return Errno::PERM;
+  case EPIPE:
+    return Errno::PIPE;
+  case EROFS:
+    return Errno::ROFS;
+  case ESPIPE:
+    return Errno::SPIPE;
+  case EXDEV:
+    // openat2 with RESOLVE_BENEATH refuses paths that escape the directory
+    return Errno::NOTCAPABLE;
+  default:
+    return Errno::IO;
+  }
+}
+
+WasiContext::WasiContext() {
+  for (int fd = 0; fd < 3; fd++) {
+    fds.push_back(std::make_shared<Entry>(Descriptor{fd, false, {}}));
+  }
+}
+
+WasiContext::~WasiContext() = default;
+
+WasiContext::Entry::~Entry() {
+  if (owned) {
+    ::close(hostFd);
+  }
+}
+
+WasiContext &WasiContext::process() {
+  static WasiContext context;
+  return context;
+}
+
+void WasiContext::setArgs(std::vector<std::string> _args) {
+  args = std::move(_args);
+}
+
+void WasiContext::setEnv(std::vector<std::string> _env) {
+  env = std::move(_env);
+}
+
+void WasiContext::preopen(const std::string &hostPath, std::string guestPath) {
+  int fd = open(hostPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open directory: " + hostPath);
+  }
+  try {
+    insert({fd, true, std::move(guestPath)});
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+}
+
+void WasiContext::setIoBackend(IoBackend backend) {
+  if (backend == IoBackend::URING && !IoUring::supported()) {
+    throw std::runtime_error("io_uring is not available");
+  }
+  io = backend;
+}
+
+std::shared_ptr<const WasiContext::Descriptor>
+WasiContext::get(u32 fd) const {
+  std::lock_guard lock(mutex);
+  if (fd >= fds.size()) {
+    return nullptr;
+  }
+  return fds[fd];
+}
+
+u32 WasiContext::insert(Descriptor descriptor) {
+  std::lock_guard lock(mutex);
+  u32 fd = 0;
+  while (fd < fds.size() && fds[fd] != nullptr) {
+    fd++;
+  }
+  if (fd == fds.size()) {
+    fds.emplace_back();
+  }
+  // the entry takes over the host fd last, nothing throws after it
+  fds[fd] = std::make_shared<Entry>(std::move(descriptor));
+  return fd;
+}
+
+Errno WasiContext::close(u32 fd) {
+  std::shared_ptr<Entry> entry;
+  {
+    std::lock_guard lock(mutex);
+    if (fd >= fds.size() || fds[fd] == nullptr) {
+      return Errno::BADF;
+    }
+    entry = std::move(fds[fd]);
+  }
+  // calls still using the descriptor keep the host fd open until they are
+  // done. without them it's closed here, so the error can be reported
+  if (entry.use_count() == 1 && entry->owned) {
+    entry->owned = false;
+    if (::close(entry->hostFd) != 0) {
+      return fromHostErrno(errno);
+    }
+  }
+  return Errno::SUCCESS;
+}
+
+WasiContext &contextOf(Caller &caller) {
+  auto *wasi = caller.context().wasi;
+  return wasi != nullptr ? *wasi : WasiContext::process();
+}
+
+static u32 result(Errno error) { return static_cast<u32>(error); }
+
+static u32 hostError() { return result(fromHostErrno(errno)); }
+
+static void proc_exit(Caller &, u32 code) { exit(code); }
+
+// the strings back to back, each null terminated, and a pointer to each
+static u32 getStrings(Caller &caller, const std::vector<std::string> &strings,
+                      u32 pointers, u32 buffer) {
+  auto memory = caller.memory();
+  if (!memory.contains(pointers, u64{strings.size()} * sizeof(u32))) {
+    return result(Errno::FAULT);
+  }
+  for (auto &string : strings) {
+    if (!memory.contains(buffer, u64{string.size()} + 1)) {
+      return result(Errno::FAULT);
+    }
+    memory.store<u32>(pointers, buffer);
+    std::memcpy(memory.data() + buffer, string.c_str(), string.size() + 1);
+    pointers += sizeof(u32);
+    buffer += string.size() + 1;
+  }
+  return result(Errno::SUCCESS);
+}
+
+static u32 getSizes(Caller &caller, const std::vector<std::string> &strings,
+                    u32 countPtr, u32 sizePtr) {
+  auto memory = caller.memory();
+  if (!memory.contains(countPtr, sizeof(u32)) ||
+      !memory.contains(sizePtr, sizeof(u32))) {
+    return result(Errno::FAULT);
+  }
+  u32 size = 0;
+  for (auto &string : strings) {
+    size += string.size() + 1;
+  }
+  memory.store<u32>(countPtr, strings.size());
+  memory.store<u32>(sizePtr, size);
+  return result(Errno::SUCCESS);
+}
+
+static u32 args_get(Caller &caller, u32 argv, u32 argvBuf) {
+  return getStrings(caller, contextOf(caller).getArgs(), argv, argvBuf);
+}
+
+static u32 args_sizes_get(Caller &caller, u32 argc, u32 argvBufSize) {
+  return getSizes(caller, contextOf(caller).getArgs(), argc, argvBufSize);
+}
+
+static u32 environ_get(Caller &caller, u32 env, u32 envBuf) {
+  return getStrings(caller, contextOf(caller).getEnv(), env, envBuf);
+}
+
+static u32 environ_sizes_get(Caller &caller, u32 count, u32 bufSize) {
+  return getSizes(caller, contextOf(caller).getEnv(), count, bufSize);
+}
+
+static u32 clock_time_get(Caller &caller, u32 clockId, u64, u32 timePtr) {
+  static constexpr clockid_t kClocks[] = {CLOCK_REALTIME, CLOCK_MONOTONIC,
+                                          CLOCK_PROCESS_CPUTIME_ID,
+                                          CLOCK_THREAD_CPUTIME_ID};
+  if (clockId >= std::size(kClocks)) {
+    return result(Errno::INVAL);
+  }
+  auto memory = caller.memory();
+  if (!memory.contains(timePtr, sizeof(u64))) {
+    return result(Errno::FAULT);
+  }
+  timespec ts;
+  if (clock_gettime(kClocks[clockId], &ts) != 0) {
+    return hostError();
+  }
+  memory.store<u64>(timePtr, u64(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec);
+  return result(Errno::SUCCESS);
+}
+
+static u32 random_get(Caller &caller, u32 buf, u32 len) {
+  auto memory = caller.memory();
+  if (!memory.contains(buf, len)) {
+    return result(Errno::FAULT);
+  }
+  for (u32 done = 0; done < len;) {
+    ssize_t count = getrandom(memory.data() + buf + done, len - done, 0);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return hostError();
+    }
+    done += count;
+  }
+  return result(Errno::SUCCESS);
+}
+
+// guest iovecs are {u32 buf, u32 len} pairs, they are turned into host
+// iovecs pointing straight into the linear memory, so the kernel moves the
+// data without any intermediate buffer
+static constexpr u32 kMaxIovs = 64;
+
+// the request through the ring of the calling thread, empty if the thread
+// has no ring
+static std::optional<i32> transferOnThreadRing(u8 opcode, int fd, iovec *iovs,
+                                               u32 count, u64 position) {
+  IoUring *ring = IoUring::forThread();
+  if (ring == nullptr) {
+    return std::nullopt;
+  }
+  thread_local u64 lastRequest = 0;
+  u64 request = ++lastRequest;
+  while (!ring->prepare(opcode, fd, iovs, count, position, request)) {
+    if (i32 submitted = ring->submit(); submitted < 0) {
+      return submitted;
+    }
+  }
+  return ring->wait(request, [](u64, i32) {});
+}
+
+// one readv/writev (or the positional variants for offset >= 0) through the
+// backend of the context, -1 and errno on failure like the syscalls. runs
+// inside host functions, so failures of the ring come back as errno as well
+// and a thread that can't get a ring falls back to the syscalls
+static ssize_t transfer(WasiContext &wasi, bool write, int fd, iovec *iovs,
+                        u32 count, i64 offset) {
+  if (wasi.ioBackend() == IoBackend::URING) {
+    u8 opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    // -1 is the current file position, like readv/writev
+    u64 position = offset < 0 ? ~u64{0} : static_cast<u64>(offset);
+    std::optional<i32> res;
+    if (AsyncIo *io = AsyncIo::current();
+        io != nullptr && Fiber::current() != nullptr) {
+      // the instance is parked meanwhile and its event loop or scheduler
+      // runs others
+      res = io->awaitIo(opcode, fd, iovs, count, position);
+    } else {
+      res = transferOnThreadRing(opcode, fd, iovs, count, position);
+    }
+    if (res.has_value()) {
+      if (*res < 0) {
+        errno = -*res;
+        return -1;
+      }
+      return *res;
+    }
+  }
+  if (offset < 0) {
+    return write ? writev(fd, iovs, count) : readv(fd, iovs, count);
+  }
+  return write ? pwritev(fd, iovs, count, offset)
+               : preadv(fd, iovs, count, offset);
+}
+
+static u32 transferIovs(Caller &caller, bool write, u32 fd, u32 iovs,
+                        u32 iovsLen, i64 offset, u32 transferredPtr) {
+  auto &wasi = contextOf(caller);
+  auto descriptor = wasi.get(fd);
+  if (descriptor == nullptr) {
+    return result(Errno::BADF);
+  }
+  auto memory = caller.memory();
+  if (!memory.contains(iovs, u64{iovsLen} * 8) ||
+      !memory.contains(transferredPtr, sizeof(u32))) {
+    return result(Errno::FAULT);
+  }
+  iovec hostIovs[kMaxIovs];
+  u64 total = 0;
+  for (u32 first = 0; first < iovsLen; first += kMaxIovs) {
+    u32 count = std::min(kMaxIovs, iovsLen - first);
+    u64 requested = 0;
+    for (u32 i = 0; i < count; i++) {
+      u32 entry = iovs + (first + i) * 8;
+      u32 buf = memory.load<u32>(entry);
+      u32 len = memory.load<u32>(entry + 4);
+      if (!memory.contains(buf, len)) {
+        return result(Errno::FAULT);
+      }
+      hostIovs[i] = {memory.data() + buf, len};
+      requested += len;
+    }
+    ssize_t done =
+        transfer(wasi, write, descriptor->hostFd, hostIovs, count, offset);
+    if (done < 0) {
+      if (total > 0) {
+        break;
+      }
+      return hostError();
+    }
+    total += done;
+    if (offset >= 0) {
+      offset += done;
+    }
+    // a short transfer ends the call like it would on the host
+    if (static_cast<u64>(done) < requested) {
+      break;
+    }
+  }
+  memory.store<u32>(transferredPtr, static_cast<u32>(total));
+  return result(Errno::SUCCESS);
+}
+
+static u32 fd_write(Caller &caller, u32 fd, u32 iovs, u32 iovsLen,
+                    u32 nwritten) {
+  return transferIovs(caller, true, fd, iovs, iovsLen, -1, nwritten);
+}
+
+static u32 fd_read(Caller &caller, u32 fd, u32 iovs, u32 iovsLen,
+                   u32 nread) {
+  return transferIovs(caller, false, fd, iovs, iovsLen, -1, nread);
+}
+
+static u32 fd_pwrite(Caller &caller, u32 fd, u32 iovs, u32 iovsLen,
+                     u64 offset, u32 nwritten) {
+  if (static_cast<i64>(offset) < 0) {
+    return result(Errno::INVAL);
+  }
+  return transferIovs(caller, true, fd, iovs, iovsLen, offset, nwritten);
+}
+
+static u32 fd_pread(Caller &caller, u32 fd, u32 iovs, u32 iovsLen, u64 offset,
+                    u32 nread) {
+  if (static_cast<i64>(offset) < 0) {
+    return result(Errno::INVAL);
+  }
+  return transferIovs(caller, false, fd, iovs, iovsLen, offset, nread);
+}
+
+static u32 fd_seek(Caller &caller, u32 fd, i64 offset, u32 whence,
+                   u32 newOffsetPtr) {
+  auto descriptor = contextOf(caller).get(fd);
+  if (descriptor == nullptr) {
+    return result(Errno::BADF);
+  }
+  // set, cur and end have the same values as on the host
+  if (whence > SEEK_END) {
+    return result(Errno::INVAL);
+  }
+  auto memory = caller.memory();
+  if (!memory.contains(newOffsetPtr, sizeof(u64))) {
+    return result(Errno::FAULT);
+  }
+  off_t position = lseek(descriptor->hostFd, offset, whence);
+  if (position < 0) {
+    return hostError();
+  }
+  memory.store<u64>(newOffsetPtr, position);
+  return result(Errno::SUCCESS);
+}
+
+static u32 fd_close(Caller &caller, u32 fd) {
+  return result(contextOf(caller).close(fd));
+}
+
+static u8 fileType(mode_t mode) {
+  switch (mode & S_IFMT) {
+  case S_IFBLK:
+    return 1;
+  case S_IFCHR:
+    return 2;
+  case S_IFDIR:
+    return 3;
+  case S_IFREG:
+    return 4;
+  case S_IFSOCK:
+    return 6;
+  case S_IFLNK:
+    return 7;
+  default:
+    return 0;
+  }
+}
+
+static u32 fd_fdstat_get(Caller &caller, u32 fd, u32 statPtr) {
+  auto descriptor = contextOf(caller).get(fd);
+  if (descriptor == nullptr) {
+    return result(Errno::BADF);
+  }
+  auto memory = caller.memory();
+  if (!memory.contains(statPtr, 24)) {
+    return result(Errno::FAULT);
+  }
+  struct stat st;
+  int flags = fcntl(descriptor->hostFd, F_GETFL);
+  if (fstat(descriptor->hostFd, &st) != 0 || flags < 0) {
+    return hostError();
+  }
+  u16 fdFlags = 0;
+  if (flags & O_APPEND) {
+    fdFlags |= 1;
+  }
+  if (flags & O_NONBLOCK) {
+    fdFlags |= 4;
+  }
+  memory.store<u8>(statPtr, fileType(st.st_mode));
+  memory.store<u16>(statPtr + 2, fdFlags);
+  // rights aren't tracked, the host permissions apply
+  memory.store<u64>(statPtr + 8, ~u64{0});
+  memory.store<u64>(statPtr + 16, ~u64{0});
+  return result(Errno::SUCCESS);
+}
+
+static u32 fd_prestat_get(Caller &caller, u32 fd, u32 prestatPtr) {
+  auto descriptor = contextOf(caller).get(fd);
+  if (descriptor == nullptr || descriptor->preopenName.empty()) {
+    return result(Errno::BADF);
+  }
+  auto memory = caller.memory();
+  if (!memory.contains(prestatPtr, 8)) {
+    return result(Errno::FAULT);
+  }
+  // tag 0 is a directory
+  memory.store<u8>(prestatPtr, 0);
+  memory.store<u32>(prestatPtr + 4, descriptor->preopenName.size());
+  return result(Errno::SUCCESS);
+}
+
+static u32 fd_prestat_dir_name(Caller &caller, u32 fd, u32 path,
+                               u32 pathLen) {
+  auto descriptor = contextOf(caller).get(fd);
+  if (descriptor == nullptr || descriptor->preopenName.empty()) {
+    return result(Errno::BADF);
+  }
+  auto &name = descriptor->preopenName;
+  auto memory = caller.memory();
+  if (pathLen < name.size()) {
+    return result(Errno::NAMETOOLONG);
+  }
+  if (!memory.contains(path, name.size())) {
+    return result(Errno::FAULT);
+  }
+  std::memcpy(memory.data() + path, name.data(), name.size());
+  return result(Errno::SUCCESS);
+}
+
+static u32 path_open(Caller &caller, u32 dirFd, u32 dirFlags, u32 path,
+                     u32 pathLen, u32 oflags, u64 rightsBase, u64,
+                     u32 fdFlags, u32 fdPtr) {
+  auto &wasi = contextOf(caller);
+  auto dir = wasi.get(dirFd);
+  if (dir == nullptr) {
+    return result(Errno::BADF);
+  }
+  auto memory = caller.memory();
+  if (!memory.contains(path, pathLen) ||
+      !memory.contains(fdPtr, sizeof(u32))) {
+    return result(Errno::FAULT);
+  }
+  std::string hostPath(reinterpret_cast<const char *>(memory.data() + path),
+                       pathLen);
+
+  constexpr u64 kRightFdRead = 1 << 1;
+  constexpr u64 kRightFdWrite = 1 << 6;
+  bool read = rightsBase & kRightFdRead;
+  bool write = rightsBase & kRightFdWrite;
+  u64 flags = O_CLOEXEC;
+  flags |= read && write ? O_RDWR : write ? O_WRONLY : O_RDONLY;
+  flags |= (oflags & 1) ? O_CREAT : 0;
+  flags |= (oflags & 2) ? O_DIRECTORY : 0;
+  flags |= (oflags & 4) ? O_EXCL : 0;
+  flags |= (oflags & 8) ? O_TRUNC : 0;
+  flags |= (fdFlags & 1) ? O_APPEND : 0;
+  flags |= (fdFlags & 4) ? O_NONBLOCK : 0;
+  flags |= (fdFlags & (2 | 8 | 16)) ? O_SYNC : 0;
+  // lookupflags bit 0 is symlink_follow
+  flags |= (dirFlags & 1) ? 0 : O_NOFOLLOW;
+
+  // the kernel keeps the lookup inside the directory, absolute paths, ".."
+  // and symlinks pointing out of it fail with EXDEV
+  open_how how{};
+  how.flags = flags;
+  how.mode = (flags & O_CREAT) ? 0644 : 0;
+  how.resolve = RESOLVE_BENEATH;
+  int fd = syscall(SYS_openat2, dir->hostFd, hostPath.c_str(), &how,
+                   sizeof(how));
+  if (fd < 0) {
+    return hostError();
+  }
+  u32 guestFd;
+  try {
+    guestFd = wasi.insert({fd, true, {}});
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+  memory.store<u32>(fdPtr, guestFd);
+  return result(Errno::SUCCESS);
+}
+
+void define(HostFunctions &functions) {
+  constexpr std::string_view module = "wasi_snapshot_preview1";
+  functions.define<&proc_exit>(module, "proc_exit")
+      .define<&args_get>(module, "args_get")
+      .define<&args_sizes_get>(module, "args_sizes_get")
+      .define<&environ_get>(module, "environ_get")
+      .define<&environ_sizes_get>(module, "environ_sizes_get")
+      .define<&clock_time_get>(module, "clock_time_get")
+      .define<&random_get>(module, "random_get")
+      .define<&fd_write>(module, "fd_write")
+      .define<&fd_read>(module, "fd_read")
+      .define<&fd_pwrite>(module, "fd_pwrite")
+      .define<&fd_pread>(module, "fd_pread")
+      .define<&fd_seek>(module, "fd_seek")
+      .define<&fd_close>(module, "fd_close")
+      .define<&fd_fdstat_get>(module, "fd_fdstat_get")
+      .define<&fd_prestat_get>(module, "fd_prestat_get")
+      .define<&fd_prestat_dir_name>(module, "fd_prestat_dir_name")
+      .define<&path_open>(module, "path_open");
+}
+
+}
+}
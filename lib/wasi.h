@@ -1,17 +1,116 @@
 #pragma once
 #include <cstdint>
-#include <cstdlib>
-#include <string_view>
-#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "lib/host-functions.hpp"
 
 namespace wasmjit {
 namespace preview1 {
 
-inline void proc_exit(int code) { exit(code); }
+// preview1 errno values
+enum class Errno : u32 {
+  SUCCESS = 0,
+  TOOBIG = 1,
+  ACCES = 2,
+  AGAIN = 6,
+  BADF = 8,
+  EXIST = 20,
+  FAULT = 21,
+  FBIG = 22,
+  INTR = 27,
+  INVAL = 28,
+  IO = 29,
+  ISDIR = 31,
+  LOOP = 32,
+  MFILE = 33,
+  NAMETOOLONG = 37,
+  NOENT = 44,
+  NOMEM = 48,
+  NOSPC = 51,
+  NOSYS = 52,
+  NOTDIR = 54,
+  NOTEMPTY = 55,
+  NOTSUP = 58,
+  PERM = 63,
+  PIPE = 64,
+  ROFS = 66,
+  SPIPE = 67,
+  XDEV = 72,
+  NOTCAPABLE = 73,
+};
+
+Errno fromHostErrno(int error);
+
+enum class IoBackend {
+  // plain readv/writev/preadv/pwritev
+  SYNC,
+  // the same requests through the io_uring of the calling thread
+  URING,
+};
+
+/*
+ * The wasi view of the world of one instance: its arguments, environment and
+ * file descriptors. Guest fds index into a table of host fds, 0-2 are the
+ * host's stdio and preopened directories follow, files can only be opened
+ * beneath a preopened directory.
+ */
+class WasiContext : NonCopyable {
+public:
+  WasiContext();
+  ~WasiContext();
+
+  // stdio only, used by instances that weren't given a context
+  static WasiContext &process();
 
-inline static std::unordered_map<std::string_view, uintptr_t> linkTable = {
-  {"proc_exit", reinterpret_cast<uintptr_t>(&proc_exit)}
+  void setArgs(std::vector<std::string> args);
+  void setEnv(std::vector<std::string> env);
+  // makes hostPath available to the guest under guestPath
+  void preopen(const std::string &hostPath, std::string guestPath);
+  // throws if the backend isn't available on this host
+  void setIoBackend(IoBackend backend);
+  IoBackend ioBackend() const { return io; }
+
+  struct Descriptor {
+    int hostFd;
+    // closed with the context, stdio stays open
+    bool owned;
+    // name of a preopened directory, empty otherwise
+    std::string preopenName;
+  };
+
+  // the fd table is shared by every instance using the context (all that
+  // weren't given one use the process context) and may be changed by any of
+  // them at the same time. get hands out a reference that keeps the host fd
+  // open, a concurrent close only takes it out of the table and the fd is
+  // closed when the last reference is gone. null if fd isn't open
+  std::shared_ptr<const Descriptor> get(u32 fd) const;
+  // if it throws, an owned host fd is still the caller's to close
+  u32 insert(Descriptor descriptor);
+  Errno close(u32 fd);
+
+  const std::vector<std::string> &getArgs() const { return args; }
+  const std::vector<std::string> &getEnv() const { return env; }
+
+private:
+  std::vector<std::string> args;
+  std::vector<std::string> env;
+  // closes an owned host fd when it is destroyed
+  struct Entry : Descriptor {
+    ~Entry();
+  };
+
+  mutable std::mutex mutex;
+  std::vector<std::shared_ptr<Entry>> fds;
+  IoBackend io = IoBackend::SYNC;
 };
 
+WasiContext &contextOf(Caller &caller);
+
+// registers the implemented preview1 functions under wasi_snapshot_preview1
+void define(HostFunctions &functions);
+
 }
 }
@@ -0,0 +1,71 @@
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+#include "instance-pool.hpp"
+
+namespace wasmjit {
+
+InstancePool::InstancePool(PoolConfig config) : config(config) {
+  slots.reserve(config.slots);
+  freeSlots.reserve(config.slots);
+  for (u32 i = 0; i < config.slots; i++) {
+    auto slot = std::make_unique<InstanceSlot>(config.maxGlobalBytes);
+    slot->memory.init(0);
+    freeSlots.push_back(slot.get());
+    slots.push_back(std::move(slot));
+  }
+}
+
+InstancePool::~InstancePool() {
+  assert(freeSlots.size() == slots.size() && "instances outlive their pool");
+}
+
+std::unique_ptr<Instance>
+InstancePool::instantiate(std::shared_ptr<const Module> module) {
+  return instantiate(std::move(module), nullptr);
+}
+
+std::unique_ptr<Instance>
+InstancePool::instantiate(std::shared_ptr<const InstanceSnapshot> snapshot) {
+  return instantiate(snapshot->module, snapshot.get());
+}
+
+std::unique_ptr<Instance>
+InstancePool::instantiate(std::shared_ptr<const Module> module,
+                          const InstanceSnapshot *snapshot) {
+  std::size_t globalBytes = module->compiler->globalAreaSize();
+  if (globalBytes > config.maxGlobalBytes) {
+    throw std::runtime_error("Module needs " + std::to_string(globalBytes) +
+                             " bytes of globals, the pool provides " +
+                             std::to_string(config.maxGlobalBytes));
+  }
+  InstanceSlot *slot;
+  {
+    std::lock_guard lock(mutex);
+    if (freeSlots.empty()) {
+      throw std::runtime_error("Instance pool is exhausted");
+    }
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+  }
+  try {
+    return std::unique_ptr<Instance>(
+        new Instance(std::move(module), slot, this, snapshot));
+  } catch (...) {
+    release(slot);
+    throw;
+  }
+}
+
+u32 InstancePool::available() const {
+  std::lock_guard lock(mutex);
+  return freeSlots.size();
+}
+
+void InstancePool::release(InstanceSlot *slot) {
+  std::lock_guard lock(mutex);
+  freeSlots.push_back(slot);
+}
+
+} // namespace wasmjit
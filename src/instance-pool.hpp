@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "runtime.hpp"
+#include "snapshot.hpp"
+
+namespace wasmjit {
+
+struct PoolConfig {
+  // number of instances that can be alive at the same time
+  u32 slots = 16;
+  // upper bound on the global area of the modules instantiated in the pool
+  std::size_t maxGlobalBytes = 4096;
+};
+
+/*
+ * Preallocated instance slots for embedders that create and drop instances
+ * at a high rate. Every slot keeps its memory reservation and global area for
+ * the lifetime of the pool, recycling one only drops the pages the previous
+ * instance could have dirtied and copies the initial globals again, so an
+ * instantiation costs no mmap/munmap and no allocation besides the Instance.
+ * The pool has to outlive the instances created from it.
+ */
+class InstancePool : NonCopyable, NonMoveable {
+public:
+  explicit InstancePool(PoolConfig config = {});
+  ~InstancePool();
+
+  // throws if all slots are in use or the module doesn't fit the slots
+  std::unique_ptr<Instance> instantiate(std::shared_ptr<const Module> module);
+  // recycling a slot that last held an instance of the same snapshot only
+  // drops the pages that instance wrote to
+  std::unique_ptr<Instance>
+  instantiate(std::shared_ptr<const InstanceSnapshot> snapshot);
+
+  u32 available() const;
+  u32 capacity() const { return config.slots; }
+
+private:
+  friend class Instance;
+
+  std::unique_ptr<Instance> instantiate(std::shared_ptr<const Module> module,
+                                        const InstanceSnapshot *snapshot);
+  void release(InstanceSlot *slot);
+
+  PoolConfig config;
+  std::vector<std::unique_ptr<InstanceSlot>> slots;
+  mutable std::mutex mutex;
+  // recently released slots are reused first, their pages are more likely
+  // to still be cached
+  std::vector<InstanceSlot *> freeSlots;
+};
+
+} // namespace wasmjit
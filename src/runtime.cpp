@@ -1,10 +1,21 @@
 #include "lib/compiler.hpp"
+#include "lib/context.hpp"
 #include "lib/parser.hpp"
+#include "lib/sampler.hpp"
+#include "lib/trace.hpp"
+#include "lib/trap.hpp"
 #include "lib/tz-utils.hpp"
 #include "lib/wasm-types.hpp"
 #include "lib/wasi.h"
+#include "instance-pool.hpp"
 #include "runtime.hpp"
+#include "snapshot.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <format>
+#include <fstream>
 #include <new>
 #include <stdexcept>
 #include <string_view>
@@ -27,40 +38,22 @@ static void parselocals(BinaryReader &reader,
   }
 }
 
-int runWasm(std::string_view fileName) {
-  auto wasmFile = MappedFile(fileName);
-  wasmFile.dump();
-  WasmModule wasmModule;
-  wasmModule.parseSections(wasmFile.asSpan());
-  wasmModule.dump();
-  auto code = wasmModule.codeSection.code;
+static void compileFunctions(WasmModule &wasmModule, WasmCompiler &compiler,
+                             std::span<const u8> code, u32 codeSectionOffset) {
   BinaryReader reader(code.data(), code.size());
-  LinearMemory memory;
-  memory.init(wasmModule.memorySection.limit->minSize);
-
-  u32 numFuncs = reader.readIntLeb<u32>();
-  LOG_DEBUG("numFuncs: {}", numFuncs);
-
-  WasmCompiler compiler(numFuncs);
+  u32 numBodies = reader.readIntLeb<u32>();
+  u32 numImported = wasmModule.functionSection.numImportedFns;
+  TRACE_INFO("decode", "numFuncs: {}", numBodies);
 
   std::vector<WasmValueType> localTypes;
-
-  std::vector<value_t> values;
-  for (auto &global : wasmModule.globalSection.initExprs) {
-    values.push_back(global.value);
-  }
-  compiler.AddGlobals(wasmModule.globalSection.globals, values);
-
-
-  for (u32 i = wasmModule.functionSection.numImportedFns; i < numFuncs; i++) {
+  for (u32 i = numImported; i < numImported + numBodies; i++) {
     localTypes.clear();
 
-    u32 typeIdx = wasmModule.functionSection.functions[i];
     auto &signature = wasmModule.getPrototype(i);
     compiler.StartFunction(i, signature.returnType, signature.paramTypes);
 
     u32 fnSize = reader.readIntLeb<u32>();
-    LOG_DEBUG("fnSize: {}", fnSize);
+    TRACE_DEBUG("decode", "fnSize: {}", fnSize);
     parselocals(reader, localTypes);
 
     compiler.AddLocals(localTypes);
@@ -68,8 +61,9 @@ int runWasm(std::string_view fileName) {
     // handle all operations
     i32 depth = 0;
     while (true) {
+      compiler.setSourceOffset(codeSectionOffset + reader.position());
       WasmOpcode op = static_cast<WasmOpcode>(reader.read<u8>());
-      LOG_DEBUG("op: {}", g_wasmOpcodeStringTable.Get(op));
+      TRACE_VERBOSE("decode", "op: {}", g_wasmOpcodeStringTable.Get(op));
       switch (op) {
       case WasmOpcode::END: {
         if (depth == 0) {
@@ -83,11 +77,19 @@ int runWasm(std::string_view fileName) {
       case WasmOpcode::BLOCK: {
         u8 res = reader.read<u8>();
         auto type = static_cast<WasmValueType>(res);
-        LOG_DEBUG("block type: {}", toString(type));
+        TRACE_VERBOSE("decode", "block type: {}", toString(type));
         compiler.StartBlock(0, 0);
         depth++;
         break;
       }
+      case WasmOpcode::LOOP: {
+        u8 res = reader.read<u8>();
+        auto type = static_cast<WasmValueType>(res);
+        TRACE_VERBOSE("decode", "loop type: {}", toString(type));
+        compiler.StartLoop(0, 0);
+        depth++;
+        break;
+      }
       case WasmOpcode::LOCAL_GET: {
         u32 localIdx = reader.readIntLeb<u32>();
         compiler.LocalGet(localIdx);
@@ -99,23 +101,30 @@ int runWasm(std::string_view fileName) {
         compiler.GlobalGet(globalIdx);
         break;
       }
+      case WasmOpcode::GLOBAL_SET: {
+        u32 globalIdx = reader.readIntLeb<u32>();
+        compiler.GlobalSet(globalIdx);
+        break;
+      }
       case WasmOpcode::BR_IF: {
         u32 offset = reader.readIntLeb<u32>();
         compiler.BrIf(offset);
         break;
       }
-      case WasmOpcode::I32_LOAD: {
+      case WasmOpcode::I32_LOAD ... WasmOpcode::I64_LOAD:
+      case WasmOpcode::I32_LOAD_8S ... WasmOpcode::I64_LOAD_32U: {
         u32 align = reader.readIntLeb<u32>();
-        i32 offset = reader.readIntLeb<i32>();
+        u32 offset = reader.readIntLeb<u32>();
         std::ignore = align;
-        compiler.I32Load(reinterpret_cast<u64>(memory.mem + offset));
+        compiler.Load(op, offset);
         break;
       }
-      case WasmOpcode::I32_STORE: {
+      case WasmOpcode::I32_STORE ... WasmOpcode::I64_STORE:
+      case WasmOpcode::I32_STORE_8 ... WasmOpcode::I64_STORE_32: {
         u32 align = reader.readIntLeb<u32>();
-        i32 offset = reader.readIntLeb<i32>();
+        u32 offset = reader.readIntLeb<u32>();
         std::ignore = align;
-        compiler.I32Store(reinterpret_cast<u64>(memory.mem + offset));
+        compiler.Store(op, offset);
         break;
       }
       case WasmOpcode::LOCAL_SET: {
@@ -138,12 +147,30 @@ int runWasm(std::string_view fileName) {
         }
         break;
       }
-      case WasmOpcode::I32_ADD: {
-        compiler.Add();
+      case WasmOpcode::I64_CONST: {
+        i64 value = reader.readIntLeb<i64>();
+        compiler.I64Const(value);
+        break;
+      }
+      case WasmOpcode::I32_ADD ... WasmOpcode::I32_ROTR:
+      case WasmOpcode::I64_ADD ... WasmOpcode::I64_ROTR: {
+        compiler.IntBinOp(op);
+        break;
+      }
+      case WasmOpcode::I32_EQ ... WasmOpcode::I32_GE_U:
+      case WasmOpcode::I64_EQ ... WasmOpcode::I64_GE_U: {
+        compiler.IntCompare(op);
         break;
       }
-      case WasmOpcode::I32_GT_S: {
-        compiler.Gts();
+      case WasmOpcode::I32_EQZ:
+      case WasmOpcode::I64_EQZ:
+      case WasmOpcode::I32_CLZ ... WasmOpcode::I32_POPCNT:
+      case WasmOpcode::I64_CLZ ... WasmOpcode::I64_POPCNT:
+      case WasmOpcode::I32_WRAP_I64:
+      case WasmOpcode::I64_EXTEND_I32_S:
+      case WasmOpcode::I64_EXTEND_I32_U:
+      case WasmOpcode::I32_EXTEND_8S ... WasmOpcode::I64_EXTEND_32S: {
+        compiler.IntUnOp(op);
         break;
       }
       case WasmOpcode::RETURN: {
@@ -152,7 +179,8 @@ int runWasm(std::string_view fileName) {
       }
       case WasmOpcode::IF: {
         // If else statements are a shorthand for block/block/br_if
-        auto type = static_cast<WasmValueType>(reader.read<u8>());
+        [[maybe_unused]] auto type =
+            static_cast<WasmValueType>(reader.read<u8>());
         depth += 2;
       }
       case WasmOpcode::ELSE: {
@@ -171,6 +199,7 @@ int runWasm(std::string_view fileName) {
         break;
       }
       case WasmOpcode::UNREACHABLE: {
+        compiler.Unreachable();
         break;
       }
       default:
@@ -179,13 +208,349 @@ int runWasm(std::string_view fileName) {
     }
   end:
     compiler.EndFunction();
+    compiler.compileStats().functions.back().wasmBytes = fnSize;
+  }
+}
+
+const HostFunctions &defaultHostFunctions() {
+  static const HostFunctions functions = [] {
+    HostFunctions functions;
+    preview1::define(functions);
+    return functions;
+  }();
+  return functions;
+}
+
+Module::Module(std::string_view fileName, CompilerOptions options,
+               const HostFunctions &imports)
+    : file(fileName) {
+  init(file->asSpan(), options, imports, std::string(fileName));
+}
+
+Module::Module(std::span<const u8> binary, CompilerOptions options,
+               const HostFunctions &imports)
+    : ownedBinary(binary.begin(), binary.end()) {
+  init(ownedBinary, options, imports, {});
+}
+
+Module::~Module() = default;
+
+// names from the name section, exported functions without one go by their
+// export name
+static JitSymbols moduleSymbols(const WasmModule &wasm, u32 numFuncs,
+                                std::string sourceName) {
+  JitSymbols symbols;
+  symbols.sourceName = !sourceName.empty()
+                           ? std::move(sourceName)
+                           : std::string(wasm.nameSection.moduleName);
+  if (symbols.sourceName.empty()) {
+    symbols.sourceName = "wasm";
+  }
+  symbols.functionNames.resize(numFuncs);
+  for (auto &entity : wasm.exportSection.exports) {
+    if (entity.type == ExportType::FUNCTION && entity.entityIndex < numFuncs) {
+      symbols.functionNames[entity.entityIndex] = entity.name;
+    }
+  }
+  for (auto &entry : wasm.nameSection.functionNames) {
+    if (entry.index < numFuncs) {
+      symbols.functionNames[entry.index] = entry.name;
+    }
+  }
+  return symbols;
+}
+
+void Module::init(std::span<const u8> binary, CompilerOptions options,
+                  const HostFunctions &imports, std::string sourceName) {
+  auto start = std::chrono::steady_clock::now();
+  wasmModule = std::make_unique<WasmModule>();
+  wasmModule->parseSections(binary);
+  auto parsed = std::chrono::steady_clock::now();
+  TRACE_INFO("module", "{}: {} bytes", sourceName, binary.size());
+  if (traceEnabled(TraceLevel::DEBUG)) {
+    wasmModule->dump();
+  }
+  linkImports(imports);
+
+  if (auto &limit = wasmModule->memorySection.limit) {
+    initialPages = limit->minSize;
+  }
+  startIndex = wasmModule->exportSection.startFunctionIndex;
+
+  auto code = wasmModule->codeSection.code;
+  BinaryReader reader(code.data(), code.size());
+  u32 numFuncs = wasmModule->functionSection.numImportedFns +
+                 reader.readIntLeb<u32>();
+  options.contextArgument = true;
+  compiler = std::make_unique<WasmCompiler>(numFuncs, options);
+  compiler->AddGlobals(wasmModule->globalSection.globals,
+                       wasmModule->globalSection.initExprs);
+  resolveDataSegments(binary);
+  indexExports();
+  compileFunctions(*wasmModule, *compiler, code, code.data() - binary.data());
+  auto symbols = moduleSymbols(*wasmModule, numFuncs, sourceName);
+  auto &stats = compiler->compileStats();
+  stats.sourceName = symbols.sourceName;
+  compiler->setSymbols(std::move(symbols));
+  compiler->finalize();
+  stats.wasmBytes = binary.size();
+  stats.codeSectionBytes = code.size();
+  stats.parseTime = parsed - start;
+  stats.totalTime = std::chrono::steady_clock::now() - start;
+  if (traceEnabled(TraceLevel::VERBOSE)) {
+    compiler->dumpAsm();
+  }
+}
+
+void Module::linkImports(const HostFunctions &imports) {
+  auto &importSection = wasmModule->importSection;
+  auto &functionSection = wasmModule->functionSection;
+  for (u32 i = 0; i < importSection.numImportedFuncs; i++) {
+    auto name = importSection.getFnName(i);
+    functionSection.importedFnPtrs[i] = imports.resolve(
+        name.l1Name, name.l2Name, wasmModule->getPrototype(i));
+  }
+}
+
+void Module::resolveDataSegments(std::span<const u8> binary) {
+  for (auto &segment : wasmModule->dataSection.segments) {
+    if (segment.isPassive) {
+      continue;
+    }
+    u32 offset;
+    if (segment.offset.isInitByGlobal) {
+      auto value =
+          compiler->constantGlobal(std::get<u32>(segment.offset.value));
+      if (!value.has_value()) {
+        throw std::runtime_error(
+            "Data segment offsets can only be read from constant globals");
+      }
+      offset = static_cast<u32>(*value);
+    } else {
+      offset = static_cast<u32>(std::get<i32>(segment.offset.value));
+    }
+    // the memory has a fixed size, so this can be checked once for all
+    // instances
+    if (u64{offset} + segment.bytes.size() >
+        u64{initialPages} * LinearMemory::pageSize) {
+      throw std::runtime_error("Data segment is out of bounds");
+    }
+    std::optional<u64> fileOffset;
+    if (file.has_value()) {
+      fileOffset = segment.bytes.data() - binary.data();
+    }
+    dataInits.push_back({offset, segment.bytes, fileOffset});
+  }
+}
+
+static constexpr u64 kHostPageSize = 4096;
+// below that a copy is cheaper than another mapping
+static constexpr u64 kMapThreshold = 64 * 1024;
+
+void Module::initMemory(LinearMemory &memory) const {
+  for (auto &data : dataInits) {
+    u64 offset = data.offset;
+    auto bytes = data.bytes;
+    // the pages in the middle of a large segment can be mapped from the
+    // file if they line up with pages of the memory, only the partial
+    // pages at both ends get copied
+    if (data.fileOffset.has_value() && bytes.size() >= kMapThreshold &&
+        offset % kHostPageSize == *data.fileOffset % kHostPageSize) {
+      u64 head = (kHostPageSize - offset % kHostPageSize) % kHostPageSize;
+      u64 body = (bytes.size() - head) & ~(kHostPageSize - 1);
+      u64 tail = bytes.size() - head - body;
+      std::memcpy(memory.mem + offset, bytes.data(), head);
+      memory.mapFile(offset + head, body, file->descriptor(),
+                     *data.fileOffset + head);
+      std::memcpy(memory.mem + offset + head + body,
+                  bytes.data() + head + body, tail);
+    } else {
+      std::memcpy(memory.mem + offset, bytes.data(), bytes.size());
+    }
+  }
+}
+
+void Module::indexExports() {
+  for (auto &entity : wasmModule->exportSection.exports) {
+    if (entity.type == ExportType::FUNCTION) {
+      exportedFunctions.emplace(entity.name, entity.entityIndex);
+    }
+  }
+  // stubs for every signature up front, the module is immutable afterwards
+  for (auto &type : wasmModule->typeSection.types) {
+    typeStubs.push_back(stubs.get(type));
+    typeBatchStubs.push_back(stubs.getBatch(type));
+  }
+}
+
+std::optional<u32> Module::findFunction(std::string_view name) const {
+  auto it = exportedFunctions.find(name);
+  if (it == exportedFunctions.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+void Module::requireDefined(u32 index) const {
+  auto &functions = wasmModule->functionSection;
+  if (index >= functions.functions.size()) {
+    throw std::runtime_error("No function " + std::to_string(index));
+  }
+  if (index < functions.numImportedFns) {
+    throw std::runtime_error("Function " + std::to_string(index) +
+                             " is imported and can't be called directly");
+  }
+}
+
+Instance::Instance(std::shared_ptr<const Module> _module)
+    : module(std::move(_module)),
+      ownedSlot(std::make_unique<InstanceSlot>(
+          module->compiler->globalAreaSize())),
+      slot(ownedSlot.get()) {
+  slot->memory.reserve();
+  initialize(nullptr);
+}
+
+Instance::Instance(std::shared_ptr<const InstanceSnapshot> snapshot)
+    : module(snapshot->module),
+      ownedSlot(std::make_unique<InstanceSlot>(
+          module->compiler->globalAreaSize())),
+      slot(ownedSlot.get()) {
+  slot->memory.reserve();
+  initialize(snapshot.get());
+}
+
+Instance::Instance(std::shared_ptr<const Module> _module, InstanceSlot *slot,
+                   InstancePool *pool, const InstanceSnapshot *snapshot)
+    : module(std::move(_module)), slot(slot), pool(pool) {
+  initialize(snapshot);
+}
+
+Instance::~Instance() {
+  if (pool != nullptr) {
+    pool->release(slot);
+  }
+}
+
+void Instance::initialize(const InstanceSnapshot *snapshot) {
+  if (snapshot != nullptr) {
+    slot->memory.mapSnapshot(snapshot->fd, snapshot->id, snapshot->pages);
+    std::memcpy(slot->globals.data(), snapshot->globals.data(),
+                snapshot->globals.size());
+  } else {
+    slot->memory.reset(module->initialPages);
+    module->initMemory(slot->memory);
+    module->compiler->initGlobalArea(slot->globals.data());
+  }
+  slot->context = InstanceContext{};
+  slot->context.memoryBase = slot->memory.mem;
+  slot->context.memorySize =
+      u64{slot->memory.committedPages} * LinearMemory::pageSize;
+  slot->context.globals = slot->globals.data();
+  slot->counters.assign(module->compiler->functionCounterCount(), {});
+  slot->context.functionCounters = slot->counters.data();
+}
+
+void Instance::resetFunctionCounters() {
+  std::fill(slot->counters.begin(), slot->counters.end(), FunctionCounters{});
+}
+
+u32 Instance::requireExport(std::string_view name) const {
+  auto index = module->findFunction(name);
+  if (!index.has_value()) {
+    throw std::runtime_error("No exported function " + std::string(name));
+  }
+  return *index;
+}
+
+std::optional<Val> Instance::invoke(u32 index, std::span<const Val> args) {
+  module->requireDefined(index);
+  auto &prototype = module->prototype(index);
+  if (!std::equal(args.begin(), args.end(), prototype.paramTypes.begin(),
+                  prototype.paramTypes.end(),
+                  [](const Val &arg, WasmValueType type) {
+                    return arg.type == type;
+                  })) {
+    throw std::runtime_error("Arguments don't match the function signature");
+  }
+  u64 bits = enter(module->entryStub(index), args.data(),
+                   module->getFunction<uintptr_t>(index));
+  if (prototype.returnType == WasmValueType::NONE) {
+    return std::nullopt;
+  }
+  return Val{prototype.returnType, bits};
+}
+
+std::optional<Val> Instance::invoke(std::string_view name,
+                                    std::span<const Val> args) {
+  return invoke(requireExport(name), args);
+}
+
+void Instance::callBatch(u32 index, u64 count, std::span<const u64> args,
+                         std::span<u64> results) {
+  module->requireDefined(index);
+  auto &prototype = module->prototype(index);
+  u64 numParams = prototype.paramTypes.size();
+  u64 numResults = prototype.returnType != WasmValueType::NONE ? 1 : 0;
+  // compare by division first, count * numParams may wrap around
+  if ((numParams != 0 && count > args.size() / numParams) ||
+      (numResults != 0 && count > results.size() / numResults) ||
+      args.size() != count * numParams ||
+      results.size() != count * numResults) {
+    throw std::runtime_error("Batch arguments don't match the function");
+  }
+  enter(module->batchStub(index), args.data(), results.data(), count,
+        module->getFunction<uintptr_t>(index));
+}
+
+void Instance::runStart() {
+  if (!module->startIndex.has_value()) {
+    throw std::runtime_error("Module has no start function");
+  }
+  call<void>(module->startIndex.value());
+}
+
+int runWasm(std::string_view fileName) {
+  // WASMJIT_TRACE=info|debug|verbose prints the traces of that level to
+  // stderr, as far as they were compiled in with WASMJIT_TRACE_LEVEL
+  if (const char *level = std::getenv("WASMJIT_TRACE")) {
+    auto traceLevel = parseTraceLevel(level);
+    if (!traceLevel.has_value()) {
+      throw std::runtime_error("Unknown trace level " + std::string(level));
+    }
+    setTraceLevel(*traceLevel);
+  }
+  CompilerOptions options{.stackChecks = true};
+  // WASMJIT_PERF=map or WASMJIT_PERF=jitdump makes the guest code visible
+  // to perf
+  if (const char *perf = std::getenv("WASMJIT_PERF")) {
+    options.perfMap = true;
+    options.jitDump = std::string_view(perf) == "jitdump";
+  }
+  // and WASMJIT_GDB to gdb
+  options.gdbJit = std::getenv("WASMJIT_GDB") != nullptr;
+  auto module = std::make_shared<const Module>(fileName, options);
+  // WASMJIT_COMPILE_STATS=<file> writes the compile stats as JSON to file
+  if (const char *statsFile = std::getenv("WASMJIT_COMPILE_STATS")) {
+    std::ofstream out(statsFile);
+    if (!out) {
+      throw std::runtime_error("Failed to open " + std::string(statsFile));
+    }
+    out << module->compileStats().toJson() << "\n";
+  }
+  Instance instance(module);
+  // WASMJIT_PROFILE=<file> samples the guest code while it runs and writes
+  // the stacks in the folded format to file
+  const char *profile = std::getenv("WASMJIT_PROFILE");
+  Sampler sampler;
+  if (profile != nullptr) {
+    sampler.start();
+  }
+  instance.runStart();
+  if (profile != nullptr) {
+    sampler.stop();
+    sampler.writeFolded(profile);
   }
-  compiler.finalize();
-  compiler.dumpAsm();
-  compiler.dumpTrace();
-  using voidvoidFn = void (*)();
-  auto fn = compiler.getEntry<voidvoidFn>(wasmModule.exportSection.startFunctionIndex.value());
-  fn();
   return 0;
 }
 
@@ -1,5 +1,17 @@
+#pragma once
 #include <limits>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "lib/compiler.hpp"
+#include "lib/context.hpp"
+#include "lib/entry-stubs.hpp"
+#include "lib/fiber.hpp"
+#include "lib/host-functions.hpp"
+#include "lib/trap.hpp"
 #include "lib/tz-utils.hpp"
 #include <limits.h>
 
@@ -8,22 +20,318 @@ namespace wasmjit {
 
 struct LinearMemory {
 
-  void init(u32 num_pages) {
-    void* result = mmap(nullptr, num_pages * pageSize, PROT_READ | PROT_WRITE,
-                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  // reserves everything an i32 address plus a u32 offset can reach, all of
+  // it beyond the accessible pages faults and is turned into an out of
+  // bounds trap, so compiled code needs no explicit bounds checks
+  void reserve() {
+    void* result = mmap(nullptr, reservationSize, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
     if (result == MAP_FAILED) {
       throw std::runtime_error("Failed to allocate memory");
     }
     mem = static_cast<u8*>(result);
   }
 
+  void init(u32 num_pages) {
+    reserve();
+    reset(num_pages);
+  }
+
+  // drops the contents of every page that was accessible so far (they read
+  // as zero again on the next touch) and makes the first num_pages
+  // accessible. the reservation stays, so this is a single madvise plus at
+  // most one mprotect when the size changes.
+  // the madvise is O(committed) only in a walk of the page tables, which is
+  // cheap where nothing was ever touched. the real work is freeing every host
+  // page that was touched since the last reset, a few hundred ns each
+  // (bench-instantiate has the numbers). tracking dirty pages ourselves
+  // wouldn't avoid that part
+  void reset(u32 num_pages) {
+    if (fileBacked) {
+      // madvise would bring back the contents of the file
+      void *result = mmap(mem, u64{committedPages} * pageSize,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                              MAP_FIXED,
+                          -1, 0);
+      if (result == MAP_FAILED) {
+        throw std::runtime_error("Failed to reset memory");
+      }
+      fileBacked = false;
+      snapshotId = 0;
+    } else if (committedPages > 0 &&
+               madvise(mem, u64{committedPages} * pageSize, MADV_DONTNEED) !=
+                   0) {
+      throw std::runtime_error("Failed to reset memory");
+    }
+    if (num_pages > committedPages) {
+      if (mprotect(mem + u64{committedPages} * pageSize,
+                   u64{num_pages - committedPages} * pageSize,
+                   PROT_READ | PROT_WRITE) != 0) {
+        throw std::runtime_error("Failed to commit memory");
+      }
+    } else if (num_pages < committedPages) {
+      if (mprotect(mem + u64{num_pages} * pageSize,
+                   u64{committedPages - num_pages} * pageSize,
+                   PROT_NONE) != 0) {
+        throw std::runtime_error("Failed to decommit memory");
+      }
+    }
+    committedPages = num_pages;
+  }
+
+  // maps [fileOffset, fileOffset + size) of fd copy on write to offset, both
+  // offsets and the size have to be host page aligned and the range has to
+  // be committed
+  void mapFile(u64 offset, u64 size, int fd, u64 fileOffset) {
+    void *result = mmap(mem + offset, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, fd, fileOffset);
+    if (result == MAP_FAILED) {
+      throw std::runtime_error("Failed to map file into memory");
+    }
+    fileBacked = true;
+  }
+
+  // makes the first num_pages a private copy on write mapping of the
+  // snapshot in fd, pages nobody writes to stay shared between all
+  // instances. mapping the same snapshot again only drops the pages that
+  // were written since, at the same cost as reset()
+  void mapSnapshot(int fd, u64 id, u32 num_pages) {
+    if (snapshotId == id && committedPages == num_pages) {
+      if (madvise(mem, u64{num_pages} * pageSize, MADV_DONTNEED) != 0) {
+        throw std::runtime_error("Failed to reset memory");
+      }
+      return;
+    }
+    reset(num_pages);
+    if (num_pages > 0) {
+      mapFile(0, u64{num_pages} * pageSize, fd, 0);
+      snapshotId = id;
+    }
+  }
+
   static constexpr u32 pageSize = 1024 * 64;
+  static constexpr u64 reservationSize = u64{8} << 30;
   u8 *mem = nullptr;
+  u32 committedPages = 0;
+  // some of the committed pages are mapped from a file
+  bool fileBacked = false;
+  // the snapshot all committed pages are mapped from, if any
+  u64 snapshotId = 0;
 
   ~LinearMemory() {
-    munmap(mem, pageSize);
+    if (mem != nullptr) {
+      munmap(mem, reservationSize);
+    }
+  }
+};
+
+// everything that makes up the state of one instance, either owned by the
+// instance or borrowed from an InstancePool
+struct InstanceSlot : NonCopyable, NonMoveable {
+  explicit InstanceSlot(std::size_t globalBytes) : globals(globalBytes) {}
+
+  LinearMemory memory;
+  GlobalArea globals;
+  InstanceContext context;
+  std::vector<FunctionCounters> counters;
+};
+
+class InstancePool;
+class InstanceSnapshot;
+
+// wasi preview1 as far as it is implemented
+const HostFunctions &defaultHostFunctions();
+
+/*
+ * A parsed and compiled module. The code takes the instance context as a
+ * hidden first argument and embeds nothing of a particular instance, so a
+ * module is immutable once constructed and can be shared (via shared_ptr)
+ * between any number of instances on any number of threads.
+ */
+class Module : NonCopyable, NonMoveable {
+public:
+  // imports are resolved against `imports` while compiling, the module
+  // doesn't keep a reference to it
+  explicit Module(std::string_view fileName, CompilerOptions options = {},
+                  const HostFunctions &imports = defaultHostFunctions());
+  // copies the binary
+  explicit Module(std::span<const u8> binary, CompilerOptions options = {},
+                  const HostFunctions &imports = defaultHostFunctions());
+  ~Module();
+
+  // native entry of a function, it takes an InstanceContext * in front of
+  // the wasm parameters
+  template <class T> T getFunction(u32 index) const {
+    requireDefined(index);
+    return compiler->getEntry<T>(index);
+  }
+  // throws unless `index` is a function of the module's own, imports have
+  // no entry to call
+  void requireDefined(u32 index) const;
+  // hash lookup in the function exports
+  std::optional<u32> findFunction(std::string_view name) const;
+  const FunctionPrototype &prototype(u32 index) const {
+    return wasmModule->getPrototype(index);
+  }
+  // calls function `index` with arguments in the form of Vals
+  EntryStub entryStub(u32 index) const {
+    return typeStubs[wasmModule->functionSection.functions[index]];
   }
+  BatchStub batchStub(u32 index) const {
+    return typeBatchStubs[wasmModule->functionSection.functions[index]];
+  }
+  std::optional<u32> startFunction() const { return startIndex; }
+  u32 memoryPages() const { return initialPages; }
+  const WasmModule &wasm() const { return *wasmModule; }
+  // how long parsing and compiling the module took and what came out
+  const CompileStats &compileStats() const {
+    return compiler->compileStats();
+  }
+
+private:
+  friend class Instance;
+  friend class InstancePool;
+  friend class InstanceSnapshot;
+
+  // an active data segment with its offset resolved
+  struct DataInit {
+    u32 offset;
+    std::span<const u8> bytes;
+    // of bytes in the module file, if the module was loaded from one
+    std::optional<u64> fileOffset;
+  };
+
+  // sourceName is what perf shows as the file of the line info
+  void init(std::span<const u8> binary, CompilerOptions options,
+            const HostFunctions &imports, std::string sourceName);
+  void linkImports(const HostFunctions &imports);
+  void indexExports();
+  void resolveDataSegments(std::span<const u8> binary);
+  // copies (or maps) the active data segments into freshly reset memory
+  void initMemory(LinearMemory &memory) const;
+
+  std::optional<MappedFile> file;
+  std::vector<u8> ownedBinary;
+  std::unique_ptr<WasmModule> wasmModule;
+  std::unique_ptr<WasmCompiler> compiler;
+  u32 initialPages = 0;
+  std::optional<u32> startIndex;
+  std::vector<DataInit> dataInits;
+  std::unordered_map<std::string_view, u32> exportedFunctions;
+  EntryStubs stubs;
+  // by type index
+  std::vector<EntryStub> typeStubs;
+  std::vector<BatchStub> typeBatchStubs;
+};
+
+template <class Sig> class TypedFunc;
+
+/*
+ * The per instance state of a module: its linear memory, globals and the
+ * context the compiled code runs against. Creating one doesn't compile
+ * anything, it only reserves the memory and copies the initial globals.
+ */
+class Instance : NonCopyable, NonMoveable {
+public:
+  explicit Instance(std::shared_ptr<const Module> module);
+  // starts out in the state the snapshot was taken in, see InstanceSnapshot
+  explicit Instance(std::shared_ptr<const InstanceSnapshot> snapshot);
+  ~Instance();
+
+  // calls function `index` with the wasm parameters `args`, traps are
+  // rethrown as WasmTrap
+  template <class Ret = void, class... Args>
+  Ret call(u32 index, Args... args) {
+    using Fn = Ret (*)(InstanceContext *, Args...);
+    return enter(module->getFunction<Fn>(index), args...);
+  }
+  // resolves an exported function once and checks its signature against
+  // Sig, e.g. typedFunc<i32(i32, i32)>("add")
+  template <class Sig> TypedFunc<Sig> typedFunc(std::string_view name);
+  // for callers that only know the signature at runtime, the argument types
+  // are checked against the function, returns the result if it has one
+  std::optional<Val> invoke(u32 index, std::span<const Val> args);
+  std::optional<Val> invoke(std::string_view name, std::span<const Val> args);
+  // calls function `index` `count` times, call i takes row i of `args` (one
+  // u64 per parameter, i32 in the low half) and writes its result to
+  // results[i]. the spans have to be exactly count rows (empty without
+  // parameters or result). all calls share a single entry into wasm and a
+  // single trap handler setup. after a trap the results of the calls before
+  // the trapping one are valid
+  void callBatch(u32 index, u64 count, std::span<const u64> args,
+                 std::span<u64> results);
+  void runStart();
+
+  // wasi calls of this instance use `wasi` instead of the process context,
+  // it has to outlive the instance
+  void setWasi(preview1::WasiContext &wasi) { slot->context.wasi = &wasi; }
+
+  // by function index, empty unless the module was compiled with
+  // CompilerOptions::callCounters
+  std::span<const FunctionCounters> functionCounters() const {
+    return slot->counters;
+  }
+  void resetFunctionCounters();
+
+  InstanceContext &ctx() { return slot->context; }
+  LinearMemory &linearMemory() { return slot->memory; }
+  const Module &getModule() const { return *module; }
+
+private:
+  friend class InstancePool;
+  friend class InstanceSnapshot;
+  template <class Sig> friend class TypedFunc;
+
+  template <class Ret, class... Args>
+  Ret enter(Ret (*fn)(InstanceContext *, Args...), Args... args) {
+    auto *context = &slot->context;
+    // the instance may be entered from a different thread or on a fiber
+    // every time
+    context->stackLimit = currentStackLimit();
+    return callGuarded([&] { return fn(context, args...); });
+  }
+  u32 requireExport(std::string_view name) const;
+
+  Instance(std::shared_ptr<const Module> module, InstanceSlot *slot,
+           InstancePool *pool, const InstanceSnapshot *snapshot);
+  // brings the (fresh or recycled) slot into the initial state of the module
+  // or the state of the snapshot
+  void initialize(const InstanceSnapshot *snapshot);
+
+  std::shared_ptr<const Module> module;
+  std::unique_ptr<InstanceSlot> ownedSlot;
+  InstanceSlot *slot;
+  // the slot goes back here on destruction
+  InstancePool *pool = nullptr;
+};
+
+// an exported function of one instance with a signature that was checked
+// when it was resolved, calling it is as cheap as Instance::call
+template <class Ret, class... Args> class TypedFunc<Ret(Args...)> {
+public:
+  Ret operator()(Args... args) const { return instance->enter(fn, args...); }
+
+private:
+  friend class Instance;
+  using Fn = Ret (*)(InstanceContext *, Args...);
+
+  TypedFunc(Instance *instance, Fn fn) : instance(instance), fn(fn) {}
+
+  Instance *instance;
+  Fn fn;
 };
 
+template <class Sig> TypedFunc<Sig> Instance::typedFunc(std::string_view name) {
+  using Fn = typename TypedFunc<Sig>::Fn;
+  u32 index = requireExport(name);
+  auto expected = HostFunction::signatureOf<Fn>();
+  if (!expected.matches(module->prototype(index))) {
+    throw std::runtime_error("Export " + std::string(name) +
+                             " doesn't have type " + expected.signature());
+  }
+  return {this, module->getFunction<Fn>(index)};
+}
+
   int runWasm(std::string_view fileName);
 }
@@ -0,0 +1,442 @@
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <stdexcept>
+#include <utility>
+
+#include "scheduler.hpp"
+
+namespace wasmjit {
+
+using Clock = std::chrono::steady_clock;
+
+// the low bits of Task::state
+enum TaskPhase : u8 { QUEUED, RUNNING, YIELDING, PARKING, PARKED };
+// wake() was called since the last park(). it lives in the same word as the
+// phase, so wake() is a single compare exchange and never touches a task
+// that could have finished meanwhile
+static constexpr u8 kWakeup = 0x80;
+
+// changes the phase and keeps a pending wakeup
+static void setPhase(std::atomic<u8> &state, u8 phase) {
+  u8 old = state.load();
+  while (!state.compare_exchange_weak(old, (old & kWakeup) | phase)) {
+  }
+}
+
+class Scheduler::Task {
+public:
+  Task(Scheduler &scheduler, std::function<void()> body)
+      : scheduler(scheduler), body(std::move(body)) {}
+
+  Scheduler &scheduler;
+  std::function<void()> body;
+  // created when the task runs for the first time, so queued tasks don't
+  // hold a stack
+  std::unique_ptr<Fiber> fiber;
+  std::atomic<u8> state{QUEUED};
+  Clock::time_point enqueuedAt;
+};
+
+// a request of a parked task, on the task's stack
+struct IoWait {
+  Scheduler::Task *task;
+  i32 result = 0;
+  std::atomic<bool> done{false};
+  // wake() has returned, the io thread doesn't touch the task anymore
+  std::atomic<bool> released{false};
+};
+
+// user data of the request that stops the io thread
+static constexpr u64 kStopIo = 0;
+
+// finished fibers a worker keeps around for the next tasks
+static constexpr std::size_t kMaxSpareFibers = 64;
+
+static thread_local Scheduler::Task *runningTask = nullptr;
+thread_local Scheduler *Scheduler::threadScheduler = nullptr;
+thread_local Scheduler::Worker *Scheduler::threadWorker = nullptr;
+
+Scheduler::Scheduler(SchedulerConfig config)
+    : config(config), started(Clock::now()) {
+  u32 count = config.workers != 0
+                  ? config.workers
+                  : std::max(1u, std::thread::hardware_concurrency());
+  for (u32 i = 0; i < count; i++) {
+    workers.push_back(std::make_unique<Worker>());
+  }
+  for (u32 i = 0; i < count; i++) {
+    workers[i]->thread = std::thread([this, i] { workerLoop(i); });
+  }
+  if (config.epochInterval.count() > 0) {
+    ticker = std::thread([this] {
+      while (!stopping.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(this->config.epochInterval);
+        incrementEpoch();
+      }
+    });
+  }
+}
+
+Scheduler::~Scheduler() {
+  try {
+    wait();
+  } catch (...) {
+    // whoever cared about task failures called wait() before
+  }
+  {
+    std::lock_guard lock(sleepMutex);
+    stopping = true;
+  }
+  wakeWorkers.notify_all();
+  for (auto &worker : workers) {
+    worker->thread.join();
+  }
+  if (ticker.joinable()) {
+    ticker.join();
+  }
+  if (ioThread.joinable()) {
+    {
+      std::lock_guard lock(ioMutex);
+      while (!ioRing->prepare(IORING_OP_NOP, -1, nullptr, 0, 0, kStopIo)) {
+        ioRing->submit();
+      }
+      ioRing->submit();
+    }
+    ioThread.join();
+  }
+}
+
+void Scheduler::submit(std::function<void()> body) {
+  submitted.fetch_add(1, std::memory_order_relaxed);
+  outstanding.fetch_add(1);
+  auto *task = new Task(*this, std::move(body));
+  enqueue(task, localWorker(), false);
+}
+
+void Scheduler::wait() {
+  std::unique_lock lock(doneMutex);
+  allDone.wait(lock, [&] { return outstanding.load() == 0; });
+  if (firstError) {
+    std::rethrow_exception(std::exchange(firstError, nullptr));
+  }
+}
+
+Scheduler::Task *Scheduler::currentTask() { return runningTask; }
+
+void Scheduler::yield() {
+  Task *task = runningTask;
+  if (task == nullptr) {
+    throw std::runtime_error("Not running on a scheduler task");
+  }
+  setPhase(task->state, YIELDING);
+  Fiber::suspend();
+}
+
+void Scheduler::park() {
+  Task *task = runningTask;
+  if (task == nullptr) {
+    throw std::runtime_error("Not running on a scheduler task");
+  }
+  u8 old = task->state.load();
+  while (true) {
+    if (old & kWakeup) {
+      if (task->state.compare_exchange_weak(old, RUNNING)) {
+        return;
+      }
+    } else if (task->state.compare_exchange_weak(old, PARKING)) {
+      break;
+    }
+  }
+  Fiber::suspend();
+}
+
+void Scheduler::wake(Task *task) {
+  u8 old = task->state.load();
+  while (true) {
+    if ((old & ~kWakeup) == PARKED) {
+      if (task->state.compare_exchange_weak(old, QUEUED)) {
+        task->scheduler.enqueue(task, task->scheduler.localWorker(), false);
+        return;
+      }
+    } else if (old & kWakeup) {
+      return;
+    } else if (task->state.compare_exchange_weak(old, old | kWakeup)) {
+      // a task that is still parking is requeued by its worker
+      return;
+    }
+  }
+}
+
+u64 Scheduler::yieldOnDeadline(InstanceContext &) {
+  Task *task = runningTask;
+  if (task == nullptr) {
+    return 0;
+  }
+  u64 slice = task->scheduler.config.sliceTicks;
+  yield();
+  return slice;
+}
+
+bool Scheduler::startIo() {
+  std::lock_guard lock(ioMutex);
+  if (ioRing == nullptr && !ioUnavailable) {
+    ioRing = IoUring::tryCreate();
+    ioUnavailable = ioRing == nullptr;
+    if (ioRing != nullptr) {
+      ioThread = std::thread([this] { ioLoop(); });
+    }
+  }
+  return ioRing != nullptr;
+}
+
+std::optional<i32> Scheduler::awaitIo(u8 opcode, int fd, const void *addr,
+                                      u32 len, u64 offset) {
+  assert(runningTask != nullptr && &runningTask->scheduler == this);
+  if (!startIo()) {
+    return std::nullopt;
+  }
+  IoWait wait{runningTask};
+  {
+    std::lock_guard lock(ioMutex);
+    // requests are submitted right away, so a full queue only needs the
+    // kernel to take them
+    while (!ioRing->prepare(opcode, fd, addr, len, offset,
+                            reinterpret_cast<u64>(&wait))) {
+      if (i32 submitted = ioRing->submit(); submitted < 0) {
+        return submitted;
+      }
+    }
+    if (i32 submitted = ioRing->submit(); submitted < 0) {
+      // only this request can be unsubmitted, the others went in with
+      // their own submit
+      ioRing->failUnsubmitted(submitted, [](u64, i32) {});
+      return submitted;
+    }
+  }
+  // park() also returns for wakeups meant for something else
+  while (!wait.done.load(std::memory_order_acquire)) {
+    park();
+  }
+  // the io thread is still inside wake(), the task mustn't finish before
+  while (!wait.released.load(std::memory_order_acquire)) {
+  }
+  return wait.result;
+}
+
+void Scheduler::ioLoop() {
+  bool stop = false;
+  while (!stop) {
+    if (ioRing->waitForCompletions(1) < 0) {
+      continue;
+    }
+    ioRing->reap([&](u64 userData, i32 result) {
+      if (userData == kStopIo) {
+        stop = true;
+        return;
+      }
+      auto *wait = reinterpret_cast<IoWait *>(userData);
+      Task *task = wait->task;
+      wait->result = result;
+      wait->done.store(true, std::memory_order_release);
+      wake(task);
+      wait->released.store(true, std::memory_order_release);
+    });
+  }
+}
+
+void Scheduler::enqueue(Task *task, Worker *local, bool front) {
+  task->enqueuedAt = Clock::now();
+  if (local != nullptr) {
+    std::lock_guard lock(local->mutex);
+    if (front) {
+      local->tasks.push_front(task);
+    } else {
+      local->tasks.push_back(task);
+    }
+  } else {
+    std::lock_guard lock(sharedMutex);
+    shared.push_back(task);
+  }
+  queued.fetch_add(1);
+  if (sleepers.load() > 0) {
+    { std::lock_guard lock(sleepMutex); }
+    wakeWorkers.notify_one();
+  }
+}
+
+Scheduler::Task *Scheduler::nextTask(u32 index) {
+  Worker &self = *workers[index];
+  auto take = [&](std::mutex &mutex, std::deque<Task *> &tasks,
+                  bool newest) -> Task * {
+    std::lock_guard lock(mutex);
+    if (tasks.empty()) {
+      return nullptr;
+    }
+    Task *task = newest ? tasks.back() : tasks.front();
+    newest ? tasks.pop_back() : tasks.pop_front();
+    queued.fetch_sub(1);
+    return task;
+  };
+  if (Task *task = take(self.mutex, self.tasks, true)) {
+    return task;
+  }
+  if (Task *task = take(sharedMutex, shared, false)) {
+    return task;
+  }
+  for (u32 i = 1; i < workers.size(); i++) {
+    Worker &victim = *workers[(index + i) % workers.size()];
+    if (Task *task = take(victim.mutex, victim.tasks, false)) {
+      self.steals.fetch_add(1, std::memory_order_relaxed);
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+Scheduler::Worker *Scheduler::localWorker() {
+  return threadScheduler == this ? threadWorker : nullptr;
+}
+
+void Scheduler::workerLoop(u32 index) {
+  Worker &worker = *workers[index];
+  threadScheduler = this;
+  threadWorker = &worker;
+  while (true) {
+    if (Task *task = nextTask(index)) {
+      run(worker, task);
+      continue;
+    }
+    std::unique_lock lock(sleepMutex);
+    sleepers.fetch_add(1);
+    wakeWorkers.wait(lock, [&] { return queued.load() > 0 || stopping; });
+    sleepers.fetch_sub(1);
+    if (stopping && queued.load() == 0) {
+      return;
+    }
+  }
+}
+
+void Scheduler::run(Worker &worker, Task *task) {
+  auto latency = static_cast<u64>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                           task->enqueuedAt)
+          .count());
+  worker.picks.fetch_add(1, std::memory_order_relaxed);
+  worker.latencySum.fetch_add(latency, std::memory_order_relaxed);
+  if (latency > worker.latencyMax.load(std::memory_order_relaxed)) {
+    worker.latencyMax.store(latency, std::memory_order_relaxed);
+  }
+  worker.latencyBuckets[std::min<u64>(std::bit_width(latency), 63)].fetch_add(
+      1, std::memory_order_relaxed);
+
+  setPhase(task->state, RUNNING);
+  if (!task->fiber) {
+    auto body = [task] { task->body(); };
+    if (worker.spareFibers.empty()) {
+      task->fiber = std::make_unique<Fiber>(body, config.stackSize);
+    } else {
+      task->fiber = std::move(worker.spareFibers.back());
+      worker.spareFibers.pop_back();
+      task->fiber->reset(body);
+    }
+  }
+  std::exception_ptr error;
+  runningTask = task;
+  AsyncIo *outerIo = AsyncIo::exchangeCurrent(this);
+  try {
+    task->fiber->resume();
+  } catch (...) {
+    error = std::current_exception();
+  }
+  AsyncIo::exchangeCurrent(outerIo);
+  runningTask = nullptr;
+
+  if (task->fiber->finished()) {
+    (error ? worker.failed : worker.completed)
+        .fetch_add(1, std::memory_order_relaxed);
+    if (worker.spareFibers.size() < kMaxSpareFibers) {
+      worker.spareFibers.push_back(std::move(task->fiber));
+    }
+    finish(task, error);
+    return;
+  }
+  u8 phase = task->state & ~kWakeup;
+  // RUNNING: the fiber was suspended directly instead of through yield() or
+  // park(), nobody would wake it, so it continues like after a yield
+  if (phase == YIELDING || phase == RUNNING) {
+    worker.yields.fetch_add(1, std::memory_order_relaxed);
+    setPhase(task->state, QUEUED);
+    // behind everything this worker has queued, and the first thing others
+    // steal
+    enqueue(task, &worker, true);
+    return;
+  }
+  worker.parks.fetch_add(1, std::memory_order_relaxed);
+  // once it is PARKED a wake() on another thread may requeue it, it isn't
+  // touched here after that
+  u8 expected = PARKING;
+  if (!task->state.compare_exchange_strong(expected, PARKED)) {
+    // woken while it was parking
+    task->state = QUEUED;
+    enqueue(task, &worker, false);
+  }
+}
+
+void Scheduler::finish(Task *task, std::exception_ptr error) {
+  delete task;
+  std::lock_guard lock(doneMutex);
+  if (error && !firstError) {
+    firstError = error;
+  }
+  if (outstanding.fetch_sub(1) == 1) {
+    allDone.notify_all();
+  }
+}
+
+SchedulerStats Scheduler::stats() const {
+  SchedulerStats stats;
+  stats.submitted = submitted.load(std::memory_order_relaxed);
+  u64 picks = 0;
+  u64 latencySum = 0;
+  u64 latencyMax = 0;
+  u64 buckets[64] = {};
+  for (auto &worker : workers) {
+    stats.completed += worker->completed.load(std::memory_order_relaxed);
+    stats.failed += worker->failed.load(std::memory_order_relaxed);
+    stats.yields += worker->yields.load(std::memory_order_relaxed);
+    stats.parks += worker->parks.load(std::memory_order_relaxed);
+    stats.steals += worker->steals.load(std::memory_order_relaxed);
+    picks += worker->picks.load(std::memory_order_relaxed);
+    latencySum += worker->latencySum.load(std::memory_order_relaxed);
+    latencyMax = std::max(latencyMax,
+                          worker->latencyMax.load(std::memory_order_relaxed));
+    for (u32 i = 0; i < 64; i++) {
+      buckets[i] += worker->latencyBuckets[i].load(std::memory_order_relaxed);
+    }
+  }
+  double seconds =
+      std::chrono::duration<double>(Clock::now() - started).count();
+  stats.throughput = seconds > 0 ? stats.completed / seconds : 0;
+  if (picks == 0) {
+    return stats;
+  }
+  auto percentile = [&](double fraction) {
+    u64 rank = static_cast<u64>(fraction * (picks - 1));
+    u64 seen = 0;
+    for (u32 i = 0; i < 64; i++) {
+      seen += buckets[i];
+      if (seen > rank) {
+        return std::chrono::nanoseconds(i == 0 ? 0 : u64{1} << i);
+      }
+    }
+    return std::chrono::nanoseconds(latencyMax);
+  };
+  stats.meanQueueLatency = std::chrono::nanoseconds(latencySum / picks);
+  stats.p50QueueLatency = percentile(0.5);
+  stats.p99QueueLatency = percentile(0.99);
+  stats.maxQueueLatency = std::chrono::nanoseconds(latencyMax);
+  return stats;
+}
+
+} // namespace wasmjit
@@ -0,0 +1,163 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "lib/context.hpp"
+#include "lib/fiber.hpp"
+#include "lib/io-uring.hpp"
+#include "lib/tz-utils.hpp"
+
+namespace wasmjit {
+
+struct SchedulerConfig {
+  // worker threads, one per core if 0
+  u32 workers = 0;
+  std::size_t stackSize = Fiber::kDefaultStackSize;
+  // epoch ticks a task runs before yieldOnDeadline() yields it again
+  u64 sliceTicks = 1;
+  // period of a thread that bumps the global epoch, none if zero (the
+  // embedder bumps it then)
+  std::chrono::microseconds epochInterval{0};
+};
+
+struct SchedulerStats {
+  u64 submitted = 0;
+  u64 completed = 0;
+  // finished with an exception
+  u64 failed = 0;
+  u64 yields = 0;
+  u64 parks = 0;
+  // tasks a worker took from the deque of another one
+  u64 steals = 0;
+  // completed tasks per second since the scheduler was created
+  double throughput = 0;
+  // time a task sat in a queue until a worker picked it up, every
+  // (re)enqueue counts. percentiles are the upper bounds of power of two
+  // buckets
+  std::chrono::nanoseconds meanQueueLatency{0};
+  std::chrono::nanoseconds p50QueueLatency{0};
+  std::chrono::nanoseconds p99QueueLatency{0};
+  std::chrono::nanoseconds maxQueueLatency{0};
+};
+
+/*
+ * Runs a queue of independent tasks (typically: instantiate, call, drop) on
+ * a fixed set of worker threads. Every task runs on a fiber of its own, so
+ * it can yield or park anywhere, e.g. inside wasm at an epoch deadline or in
+ * a host function, and continue later on any worker.
+ *
+ * Each worker owns a deque: it runs the newest task of its own deque first,
+ * idle workers take submitted tasks from a shared queue and then steal the
+ * oldest tasks of the others.
+ *
+ * wasi io of a task goes to an io_uring shared by the workers and parks the
+ * task, a thread of the scheduler reaps the completions and wakes the tasks.
+ */
+class Scheduler : public AsyncIo, NonCopyable, NonMoveable {
+public:
+  class Task;
+
+  explicit Scheduler(SchedulerConfig config = {});
+  // waits for every task
+  ~Scheduler();
+
+  // from a task of this scheduler the task goes to the deque of its
+  // worker, otherwise to the shared queue
+  void submit(std::function<void()> body);
+  // blocks until every task submitted so far finished, rethrows the first
+  // exception a task finished with
+  void wait();
+  SchedulerStats stats() const;
+  u32 numWorkers() const { return workers.size(); }
+
+  // the task running on this thread, null outside of a task
+  static Task *currentTask();
+  // on a task: goes to the back of the line and continues later
+  static void yield();
+  // on a task: suspends it until wake() is called for it, returns right
+  // away if it was woken since it last parked
+  static void park();
+  // makes a parked task runnable again, from any thread. the task can't
+  // finish before this returns as long as it only continues after a wake
+  static void wake(Task *task);
+  // EpochDeadlineCallback for instances run by a scheduler: yields the task
+  // at the deadline and gives it another slice afterwards. outside of a task
+  // the instance traps with INTERRUPTED as usual
+  static u64 yieldOnDeadline(InstanceContext &ctx);
+
+  // on a task of this scheduler, see AsyncIo
+  std::optional<i32> awaitIo(u8 opcode, int fd, const void *addr, u32 len,
+                             u64 offset) override;
+
+private:
+  struct alignas(kCacheLineSize) Worker {
+    std::mutex mutex;
+    std::deque<Task *> tasks;
+    std::thread thread;
+    // stacks of finished tasks, only touched by the worker itself
+    std::vector<std::unique_ptr<Fiber>> spareFibers;
+    std::atomic<u64> completed{0};
+    std::atomic<u64> failed{0};
+    std::atomic<u64> yields{0};
+    std::atomic<u64> parks{0};
+    std::atomic<u64> steals{0};
+    std::atomic<u64> picks{0};
+    std::atomic<u64> latencySum{0};
+    std::atomic<u64> latencyMax{0};
+    // by the bit width of the latency in ns
+    std::atomic<u64> latencyBuckets[64] = {};
+  };
+
+  // the worker of this scheduler the calling thread is, if any
+  Worker *localWorker();
+  void workerLoop(u32 index);
+  Task *nextTask(u32 index);
+  void run(Worker &worker, Task *task);
+  void enqueue(Task *task, Worker *local, bool front);
+  void finish(Task *task, std::exception_ptr error);
+  // creates the ring and the thread reaping it on first use, false if there
+  // is no io_uring
+  bool startIo();
+  void ioLoop();
+
+  SchedulerConfig config;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::chrono::steady_clock::time_point started;
+
+  std::mutex sharedMutex;
+  std::deque<Task *> shared;
+  // tasks sitting in any queue, idle workers sleep while it is 0
+  std::atomic<u64> queued{0};
+  std::atomic<u32> sleepers{0};
+  std::mutex sleepMutex;
+  std::condition_variable wakeWorkers;
+  std::atomic<bool> stopping{false};
+
+  std::atomic<u64> submitted{0};
+  // submitted but not finished
+  std::atomic<u64> outstanding{0};
+  std::mutex doneMutex;
+  std::condition_variable allDone;
+  std::exception_ptr firstError;
+
+  std::thread ticker;
+
+  // guards preparing and submitting, the io thread reaps without it
+  std::mutex ioMutex;
+  std::unique_ptr<IoUring> ioRing;
+  bool ioUnavailable = false;
+  std::thread ioThread;
+
+  static thread_local Scheduler *threadScheduler;
+  static thread_local Worker *threadWorker;
+};
+
+} // namespace wasmjit
@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "snapshot.hpp"
+
+namespace wasmjit {
+
+static constexpr std::size_t kHostPageSize = 4096;
+
+static bool isZeroPage(const u8 *page) {
+  return std::all_of(page, page + kHostPageSize,
+                     [](u8 byte) { return byte == 0; });
+}
+
+InstanceSnapshot::InstanceSnapshot(Instance &instance)
+    : module(instance.module),
+      pages(instance.slot->memory.committedPages) {
+  static std::atomic<u64> nextId{1};
+  id = nextId++;
+
+  fd = memfd_create("wasmjit-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create memfd");
+  }
+  u64 size = u64{pages} * LinearMemory::pageSize;
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    throw std::runtime_error("Failed to size snapshot");
+  }
+  const u8 *mem = instance.slot->memory.mem;
+  for (u64 offset = 0; offset < size; offset += kHostPageSize) {
+    if (isZeroPage(mem + offset)) {
+      continue;
+    }
+    // runs of non zero pages go out with a single write
+    u64 end = offset + kHostPageSize;
+    while (end < size && !isZeroPage(mem + end)) {
+      end += kHostPageSize;
+    }
+    for (u64 pos = offset; pos < end;) {
+      ssize_t written = pwrite(fd, mem + pos, end - pos, pos);
+      if (written <= 0) {
+        close(fd);
+        throw std::runtime_error("Failed to write snapshot");
+      }
+      pos += written;
+    }
+    offset = end;
+  }
+  // private mappings can still be written, the memfd itself can't
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+    close(fd);
+    throw std::runtime_error("Failed to seal snapshot");
+  }
+
+  auto &area = instance.slot->globals;
+  std::size_t globalBytes = module->compiler->globalAreaSize();
+  globals.assign(area.data(), area.data() + globalBytes);
+}
+
+InstanceSnapshot::~InstanceSnapshot() { close(fd); }
+
+} // namespace wasmjit
@@ -0,0 +1,38 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+#include "runtime.hpp"
+
+namespace wasmjit {
+
+/*
+ * The linear memory and globals of an instance frozen at one point in time,
+ * usually right after its start function did the expensive initialization.
+ * The memory lives in a sealed memfd that instances map MAP_PRIVATE, so they
+ * start out in the snapshotted state without copying anything and share every
+ * page they don't write to. Pages that are all zero are left as holes in the
+ * memfd and take up no memory at all.
+ */
+class InstanceSnapshot : NonCopyable, NonMoveable {
+public:
+  // captures `instance` as it is now, the instance stays usable
+  explicit InstanceSnapshot(Instance &instance);
+  ~InstanceSnapshot();
+
+  const Module &getModule() const { return *module; }
+  u32 memoryPages() const { return pages; }
+
+private:
+  friend class Instance;
+  friend class InstancePool;
+
+  std::shared_ptr<const Module> module;
+  int fd = -1;
+  // tells the snapshots apart for LinearMemory::mapSnapshot, fds get reused
+  u64 id;
+  u32 pages;
+  std::vector<u8> globals;
+};
+
+} // namespace wasmjit
@@ -8,14 +8,26 @@
 #include "asmjit/core/type.h"
 #include "asmjit/x86/x86compiler.h"
 #include "doctest.h"
+#include "lib/code-map.hpp"
 #include "lib/compiler.hpp"
+#include "lib/context.hpp"
+#include "lib/host-features.hpp"
 #include "lib/parser.hpp"
+#include "lib/trap.hpp"
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <optional>
+#include <stop_token>
+#include <thread>
 #include <vector>
 #include "src/runtime.hpp"
 
@@ -190,12 +202,514 @@ TEST_CASE("call external") {
   cc.Call(reinterpret_cast<uintptr_t>(&add), WasmValueType::I32, params);
   cc.EndFunction();
   cc.finalize();
-  cc.dumpAsm();
-  cc.dumpTrace();
   auto fn = cc.getEntry<IntIntIntFn>(0);
   REQUIRE_EQ(fn(1, 2), 3);
 }
 
+TEST_CASE("unbounded recursion traps with stack overflow") {
+  InstanceContext ctx;
+  ctx.stackLimit = computeStackLimit();
+  WasmCompiler cc(1, {.stackChecks = true});
+  cc.bindContext(&ctx);
+  cc.StartFunction(0, WasmValueType::NONE, {});
+  cc.Call(u32{0}, WasmValueType::NONE, {});
+  cc.EndFunction();
+  cc.finalize();
+  auto fn = cc.getEntry<voidvoidFn>(0);
+  try {
+    callGuarded(fn);
+    FAIL("expected a trap");
+  } catch (const WasmTrap &trap) {
+    REQUIRE_EQ(trap.code(), TrapCode::STACK_OVERFLOW);
+  }
+}
+
+static void compileCountdown(WasmCompiler &cc) {
+  std::vector<WasmValueType> params = {WasmValueType::I32};
+  cc.StartFunction(0, WasmValueType::I32, params);
+  cc.StartLoop(0, 0);
+  cc.LocalGet(0);
+  cc.I32Const(-1);
+  cc.Add();
+  cc.LocalSet(0);
+  cc.LocalGet(0);
+  cc.BrIf(0);
+  cc.EndBlock();
+  cc.LocalGet(0);
+  cc.EndFunction();
+  cc.finalize();
+}
+
+TEST_CASE("loop counts down to zero") {
+  WasmCompiler cc(1);
+  compileCountdown(cc);
+  auto fn = cc.getEntry<IntIntFn>(0);
+  REQUIRE_EQ(fn(10), 0);
+}
+
+static void compileEndlessLoop(WasmCompiler &cc) {
+  cc.StartFunction(0, WasmValueType::NONE, {});
+  cc.StartLoop(0, 0);
+  cc.I32Const(1);
+  cc.BrIf(0);
+  cc.EndBlock();
+  cc.EndFunction();
+  cc.finalize();
+}
+
+TEST_CASE("endless loop is interrupted at the epoch deadline") {
+  InstanceContext ctx;
+  WasmCompiler cc(1, {.epochInterruption = true});
+  cc.bindContext(&ctx);
+  compileEndlessLoop(cc);
+  ctx.setEpochDeadline(0);
+  auto fn = cc.getEntry<voidvoidFn>(0);
+  try {
+    callGuarded(fn);
+    FAIL("expected a trap");
+  } catch (const WasmTrap &trap) {
+    REQUIRE_EQ(trap.code(), TrapCode::INTERRUPTED);
+  }
+}
+
+static std::atomic<int> epochCallbackCalls = 0;
+
+TEST_CASE("epoch deadline callback can extend the deadline") {
+  InstanceContext ctx;
+  WasmCompiler cc(1, {.epochInterruption = true});
+  cc.bindContext(&ctx);
+  compileEndlessLoop(cc);
+  epochCallbackCalls = 0;
+  ctx.epochDeadlineCallback = [](InstanceContext &) -> u64 {
+    return ++epochCallbackCalls < 3 ? 1 : 0;
+  };
+  ctx.setEpochDeadline(1);
+
+  // stopped and joined by its destructor, also when a REQUIRE fails
+  std::jthread timer([](std::stop_token stop) {
+    while (!stop.stop_requested()) {
+      incrementEpoch();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  auto fn = cc.getEntry<voidvoidFn>(0);
+  REQUIRE_THROWS_AS(callGuarded(fn), WasmTrap);
+  REQUIRE_EQ(epochCallbackCalls, 3);
+}
+
+TEST_CASE("fuel is charged per basic block") {
+  InstanceContext ctx;
+  WasmCompiler cc(1, {.fuelMetering = true});
+  cc.bindContext(&ctx);
+  compileCountdown(cc);
+  auto fn = cc.getEntry<IntIntFn>(0);
+
+  // 1 (loop) + 10 * 6 (loop body) + 1 (end) + 2 (local.get, end)
+  ctx.setFuel(1000);
+  REQUIRE_EQ(callGuarded([&] { return fn(10); }), 0);
+  REQUIRE_EQ(ctx.remainingFuel(), 1000 - 64);
+
+  ctx.setFuel(20);
+  try {
+    callGuarded([&] { return fn(10); });
+    FAIL("expected a trap");
+  } catch (const WasmTrap &trap) {
+    REQUIRE_EQ(trap.code(), TrapCode::OUT_OF_FUEL);
+  }
+  REQUIRE_EQ(ctx.remainingFuel(), 0);
+}
+
+TEST_CASE("unreachable traps with a wasm backtrace") {
+  WasmCompiler cc(2);
+  cc.StartFunction(0, WasmValueType::NONE, {});
+  cc.setSourceOffset(10);
+  cc.Unreachable();
+  cc.EndFunction();
+  cc.StartFunction(1, WasmValueType::NONE, {});
+  cc.setSourceOffset(20);
+  cc.Call(u32{0}, WasmValueType::NONE, {});
+  cc.EndFunction();
+  cc.finalize();
+  auto fn = cc.getEntry<voidvoidFn>(1);
+  try {
+    callGuarded(fn);
+    FAIL("expected a trap");
+  } catch (const WasmTrap &trap) {
+    REQUIRE_EQ(trap.code(), TrapCode::UNREACHABLE);
+    auto &frames = trap.backtrace();
+    REQUIRE_EQ(frames.size(), 2);
+    REQUIRE_EQ(frames[0].funcIndex, 0);
+    REQUIRE_EQ(frames[0].wasmOffset, 10);
+    REQUIRE_EQ(frames[1].funcIndex, 1);
+    REQUIRE_EQ(frames[1].wasmOffset, 20);
+  }
+}
+
+TEST_CASE("load past the end of memory traps") {
+  LinearMemory mem;
+  mem.init(1);
+  WasmCompiler cc(1);
+  cc.StartFunction(0, WasmValueType::I32, {});
+  cc.I32Const(LinearMemory::pageSize);
+  cc.I32Load(reinterpret_cast<uintptr_t>(mem.mem));
+  cc.EndFunction();
+  cc.finalize();
+  auto fn = cc.getEntry<IntVoidFn>(0);
+  try {
+    callGuarded(fn);
+    FAIL("expected a trap");
+  } catch (const WasmTrap &trap) {
+    REQUIRE_EQ(trap.code(), TrapCode::MEMORY_OUT_OF_BOUNDS);
+  }
+}
+
+// fn(a, b) = a op b
+static void compileBinOp(WasmCompiler &cc, u32 index, WasmOpcode op,
+                         WasmValueType type) {
+  std::vector<WasmValueType> params = {type, type};
+  cc.StartFunction(index, type, params);
+  cc.LocalGet(0);
+  cc.LocalGet(1);
+  cc.IntBinOp(op);
+  cc.EndFunction();
+}
+
+TEST_CASE("integer division and remainder") {
+  using I64I64I64Fn = i64 (*)(i64, i64);
+  WasmCompiler cc(8);
+  WasmOpcode ops[] = {WasmOpcode::I32_DIV_S, WasmOpcode::I32_DIV_U,
+                      WasmOpcode::I32_REM_S, WasmOpcode::I32_REM_U,
+                      WasmOpcode::I64_DIV_S, WasmOpcode::I64_DIV_U,
+                      WasmOpcode::I64_REM_S, WasmOpcode::I64_REM_U};
+  for (u32 i = 0; i < 8; i++) {
+    compileBinOp(cc, i, ops[i], i < 4 ? WasmValueType::I32 : WasmValueType::I64);
+  }
+  cc.finalize();
+  auto divS = cc.getEntry<IntIntIntFn>(0);
+  auto divU = cc.getEntry<IntIntIntFn>(1);
+  auto remS = cc.getEntry<IntIntIntFn>(2);
+  auto remU = cc.getEntry<IntIntIntFn>(3);
+  REQUIRE_EQ(divS(-7, 2), -3);
+  REQUIRE_EQ(divU(-7, 2), static_cast<i32>(0xfffffff9u / 2));
+  REQUIRE_EQ(remS(-7, 2), -1);
+  REQUIRE_EQ(remU(-7, 2), 1);
+  REQUIRE_EQ(divS(7, -1), -7);
+  REQUIRE_EQ(remS(INT32_MIN, -1), 0);
+  REQUIRE_EQ(cc.getEntry<I64I64I64Fn>(4)(INT64_MIN + 1, -1), INT64_MAX);
+  REQUIRE_EQ(cc.getEntry<I64I64I64Fn>(5)(-1, 3), static_cast<i64>(~u64{0} / 3));
+  REQUIRE_EQ(cc.getEntry<I64I64I64Fn>(6)(INT64_MIN, -1), 0);
+  REQUIRE_EQ(cc.getEntry<I64I64I64Fn>(7)(-1, 10), static_cast<i64>(~u64{0} % 10));
+
+  auto expectTrap = [](auto fn, TrapCode code) {
+    try {
+      callGuarded(fn);
+      FAIL("expected a trap");
+    } catch (const WasmTrap &trap) {
+      REQUIRE_EQ(trap.code(), code);
+    }
+  };
+  expectTrap([&] { return divS(INT32_MIN, -1); }, TrapCode::INTEGER_OVERFLOW);
+  expectTrap([&] { return divS(1, 0); }, TrapCode::INTEGER_DIVIDE_BY_ZERO);
+  expectTrap([&] { return remU(1, 0); }, TrapCode::INTEGER_DIVIDE_BY_ZERO);
+  expectTrap([&] { return remS(1, 0); }, TrapCode::INTEGER_DIVIDE_BY_ZERO);
+}
+
+TEST_CASE("trap sites cover the moves the register allocator adds") {
+  // more live values than registers, so the operands of the division are
+  // reloaded between the site's label and the div
+  constexpr i32 numLive = 24;
+  std::vector<WasmValueType> params = {WasmValueType::I32,
+                                       WasmValueType::I32};
+  WasmCompiler cc(1);
+  cc.StartFunction(0, WasmValueType::I32, params);
+  for (i32 i = 0; i < numLive; i++) {
+    cc.LocalGet(0);
+    cc.I32Const(i);
+    cc.Add();
+  }
+  cc.setSourceOffset(42);
+  cc.LocalGet(0);
+  cc.LocalGet(1);
+  cc.IntBinOp(WasmOpcode::I32_DIV_U);
+  for (i32 i = 0; i < numLive; i++) {
+    cc.Add();
+  }
+  cc.EndFunction();
+  cc.finalize();
+  auto fn = cc.getEntry<IntIntIntFn>(0);
+  REQUIRE_EQ(callGuarded([&] { return fn(6, 3); }),
+             2 + numLive * 6 + numLive * (numLive - 1) / 2);
+  try {
+    callGuarded([&] { return fn(6, 0); });
+    FAIL("expected a trap");
+  } catch (const WasmTrap &trap) {
+    REQUIRE_EQ(trap.code(), TrapCode::INTEGER_DIVIDE_BY_ZERO);
+    REQUIRE_EQ(trap.backtrace().size(), 1);
+    REQUIRE_EQ(trap.backtrace()[0].wasmOffset, 42);
+  }
+}
+
+TEST_CASE("trap sites are found anywhere in their range") {
+  CodeMap map(0x1000, 0x100, {{0, 0x100, 0}},
+              {{0x10, 0x10, 1, false, TrapCode::UNREACHABLE},
+               {0x20, 0x28, 2, true, TrapCode::INTEGER_DIVIDE_BY_ZERO},
+               {0x30, 0x30, 3, false, TrapCode::UNREACHABLE}});
+  REQUIRE_EQ(map.findTrapSite(0x101f), nullptr);
+  REQUIRE_EQ(map.findTrapSite(0x1020)->wasmOffset, 2);
+  REQUIRE_EQ(map.findTrapSite(0x1025)->wasmOffset, 2);
+  REQUIRE_EQ(map.findTrapSite(0x1028), nullptr);
+  REQUIRE_EQ(map.findTrapSite(0x1030), nullptr);
+  REQUIRE_EQ(map.findTrapSite(0x1010), nullptr);
+}
+
+TEST_CASE("unregistering a code map waits for the refs to it") {
+  auto map = std::make_unique<CodeMap>(
+      0x7000, 0x100, std::vector<FunctionRange>{{0, 0x100, 0}},
+      std::vector<SourceSite>{});
+  registerCodeMap(map.get());
+  std::atomic<bool> unregistered = false;
+  std::optional<CodeMapRef> ref(std::in_place, 0x7010);
+  REQUIRE_EQ(ref->get(), map.get());
+  std::jthread destroyer([&] {
+    unregisterCodeMap(map.get());
+    unregistered = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  REQUIRE_FALSE(unregistered.load());
+  ref.reset();
+  destroyer.join();
+  REQUIRE(unregistered.load());
+  REQUIRE_FALSE(CodeMapRef(0x7010));
+}
+
+TEST_CASE("division by a constant matches native division") {
+  i64 divisors[] = {1,  -1,   2,  -2, 3,  -3,     5,          7,
+                    10, -10,  16, 25, 641, 1 << 30, INT32_MIN, 0x7fffffff,
+                    -0x7fffffff, 1000000007, INT64_MIN, INT64_MAX,
+                    0x100000001};
+  i64 samples[] = {0,         1,         -1,         7,         -7,
+                   100,       -100,      12345678,   -12345678, INT32_MAX,
+                   INT32_MIN, INT64_MAX, INT64_MIN,  0x123456789abcdef,
+                   -0x123456789abcdef};
+  WasmOpcode ops[] = {WasmOpcode::I32_DIV_S, WasmOpcode::I32_DIV_U,
+                      WasmOpcode::I32_REM_S, WasmOpcode::I32_REM_U,
+                      WasmOpcode::I64_DIV_S, WasmOpcode::I64_DIV_U,
+                      WasmOpcode::I64_REM_S, WasmOpcode::I64_REM_U};
+  u32 numFuncs = std::size(divisors) * std::size(ops);
+  WasmCompiler cc(numFuncs);
+  u32 index = 0;
+  for (i64 divisor : divisors) {
+    for (u32 i = 0; i < std::size(ops); i++) {
+      auto type = i < 4 ? WasmValueType::I32 : WasmValueType::I64;
+      std::vector<WasmValueType> params = {type};
+      cc.StartFunction(index++, type, params);
+      cc.LocalGet(0);
+      if (type == WasmValueType::I32) {
+        cc.I32Const(static_cast<i32>(divisor));
+      } else {
+        cc.I64Const(divisor);
+      }
+      cc.IntBinOp(ops[i]);
+      cc.EndFunction();
+    }
+  }
+  cc.finalize();
+
+  index = 0;
+  for (i64 divisor : divisors) {
+    i32 d32 = static_cast<i32>(divisor);
+    for (u32 i = 0; i < std::size(ops); i++, index++) {
+      for (i64 sample : samples) {
+        i32 x32 = static_cast<i32>(sample);
+        CAPTURE(divisor);
+        CAPTURE(sample);
+        CAPTURE(i);
+        switch (ops[i]) {
+        case WasmOpcode::I32_DIV_S:
+          if (d32 != 0 && !(x32 == INT32_MIN && d32 == -1)) {
+            REQUIRE_EQ(cc.getEntry<IntIntFn>(index)(x32), x32 / d32);
+          }
+          break;
+        case WasmOpcode::I32_DIV_U:
+          if (d32 != 0) {
+            REQUIRE_EQ(static_cast<u32>(cc.getEntry<IntIntFn>(index)(x32)),
+                       static_cast<u32>(x32) / static_cast<u32>(d32));
+          }
+          break;
+        case WasmOpcode::I32_REM_S:
+          if (d32 != 0) {
+            i32 expected = d32 == -1 ? 0 : x32 % d32;
+            REQUIRE_EQ(cc.getEntry<IntIntFn>(index)(x32), expected);
+          }
+          break;
+        case WasmOpcode::I32_REM_U:
+          if (d32 != 0) {
+            REQUIRE_EQ(static_cast<u32>(cc.getEntry<IntIntFn>(index)(x32)),
+                       static_cast<u32>(x32) % static_cast<u32>(d32));
+          }
+          break;
+        case WasmOpcode::I64_DIV_S:
+          if (!(sample == INT64_MIN && divisor == -1)) {
+            REQUIRE_EQ(cc.getEntry<i64 (*)(i64)>(index)(sample), sample / divisor);
+          }
+          break;
+        case WasmOpcode::I64_DIV_U:
+          REQUIRE_EQ(static_cast<u64>(cc.getEntry<i64 (*)(i64)>(index)(sample)),
+                     static_cast<u64>(sample) / static_cast<u64>(divisor));
+          break;
+        case WasmOpcode::I64_REM_S: {
+          i64 expected = divisor == -1 ? 0 : sample % divisor;
+          REQUIRE_EQ(cc.getEntry<i64 (*)(i64)>(index)(sample), expected);
+          break;
+        }
+        case WasmOpcode::I64_REM_U:
+          REQUIRE_EQ(static_cast<u64>(cc.getEntry<i64 (*)(i64)>(index)(sample)),
+                     static_cast<u64>(sample) % static_cast<u64>(divisor));
+          break;
+        default:
+          break;
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("integer compares and conversions") {
+  WasmCompiler cc(3);
+  std::vector<WasmValueType> params = {WasmValueType::I32, WasmValueType::I32};
+  cc.StartFunction(0, WasmValueType::I32, params);
+  cc.LocalGet(0);
+  cc.LocalGet(1);
+  cc.IntCompare(WasmOpcode::I32_LT_U);
+  cc.EndFunction();
+  // (i64.extend_i32_u a) + (i64.extend8_s b) as i64
+  cc.StartFunction(1, WasmValueType::I64, params);
+  cc.LocalGet(0);
+  cc.IntUnOp(WasmOpcode::I64_EXTEND_I32_U);
+  cc.LocalGet(1);
+  cc.IntUnOp(WasmOpcode::I64_EXTEND_I32_S);
+  cc.IntUnOp(WasmOpcode::I64_EXTEND_8S);
+  cc.IntBinOp(WasmOpcode::I64_ADD);
+  cc.EndFunction();
+  std::vector<WasmValueType> param = {WasmValueType::I64};
+  cc.StartFunction(2, WasmValueType::I32, param);
+  cc.LocalGet(0);
+  cc.IntUnOp(WasmOpcode::I64_EQZ);
+  cc.EndFunction();
+  cc.finalize();
+  auto ltU = cc.getEntry<IntIntIntFn>(0);
+  REQUIRE_EQ(ltU(1, -1), 1);
+  REQUIRE_EQ(ltU(-1, 1), 0);
+  auto extend = cc.getEntry<i64 (*)(i32, i32)>(1);
+  REQUIRE_EQ(extend(-1, 0xff), i64{0xffffffff} - 1);
+  auto eqz = cc.getEntry<i32 (*)(i64)>(2);
+  REQUIRE_EQ(eqz(0), 1);
+  REQUIRE_EQ(eqz(i64{1} << 40), 0);
+}
+
+TEST_CASE("bit counts and rotates on the host and the baseline profile") {
+  using I64I64Fn = i64 (*)(i64);
+  using I64I64I64Fn = i64 (*)(i64, i64);
+  for (auto profile :
+       {HostFeatureProfile::detect(), HostFeatureProfile::baseline()}) {
+    CAPTURE(profile.toString());
+    WasmCompiler cc(16, {.targetFeatures = profile});
+    WasmOpcode unOps[] = {WasmOpcode::I32_CLZ, WasmOpcode::I32_CTZ,
+                          WasmOpcode::I32_POPCNT, WasmOpcode::I64_CLZ,
+                          WasmOpcode::I64_CTZ, WasmOpcode::I64_POPCNT};
+    for (u32 i = 0; i < 6; i++) {
+      auto type = i < 3 ? WasmValueType::I32 : WasmValueType::I64;
+      std::vector<WasmValueType> params = {type};
+      cc.StartFunction(i, type, params);
+      cc.LocalGet(0);
+      cc.IntUnOp(unOps[i]);
+      cc.EndFunction();
+    }
+    WasmOpcode binOps[] = {WasmOpcode::I32_ROTL, WasmOpcode::I32_ROTR,
+                           WasmOpcode::I32_SHL,  WasmOpcode::I64_ROTL,
+                           WasmOpcode::I64_ROTR, WasmOpcode::I64_SHR_S};
+    for (u32 i = 0; i < 6; i++) {
+      compileBinOp(cc, 6 + i, binOps[i],
+                   i < 3 ? WasmValueType::I32 : WasmValueType::I64);
+    }
+    // constant counts, larger than the width to check the masking
+    std::vector<WasmValueType> i32Param = {WasmValueType::I32};
+    std::vector<WasmValueType> i64Param = {WasmValueType::I64};
+    cc.StartFunction(12, WasmValueType::I32, i32Param);
+    cc.LocalGet(0);
+    cc.I32Const(35);
+    cc.IntBinOp(WasmOpcode::I32_ROTL);
+    cc.EndFunction();
+    cc.StartFunction(13, WasmValueType::I64, i64Param);
+    cc.LocalGet(0);
+    cc.I64Const(13);
+    cc.IntBinOp(WasmOpcode::I64_ROTR);
+    cc.EndFunction();
+    cc.StartFunction(14, WasmValueType::I64, i64Param);
+    cc.LocalGet(0);
+    cc.I64Const(65);
+    cc.IntBinOp(WasmOpcode::I64_SHR_U);
+    cc.EndFunction();
+    cc.StartFunction(15, WasmValueType::I32, i32Param);
+    cc.LocalGet(0);
+    cc.I32Const(0);
+    cc.IntBinOp(WasmOpcode::I32_ROTL);
+    cc.EndFunction();
+    cc.finalize();
+    REQUIRE_EQ(cc.targetFeatures(), profile);
+
+    u64 samples[] = {0, 1, 0x80000000, 0xffffffff, 0x00f0'0000'0000'0100,
+                     ~u64{0}, u64{1} << 63, 0x123456789abcdef0};
+    for (u64 x : samples) {
+      u32 x32 = static_cast<u32>(x);
+      CAPTURE(x);
+      REQUIRE_EQ(cc.getEntry<IntIntFn>(0)(x32), std::countl_zero(x32));
+      REQUIRE_EQ(cc.getEntry<IntIntFn>(1)(x32), std::countr_zero(x32));
+      REQUIRE_EQ(cc.getEntry<IntIntFn>(2)(x32), std::popcount(x32));
+      REQUIRE_EQ(cc.getEntry<I64I64Fn>(3)(x), std::countl_zero(x));
+      REQUIRE_EQ(cc.getEntry<I64I64Fn>(4)(x), std::countr_zero(x));
+      REQUIRE_EQ(cc.getEntry<I64I64Fn>(5)(x), std::popcount(x));
+      for (u32 count : {0u, 1u, 31u, 33u, 63u, 100u}) {
+        CAPTURE(count);
+        REQUIRE_EQ(static_cast<u32>(cc.getEntry<IntIntIntFn>(6)(x32, count)),
+                   std::rotl(x32, count & 31));
+        REQUIRE_EQ(static_cast<u32>(cc.getEntry<IntIntIntFn>(7)(x32, count)),
+                   std::rotr(x32, count & 31));
+        REQUIRE_EQ(static_cast<u32>(cc.getEntry<IntIntIntFn>(8)(x32, count)),
+                   x32 << (count & 31));
+        REQUIRE_EQ(static_cast<u64>(cc.getEntry<I64I64I64Fn>(9)(x, count)),
+                   std::rotl(x, count & 63));
+        REQUIRE_EQ(static_cast<u64>(cc.getEntry<I64I64I64Fn>(10)(x, count)),
+                   std::rotr(x, count & 63));
+        REQUIRE_EQ(cc.getEntry<I64I64I64Fn>(11)(x, count),
+                   static_cast<i64>(x) >> (count & 63));
+      }
+      REQUIRE_EQ(static_cast<u32>(cc.getEntry<IntIntFn>(12)(x32)),
+                 std::rotl(x32, 3));
+      REQUIRE_EQ(static_cast<u64>(cc.getEntry<I64I64Fn>(13)(x)),
+                 std::rotr(x, 13));
+      REQUIRE_EQ(static_cast<u64>(cc.getEntry<I64I64Fn>(14)(x)), x >> 1);
+      REQUIRE_EQ(static_cast<u32>(cc.getEntry<IntIntFn>(15)(x32)), x32);
+    }
+  }
+}
+
+TEST_CASE("code for cpu features the host lacks is rejected") {
+  HostFeatureProfile host = HostFeatureProfile::detect();
+  REQUIRE(host.supports(HostFeatureProfile::baseline()));
+  REQUIRE_NOTHROW(requireHostSupport(host));
+  // no real cpu has this one
+  HostFeatureProfile unknown{1u << 31};
+  REQUIRE_FALSE(host.supports(unknown));
+  REQUIRE_THROWS_AS(requireHostSupport(unknown), std::runtime_error);
+  REQUIRE_THROWS_AS(WasmCompiler(1, {.targetFeatures = unknown}),
+                    std::runtime_error);
+  HostFeatureProfile profile{HostFeatureProfile::LZCNT |
+                             HostFeatureProfile::POPCNT};
+  REQUIRE_EQ(profile.toString(), "lzcnt,popcnt");
+  REQUIRE_EQ(HostFeatureProfile::baseline().toString(), "baseline");
+}
+
 TEST_CASE("greater than") {
   WasmCompiler cc(1);
   std::vector<WasmValueType> params = {WasmValueType::I32, WasmValueType::I32};
@@ -305,25 +819,67 @@ TEST_CASE("block with input") {
   REQUIRE_EQ(fn(42), 84);
 }
 
-// TEST_CASE("global get non mutable") {
-//   WasmCompiler cc(1);
-//   WasmGlobal global;
-//   global.type = WasmValueType::I32;
-//   global.isMutable = false;
-//   std::vector<WasmGlobal> globals = {global};
-//   std::vector<value_t> values = {42};
-//   cc.AddGlobals(globals, values);
-
-//   std::vector<WasmValueType> params = {};
-//   cc.StartFunction(0, WasmValueType::I32, params);
-//   cc.GlobalGet(0);
-//   cc.EndFunction();
-//   cc.finalize();
-//   cc.dumpAsm();
-//   auto fn = cc.getEntry<IntVoidFn>(0);
-//   REQUIRE_EQ(fn(), 42);
-// }
+TEST_CASE("immutable globals are folded into the code") {
+  std::vector<WasmGlobal> globals = {{WasmValueType::I32, false},
+                                     {WasmValueType::I64, false},
+                                     {WasmValueType::I32, false}};
+  std::vector<WasmConstExpr> inits = {{false, i32{42}},
+                                      {false, i64{1} << 40},
+                                      {true, u32{0}}};
+  // no context bound, constants never touch the global area
+  WasmCompiler cc(2);
+  cc.AddGlobals(globals, inits);
+  REQUIRE_EQ(cc.globalAreaSize(), 0);
+  cc.StartFunction(0, WasmValueType::I32, {});
+  cc.GlobalGet(0);
+  cc.GlobalGet(2);
+  cc.Add();
+  cc.EndFunction();
+  cc.StartFunction(1, WasmValueType::I64, {});
+  cc.GlobalGet(1);
+  cc.EndFunction();
+  cc.finalize();
+  REQUIRE_EQ(cc.getEntry<IntVoidFn>(0)(), 84);
+  REQUIRE_EQ(cc.getEntry<i64 (*)()>(1)(), i64{1} << 40);
+}
 
+TEST_CASE("mutable globals live in the instance's global area") {
+  std::vector<WasmGlobal> globals = {{WasmValueType::I32, true},
+                                     {WasmValueType::I64, false},
+                                     {WasmValueType::I64, true}};
+  std::vector<WasmConstExpr> inits = {
+      {false, i32{1}}, {false, i64{5}}, {false, i64{-1}}};
+  InstanceContext context;
+  WasmCompiler cc(1);
+  cc.bindContext(&context);
+  cc.AddGlobals(globals, inits);
+  REQUIRE_EQ(cc.globalAreaSize(), 2 * sizeof(u64));
+  GlobalArea area(cc.globalAreaSize());
+  REQUIRE_EQ(reinterpret_cast<uintptr_t>(area.data()) % kCacheLineSize, 0);
+  cc.initGlobalArea(area.data());
+  context.globals = area.data();
+
+  // g0 = g0 + 1, g2 = g2 + g1, returns g0
+  cc.StartFunction(0, WasmValueType::I32, {});
+  cc.GlobalGet(0);
+  cc.I32Const(1);
+  cc.Add();
+  cc.GlobalSet(0);
+  cc.GlobalGet(2);
+  cc.GlobalGet(1);
+  cc.IntBinOp(WasmOpcode::I64_ADD);
+  cc.GlobalSet(2);
+  cc.GlobalGet(0);
+  cc.EndFunction();
+  cc.finalize();
+  auto fn = cc.getEntry<IntVoidFn>(0);
+  REQUIRE_EQ(fn(), 2);
+  REQUIRE_EQ(fn(), 3);
+  i64 g2;
+  std::memcpy(&g2, area.data() + sizeof(u64), sizeof(g2));
+  REQUIRE_EQ(g2, 9);
+  REQUIRE_THROWS_AS(cc.GlobalSet(1), std::runtime_error);
+}
 
 TEST_CASE("block br_if") {
   WasmCompiler cc(1);
@@ -495,6 +1051,58 @@ TEST_CASE("trace example 1") {
   // cc.Call(u32(4), rets[0], params[0]);
   cc.EndFunction();
   cc.finalize();
-  cc.dumpAsm();
-  cc.dumpTrace();
+}
+
+TEST_CASE("compiled code is registered with gdb") {
+  {
+    WasmCompiler cc(1, {.gdbJit = true});
+    cc.setSymbols({"increment.wasm", {"increment"}});
+    std::vector<WasmValueType> params = {WasmValueType::I32};
+    cc.StartFunction(0, WasmValueType::I32, params);
+    cc.setSourceOffset(0x20);
+    cc.LocalGet(0);
+    cc.setSourceOffset(0x22);
+    cc.I32Const(1);
+    cc.setSourceOffset(0x24);
+    cc.Add();
+    cc.EndFunction();
+    cc.finalize();
+    REQUIRE_EQ(cc.getEntry<IntIntFn>(0)(10), 11);
+    REQUIRE_GT(cc.codeMap()->lineTable().size(), 0);
+
+    auto *entry = __jit_debug_descriptor.first_entry;
+    REQUIRE(entry != nullptr);
+    REQUIRE_EQ(__jit_debug_descriptor.relevant_entry, entry);
+    REQUIRE_EQ(std::string_view(entry->symfile_addr, 4), "\x7f" "ELF");
+    std::string_view image(entry->symfile_addr, entry->symfile_size);
+    REQUIRE_NE(image.find("increment"), std::string_view::npos);
+    REQUIRE_NE(image.find(".debug_line"), std::string_view::npos);
+  }
+  REQUIRE(__jit_debug_descriptor.first_entry == nullptr);
+}
+
+TEST_CASE("traces go to the ring sink") {
+  TraceRing ring(4);
+  setTraceSink(&ring);
+  setTraceLevel(TraceLevel::DEBUG);
+  REQUIRE_EQ(traceEnabled(TraceLevel::DEBUG), WASMJIT_TRACE_LEVEL >= 2);
+  REQUIRE_FALSE(traceEnabled(TraceLevel::VERBOSE));
+  for (int i = 0; i < 6; i++) {
+    trace(TraceLevel::INFO, "test", "record {}", i);
+  }
+  trace(TraceLevel::DEBUG, "test", "{}", std::string(1000, 'x'));
+  setTraceSink(nullptr);
+  setTraceLevel(TraceLevel::NONE);
+
+  auto records = ring.snapshot();
+  REQUIRE_EQ(records.size(), 4);
+  REQUIRE_EQ(records[0].message, "record 3");
+  REQUIRE_EQ(records[2].message, "record 5");
+  REQUIRE_EQ(std::string_view(records[2].category), "test");
+  REQUIRE_LE(records[1].timestampNs, records[2].timestampNs);
+  REQUIRE_EQ(records[3].level, TraceLevel::DEBUG);
+  REQUIRE_EQ(records[3].message.size(), TraceRing::kMaxMessageSize);
+  REQUIRE_EQ(ring.dropped(), 0);
+  REQUIRE_EQ(parseTraceLevel("verbose"), TraceLevel::VERBOSE);
+  REQUIRE_FALSE(parseTraceLevel("loud").has_value());
 }
@@ -0,0 +1,54 @@
+#pragma once
+#include "lib/tz-utils.hpp"
+
+// modules used by the tests as well as by the benches, so both run the same
+// code
+
+namespace wasmjit {
+
+// (module
+//   (memory 1)
+//   (global $g (mut i32) (i32.const 10))
+//   (func (export "bump") (param i32) (result i32)
+//     (i32.store offset=4 (i32.const 0)
+//       (global.set $g (i32.add (global.get $g) (local.get 0)))
+//       (global.get $g))
+//     (i32.load (i32.const 4))))
+inline constexpr u8 kBumpModule[] = {
+    0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+    // type section
+    0x01, 0x06, 0x01, 0x60, 0x01, 0x7f, 0x01, 0x7f,
+    // function section
+    0x03, 0x02, 0x01, 0x00,
+    // memory section
+    0x05, 0x03, 0x01, 0x00, 0x01,
+    // global section
+    0x06, 0x06, 0x01, 0x7f, 0x01, 0x41, 0x0a, 0x0b,
+    // export section
+    0x07, 0x08, 0x01, 0x04, 'b', 'u', 'm', 'p', 0x00, 0x00,
+    // code section
+    0x0a, 0x17, 0x01, 0x15, 0x00, 0x41, 0x00, 0x23, 0x00, 0x20, 0x00, 0x6a,
+    0x24, 0x00, 0x23, 0x00, 0x36, 0x02, 0x04, 0x41, 0x04, 0x28, 0x02, 0x00,
+    0x0b};
+
+// (module
+//   (memory 1)
+//   (func (export "spin") (param i32) (result i32)
+//     (loop (local.set 0 (i32.add (local.get 0) (i32.const -1)))
+//           (br_if 0 (local.get 0)))
+//     (local.get 0)))
+inline constexpr u8 kSpinModule[] = {
+    0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+    // type section
+    0x01, 0x06, 0x01, 0x60, 0x01, 0x7f, 0x01, 0x7f,
+    // function section
+    0x03, 0x02, 0x01, 0x00,
+    // memory section
+    0x05, 0x03, 0x01, 0x00, 0x01,
+    // export section
+    0x07, 0x08, 0x01, 0x04, 's', 'p', 'i', 'n', 0x00, 0x00,
+    // code section
+    0x0a, 0x14, 0x01, 0x12, 0x00, 0x03, 0x40, 0x20, 0x00, 0x41, 0x7f, 0x6a,
+    0x21, 0x00, 0x20, 0x00, 0x0d, 0x00, 0x0b, 0x20, 0x00, 0x0b};
+
+} // namespace wasmjit
@@ -2,6 +2,7 @@
 #include "lib/parser.hpp"
 #include "lib/tz-utils.hpp"
 
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <filesystem>
@@ -25,3 +26,17 @@ TEST_CASE("parser real") {
   mod.parseSections(file.asSpan());
 
 }
+
+TEST_CASE("the arena hands out allocations larger than a block") {
+  ArenaAllocator alloc;
+  auto small = alloc.constructSpan<u32>(16);
+  auto large = alloc.constructSpan<u32>(10'000);
+  std::fill(large.begin(), large.end(), 7);
+  auto after = alloc.constructSpan<u32>(16);
+  std::fill(small.begin(), small.end(), 1);
+  std::fill(after.begin(), after.end(), 2);
+  REQUIRE_EQ(large.front(), 7);
+  REQUIRE_EQ(large.back(), 7);
+  // the small ones still share a block
+  REQUIRE_EQ(after.data(), small.data() + small.size());
+}
@@ -1,5 +1,27 @@
+#include "src/instance-pool.hpp"
 #include "src/runtime.hpp"
+#include "src/scheduler.hpp"
+#include "src/snapshot.hpp"
+#include "lib/event-loop.hpp"
+#include "lib/io-uring.hpp"
+#include "lib/sampler.hpp"
+#include "lib/wasi.h"
+#include "test/test-modules.hpp"
 #include "doctest.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 using namespace wasmjit;
 
@@ -10,3 +32,853 @@ TEST_CASE("runtime") {
   auto res = runWasm("../real_examples/exmaple.wasm");
   REQUIRE_EQ(res, 1);
 }
+
+TEST_CASE("instances of one module are isolated") {
+  auto module = std::make_shared<const Module>(std::span(kBumpModule));
+  auto bump = module->findFunction("bump");
+  REQUIRE(bump.has_value());
+  REQUIRE_FALSE(module->findFunction("missing").has_value());
+  REQUIRE_EQ(module->memoryPages(), 1);
+
+  Instance first(module);
+  Instance second(module);
+  REQUIRE_EQ(first.call<i32>(*bump, 5), 15);
+  REQUIRE_EQ(first.call<i32>(*bump, 5), 20);
+  REQUIRE_EQ(second.call<i32>(*bump, 1), 11);
+  REQUIRE_EQ(*reinterpret_cast<i32 *>(first.linearMemory().mem + 4), 20);
+  REQUIRE_EQ(*reinterpret_cast<i32 *>(second.linearMemory().mem + 4), 11);
+}
+
+TEST_CASE("instances can be used from several threads") {
+  auto module = std::make_shared<const Module>(std::span(kBumpModule));
+  u32 bump = module->findFunction("bump").value();
+  std::vector<std::thread> threads;
+  std::atomic<u32> failures{0};
+  for (u32 t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      Instance instance(module);
+      for (i32 i = 1; i <= 1000; i++) {
+        if (instance.call<i32>(bump, 1) != 10 + i) {
+          failures++;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE_EQ(failures.load(), 0);
+}
+
+TEST_CASE("pooled instances start from a clean slot") {
+  auto module = std::make_shared<const Module>(std::span(kBumpModule));
+  u32 bump = module->findFunction("bump").value();
+  InstancePool pool({.slots = 2});
+  REQUIRE_EQ(pool.available(), 2);
+
+  for (int round = 0; round < 3; round++) {
+    auto instance = pool.instantiate(module);
+    REQUIRE_EQ(pool.available(), 1);
+    auto *mem = instance->linearMemory().mem;
+    // whatever the last user left in the memory is gone
+    REQUIRE_EQ(*reinterpret_cast<i32 *>(mem + 4), 0);
+    REQUIRE_EQ(mem[LinearMemory::pageSize - 1], 0);
+    mem[LinearMemory::pageSize - 1] = 0xff;
+    REQUIRE_EQ(instance->call<i32>(bump, 3), 13);
+  }
+  REQUIRE_EQ(pool.available(), 2);
+}
+
+TEST_CASE("an exhausted pool refuses to instantiate") {
+  auto module = std::make_shared<const Module>(std::span(kBumpModule));
+  InstancePool pool({.slots = 1});
+  auto first = pool.instantiate(module);
+  REQUIRE_THROWS_AS(pool.instantiate(module), std::runtime_error);
+  first.reset();
+  REQUIRE_NOTHROW(pool.instantiate(module));
+
+  InstancePool tiny({.slots = 1, .maxGlobalBytes = 0});
+  REQUIRE_THROWS_AS(tiny.instantiate(module), std::runtime_error);
+  REQUIRE_EQ(tiny.available(), 1);
+}
+
+TEST_CASE("instances start from a snapshot and copy on write") {
+  auto module = std::make_shared<const Module>(std::span(kBumpModule));
+  u32 bump = module->findFunction("bump").value();
+  Instance initialized(module);
+  REQUIRE_EQ(initialized.call<i32>(bump, 90), 100);
+  initialized.linearMemory().mem[3 * 4096] = 42;
+  auto snapshot = std::make_shared<const InstanceSnapshot>(initialized);
+  REQUIRE_EQ(snapshot->memoryPages(), 1);
+
+  // the snapshot doesn't follow the instance it was taken from
+  REQUIRE_EQ(initialized.call<i32>(bump, 1), 101);
+
+  Instance first(snapshot);
+  Instance second(snapshot);
+  REQUIRE_EQ(first.linearMemory().mem[3 * 4096], 42);
+  REQUIRE_EQ(first.call<i32>(bump, 1), 101);
+  REQUIRE_EQ(first.call<i32>(bump, 1), 102);
+  REQUIRE_EQ(second.call<i32>(bump, 5), 105);
+
+  InstancePool pool({.slots = 1});
+  for (int round = 0; round < 3; round++) {
+    auto pooled = pool.instantiate(snapshot);
+    REQUIRE_EQ(*reinterpret_cast<i32 *>(pooled->linearMemory().mem + 4), 100);
+    REQUIRE_EQ(pooled->call<i32>(bump, 2), 102);
+  }
+  // a fresh instance in a slot that held the snapshot is zeroed again
+  auto plain = pool.instantiate(module);
+  REQUIRE_EQ(plain->linearMemory().mem[3 * 4096], 0);
+  REQUIRE_EQ(plain->call<i32>(bump, 1), 11);
+}
+
+// 5 bytes no matter the value, keeps the layout of dataModule fixed
+static void appendPaddedLeb(std::vector<u8> &out, u32 value) {
+  for (int i = 0; i < 4; i++) {
+    out.push_back(0x80 | (value & 0x7f));
+    value >>= 7;
+  }
+  out.push_back(value);
+}
+
+// (module
+//   (memory 2)
+//   (func (export "load") (param i32) (result i32) (i32.load (local.get 0)))
+//   (data (i32.const offset) "bytes"))
+// padded with a custom section so that the segment starts at a file offset
+// that is congruent to `offset` modulo the host page size
+static std::vector<u8> dataModule(u32 offset, std::span<const u8> bytes) {
+  std::vector<u8> out = {
+      0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+      // type section
+      0x01, 0x06, 0x01, 0x60, 0x01, 0x7f, 0x01, 0x7f,
+      // function section
+      0x03, 0x02, 0x01, 0x00,
+      // memory section
+      0x05, 0x03, 0x01, 0x00, 0x02,
+      // export section
+      0x07, 0x08, 0x01, 0x04, 'l', 'o', 'a', 'd', 0x00, 0x00,
+      // code section
+      0x0a, 0x09, 0x01, 0x07, 0x00, 0x20, 0x00, 0x28, 0x02, 0x00, 0x0b};
+  // custom section header + name, data section header, segment header
+  std::size_t start = out.size() + 8 + 6 + 14;
+  u32 padding = (offset - start) % 4096;
+  out.push_back(0x00);
+  appendPaddedLeb(out, 2 + padding);
+  out.push_back(0x01);
+  out.push_back('p');
+  out.insert(out.end(), padding, 0);
+  // data section
+  out.push_back(0x0b);
+  appendPaddedLeb(out, 14 + bytes.size());
+  out.insert(out.end(), {0x01, 0x00, 0x41});
+  appendPaddedLeb(out, offset);
+  out.push_back(0x0b);
+  appendPaddedLeb(out, bytes.size());
+  REQUIRE_EQ(out.size() % 4096, offset % 4096);
+  out.insert(out.end(), bytes.begin(), bytes.end());
+  return out;
+}
+
+TEST_CASE("data segments initialize the memory") {
+  const u8 greeting[] = {'h', 'i', '!', 0};
+  auto module = std::make_shared<const Module>(dataModule(100, greeting));
+  u32 load = module->findFunction("load").value();
+  InstancePool pool({.slots = 1});
+  for (int round = 0; round < 2; round++) {
+    auto instance = pool.instantiate(module);
+    REQUIRE_EQ(instance->call<i32>(load, 100), 0x00216968);
+    REQUIRE_FALSE(instance->linearMemory().fileBacked);
+    std::memset(instance->linearMemory().mem + 100, 0xff, 4);
+  }
+
+  std::vector<u8> tooLarge(LinearMemory::pageSize);
+  REQUIRE_THROWS_AS(
+      Module(dataModule(LinearMemory::pageSize + 1, tooLarge)),
+      std::runtime_error);
+}
+
+TEST_CASE("large data segments are mapped from the module file") {
+  std::vector<u8> bytes(3 * 4096 * 8 + 123);
+  for (std::size_t i = 0; i < bytes.size(); i++) {
+    bytes[i] = static_cast<u8>(i * 7 + 1);
+  }
+  u32 offset = 3 * 4096 + 10;
+  auto path = std::filesystem::temp_directory_path() / "wasmjit-data.wasm";
+  {
+    auto binary = dataModule(offset, bytes);
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(binary.data()), binary.size());
+  }
+  auto module = std::make_shared<const Module>(path.string());
+  std::filesystem::remove(path);
+  u32 load = module->findFunction("load").value();
+
+  Instance first(module);
+  Instance second(module);
+  REQUIRE(first.linearMemory().fileBacked);
+  u8 *mem = first.linearMemory().mem;
+  REQUIRE(std::equal(bytes.begin(), bytes.end(), mem + offset));
+  REQUIRE_EQ(mem[offset - 1], 0);
+  REQUIRE_EQ(mem[offset + bytes.size()], 0);
+
+  // the mapping is private to every instance
+  i32 before = second.call<i32>(load, offset + 8192);
+  std::memset(mem + offset, 0, bytes.size());
+  REQUIRE_EQ(first.call<i32>(load, offset + 8192), 0);
+  REQUIRE_EQ(second.call<i32>(load, offset + 8192), before);
+}
+
+// (module
+//   (import "env" "scale" (func $scale (param i32) (result i32)))
+//   (memory 1)
+//   (func (export "run") (param i32) (result i32) (call $scale (local.get 0))))
+static const u8 kImportModule[] = {
+    0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+    // type section
+    0x01, 0x06, 0x01, 0x60, 0x01, 0x7f, 0x01, 0x7f,
+    // import section
+    0x02, 0x0d, 0x01, 0x03, 'e', 'n', 'v', 0x05, 's', 'c', 'a', 'l', 'e',
+    0x00, 0x00,
+    // function section
+    0x03, 0x02, 0x01, 0x00,
+    // memory section
+    0x05, 0x03, 0x01, 0x00, 0x01,
+    // export section
+    0x07, 0x07, 0x01, 0x03, 'r', 'u', 'n', 0x00, 0x01,
+    // code section
+    0x0a, 0x08, 0x01, 0x06, 0x00, 0x20, 0x00, 0x10, 0x00, 0x0b};
+
+static i32 scale(Caller &caller, i32 value) {
+  caller.memory().store<i32>(value, value);
+  return value * 3;
+}
+
+static i64 scaleWide(Caller &, i64 value) { return value * 3; }
+
+static i32 scaleThrowing(Caller &, i32) {
+  throw std::runtime_error("scale failed");
+}
+
+static bool scaleBufferFreed = false;
+
+// traps with a local that has to be destroyed on the way out
+static i32 scaleBuffered(Caller &caller, i32 value) {
+  struct Guard {
+    ~Guard() { scaleBufferFreed = true; }
+  } guard;
+  std::vector<u8> buffer(64);
+  caller.memory().store<i32>(value, value);
+  return value * 3;
+}
+
+TEST_CASE("host functions are bound with their c++ type") {
+  HostFunctions functions;
+  functions.define<&scale>("env", "scale");
+  auto *scaleFn = functions.find("env", "scale");
+  REQUIRE(scaleFn != nullptr);
+  REQUIRE_EQ(scaleFn->signature(), "(i32) -> i32");
+
+  auto module =
+      std::make_shared<const Module>(std::span(kImportModule),
+                                     CompilerOptions{}, functions);
+  u32 run = module->findFunction("run").value();
+  Instance instance(module);
+  REQUIRE_EQ(instance.call<i32>(run, 8), 24);
+  REQUIRE_EQ(*reinterpret_cast<i32 *>(instance.linearMemory().mem + 8), 8);
+  try {
+    instance.call<i32>(run, LinearMemory::pageSize - 2);
+    FAIL("expected a trap");
+  } catch (WasmTrap &trap) {
+    REQUIRE_EQ(trap.code(), TrapCode::MEMORY_OUT_OF_BOUNDS);
+  }
+
+  // the import has no entry of its own, nor has anything past the functions
+  std::vector<Val> args = {Val::fromI32(1)};
+  REQUIRE_THROWS_AS(instance.call<i32>(0, 1), std::runtime_error);
+  REQUIRE_THROWS_AS(instance.invoke(0, args), std::runtime_error);
+  REQUIRE_THROWS_AS(instance.invoke(run + 1, args), std::runtime_error);
+  u64 batchArgs[] = {1};
+  u64 batchResults[1];
+  REQUIRE_THROWS_AS(instance.callBatch(0, 1, batchArgs, batchResults),
+                    std::runtime_error);
+
+  HostFunctions buffered;
+  buffered.define<&scaleBuffered>("env", "scale");
+  auto bufferedModule = std::make_shared<const Module>(
+      std::span(kImportModule), CompilerOptions{}, buffered);
+  Instance bufferedInstance(bufferedModule);
+  scaleBufferFreed = false;
+  try {
+    bufferedInstance.call<i32>(run, LinearMemory::pageSize - 2);
+    FAIL("expected a trap");
+  } catch (WasmTrap &trap) {
+    REQUIRE_EQ(trap.code(), TrapCode::MEMORY_OUT_OF_BOUNDS);
+  }
+  REQUIRE(scaleBufferFreed);
+
+  // any other exception is turned into a trap at the trampoline as well,
+  // it can't unwind through the jit frames
+  HostFunctions throwing;
+  throwing.define<&scaleThrowing>("env", "scale");
+  auto throwingModule = std::make_shared<const Module>(
+      std::span(kImportModule), CompilerOptions{}, throwing);
+  Instance throwingInstance(throwingModule);
+  try {
+    throwingInstance.call<i32>(run, 8);
+    FAIL("expected a trap");
+  } catch (WasmTrap &trap) {
+    REQUIRE_EQ(trap.code(), TrapCode::HOST_ERROR);
+  }
+
+  HostFunctions wrongType;
+  wrongType.define<&scaleWide>("env", "scale");
+  REQUIRE_THROWS_AS(Module(std::span(kImportModule), {}, wrongType),
+                    std::runtime_error);
+  REQUIRE_THROWS_AS(Module(std::span(kImportModule), {}, HostFunctions{}),
+                    std::runtime_error);
+}
+
+TEST_CASE("exports are called through typed functions and vals") {
+  auto module = std::make_shared<const Module>(std::span(kBumpModule));
+  Instance instance(module);
+
+  auto bump = instance.typedFunc<i32(i32)>("bump");
+  REQUIRE_EQ(bump(5), 15);
+  REQUIRE_THROWS_AS(instance.typedFunc<i64(i32)>("bump"), std::runtime_error);
+  REQUIRE_THROWS_AS(instance.typedFunc<i32(i32, i32)>("bump"),
+                    std::runtime_error);
+  REQUIRE_THROWS_AS(instance.typedFunc<i32(i32)>("missing"),
+                    std::runtime_error);
+
+  std::vector<Val> args = {Val::fromI32(-20)};
+  auto result = instance.invoke("bump", args);
+  REQUIRE(result.has_value());
+  REQUIRE_EQ(*result, Val::fromI32(-5));
+  // both paths see the same instance
+  REQUIRE_EQ(bump(0), -5);
+
+  std::vector<Val> wrongType = {Val::fromI64(1)};
+  REQUIRE_THROWS_AS(instance.invoke("bump", wrongType), std::runtime_error);
+  REQUIRE_THROWS_AS(instance.invoke("bump", {}), std::runtime_error);
+}
+
+// (func (export "tick") (i32.store (i32.const 0)
+//   (i32.add (i32.load (i32.const 0)) (i32.const 1))))
+static const u8 kTickModule[] = {
+    0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+    // type section
+    0x01, 0x04, 0x01, 0x60, 0x00, 0x00,
+    // function section
+    0x03, 0x02, 0x01, 0x00,
+    // memory section
+    0x05, 0x03, 0x01, 0x00, 0x01,
+    // export section
+    0x07, 0x08, 0x01, 0x04, 't', 'i', 'c', 'k', 0x00, 0x00,
+    // code section
+    0x0a, 0x11, 0x01, 0x0f, 0x00, 0x41, 0x00, 0x41, 0x00, 0x28, 0x02, 0x00,
+    0x41, 0x01, 0x6a, 0x36, 0x02, 0x00, 0x0b};
+
+// (func (export "store") (param i32 i32)
+//   (i32.store (local.get 0) (local.get 1)))
+static const u8 kStoreModule[] = {
+    0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+    // type section
+    0x01, 0x06, 0x01, 0x60, 0x02, 0x7f, 0x7f, 0x00,
+    // function section
+    0x03, 0x02, 0x01, 0x00,
+    // memory section
+    0x05, 0x03, 0x01, 0x00, 0x01,
+    // export section
+    0x07, 0x09, 0x01, 0x05, 's', 't', 'o', 'r', 'e', 0x00, 0x00,
+    // code section
+    0x0a, 0x0b, 0x01, 0x09, 0x00, 0x20, 0x00, 0x20, 0x01, 0x36, 0x02, 0x00,
+    0x0b};
+
+TEST_CASE("batches share one entry into wasm") {
+  auto module = std::make_shared<const Module>(std::span(kBumpModule));
+  u32 bump = module->findFunction("bump").value();
+  Instance instance(module);
+  std::vector<u64> args = {1, 2, 3, static_cast<u32>(-6)};
+  std::vector<u64> results(4);
+  instance.callBatch(bump, 4, args, results);
+  REQUIRE_EQ(results, std::vector<u64>{11, 13, 16, 10});
+
+  std::vector<u64> tooFew(3);
+  REQUIRE_THROWS_AS(instance.callBatch(bump, 4, args, tooFew),
+                    std::runtime_error);
+  REQUIRE_THROWS_AS(instance.callBatch(bump, 3, args, tooFew),
+                    std::runtime_error);
+
+  // nothing in the spans tells how often to call a function without
+  // parameters and result
+  auto tickModule = std::make_shared<const Module>(std::span(kTickModule));
+  Instance ticking(tickModule);
+  ticking.callBatch(tickModule->findFunction("tick").value(), 5, {}, {});
+  REQUIRE_EQ(*reinterpret_cast<i32 *>(ticking.linearMemory().mem), 5);
+
+  // the expected span sizes must not wrap around for a huge count
+  auto storeModule = std::make_shared<const Module>(std::span(kStoreModule));
+  u32 store = storeModule->findFunction("store").value();
+  Instance storing(storeModule);
+  std::vector<u64> stores = {0, 7, 4, 9};
+  storing.callBatch(store, 2, stores, {});
+  REQUIRE_EQ(reinterpret_cast<i32 *>(storing.linearMemory().mem)[1], 9);
+  REQUIRE_THROWS_AS(storing.callBatch(store, u64{1} << 63, {}, {}),
+                    std::runtime_error);
+  REQUIRE_THROWS_AS(instance.callBatch(bump, ~u64{0}, args, results),
+                    std::runtime_error);
+
+  HostFunctions functions;
+  functions.define<&scale>("env", "scale");
+  auto trapping = std::make_shared<const Module>(std::span(kImportModule),
+                                                 CompilerOptions{}, functions);
+  Instance other(trapping);
+  args = {4, 8, LinearMemory::pageSize, 12};
+  results.assign(4, 0);
+  REQUIRE_THROWS_AS(
+      other.callBatch(trapping->findFunction("run").value(), 4, args,
+                      results),
+      WasmTrap);
+  REQUIRE_EQ(results, std::vector<u64>{12, 24, 0, 0});
+}
+
+// (module
+//   (import "wasi_snapshot_preview1" "fd_write"
+//     (func $fd_write (param i32 i32 i32 i32) (result i32)))
+//   (memory 1)
+//   (func (export "write") (param i32 i32 i32 i32) (result i32)
+//     (call $fd_write (local.get 0) (local.get 1) (local.get 2) (local.get 3))))
+static const u8 kWriteModule[] = {
+    0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+    // type section
+    0x01, 0x09, 0x01, 0x60, 0x04, 0x7f, 0x7f, 0x7f, 0x7f, 0x01, 0x7f,
+    // import section
+    0x02, 0x23, 0x01, 0x16, 'w', 'a', 's', 'i', '_', 's', 'n', 'a', 'p', 's',
+    'h', 'o', 't', '_', 'p', 'r', 'e', 'v', 'i', 'e', 'w', '1', 0x08, 'f', 'd',
+    '_', 'w', 'r', 'i', 't', 'e', 0x00, 0x00,
+    // function section
+    0x03, 0x02, 0x01, 0x00,
+    // memory section
+    0x05, 0x03, 0x01, 0x00, 0x01,
+    // export section
+    0x07, 0x09, 0x01, 0x05, 'w', 'r', 'i', 't', 'e', 0x00, 0x01,
+    // code section
+    0x0a, 0x0e, 0x01, 0x0c, 0x00, 0x20, 0x00, 0x20, 0x01, 0x20, 0x02, 0x20,
+    0x03, 0x10, 0x00, 0x0b};
+
+TEST_CASE("fd_write gathers iovecs straight from the linear memory") {
+  auto module = std::make_shared<const Module>(std::span(kWriteModule));
+  auto write = module->findFunction("write").value();
+  Instance instance(module);
+  int pipeFds[2];
+  REQUIRE_EQ(pipe(pipeFds), 0);
+  preview1::WasiContext wasi;
+  u32 guestFd = wasi.insert({pipeFds[1], true, {}});
+  instance.setWasi(wasi);
+
+  MemoryView memory(instance.ctx().memoryBase, instance.ctx().memorySize);
+  std::memcpy(memory.data() + 100, "hello ", 6);
+  std::memcpy(memory.data() + 200, "wasi", 4);
+  memory.store<u32>(16, 100);
+  memory.store<u32>(20, 6);
+  memory.store<u32>(24, 200);
+  memory.store<u32>(28, 4);
+  REQUIRE_EQ(instance.call<i32>(write, guestFd, 16, 2, 8), 0);
+  REQUIRE_EQ(memory.load<u32>(8), 10);
+  char buffer[16] = {};
+  REQUIRE_EQ(read(pipeFds[0], buffer, sizeof(buffer)), 10);
+  REQUIRE_EQ(std::string_view(buffer), "hello wasi");
+
+  REQUIRE_EQ(instance.call<i32>(write, 42, 16, 2, 8),
+             static_cast<i32>(preview1::Errno::BADF));
+  memory.store<u32>(28, LinearMemory::pageSize);
+  REQUIRE_EQ(instance.call<i32>(write, guestFd, 16, 2, 8),
+             static_cast<i32>(preview1::Errno::FAULT));
+  REQUIRE_EQ(wasi.close(guestFd), preview1::Errno::SUCCESS);
+  close(pipeFds[0]);
+}
+
+TEST_CASE("the wasi fd table can be changed from several threads") {
+  preview1::WasiContext wasi;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&wasi, t] {
+      for (int i = 0; i < 1000; i++) {
+        u32 fd = wasi.insert({100 + t, false, {}});
+        auto descriptor = wasi.get(fd);
+        REQUIRE(descriptor != nullptr);
+        REQUIRE_EQ(descriptor->hostFd, 100 + t);
+        REQUIRE_EQ(wasi.close(fd), preview1::Errno::SUCCESS);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  // only stdio is left
+  REQUIRE(wasi.get(2) != nullptr);
+  REQUIRE(wasi.get(3) == nullptr);
+}
+
+TEST_CASE("a closed wasi fd stays open while a call uses it") {
+  preview1::WasiContext wasi;
+  int pipeFds[2];
+  REQUIRE_EQ(pipe(pipeFds), 0);
+  u32 fd = wasi.insert({pipeFds[0], true, {}});
+  auto descriptor = wasi.get(fd);
+  REQUIRE_EQ(wasi.close(fd), preview1::Errno::SUCCESS);
+  REQUIRE(wasi.get(fd) == nullptr);
+  // the host fd number can't be reused by another open yet
+  REQUIRE_NE(fcntl(pipeFds[0], F_GETFD), -1);
+  descriptor.reset();
+  REQUIRE_EQ(fcntl(pipeFds[0], F_GETFD), -1);
+  ::close(pipeFds[1]);
+}
+
+TEST_CASE("fd_write through io_uring") {
+  if (!IoUring::supported()) {
+    MESSAGE("io_uring is not available, skipped");
+    return;
+  }
+  auto module = std::make_shared<const Module>(std::span(kWriteModule));
+  auto write = module->findFunction("write").value();
+  Instance instance(module);
+  int pipeFds[2];
+  REQUIRE_EQ(pipe(pipeFds), 0);
+  preview1::WasiContext wasi;
+  wasi.setIoBackend(preview1::IoBackend::URING);
+  u32 guestFd = wasi.insert({pipeFds[1], true, {}});
+  instance.setWasi(wasi);
+
+  MemoryView memory(instance.ctx().memoryBase, instance.ctx().memorySize);
+  std::memcpy(memory.data() + 100, "ring", 4);
+  memory.store<u32>(16, 100);
+  memory.store<u32>(20, 4);
+  for (int i = 0; i < 3; i++) {
+    REQUIRE_EQ(instance.call<i32>(write, guestFd, 16, 1, 8), 0);
+    REQUIRE_EQ(memory.load<u32>(8), 4);
+  }
+  char buffer[16] = {};
+  REQUIRE_EQ(read(pipeFds[0], buffer, sizeof(buffer)), 12);
+  REQUIRE_EQ(std::string_view(buffer), "ringringring");
+  close(pipeFds[0]);
+}
+
+static i32 suspendingScale(Caller &caller, i32 value) {
+  Fiber::suspend();
+  caller.memory().store<i32>(value, value);
+  return value * 3;
+}
+
+TEST_CASE("host functions suspend instances running on fibers") {
+  HostFunctions functions;
+  functions.define<&suspendingScale>("env", "scale");
+  auto module = std::make_shared<const Module>(
+      std::span(kImportModule), CompilerOptions{.stackChecks = true},
+      functions);
+  u32 run = module->findFunction("run").value();
+  constexpr u32 kInstances = 64;
+  std::vector<std::unique_ptr<Instance>> instances;
+  std::vector<std::unique_ptr<Fiber>> fibers;
+  std::vector<i32> results(kInstances);
+  for (u32 i = 0; i < kInstances; i++) {
+    instances.push_back(std::make_unique<Instance>(module));
+    fibers.push_back(std::make_unique<Fiber>([&, i] {
+      results[i] = instances[i]->call<i32>(run, i * 4);
+    }));
+  }
+  // every instance is parked inside the host function before any continues
+  for (auto &fiber : fibers) {
+    fiber->resume();
+    REQUIRE_FALSE(fiber->finished());
+  }
+  for (auto &fiber : fibers) {
+    fiber->resume();
+    REQUIRE(fiber->finished());
+  }
+  for (u32 i = 0; i < kInstances; i++) {
+    REQUIRE_EQ(results[i], static_cast<i32>(i * 12));
+    MemoryView memory(instances[i]->ctx().memoryBase,
+                      instances[i]->ctx().memorySize);
+    REQUIRE_EQ(memory.load<u32>(i * 4), i * 4);
+  }
+
+  // a trap after the resume unwinds to the call on the same fiber
+  Fiber trapping(
+      [&] { instances[0]->call<i32>(run, LinearMemory::pageSize - 2); });
+  trapping.resume();
+  REQUIRE_THROWS_AS(trapping.resume(), WasmTrap);
+}
+
+TEST_CASE("wasi io of instances on an event loop is submitted together") {
+  if (!IoUring::supported()) {
+    MESSAGE("io_uring is not available, skipped");
+    return;
+  }
+  auto module = std::make_shared<const Module>(std::span(kWriteModule));
+  auto write = module->findFunction("write").value();
+  int pipeFds[2];
+  REQUIRE_EQ(pipe(pipeFds), 0);
+  preview1::WasiContext wasi;
+  wasi.setIoBackend(preview1::IoBackend::URING);
+  u32 guestFd = wasi.insert({pipeFds[1], true, {}});
+
+  EventLoop loop;
+  std::vector<std::unique_ptr<Instance>> instances;
+  for (int i = 0; i < 16; i++) {
+    auto &instance =
+        *instances.emplace_back(std::make_unique<Instance>(module));
+    instance.setWasi(wasi);
+    MemoryView memory(instance.ctx().memoryBase, instance.ctx().memorySize);
+    std::memcpy(memory.data() + 100, "ring", 4);
+    memory.store<u32>(16, 100);
+    memory.store<u32>(20, 4);
+    loop.spawn([&instance, write, guestFd] {
+      if (instance.call<i32>(write, guestFd, 16, 1, 8) != 0) {
+        throw std::runtime_error("fd_write failed");
+      }
+    });
+  }
+  loop.run();
+  REQUIRE_EQ(loop.liveFibers(), 0);
+  char buffer[128] = {};
+  REQUIRE_EQ(read(pipeFds[0], buffer, sizeof(buffer)), 64);
+  REQUIRE_EQ(wasi.close(guestFd), preview1::Errno::SUCCESS);
+  close(pipeFds[0]);
+}
+
+TEST_CASE("wasi io of scheduled instances parks the task") {
+  if (!IoUring::supported()) {
+    MESSAGE("io_uring is not available, skipped");
+    return;
+  }
+  auto module = std::make_shared<const Module>(std::span(kWriteModule));
+  auto write = module->findFunction("write").value();
+  int pipeFds[2];
+  REQUIRE_EQ(pipe(pipeFds), 0);
+  preview1::WasiContext wasi;
+  wasi.setIoBackend(preview1::IoBackend::URING);
+  u32 guestFd = wasi.insert({pipeFds[1], true, {}});
+  {
+    Scheduler scheduler({.workers = 2});
+    for (int i = 0; i < 16; i++) {
+      scheduler.submit([&] {
+        Instance instance(module);
+        instance.setWasi(wasi);
+        MemoryView memory(instance.ctx().memoryBase,
+                          instance.ctx().memorySize);
+        std::memcpy(memory.data() + 100, "ring", 4);
+        memory.store<u32>(16, 100);
+        memory.store<u32>(20, 4);
+        if (instance.call<i32>(write, guestFd, 16, 1, 8) != 0) {
+          throw std::runtime_error("fd_write failed");
+        }
+      });
+    }
+    scheduler.wait();
+    REQUIRE_EQ(scheduler.stats().completed, 16);
+  }
+  char buffer[128] = {};
+  REQUIRE_EQ(read(pipeFds[0], buffer, sizeof(buffer)), 64);
+  REQUIRE_EQ(wasi.close(guestFd), preview1::Errno::SUCCESS);
+  close(pipeFds[0]);
+}
+
+TEST_CASE("a task suspended without yield or park continues") {
+  std::atomic<u32> finished = 0;
+  {
+    Scheduler scheduler({.workers = 1});
+    scheduler.submit([&] {
+      Fiber::suspend();
+      finished++;
+    });
+    scheduler.wait();
+    auto stats = scheduler.stats();
+    REQUIRE_EQ(stats.yields, 1);
+    REQUIRE_EQ(stats.parks, 0);
+  }
+  REQUIRE_EQ(finished, 1);
+}
+
+TEST_CASE("the scheduler yields instances at epoch deadlines") {
+  auto module = std::make_shared<const Module>(
+      std::span(kSpinModule), CompilerOptions{.epochInterruption = true});
+  u32 spin = module->findFunction("spin").value();
+  std::atomic<u32> finished = 0;
+  {
+    Scheduler scheduler({.workers = 2,
+                         .epochInterval = std::chrono::milliseconds(1)});
+    for (int i = 0; i < 8; i++) {
+      scheduler.submit([&] {
+        Instance instance(module);
+        instance.ctx().epochDeadlineCallback = Scheduler::yieldOnDeadline;
+        instance.ctx().setEpochDeadline(1);
+        if (instance.call<i32>(spin, 100'000'000) == 0) {
+          finished++;
+        }
+      });
+    }
+    scheduler.wait();
+    auto stats = scheduler.stats();
+    REQUIRE_EQ(stats.submitted, 8);
+    REQUIRE_EQ(stats.completed, 8);
+    REQUIRE_EQ(stats.failed, 0);
+    REQUIRE_GT(stats.yields, 0);
+    REQUIRE_GE(stats.maxQueueLatency, stats.p50QueueLatency);
+  }
+  REQUIRE_EQ(finished, 8);
+
+  // without a scheduler the deadline still interrupts
+  Instance instance(module);
+  instance.ctx().epochDeadlineCallback = Scheduler::yieldOnDeadline;
+  instance.ctx().setEpochDeadline(0);
+  REQUIRE_THROWS_AS(instance.call<i32>(spin, 100'000'000), WasmTrap);
+}
+
+// (module
+//   (memory 1)
+//   (func $helper (result i32) (i32.const 42))
+//   (func (export "answer") (result i32) (call $helper)))
+static const u8 kNamedModule[] = {
+    0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+    // type section
+    0x01, 0x05, 0x01, 0x60, 0x00, 0x01, 0x7f,
+    // function section
+    0x03, 0x03, 0x02, 0x00, 0x00,
+    // memory section
+    0x05, 0x03, 0x01, 0x00, 0x01,
+    // export section
+    0x07, 0x0a, 0x01, 0x06, 'a', 'n', 's', 'w', 'e', 'r', 0x00, 0x01,
+    // code section
+    0x0a, 0x0b, 0x02, 0x04, 0x00, 0x41, 0x2a, 0x0b, 0x04, 0x00, 0x10, 0x00,
+    0x0b,
+    // custom "name" section with the function names subsection
+    0x00, 0x10, 0x04, 'n', 'a', 'm', 'e', 0x01, 0x09, 0x01, 0x00, 0x06, 'h',
+    'e', 'l', 'p', 'e', 'r'};
+
+TEST_CASE("compiled functions are announced to perf") {
+  std::string pid = std::to_string(getpid());
+  std::string perfMapPath = "/tmp/perf-" + pid + ".map";
+  std::string jitDumpPath = "/tmp/jit-" + pid + ".dump";
+  // removed however the test ends
+  struct RemoveFiles {
+    ~RemoveFiles() {
+      std::remove(perfMap.c_str());
+      std::remove(jitDump.c_str());
+    }
+    const std::string &perfMap;
+    const std::string &jitDump;
+  } removeFiles{perfMapPath, jitDumpPath};
+
+  auto module = std::make_shared<const Module>(
+      std::span(kNamedModule),
+      CompilerOptions{.perfMap = true, .jitDump = true});
+  REQUIRE_EQ(module->wasm().nameSection.functionName(0), "helper");
+  Instance instance(module);
+  REQUIRE_EQ(instance.call<i32>(module->findFunction("answer").value()), 42);
+
+  std::ifstream perfMap(perfMapPath);
+  std::string symbols((std::istreambuf_iterator<char>(perfMap)), {});
+  REQUIRE_NE(symbols.find(" helper\n"), std::string::npos);
+  REQUIRE_NE(symbols.find(" answer\n"), std::string::npos);
+
+  std::ifstream jitDump(jitDumpPath, std::ios::binary);
+  u32 magic = 0;
+  jitDump.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+  REQUIRE_EQ(magic, 0x4a695444);
+}
+
+TEST_CASE("the sampler attributes samples to wasm functions") {
+  auto module = std::make_shared<const Module>(std::span(kSpinModule));
+  u32 spin = module->findFunction("spin").value();
+  Instance instance(module);
+  Sampler sampler({.frequency = 1000});
+  sampler.start();
+  for (int i = 0; i < 100 && sampler.stats().samples < 10; i++) {
+    REQUIRE_EQ(instance.call<i32>(spin, 10'000'000), 0);
+  }
+  sampler.stop();
+  REQUIRE_GT(sampler.stats().samples, 0);
+  REQUIRE_NE(sampler.folded().find("`spin "), std::string::npos);
+
+  sampler.clear();
+  REQUIRE_EQ(sampler.stats().samples, 0);
+  REQUIRE_EQ(sampler.folded(), "");
+}
+
+TEST_CASE("instrumented functions count their calls and cycles") {
+  auto module = std::make_shared<const Module>(
+      std::span(kNamedModule), CompilerOptions{.cycleCounters = true});
+  u32 answer = module->findFunction("answer").value();
+  Instance instance(module);
+  for (int i = 0; i < 3; i++) {
+    REQUIRE_EQ(instance.call<i32>(answer), 42);
+  }
+  auto counters = instance.functionCounters();
+  REQUIRE_EQ(counters.size(), 2);
+  for (auto &counter : counters) {
+    REQUIRE_EQ(counter.calls, 3);
+    REQUIRE_EQ(counter.returns, 3);
+    REQUIRE_GE(counter.inclusiveCycles, counter.exclusiveCycles);
+  }
+  // answer calls helper
+  REQUIRE_GE(counters[answer].inclusiveCycles, counters[0].inclusiveCycles);
+  REQUIRE_EQ(counters[0].inclusiveCycles, counters[0].exclusiveCycles);
+
+  instance.resetFunctionCounters();
+  REQUIRE_EQ(instance.functionCounters()[answer].calls, 0);
+  REQUIRE_EQ(instance.functionCounters()[answer].inclusiveCycles, 0);
+
+  // without the option nothing is counted
+  Instance plain(std::make_shared<const Module>(std::span(kNamedModule)));
+  REQUIRE(plain.functionCounters().empty());
+}
+
+TEST_CASE("compile stats cover every phase and function") {
+  auto module = std::make_shared<const Module>(std::span(kNamedModule));
+  auto &stats = module->compileStats();
+  REQUIRE_EQ(stats.wasmBytes, sizeof(kNamedModule));
+  REQUIRE_GT(stats.codeSectionBytes, 0);
+  REQUIRE_GT(stats.nativeBytes, 0);
+  REQUIRE_GE(stats.totalTime, stats.parseTime + stats.translateTime +
+                                  stats.finalizeTime + stats.linkTime);
+  REQUIRE_EQ(stats.functions.size(), 2);
+  u64 nativeBytes = 0;
+  for (auto &function : stats.functions) {
+    REQUIRE_EQ(function.wasmBytes, 4);
+    REQUIRE_GT(function.nativeBytes, 0);
+    nativeBytes += function.nativeBytes;
+  }
+  REQUIRE_LE(nativeBytes, stats.nativeBytes);
+
+  std::string json = stats.toJson();
+  REQUIRE_EQ(json.front(), '{');
+  REQUIRE_EQ(json.back(), '}');
+  std::string wasmBytes =
+      "\"wasmBytes\":" + std::to_string(sizeof(kNamedModule));
+  REQUIRE_NE(json.find(wasmBytes), std::string::npos);
+  REQUIRE_NE(json.find("\"functions\":[{\"index\":0,"), std::string::npos);
+}
+
+TEST_CASE("the benchmark kernels compute their reference results") {
+  auto load = [](const char *name) {
+    return std::make_shared<const Module>(std::string("../wasm_examples/") +
+                                          name);
+  };
+  Instance fib(load("fib.wasm"));
+  REQUIRE_EQ(fib.typedFunc<i32(i32)>("fib")(20), 6765);
+
+  Instance sieve(load("sieve.wasm"));
+  REQUIRE_EQ(sieve.typedFunc<i32(i32)>("sieve")(10000), 1229);
+
+  Instance crc32(load("crc32.wasm"));
+  crc32.typedFunc<i32(i32)>("fill")(4096);
+  REQUIRE_EQ(static_cast<u32>(crc32.typedFunc<i32(i32)>("crc32")(4096)),
+             0x4641a512u);
+
+  Instance matmul(load("matmul.wasm"));
+  matmul.typedFunc<i32(i32)>("init")(16);
+  REQUIRE_EQ(matmul.typedFunc<i32(i32)>("matmul")(16), 87040);
+}
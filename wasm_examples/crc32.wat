@@ -0,0 +1,76 @@
+(module
+  (memory 1)
+  ;; fills the first len bytes with a linear congruential sequence
+  (func $fill (export "fill") (param $len i32) (result i32)
+    (local $i i32) (local $x i32)
+    i32.const 1
+    local.set $x
+    loop
+      local.get $x
+      i32.const 1103515245
+      i32.mul
+      i32.const 12345
+      i32.add
+      local.set $x
+      local.get $i
+      local.get $x
+      i32.const 16
+      i32.shr_u
+      i32.store8
+      local.get $i
+      i32.const 1
+      i32.add
+      local.set $i
+      local.get $i
+      local.get $len
+      i32.lt_u
+      br_if 0
+    end
+    local.get $len)
+  ;; bitwise crc32 (ieee, reflected) of the first len bytes, len >= 1
+  (func $crc32 (export "crc32") (param $len i32) (result i32)
+    (local $crc i32) (local $i i32) (local $bit i32)
+    i32.const -1
+    local.set $crc
+    loop
+      local.get $crc
+      local.get $i
+      i32.load8_u
+      i32.xor
+      local.set $crc
+      i32.const 8
+      local.set $bit
+      loop
+        ;; crc = crc >> 1 ^ (0xedb88320 & -(crc & 1))
+        local.get $crc
+        i32.const 1
+        i32.shr_u
+        i32.const 0xedb88320
+        i32.const 0
+        local.get $crc
+        i32.const 1
+        i32.and
+        i32.sub
+        i32.and
+        i32.xor
+        local.set $crc
+        local.get $bit
+        i32.const 1
+        i32.sub
+        local.set $bit
+        local.get $bit
+        br_if 0
+      end
+      local.get $i
+      i32.const 1
+      i32.add
+      local.set $i
+      local.get $i
+      local.get $len
+      i32.lt_u
+      br_if 0
+    end
+    local.get $crc
+    i32.const -1
+    i32.xor)
+)
@@ -0,0 +1,24 @@
+(module
+  ;; naive doubly recursive fibonacci, dominated by call overhead
+  (func $fib (export "fib") (param $n i32) (result i32)
+    (local $result i32)
+    local.get $n
+    local.set $result
+    block
+      local.get $n
+      i32.const 2
+      i32.lt_u
+      br_if 0
+      local.get $n
+      i32.const 1
+      i32.sub
+      call $fib
+      local.get $n
+      i32.const 2
+      i32.sub
+      call $fib
+      i32.add
+      local.set $result
+    end
+    local.get $result)
+)
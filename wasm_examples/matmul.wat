@@ -0,0 +1,145 @@
+(module
+  ;; three n x n matrices of i32 back to back: a at 0, b at 4n^2 and c at
+  ;; 8n^2, so n can be up to 73
+  (memory 1)
+  ;; a[i][j] = i + j, b[i][j] = i - j, n >= 1
+  (func $init (export "init") (param $n i32) (result i32)
+    (local $i i32) (local $j i32) (local $b i32) (local $at i32)
+    local.get $n
+    local.get $n
+    i32.mul
+    i32.const 2
+    i32.shl
+    local.set $b
+    loop
+      i32.const 0
+      local.set $j
+      loop
+        local.get $i
+        local.get $n
+        i32.mul
+        local.get $j
+        i32.add
+        i32.const 2
+        i32.shl
+        local.set $at
+        local.get $at
+        local.get $i
+        local.get $j
+        i32.add
+        i32.store
+        local.get $at
+        local.get $b
+        i32.add
+        local.get $i
+        local.get $j
+        i32.sub
+        i32.store
+        local.get $j
+        i32.const 1
+        i32.add
+        local.set $j
+        local.get $j
+        local.get $n
+        i32.lt_u
+        br_if 0
+      end
+      local.get $i
+      i32.const 1
+      i32.add
+      local.set $i
+      local.get $i
+      local.get $n
+      i32.lt_u
+      br_if 0
+    end
+    local.get $n)
+  ;; c = a * b, returns the sum of c
+  (func $matmul (export "matmul") (param $n i32) (result i32)
+    (local $i i32) (local $j i32) (local $k i32) (local $b i32) (local $c i32)
+    (local $sum i32) (local $checksum i32)
+    local.get $n
+    local.get $n
+    i32.mul
+    i32.const 2
+    i32.shl
+    local.set $b
+    local.get $b
+    local.get $b
+    i32.add
+    local.set $c
+    loop
+      i32.const 0
+      local.set $j
+      loop
+        i32.const 0
+        local.set $sum
+        i32.const 0
+        local.set $k
+        loop
+          local.get $i
+          local.get $n
+          i32.mul
+          local.get $k
+          i32.add
+          i32.const 2
+          i32.shl
+          i32.load
+          local.get $k
+          local.get $n
+          i32.mul
+          local.get $j
+          i32.add
+          i32.const 2
+          i32.shl
+          local.get $b
+          i32.add
+          i32.load
+          i32.mul
+          local.get $sum
+          i32.add
+          local.set $sum
+          local.get $k
+          i32.const 1
+          i32.add
+          local.set $k
+          local.get $k
+          local.get $n
+          i32.lt_u
+          br_if 0
+        end
+        local.get $i
+        local.get $n
+        i32.mul
+        local.get $j
+        i32.add
+        i32.const 2
+        i32.shl
+        local.get $c
+        i32.add
+        local.get $sum
+        i32.store
+        local.get $checksum
+        local.get $sum
+        i32.add
+        local.set $checksum
+        local.get $j
+        i32.const 1
+        i32.add
+        local.set $j
+        local.get $j
+        local.get $n
+        i32.lt_u
+        br_if 0
+      end
+      local.get $i
+      i32.const 1
+      i32.add
+      local.set $i
+      local.get $i
+      local.get $n
+      i32.lt_u
+      br_if 0
+    end
+    local.get $checksum)
+)
@@ -0,0 +1,66 @@
+(module
+  ;; a byte per number, so n can be up to 65536
+  (memory 1)
+  ;; the number of primes below n, n >= 2
+  (func $sieve (export "sieve") (param $n i32) (result i32)
+    (local $i i32) (local $j i32) (local $count i32)
+    i32.const 0
+    local.set $i
+    loop
+      local.get $i
+      i32.const 0
+      i32.store8
+      local.get $i
+      i32.const 1
+      i32.add
+      local.set $i
+      local.get $i
+      local.get $n
+      i32.lt_u
+      br_if 0
+    end
+    i32.const 2
+    local.set $i
+    loop
+      block
+        ;; crossed out already
+        local.get $i
+        i32.load8_u
+        br_if 0
+        local.get $count
+        i32.const 1
+        i32.add
+        local.set $count
+        local.get $i
+        local.get $i
+        i32.mul
+        local.set $j
+        local.get $j
+        local.get $n
+        i32.ge_u
+        br_if 0
+        loop
+          local.get $j
+          i32.const 1
+          i32.store8
+          local.get $j
+          local.get $i
+          i32.add
+          local.set $j
+          local.get $j
+          local.get $n
+          i32.lt_u
+          br_if 0
+        end
+      end
+      local.get $i
+      i32.const 1
+      i32.add
+      local.set $i
+      local.get $i
+      local.get $n
+      i32.lt_u
+      br_if 0
+    end
+    local.get $count)
+)